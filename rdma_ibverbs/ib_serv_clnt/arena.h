@@ -0,0 +1,157 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <sys/mman.h>
+#include "common.h"
+
+/*
+ * Pre-registered hugepage arena for RDMA buffers
+ *
+ * malloc() + ibv_reg_mr() per buffer costs a syscall, a page walk and
+ * pinning for every registration, and each MR takes MTT/MPT entries on
+ * the HCA. The arena instead reserves one region up front, backed by
+ * 2 MB hugepages when the system has them (so the HCA needs 512x fewer
+ * translation entries), and registers it exactly once. Sub-buffers are
+ * handed out from it without any verbs call and all share the arena's
+ * lkey/rkey.
+ *
+ * Allocation sizes are rounded up to a power of two between
+ * ARENA_MIN_SIZE and the arena size. Each size class has its own stack
+ * of free blocks; new blocks come from a bump pointer and are aligned
+ * to their size, capped at ARENA_MAX_ALIGN. Freed blocks are only
+ * reused for the same class, the arena never coalesces.
+ *
+ * The free stacks live in ordinary malloc()ed memory, not in the free
+ * blocks themselves: the blocks are inside the registered region, and
+ * a peer holding its rkey could otherwise rewrite the links and have
+ * the next arena_alloc() hand out an address of its choosing.
+ *
+ * Note that every sub-buffer is reachable through the same rkey, so a
+ * peer that knows one buffer's rkey can reach all others it is given
+ * the address of. Use one arena per trust domain, or register the arena
+ * for local access only and give each peer an MR of its own over its
+ * sub-buffer; the pages are already pinned, which makes that cheaper.
+ */
+#define ARENA_HUGEPAGE  (2ul << 20)
+#define ARENA_MIN_SHIFT 6               // one cache line
+#define ARENA_MIN_SIZE  (1ul << ARENA_MIN_SHIFT)
+#define ARENA_MAX_ALIGN 4096ul
+#define ARENA_CLASSES   (64 - ARENA_MIN_SHIFT)
+
+struct arena {
+    struct ibv_mr *mr;
+    char *base;
+    size_t size;
+    size_t used;                        // bump pointer offset
+    int huge;                           // backed by MAP_HUGETLB pages
+    struct arena_stack {                // free blocks of one size class
+        char **blk;
+        size_t n, cap;
+    } free_list[ARENA_CLASSES];
+};
+
+// One sub-buffer: address, rounded-up length and the keys to use with it
+struct arena_buf {
+    char *addr;
+    size_t len;
+    uint32_t lkey;
+    uint32_t rkey;
+};
+
+static inline unsigned arena_class(size_t len) {
+    if (len <= ARENA_MIN_SIZE)
+        return 0;
+    return 64 - __builtin_clzl(len - 1) - ARENA_MIN_SHIFT;
+}
+
+/*
+ * Reserve and register 'size' bytes (rounded up to a hugepage).
+ * Falls back to normal pages with transparent hugepage advice when no
+ * hugetlbfs pages are available. Returns 0 or -1 with errno set.
+ */
+static inline int arena_create(struct arena *a, struct ibv_pd *pd,
+                               size_t size, int access) {
+    memset(a, 0, sizeof(*a));
+    a->size = (size + ARENA_HUGEPAGE - 1) & ~(ARENA_HUGEPAGE - 1);
+
+    a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (a->base != MAP_FAILED) {
+        a->huge = 1;
+    } else {
+        a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->base == MAP_FAILED)
+            return -1;
+        madvise(a->base, a->size, MADV_HUGEPAGE);
+    }
+
+    a->mr = ibv_reg_mr(pd, a->base, a->size, access);
+    if (!a->mr) {
+        int err = errno;
+        munmap(a->base, a->size);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void arena_destroy(struct arena *a) {
+    for (unsigned cls = 0; cls < ARENA_CLASSES; cls++)
+        free(a->free_list[cls].blk);
+    ibv_dereg_mr(a->mr);
+    munmap(a->base, a->size);
+}
+
+/*
+ * Carve out a buffer of at least len bytes. Returns a buffer with
+ * addr == NULL when the arena is exhausted.
+ */
+static inline struct arena_buf arena_alloc(struct arena *a, size_t len) {
+    struct arena_buf b = {0};
+    unsigned cls = arena_class(len);
+    size_t blk = ARENA_MIN_SIZE << cls;
+
+    if (cls >= ARENA_CLASSES)
+        return b;
+
+    struct arena_stack *st = &a->free_list[cls];
+    if (st->n) {
+        b.addr = st->blk[--st->n];
+    } else {
+        size_t align = blk < ARENA_MAX_ALIGN ? blk : ARENA_MAX_ALIGN;
+        size_t off = (a->used + align - 1) & ~(align - 1);
+
+        if (off + blk > a->size)
+            return b;
+        b.addr = a->base + off;
+        a->used = off + blk;
+    }
+    b.len = blk;
+    b.lkey = a->mr->lkey;
+    b.rkey = a->mr->rkey;
+    return b;
+}
+
+/*
+ * Give a buffer back to its size class. If the class's stack cannot
+ * grow the block is leaked rather than lost track of halfway.
+ */
+static inline void arena_free(struct arena *a, struct arena_buf *b) {
+    struct arena_stack *st = &a->free_list[arena_class(b->len)];
+
+    if (st->n == st->cap) {
+        size_t cap = st->cap ? 2 * st->cap : 64;
+        char **blk = realloc(st->blk, cap * sizeof(*blk));
+        if (!blk) {
+            b->addr = NULL;
+            return;
+        }
+        st->blk = blk;
+        st->cap = cap;
+    }
+    st->blk[st->n++] = b->addr;
+    b->addr = NULL;
+}
+
+#endif
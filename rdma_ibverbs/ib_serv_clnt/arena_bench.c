@@ -0,0 +1,137 @@
+// arena_bench.c
+// Compares allocate-and-register rates of malloc() + ibv_reg_mr() per
+// buffer against sub-buffers handed out by the pre-registered arena.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "arena.h"
+
+#define ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ)
+
+/*
+ * Each round allocates 'batch' buffers of 'size' bytes and then frees
+ * them again, so both paths see the same number of live buffers. The
+ * buffers are touched once so that malloc() cannot hand out pages that
+ * were never faulted in and make registration look cheaper than it is.
+ */
+static double bench_malloc_reg(struct ibv_pd *pd, size_t size,
+                               uint64_t iters, uint32_t batch) {
+    char **bufs = calloc(batch, sizeof(*bufs));
+    struct ibv_mr **mrs = calloc(batch, sizeof(*mrs));
+    if (!bufs || !mrs) die("calloc");
+
+    uint64_t start = now_ns();
+    for (uint64_t done = 0; done < iters; done += batch) {
+        for (uint32_t i = 0; i < batch; i++) {
+            bufs[i] = malloc(size);
+            if (!bufs[i]) die("malloc");
+            bufs[i][0] = 0;
+            mrs[i] = ibv_reg_mr(pd, bufs[i], size, ACCESS);
+            if (!mrs[i]) die("ibv_reg_mr");
+        }
+        for (uint32_t i = 0; i < batch; i++) {
+            ibv_dereg_mr(mrs[i]);
+            free(bufs[i]);
+        }
+    }
+    double sec = (now_ns() - start) / 1e9;
+
+    free(mrs);
+    free(bufs);
+    return sec;
+}
+
+static double bench_arena(struct arena *a, size_t size,
+                          uint64_t iters, uint32_t batch) {
+    struct arena_buf *bufs = calloc(batch, sizeof(*bufs));
+    if (!bufs) die("calloc");
+
+    uint64_t start = now_ns();
+    for (uint64_t done = 0; done < iters; done += batch) {
+        for (uint32_t i = 0; i < batch; i++) {
+            bufs[i] = arena_alloc(a, size);
+            if (!bufs[i].addr) {
+                fprintf(stderr, "arena exhausted\n");
+                exit(1);
+            }
+            bufs[i].addr[0] = 0;
+        }
+        for (uint32_t i = 0; i < batch; i++)
+            arena_free(a, &bufs[i]);
+    }
+    double sec = (now_ns() - start) / 1e9;
+
+    free(bufs);
+    return sec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s size] [-n iters] [-b batch]\n"
+            "  -s size    buffer size in bytes (default %d)\n"
+            "  -n iters   buffers to allocate and release (default 100000)\n"
+            "  -b batch   buffers live at the same time (default 64)\n",
+            prog, BUFFER_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t size = BUFFER_SIZE;
+    uint64_t iters = 100000;
+    uint32_t batch = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:b:")) != -1) {
+        switch (opt) {
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'n': iters = strtoull(optarg, NULL, 0); break;
+        case 'b': batch = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !size || !iters || !batch)
+        usage(argv[0]);
+    iters = (iters + batch - 1) / batch * batch;
+
+    struct ibv_device **dev_list = ibv_get_device_list(NULL);
+    if (!dev_list || !dev_list[0]) die("ibv_get_device_list");
+
+    struct ibv_context *ctx = ibv_open_device(dev_list[0]);
+    if (!ctx) die("ibv_open_device");
+
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    if (!pd) die("ibv_alloc_pd");
+
+    // Arena large enough for one batch; its registration is timed too
+    struct arena a;
+    uint64_t t0 = now_ns();
+    if (arena_create(&a, pd, (size_t)batch * (ARENA_MIN_SIZE << arena_class(size)), ACCESS))
+        die("arena_create");
+    double reg_sec = (now_ns() - t0) / 1e9;
+
+    printf("%s: %zu byte buffers, %llu allocations, %u live\n",
+           ibv_get_device_name(dev_list[0]), size,
+           (unsigned long long)iters, batch);
+    printf("arena: %zu MB on %s pages, registered once in %.1f us\n",
+           a.size >> 20, a.huge ? "huge" : "normal", reg_sec * 1e6);
+
+    double sec = bench_malloc_reg(pd, size, iters, batch);
+    printf("  malloc + ibv_reg_mr: %10.0f allocs/s  %8.3f us/alloc\n",
+           iters / sec, sec * 1e6 / iters);
+
+    sec = bench_arena(&a, size, iters, batch);
+    printf("  arena_alloc:         %10.0f allocs/s  %8.3f us/alloc\n",
+           iters / sec, sec * 1e6 / iters);
+
+    arena_destroy(&a);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(dev_list);
+
+    return 0;
+}
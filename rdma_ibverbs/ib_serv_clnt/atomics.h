@@ -0,0 +1,218 @@
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+#include "common.h"
+#include "cq_engine.h"
+
+/*
+ * Distributed counter and locks on RDMA atomics
+ *
+ * The server registers a small region with IBV_ACCESS_REMOTE_ATOMIC.
+ * Each 8-byte word sits on its own cache line. Clients operate on the
+ * words with IBV_WR_ATOMIC_FETCH_AND_ADD and IBV_WR_ATOMIC_CMP_AND_SWP.
+ * The server CPU takes no part; the responder HCA performs the
+ * read-modify-write and returns the old value into a local 8-byte
+ * buffer of the requester.
+ *
+ *   AT_COUNTER  sequence counter: FAA 1 hands out unique numbers, the
+ *               job of a central ticketing service
+ *   AT_SPIN     spin lock: 0 = free, else the holder's id; CAS 0 -> id
+ *               to take it, CAS id -> 0 to give it back
+ *   AT_TICKET   ticket lock: FAA 1 on AT_TICKET draws a ticket, the
+ *   AT_SERVING  holder is whoever's ticket AT_SERVING shows (polled
+ *               with RDMA_READ), FAA 1 on AT_SERVING passes it on. FIFO
+ *               fair, where the spin lock lets the lucky CAS win
+ *   AT_GUARDED  changed only under a lock, with a plain READ + WRITE;
+ *               if the locks work, it ends up equal to the number of
+ *               critical sections run
+ *
+ * Atomics are only atomic against each other, and with IBV_ATOMIC_HCA
+ * only against those that go through the same HCA: always the case
+ * here, since every client targets the server's HCA. How many atomics
+ * (and READs) a QP may have outstanding is max_rd_atomic on the
+ * requester and max_dest_rd_atomic on the responder.
+ */
+#define AT_COUNTER   0
+#define AT_SPIN      1
+#define AT_TICKET    2
+#define AT_SERVING   3
+#define AT_GUARDED   4
+#define AT_WORDS     5
+#define AT_STRIDE    64                         // one word per cache line
+#define AT_SIZE      (AT_WORDS * AT_STRIDE)
+
+/* --- server side ------------------------------------------------------ */
+
+struct at_region {
+    char *base;
+    struct ibv_mr *mr;
+};
+
+// Returns 0, or -1 with errno set
+static inline int at_region_create(struct at_region *r, struct ibv_pd *pd) {
+    void *mem;
+
+    if (posix_memalign(&mem, 4096, AT_SIZE))
+        return -1;
+    memset(mem, 0, AT_SIZE);
+    r->base = mem;
+    r->mr = ibv_reg_mr(pd, mem, AT_SIZE,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                       IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC);
+    if (!r->mr) {
+        int err = errno;
+        free(mem);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void at_region_destroy(struct at_region *r) {
+    ibv_dereg_mr(r->mr);
+    free(r->base);
+}
+
+static inline uint64_t at_region_word(const struct at_region *r, int word) {
+    return *(volatile uint64_t *)(r->base + word * AT_STRIDE);
+}
+
+/* --- client side ------------------------------------------------------ */
+
+struct at_conn {
+    struct ibv_qp *qp;
+    struct cq_engine *cqe;
+    uint64_t *res;              // one result slot per WR in flight
+    uint32_t lkey;
+    uint64_t raddr;             // the server's region
+    uint32_t rkey;
+
+    uint64_t spins;             // failed lock attempts
+};
+
+/*
+ * Post one operation on word: FAA (cmp_add = value to add), CAS
+ * (compare cmp_add, swap in swap), or an 8-byte READ/WRITE. The old
+ * value or the READ result lands in res[slot]; a WRITE sends
+ * res[slot]. Returns 0, or -1 with errno set.
+ */
+static inline int at_post(struct at_conn *a, enum ibv_wr_opcode op, int word,
+                          uint64_t cmp_add, uint64_t swap, uint32_t slot) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)&a->res[slot],
+        .length = sizeof(uint64_t),
+        .lkey = a->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+    uint64_t raddr = a->raddr + word * AT_STRIDE;
+
+    wr.wr_id = slot;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = op;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    if (op == IBV_WR_ATOMIC_FETCH_AND_ADD || op == IBV_WR_ATOMIC_CMP_AND_SWP) {
+        wr.wr.atomic.remote_addr = raddr;
+        wr.wr.atomic.rkey = a->rkey;
+        wr.wr.atomic.compare_add = cmp_add;
+        wr.wr.atomic.swap = swap;
+    } else {
+        wr.wr.rdma.remote_addr = raddr;
+        wr.wr.rdma.rkey = a->rkey;
+    }
+
+    int ret = ibv_post_send(a->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+// One operation from slot 0, waited for; *old gets res[0]
+static inline int at_sync(struct at_conn *a, enum ibv_wr_opcode op, int word,
+                          uint64_t cmp_add, uint64_t swap, uint64_t *old) {
+    struct ibv_wc wc;
+
+    if (at_post(a, op, word, cmp_add, swap, 0))
+        return -1;
+    cq_engine_wait(a->cqe, &wc, 1);
+    if (wc.status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "atomic op %d failed: %s\n", op,
+                ibv_wc_status_str(wc.status));
+        errno = EIO;
+        return -1;
+    }
+    if (old)
+        *old = a->res[0];
+    return 0;
+}
+
+static inline int at_faa(struct at_conn *a, int word, uint64_t add,
+                         uint64_t *old) {
+    return at_sync(a, IBV_WR_ATOMIC_FETCH_AND_ADD, word, add, 0, old);
+}
+
+static inline int at_cas(struct at_conn *a, int word, uint64_t cmp,
+                         uint64_t swap, uint64_t *old) {
+    return at_sync(a, IBV_WR_ATOMIC_CMP_AND_SWP, word, cmp, swap, old);
+}
+
+static inline int at_read(struct at_conn *a, int word, uint64_t *val) {
+    return at_sync(a, IBV_WR_RDMA_READ, word, 0, 0, val);
+}
+
+static inline int at_write(struct at_conn *a, int word, uint64_t val) {
+    a->res[0] = val;
+    return at_sync(a, IBV_WR_RDMA_WRITE, word, 0, 0, NULL);
+}
+
+// Next number of the distributed sequence
+static inline int at_seq_next(struct at_conn *a, uint64_t *seq) {
+    return at_faa(a, AT_COUNTER, 1, seq);
+}
+
+// id must be non-zero and unique among the lock's users
+static inline int at_spin_lock(struct at_conn *a, uint64_t id) {
+    uint64_t old;
+
+    for (;;) {
+        if (at_cas(a, AT_SPIN, 0, id, &old))
+            return -1;
+        if (!old)
+            return 0;
+        a->spins++;
+    }
+}
+
+static inline int at_spin_unlock(struct at_conn *a, uint64_t id) {
+    uint64_t old;
+
+    if (at_cas(a, AT_SPIN, id, 0, &old))
+        return -1;
+    if (old != id) {
+        errno = EPERM;          // we did not hold it
+        return -1;
+    }
+    return 0;
+}
+
+static inline int at_ticket_lock(struct at_conn *a) {
+    uint64_t ticket, serving;
+
+    if (at_faa(a, AT_TICKET, 1, &ticket))
+        return -1;
+    for (;;) {
+        if (at_read(a, AT_SERVING, &serving))
+            return -1;
+        if (serving == ticket)
+            return 0;
+        a->spins++;
+    }
+}
+
+static inline int at_ticket_unlock(struct at_conn *a) {
+    return at_faa(a, AT_SERVING, 1, NULL);
+}
+
+#endif
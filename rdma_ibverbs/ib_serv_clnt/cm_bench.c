@@ -0,0 +1,217 @@
+// cm_bench.c
+// Connection setup rate over rdma_cm: opens bursts of RC connections
+// with many of them in address/route resolution and handshake at once
+// (see cm_mgr.h), then tears them all down again.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "hist.h"
+#include "cm_mgr.h"
+
+#define CQ_DEPTH 4096
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static const struct ibv_qp_cap qp_cap = {
+    .max_send_wr = 16,
+    .max_recv_wr = 16,
+    .max_send_sge = 1,
+    .max_recv_sge = 1,
+};
+
+static void report_failure(const struct cm_conn *c) {
+    fprintf(stderr, "connection failed: %s, status %d\n",
+            rdma_event_str(c->event), c->status);
+}
+
+/*
+ * Passive side: accept everything, release connections when the peer
+ * disconnects. Runs until SIGINT/SIGTERM.
+ */
+static void run_server(uint16_t port, int backlog) {
+    struct cm_mgr m;
+    struct cm_conn *c;
+
+    cm_mgr_create(&m, &qp_cap, CQ_DEPTH);
+    cm_listen(&m, port, backlog);
+    printf("Listening for rdma_cm connections on port %u\n", port);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    while (!stop) {
+        cm_mgr_wait(&m, 1000);
+        for (int r; (r = cm_mgr_step(&m, &c)) >= 0;) {
+            if (r == 0 || c->state == CM_ESTABLISHED)
+                continue;
+            if (c->state == CM_FAILED)
+                report_failure(c);
+            cm_conn_destroy(c);
+        }
+    }
+
+    printf("Accepted %llu connections, %llu closed, %llu failed\n",
+           (unsigned long long)m.established, (unsigned long long)m.closed,
+           (unsigned long long)m.failed);
+    // Connections still open are released with the process
+    cm_mgr_destroy(&m);
+}
+
+/*
+ * Active side. Each round connects conns QPs, keeping up to outstanding
+ * of them in flight, then disconnects all of them. outstanding = 1 is
+ * the serial baseline: one connection set up after the other, as the
+ * TCP exchange in rdma_client does.
+ */
+static void run_client(const char *server_ip, const char *port,
+                       uint32_t conns, uint32_t outstanding, uint32_t rounds) {
+    static struct hist h;
+    struct addrinfo hints = {0}, *res;
+    struct cm_mgr m;
+    struct cm_conn *c;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(server_ip, port, &hints, &res))
+        die("getaddrinfo");
+
+    struct cm_conn **open = calloc(conns, sizeof(*open));
+    if (!open)
+        die("calloc");
+
+    cm_mgr_create(&m, &qp_cap, CQ_DEPTH);
+    hist_init(&h);
+
+    printf("%u connections per round, %u in flight, %u rounds\n",
+           conns, outstanding, rounds);
+
+    uint64_t total_ns = 0, total_conns = 0;
+    for (uint32_t round = 0; round < rounds; round++) {
+        uint32_t started = 0, established = 0, failed = 0, dropped = 0;
+
+        uint64_t start = now_ns();
+        while (established + failed < conns) {
+            while (started < conns &&
+                   started - established - failed < outstanding) {
+                if (!cm_connect(&m, res->ai_addr, (void *)(uintptr_t)started))
+                    die("cm_connect");
+                started++;
+            }
+
+            cm_mgr_wait(&m, -1);
+            for (int r; (r = cm_mgr_step(&m, &c)) >= 0;) {
+                if (r == 0)
+                    continue;
+                if (c->state == CM_ESTABLISHED) {
+                    hist_add(&h, c->established_ns - c->start_ns);
+                    open[(uintptr_t)c->ctx] = c;
+                    established++;
+                } else if (open[(uintptr_t)c->ctx] == c) {
+                    // Established, then closed or failed before teardown
+                    open[(uintptr_t)c->ctx] = NULL;
+                    cm_conn_destroy(c);
+                    dropped++;
+                } else {
+                    report_failure(c);
+                    cm_conn_destroy(c);
+                    failed++;
+                }
+            }
+        }
+        uint64_t setup_ns = now_ns() - start;
+        total_ns += setup_ns;
+        total_conns += established;
+
+        /*
+         * Tear the whole burst down again before the next round. A
+         * connection can also end in an error instead of DISCONNECTED;
+         * it is closed all the same.
+         */
+        start = now_ns();
+        for (uint32_t i = 0; i < conns; i++)
+            if (open[i])
+                cm_disconnect(open[i]);
+        uint32_t closed = dropped;
+        while (closed < established) {
+            cm_mgr_wait(&m, -1);
+            for (int r; (r = cm_mgr_step(&m, &c)) >= 0;) {
+                if (r == 0 || (c->state != CM_CLOSED && c->state != CM_FAILED))
+                    continue;
+                if (c->state == CM_FAILED)
+                    report_failure(c);
+                open[(uintptr_t)c->ctx] = NULL;
+                cm_conn_destroy(c);
+                closed++;
+            }
+        }
+        uint64_t teardown_ns = now_ns() - start;
+
+        printf("  round %u: %u established, %u failed in %.3f s "
+               "(%.0f conn/s), teardown %.3f s\n",
+               round, established, failed, setup_ns / 1e9,
+               established / (setup_ns / 1e9), teardown_ns / 1e9);
+    }
+
+    printf("Connection rate: %.0f conn/s\n", total_conns / (total_ns / 1e9));
+    hist_print_us("connect (resolve addr -> ESTABLISHED)", &h);
+
+    cm_mgr_destroy(&m);
+    free(open);
+    freeaddrinfo(res);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -l <port> [-B backlog]\n"
+            "       %s <server_ip> <port> [-c conns] [-o outstanding] [-r rounds]\n"
+            "  -l port        accept connections on this port\n"
+            "  -B backlog     listen backlog (default 1024)\n"
+            "  -c conns       connections per round (default 1000)\n"
+            "  -o outstanding connection attempts in flight, 1 = serial\n"
+            "                 (default 64)\n"
+            "  -r rounds      connect/disconnect rounds (default 5)\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *listen_port = NULL;
+    int backlog = 1024;
+    uint32_t conns = 1000, outstanding = 64, rounds = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:B:c:o:r:")) != -1) {
+        switch (opt) {
+        case 'l': listen_port = optarg; break;
+        case 'B': backlog = strtol(optarg, NULL, 0); break;
+        case 'c': conns = strtoul(optarg, NULL, 0); break;
+        case 'o': outstanding = strtoul(optarg, NULL, 0); break;
+        case 'r': rounds = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (listen_port) {
+        if (optind != argc || backlog <= 0)
+            usage(argv[0]);
+        run_server(strtoul(listen_port, NULL, 0), backlog);
+        return 0;
+    }
+
+    if (argc - optind != 2 || !conns || !outstanding || !rounds)
+        usage(argv[0]);
+    run_client(argv[optind], argv[optind + 1], conns, outstanding, rounds);
+
+    return 0;
+}
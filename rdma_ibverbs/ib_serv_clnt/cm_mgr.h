@@ -0,0 +1,329 @@
+#ifndef CM_MGR_H
+#define CM_MGR_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <rdma/rdma_cma.h>
+#include "common.h"
+
+/*
+ * Asynchronous connection manager on an rdma_cm event channel
+ *
+ * rdma_cm does what rdma_server/rdma_client do by hand over TCP: it
+ * resolves the peer's IP address to a local device and GID, resolves a
+ * path, runs the connection handshake and moves the QP through
+ * INIT/RTR/RTS on the way. Each of those steps finishes with an event
+ * on the event channel instead of blocking.
+ *
+ * Every cm_conn is a small state machine driven by those events, so any
+ * number of connections can be at different steps at the same time.
+ * cm_connect() only starts address resolution and returns; cm_mgr_step()
+ * takes one event and starts the next step of the connection it
+ * belongs to:
+ *
+ *   active:  RESOLVING_ADDR -> RESOLVING_ROUTE -> CONNECTING -> ESTABLISHED
+ *   passive: (connect request) ACCEPTING -> ESTABLISHED
+ *   both:    ESTABLISHED -> DISCONNECTING -> CLOSED, any error -> FAILED
+ *
+ * Up to CM_PRIV_MAX bytes of private data travel with the connect
+ * request and with the accept, enough for a struct conn_info that
+ * describes a buffer. All QPs share one PD and one CQ, allocated on the
+ * device of the first connection.
+ *
+ * The channel fd is non-blocking. cm_mgr_wait() polls it, or an event
+ * loop can keep it in its epoll set and call cm_mgr_step() until that
+ * returns -1. Not thread safe.
+ */
+#define CM_PRIV_MAX     sizeof(struct conn_info)
+#define CM_TIMEOUT_MS   2000
+
+enum cm_state {
+    CM_RESOLVING_ADDR,
+    CM_RESOLVING_ROUTE,
+    CM_CONNECTING,
+    CM_ACCEPTING,
+    CM_ESTABLISHED,
+    CM_DISCONNECTING,
+    CM_CLOSED,
+    CM_FAILED,
+};
+
+struct cm_conn {
+    struct rdma_cm_id *id;
+    enum cm_state state;
+    int passive;
+    enum rdma_cm_event_type event;  // last event seen, tells why it FAILED
+    int status;
+    uint64_t start_ns;              // cm_connect() or the connect request
+    uint64_t established_ns;
+    uint8_t priv[CM_PRIV_MAX];      // private data sent by the peer
+    uint8_t priv_len;
+    void *ctx;                      // for the caller
+};
+
+struct cm_mgr {
+    struct rdma_event_channel *ec;
+    struct rdma_cm_id *listen_id;
+    struct ibv_context *verbs;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    int cq_depth;
+    struct ibv_qp_cap cap;          // for every QP
+    uint8_t priv[CM_PRIV_MAX];      // sent with our connects and accepts
+    uint8_t priv_len;
+
+    uint64_t started;
+    uint64_t established;
+    uint64_t failed;
+    uint64_t closed;
+};
+
+static inline void cm_mgr_create(struct cm_mgr *m, const struct ibv_qp_cap *cap,
+                                 int cq_depth) {
+    memset(m, 0, sizeof(*m));
+    m->cap = *cap;
+    m->cq_depth = cq_depth;
+
+    m->ec = rdma_create_event_channel();
+    if (!m->ec)
+        die("rdma_create_event_channel");
+    int flags = fcntl(m->ec->fd, F_GETFL);
+    if (fcntl(m->ec->fd, F_SETFL, flags | O_NONBLOCK))
+        die("fcntl");
+}
+
+// Private data for the connect requests and accepts that follow
+static inline void cm_mgr_set_private(struct cm_mgr *m, const void *data,
+                                      size_t len) {
+    if (len > CM_PRIV_MAX)
+        len = CM_PRIV_MAX;
+    memcpy(m->priv, data, len);
+    m->priv_len = len;
+}
+
+static inline int cm_mgr_fd(const struct cm_mgr *m) {
+    return m->ec->fd;
+}
+
+// Accept connections on port, on every local RDMA address
+static inline void cm_listen(struct cm_mgr *m, uint16_t port, int backlog) {
+    struct sockaddr_in addr = {0};
+
+    if (rdma_create_id(m->ec, &m->listen_id, NULL, RDMA_PS_TCP))
+        die("rdma_create_id");
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (rdma_bind_addr(m->listen_id, (struct sockaddr *)&addr))
+        die("rdma_bind_addr");
+    if (rdma_listen(m->listen_id, backlog))
+        die("rdma_listen");
+}
+
+static inline struct cm_conn *cm_conn_new(struct rdma_cm_id *id, int passive) {
+    struct cm_conn *c = calloc(1, sizeof(*c));
+
+    if (!c)
+        die("calloc");
+    c->id = id;
+    c->passive = passive;
+    c->start_ns = now_ns();
+    id->context = c;
+    return c;
+}
+
+/*
+ * Start connecting to dst. Returns at once, the connection shows up
+ * again from cm_mgr_step() as ESTABLISHED or FAILED. NULL if address
+ * resolution could not even be started.
+ */
+static inline struct cm_conn *cm_connect(struct cm_mgr *m,
+                                         const struct sockaddr *dst,
+                                         void *ctx) {
+    struct rdma_cm_id *id;
+
+    if (rdma_create_id(m->ec, &id, NULL, RDMA_PS_TCP))
+        return NULL;
+
+    struct cm_conn *c = cm_conn_new(id, 0);
+    c->ctx = ctx;
+    c->state = CM_RESOLVING_ADDR;
+    if (rdma_resolve_addr(id, NULL, (struct sockaddr *)dst, CM_TIMEOUT_MS)) {
+        int err = errno;
+        rdma_destroy_id(id);
+        free(c);
+        errno = err;
+        return NULL;
+    }
+    m->started++;
+    return c;
+}
+
+static inline void cm_disconnect(struct cm_conn *c) {
+    if (c->state != CM_ESTABLISHED)
+        return;
+    c->state = CM_DISCONNECTING;
+    rdma_disconnect(c->id);
+}
+
+// Release a CLOSED or FAILED connection (or one that is no longer wanted)
+static inline void cm_conn_destroy(struct cm_conn *c) {
+    if (c->id->qp)
+        rdma_destroy_qp(c->id);
+    rdma_destroy_id(c->id);
+    free(c);
+}
+
+// PD and CQ live on the device that rdma_cm picked for the first peer
+static inline int cm_attach_device(struct cm_mgr *m, struct ibv_context *verbs) {
+    if (m->verbs)
+        return m->verbs == verbs ? 0 : -1;
+
+    m->pd = ibv_alloc_pd(verbs);
+    if (!m->pd)
+        die("ibv_alloc_pd");
+    m->cq = ibv_create_cq(verbs, m->cq_depth, NULL, NULL, 0);
+    if (!m->cq)
+        die("ibv_create_cq");
+    m->verbs = verbs;
+    return 0;
+}
+
+static inline int cm_create_qp(struct cm_mgr *m, struct cm_conn *c) {
+    struct ibv_qp_init_attr attr = {0};
+
+    if (cm_attach_device(m, c->id->verbs))
+        return -1;
+    attr.send_cq = m->cq;
+    attr.recv_cq = m->cq;
+    attr.qp_type = IBV_QPT_RC;
+    attr.cap = m->cap;
+    return rdma_create_qp(c->id, m->pd, &attr);
+}
+
+static inline void cm_conn_param(struct cm_mgr *m, struct rdma_conn_param *p) {
+    memset(p, 0, sizeof(*p));
+    p->private_data = m->priv_len ? m->priv : NULL;
+    p->private_data_len = m->priv_len;
+    p->responder_resources = 1;
+    p->initiator_depth = 1;
+    p->retry_count = 7;
+    p->rnr_retry_count = 7;
+}
+
+/*
+ * Handle one event from the channel. Returns -1 if there was none, 1 if
+ * it moved a connection to ESTABLISHED, CLOSED or FAILED (stored in
+ * *out), 0 otherwise. The event is acknowledged before acting on it,
+ * so the caller may destroy *out right away.
+ */
+static inline int cm_mgr_step(struct cm_mgr *m, struct cm_conn **out) {
+    struct rdma_cm_event *ev;
+    struct rdma_conn_param param;
+
+    if (rdma_get_cm_event(m->ec, &ev)) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        die("rdma_get_cm_event");
+    }
+
+    struct rdma_cm_id *id = ev->id;
+    struct cm_conn *c;
+    const void *priv = ev->param.conn.private_data;
+    size_t priv_len = ev->param.conn.private_data_len;
+
+    if (ev->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+        c = cm_conn_new(id, 1);
+    else
+        c = id->context;
+    if (!c) {                   // the listener itself
+        rdma_ack_cm_event(ev);
+        return 0;
+    }
+    c->event = ev->event;
+    c->status = ev->status;
+    if (priv && (ev->event == RDMA_CM_EVENT_CONNECT_REQUEST ||
+                 (ev->event == RDMA_CM_EVENT_ESTABLISHED && !c->passive))) {
+        c->priv_len = priv_len < CM_PRIV_MAX ? priv_len : CM_PRIV_MAX;
+        memcpy(c->priv, priv, c->priv_len);
+    }
+    rdma_ack_cm_event(ev);
+    *out = c;
+
+    switch (c->event) {
+    case RDMA_CM_EVENT_ADDR_RESOLVED:
+        if (cm_attach_device(m, id->verbs) ||
+            rdma_resolve_route(id, CM_TIMEOUT_MS))
+            break;
+        c->state = CM_RESOLVING_ROUTE;
+        return 0;
+
+    case RDMA_CM_EVENT_ROUTE_RESOLVED:
+        cm_conn_param(m, &param);
+        if (cm_create_qp(m, c) || rdma_connect(id, &param))
+            break;
+        c->state = CM_CONNECTING;
+        return 0;
+
+    case RDMA_CM_EVENT_CONNECT_REQUEST:
+        cm_conn_param(m, &param);
+        if (cm_create_qp(m, c) || rdma_accept(id, &param)) {
+            rdma_reject(id, NULL, 0);
+            break;
+        }
+        m->started++;
+        c->state = CM_ACCEPTING;
+        return 0;
+
+    case RDMA_CM_EVENT_ESTABLISHED:
+        c->state = CM_ESTABLISHED;
+        c->established_ns = now_ns();
+        m->established++;
+        return 1;
+
+    case RDMA_CM_EVENT_DISCONNECTED:
+        if (c->state == CM_ESTABLISHED)     // the peer went first
+            rdma_disconnect(id);
+        c->state = CM_CLOSED;
+        m->closed++;
+        return 1;
+
+    case RDMA_CM_EVENT_ADDR_ERROR:
+    case RDMA_CM_EVENT_ROUTE_ERROR:
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+    case RDMA_CM_EVENT_REJECTED:
+    case RDMA_CM_EVENT_DEVICE_REMOVAL:
+        break;
+
+    default:                    // TIMEWAIT_EXIT, ADDR_CHANGE, ...
+        return 0;
+    }
+
+    c->state = CM_FAILED;
+    m->failed++;
+    return 1;
+}
+
+// Sleep until the channel has events, or timeout_ms passed (-1 = forever)
+static inline int cm_mgr_wait(struct cm_mgr *m, int timeout_ms) {
+    struct pollfd pfd = { .fd = cm_mgr_fd(m), .events = POLLIN };
+    int n = poll(&pfd, 1, timeout_ms);
+
+    if (n < 0 && errno != EINTR)
+        die("poll");
+    return n;
+}
+
+// Connections must already be destroyed
+static inline void cm_mgr_destroy(struct cm_mgr *m) {
+    if (m->listen_id)
+        rdma_destroy_id(m->listen_id);
+    if (m->cq)
+        ibv_destroy_cq(m->cq);
+    if (m->pd)
+        ibv_dealloc_pd(m->pd);
+    rdma_destroy_event_channel(m->ec);
+}
+
+#endif
@@ -0,0 +1,418 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <arpa/inet.h>
+#include "common.h"
+#include "hist.h"
+#include "tsc.h"
+
+/*
+ * Small-message coalescing over one-sided RDMA writes
+ *
+ * One RDMA_WRITE per 32..200 byte record makes the NIC's message rate
+ * the limit, tens of millions of WRs per second, long before the link
+ * is full. Here records are appended to a registered staging ring
+ * instead, each behind an 8 byte header, and the staged bytes go out
+ * as one RDMA_WRITE_WITH_IMM when either
+ *
+ *   - threshold bytes are staged (size flush), or
+ *   - the oldest staged record is deadline_ns old (deadline flush),
+ *
+ * whichever comes first. The deadline bounds the latency that waiting
+ * for company adds to a record when the producer is slow; at full
+ * speed the threshold fills first and the deadline never fires.
+ *
+ * The staging ring and the peer's receive ring have the same size and
+ * records sit at the same offsets in both, as in rstream.h: the
+ * immediate of a flush is the new producer cursor, and the receiver
+ * walks the records in place, straight from its ring, then returns
+ * credits (consumer cursor, CO_CREDIT set) with a zero-length
+ * WRITE_WITH_IMM once a quarter of the ring has been consumed. A
+ * record never wraps: if it does not fit before the end of the ring, a
+ * CO_WRAP header pads the rest and the record starts over at offset 0.
+ *
+ * Records are not copied on the receiving side, so a record is only
+ * valid inside the callback that is handed it. A record's frame may
+ * take at most an eighth of the ring. The QP must be an RC QP
+ * with at least CO_RECV_DEPTH receive WRs and CO_SQ_MIN send WRs. Not
+ * thread safe.
+ */
+#define CO_CREDIT        0x80000000u
+#define CO_CURSOR_MASK   0x7fffffffu
+#define CO_RECV_DEPTH    256
+#define CO_RECV_BATCH    32
+#define CO_SQ_MIN        4
+#define CO_MAX_SIZE      (1u << 30)
+#define CO_ALIGN         8
+#define CO_WRAP          UINT32_MAX     // header of the padding at the ring's end
+
+// wr_id of a send: for data, the cursor it completes
+#define CO_WRID(cursor, data)  ((uint64_t)(cursor) << 32 | (data))
+
+struct co_hdr {
+    uint32_t len;               // payload bytes, or CO_WRAP
+    uint32_t reserved;
+};
+
+typedef void (*co_record_fn)(void *arg, const char *rec, uint32_t len);
+
+struct coalescer {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *ring;                 // peer writes here
+    char *stage;                // records staged for the peer
+    uint32_t size;              // power of two
+    uint32_t sq_free;
+
+    uint64_t peer_ring;
+    uint32_t peer_rkey;
+
+    // send side
+    uint32_t threshold;         // flush once this many bytes are staged
+    uint64_t deadline_ns;       // ... or the oldest record is this old
+    uint32_t staged;            // bytes appended
+    uint32_t produced;          // ... and flushed to the peer
+    uint32_t completed;         // ... and whose write completed locally
+    uint32_t peer_consumed;     // from the peer's last credit
+    uint64_t first_ns;          // tsc_ns() of the oldest unflushed record
+    uint64_t append_ns;         // sum over the unflushed records
+    uint32_t pending;           // unflushed records
+
+    // receive side
+    uint32_t peer_produced;
+    uint32_t consumed;
+    uint32_t credited;
+    uint32_t recv_used;
+    struct ibv_recv_wr rwr[CO_RECV_BATCH];
+
+    uint64_t records;           // appended, or handed to the callback
+    uint64_t flushes;
+    uint64_t size_flushes;
+    uint64_t deadline_flushes;
+    uint64_t credit_stalls;     // appends that found the ring full
+    uint64_t delay_ns;          // append-to-doorbell, summed over records
+    struct hist *delay;         // per flush, of its oldest record; optional
+};
+
+static inline uint32_t co_frame(uint32_t len) {
+    return (sizeof(struct co_hdr) + len + CO_ALIGN - 1) & ~(CO_ALIGN - 1);
+}
+
+// Extend a 31-bit cursor from an immediate to the full 32-bit counter
+static inline uint32_t co_cursor(uint32_t old, uint32_t imm) {
+    return old + ((imm - old) & CO_CURSOR_MASK);
+}
+
+static inline int co_post_recvs(struct coalescer *c, uint32_t n) {
+    struct ibv_recv_wr *bad_wr;
+
+    for (uint32_t i = 0; i < n; i++)
+        c->rwr[i].next = i + 1 < n ? &c->rwr[i + 1] : NULL;
+    return ibv_post_recv(c->qp, c->rwr, &bad_wr);
+}
+
+/*
+ * Register the rings and post the immediate receives. Records go out
+ * once threshold bytes are staged or the oldest is deadline_ns old; a
+ * threshold of 0 sends every record by itself. sq_depth is the QP's
+ * max_send_wr. Returns 0, or -1 with errno set.
+ */
+static inline int co_create(struct coalescer *c, struct ibv_pd *pd,
+                            struct ibv_qp *qp, struct ibv_cq *cq,
+                            uint32_t size, uint32_t sq_depth,
+                            uint32_t threshold, uint64_t deadline_ns) {
+    void *mem;
+
+    memset(c, 0, sizeof(*c));
+    if (!size || (size & (size - 1)) || size > CO_MAX_SIZE ||
+        threshold > size / 2 || sq_depth < CO_SQ_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (posix_memalign(&mem, 4096, 2 * (size_t)size))
+        return -1;
+    memset(mem, 0, 2 * (size_t)size);
+    c->mr = ibv_reg_mr(pd, mem, 2 * (size_t)size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!c->mr) {
+        int err = errno;
+        free(mem);
+        errno = err;
+        return -1;
+    }
+    c->qp = qp;
+    c->cq = cq;
+    c->ring = mem;
+    c->stage = c->ring + size;
+    c->size = size;
+    c->sq_free = sq_depth;
+    c->threshold = threshold;
+    c->deadline_ns = deadline_ns;
+    tsc_init();
+
+    int ret = 0;
+    for (uint32_t i = 0; i < CO_RECV_DEPTH && !ret; i += CO_RECV_BATCH)
+        ret = co_post_recvs(c, CO_RECV_BATCH);
+    if (ret) {
+        ibv_dereg_mr(c->mr);
+        free(mem);
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void co_destroy(struct coalescer *c) {
+    ibv_dereg_mr(c->mr);
+    free(c->ring);
+}
+
+// What the peer needs to write into our ring; merge into its conn_info
+static inline void co_local(const struct coalescer *c, struct conn_info *info) {
+    info->rkey = c->mr->rkey;
+    info->vaddr = (uintptr_t)c->ring;
+    info->len = c->size;
+}
+
+static inline int co_set_peer(struct coalescer *c, const struct conn_info *remote) {
+    if (remote->len != c->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->peer_ring = remote->vaddr;
+    c->peer_rkey = remote->rkey;
+    return 0;
+}
+
+static inline int co_post_credit(struct coalescer *c) {
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = CO_WRID(0, 0);
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(CO_CREDIT | (c->consumed & CO_CURSOR_MASK));
+    wr.wr.rdma.remote_addr = c->peer_ring;
+    wr.wr.rdma.rkey = c->peer_rkey;
+    int ret = ibv_post_send(c->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    c->sq_free--;
+    c->credited = c->consumed;
+    return 0;
+}
+
+/*
+ * Write out everything staged since the last flush: it is contiguous,
+ * since a record never wraps. One send WR stays free for credits.
+ */
+static inline int co_flush_now(struct coalescer *c, uint64_t now) {
+    uint32_t pos = c->produced & (c->size - 1);
+    uint32_t len = c->staged - c->produced;
+    struct ibv_sge sge = {
+        (uintptr_t)c->stage + pos, len, c->mr->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    if (!len || c->sq_free < 2)
+        return 0;
+    wr.wr_id = CO_WRID(c->staged, 1);
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(c->staged & CO_CURSOR_MASK);
+    wr.wr.rdma.remote_addr = c->peer_ring + pos;
+    wr.wr.rdma.rkey = c->peer_rkey;
+    int ret = ibv_post_send(c->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+
+    c->sq_free--;
+    c->produced = c->staged;
+    c->flushes++;
+    if (c->pending) {
+        c->delay_ns += c->pending * now - c->append_ns;
+        if (c->delay)
+            hist_add(c->delay, now - c->first_ns);
+    }
+    c->pending = 0;
+    c->append_ns = 0;
+    return 1;
+}
+
+// Flush if the threshold or the deadline says so
+static inline int co_maybe_flush(struct coalescer *c, uint64_t now) {
+    int ret;
+
+    if (c->staged == c->produced)
+        return 0;
+    if (c->staged - c->produced >= c->threshold) {
+        if ((ret = co_flush_now(c, now)) > 0)
+            c->size_flushes++;
+    } else if (now - c->first_ns >= c->deadline_ns) {
+        if ((ret = co_flush_now(c, now)) > 0)
+            c->deadline_flushes++;
+    } else {
+        return 0;
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Reap completions: cursors from the peer's immediates and send slots
+ * from our own writes, return credits, and flush what the deadline
+ * says is due. Returns the number of completions, or -1 on error.
+ */
+static inline int co_progress(struct coalescer *c) {
+    struct ibv_wc wc[32];
+    int n = ibv_poll_cq(c->cq, 32, wc);
+
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "coalesce: completion failed: %s\n",
+                    ibv_wc_status_str(wc[i].status));
+            errno = EIO;
+            return -1;
+        }
+        if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            uint32_t imm = ntohl(wc[i].imm_data);
+
+            if (imm & CO_CREDIT)
+                c->peer_consumed = co_cursor(c->peer_consumed, imm);
+            else
+                c->peer_produced = co_cursor(c->peer_produced, imm);
+            if (++c->recv_used == CO_RECV_BATCH) {
+                int ret = co_post_recvs(c, CO_RECV_BATCH);
+                if (ret) {
+                    errno = ret;
+                    return -1;
+                }
+                c->recv_used = 0;
+            }
+        } else {
+            c->sq_free++;
+            if (wc[i].wr_id & 1)
+                c->completed = wc[i].wr_id >> 32;
+        }
+    }
+    if (c->consumed - c->credited >= c->size / 4 && c->sq_free &&
+        co_post_credit(c))
+        return -1;
+    if (co_maybe_flush(c, tsc_ns()))
+        return -1;
+    return n;
+}
+
+/*
+ * Stage one record of len bytes. Returns 1 if it was taken, 0 if the
+ * ring has no room for it yet (call again), -1 on error.
+ */
+static inline int co_append(struct coalescer *c, const void *rec, uint32_t len) {
+    uint32_t frame = co_frame(len);
+    uint32_t pos = c->staged & (c->size - 1);
+    uint32_t tail = c->size - pos;
+    uint32_t need = frame > tail ? frame + tail : frame;
+
+    // Small enough that credits held back (a quarter) never starve it
+    if (frame > c->size / 8) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    // Without a threshold every record is its own write: wait for a WR
+    if (!c->threshold && c->sq_free < 2)
+        return co_progress(c) < 0 ? -1 : 0;
+
+    // Room at the peer, and staging bytes whose writes have completed
+    uint32_t room = c->size - (c->staged - c->peer_consumed);
+    uint32_t reusable = c->size - (c->staged - c->completed);
+    if (reusable < room)
+        room = reusable;
+    /*
+     * A flush must not cross the end of the ring: what is staged up to
+     * there goes out before anything is staged at offset 0.
+     */
+    int at_end = frame > tail || (!pos && c->staged != c->produced);
+    if (room < need || (at_end && c->sq_free < 2)) {
+        if (co_progress(c) < 0 || co_flush_now(c, tsc_ns()) < 0)
+            return -1;
+        c->credit_stalls++;
+        return 0;
+    }
+
+    if (frame > tail) {
+        struct co_hdr *wrap = (struct co_hdr *)(c->stage + pos);
+        wrap->len = CO_WRAP;
+        c->staged += tail;
+    }
+    if (at_end) {
+        if (co_flush_now(c, tsc_ns()) < 0)
+            return -1;
+        pos = 0;
+    }
+
+    uint64_t now = tsc_ns();
+    struct co_hdr *h = (struct co_hdr *)(c->stage + pos);
+    h->len = len;
+    memcpy(h + 1, rec, len);
+    if (c->staged == c->produced)
+        c->first_ns = now;
+    c->staged += frame;
+    c->pending++;
+    c->append_ns += now;
+    c->records++;
+    return co_maybe_flush(c, now) < 0 ? -1 : 1;
+}
+
+static inline int co_append_all(struct coalescer *c, const void *rec, uint32_t len) {
+    int ret;
+
+    while (!(ret = co_append(c, rec, len)))
+        ;
+    return ret < 0 ? -1 : 0;
+}
+
+// Flush whatever is staged and wait until it has all been placed
+static inline int co_drain(struct coalescer *c) {
+    while (c->completed != c->staged) {
+        if (co_flush_now(c, tsc_ns()) < 0 || co_progress(c) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand every record that has arrived to fn, in place in the ring.
+ * Returns the number of records, or -1 on error.
+ */
+static inline int co_recv(struct coalescer *c, co_record_fn fn, void *arg) {
+    int n = 0;
+
+    if (co_progress(c) < 0)
+        return -1;
+    while (c->consumed != c->peer_produced) {
+        uint32_t pos = c->consumed & (c->size - 1);
+        const struct co_hdr *h = (const struct co_hdr *)(c->ring + pos);
+
+        if (h->len == CO_WRAP) {
+            c->consumed += c->size - pos;
+            continue;
+        }
+        fn(arg, (const char *)(h + 1), h->len);
+        c->consumed += co_frame(h->len);
+        c->records++;
+        n++;
+    }
+    if (c->consumed - c->credited >= c->size / 4 && c->sq_free &&
+        co_post_credit(c))
+        return -1;
+    return n;
+}
+
+#endif
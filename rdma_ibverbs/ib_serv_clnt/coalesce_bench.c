@@ -0,0 +1,329 @@
+// coalesce_bench.c
+// Small records over RDMA: one RDMA_WRITE per record against records coalesced
+// into one write per threshold bytes or deadline (coalesce.h). Reports records
+// per second, writes per record and the latency that coalescing adds.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "ibdev.h"
+#include "hist.h"
+#include "coalesce.h"
+
+#define MODE_ONE      1         // one write per record
+#define MODE_CO       2         // coalesced
+#define SQ_DEPTH      128
+#define MAX_RECORD    4096
+
+// Sent by the client first
+struct co_hello {
+    uint32_t mode;
+    uint32_t ring;
+    uint64_t records;
+};
+
+// The server's count, once every record is in
+struct co_result {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t bad;               // out of sequence
+    uint64_t ns;                // first to last record
+};
+
+struct session {
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct coalescer co;
+    int sock;
+};
+
+// What the server's callback checks: every record starts with its number
+struct verify {
+    uint64_t next;
+    uint64_t bytes;
+    uint64_t bad;
+};
+
+static const char *mode_name(uint32_t mode) {
+    return mode == MODE_CO ? "coalesced" : "one write per record";
+}
+
+/*
+ * QP, CQ and coalescer for one session, connected to the peer over
+ * sock. threshold and deadline_ns only matter on the sending side.
+ */
+static void session_open(struct session *s, const struct ibdev *dev,
+                         struct ibv_pd *pd, int sock, uint32_t ring,
+                         uint32_t threshold, uint64_t deadline_ns) {
+    struct conn_info local = {0}, remote;
+
+    s->sock = sock;
+    s->cq = ibv_create_cq(dev->ctx, SQ_DEPTH + CO_RECV_DEPTH, NULL, NULL, 0);
+    if (!s->cq)
+        die("ibv_create_cq");
+    struct ibv_qp_init_attr init = {0};
+    init.send_cq = s->cq;
+    init.recv_cq = s->cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = SQ_DEPTH;
+    init.cap.max_recv_wr = CO_RECV_DEPTH;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    s->qp = ibv_create_qp(pd, &init);
+    if (!s->qp)
+        die("ibv_create_qp");
+    if (ibdev_qp_to_init(dev, s->qp, IBV_ACCESS_REMOTE_WRITE))
+        die("ibdev_qp_to_init");
+    if (co_create(&s->co, pd, s->qp, s->cq, ring, SQ_DEPTH, threshold,
+                  deadline_ns))
+        die("co_create");
+
+    local.qpn = s->qp->qp_num;
+    local.psn = rand() & 0xffffff;
+    co_local(&s->co, &local);
+    ibdev_fill_info(dev, &local);
+    xfer(sock, &local, sizeof(local), 1);
+    xfer(sock, &remote, sizeof(remote), 0);
+    if (co_set_peer(&s->co, &remote))
+        die("co_set_peer");
+    if (ibdev_qp_to_rts(dev, s->qp, local.psn, &remote, 1))
+        die("ibdev_qp_to_rts");
+
+    // Both QPs are in RTS before the first record is written
+    char ready = 'R';
+    xfer(sock, &ready, 1, 1);
+    xfer(sock, &ready, 1, 0);
+}
+
+static void session_close(struct session *s) {
+    ibv_destroy_qp(s->qp);
+    co_destroy(&s->co);
+    ibv_destroy_cq(s->cq);
+}
+
+/* --- server ---------------------------------------------------------- */
+
+static void check_record(void *arg, const char *rec, uint32_t len) {
+    struct verify *v = arg;
+    uint64_t seq;
+
+    memcpy(&seq, rec, sizeof(seq));
+    if (seq != v->next)
+        v->bad++;
+    v->next = seq + 1;
+    v->bytes += len;
+}
+
+static void serve(const struct ibdev *dev, struct ibv_pd *pd, int sock) {
+    struct co_hello hello;
+    struct co_result res = {0};
+    struct verify v = {0};
+    struct session s;
+    uint64_t first = 0;
+
+    xfer(sock, &hello, sizeof(hello), 0);
+    session_open(&s, dev, pd, sock, hello.ring, 0, 0);
+    printf("Client connected: %llu records, %s, %u byte ring\n",
+           (unsigned long long)hello.records, mode_name(hello.mode), hello.ring);
+
+    while (s.co.records < hello.records) {
+        int n = co_recv(&s.co, check_record, &v);
+        if (n < 0)
+            die("co_recv");
+        if (n && !first)
+            first = now_ns();
+    }
+    res.ns = now_ns() - first;
+    res.records = s.co.records;
+    res.bytes = v.bytes;
+    res.bad = v.bad;
+    printf("  %llu records, %llu bytes, %llu out of sequence, %.3f Mrec/s\n",
+           (unsigned long long)res.records, (unsigned long long)res.bytes,
+           (unsigned long long)res.bad,
+           res.ns ? res.records / (res.ns / 1e9) / 1e6 : 0);
+    xfer(sock, &res, sizeof(res), 1);
+
+    // Keep the QP until the client is done with it
+    char c;
+    if (read(sock, &c, 1) < 0)
+        perror("read");
+    session_close(&s);
+}
+
+/* --- client ---------------------------------------------------------- */
+
+static uint64_t xorshift(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/*
+ * records records of min..max bytes, paced to rate records per second
+ * if rate is not 0. Returns the seconds until the last one was placed.
+ */
+static double run(struct session *s, uint64_t records, uint32_t min,
+                  uint32_t max, uint64_t rate) {
+    static char rec[MAX_RECORD];
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    uint64_t start = tsc_ns();
+
+    for (uint64_t i = 0; i < records; i++) {
+        uint32_t len = min + (max > min ? xorshift(&rng) % (max - min + 1) : 0);
+
+        // Pacing: meanwhile the deadline may flush what is staged
+        if (rate)
+            while (tsc_ns() - start < i * 1000000000ull / rate)
+                if (co_progress(&s->co) < 0)
+                    die("co_progress");
+        memcpy(rec, &i, sizeof(i));
+        if (co_append_all(&s->co, rec, len))
+            die("co_append");
+    }
+    if (co_drain(&s->co))
+        die("co_drain");
+    return (tsc_ns() - start) / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> [-o|-c] [-s min[:max]] [-n records]\n"
+            "          [-t threshold] [-u deadline_us] [-R rate] [-r ring]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port      serve on port\n"
+            "  -o           one RDMA_WRITE per record only\n"
+            "  -c           coalesced only (default: both, one after the other)\n"
+            "  -s min:max   record sizes, uniformly random (default 32:200)\n"
+            "  -n records   records per run (default 10000000)\n"
+            "  -t threshold flush once this many bytes are staged (default 8192)\n"
+            "  -u us        ... or once the oldest record is this old (default 10)\n"
+            "  -R rate      produce this many records per second (default: as\n"
+            "               fast as possible)\n"
+            "  -r ring      ring size in bytes, a power of two (default 1048576)\n"
+            "  -D dev       use this HCA (default: the first one)\n"
+            "  -P pnetid    use the HCA port with this PNET ID (s390)\n"
+            "  -i port      HCA port (default: the first active one)\n"
+            "  -G index     GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    const char *listen_port = NULL;
+    uint32_t min = 32, max = 200, threshold = 8192, ring = 1 << 20;
+    uint64_t records = 10000000, deadline_us = 10, rate = 0;
+    int modes = MODE_ONE | MODE_CO, opt;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "L:ocs:n:t:u:R:r:D:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'o': modes = MODE_ONE; break;
+        case 'c': modes = MODE_CO; break;
+        case 's':
+            min = max = strtoul(optarg, &end, 0);
+            if (*end == ':')
+                max = strtoul(end + 1, NULL, 0);
+            break;
+        case 'n': records = strtoull(optarg, NULL, 0); break;
+        case 't': threshold = strtoul(optarg, NULL, 0); break;
+        case 'u': deadline_us = strtoull(optarg, NULL, 0); break;
+        case 'R': rate = strtoull(optarg, NULL, 0); break;
+        case 'r': ring = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (min < sizeof(uint64_t) || max < min || max > MAX_RECORD || !records ||
+        !threshold || !ring || (ring & (ring - 1)) || ring > CO_MAX_SIZE ||
+        threshold > ring / 2 || co_frame(max) > ring / 8 ||
+        (listen_port ? optind != argc : argc - optind != 2))
+        usage(argv[0]);
+
+    struct ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+        die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+    struct ibv_pd *pd = ibv_alloc_pd(dev.ctx);
+    if (!pd)
+        die("ibv_alloc_pd");
+
+    if (listen_port) {
+        int lfd = tcp_listen(listen_port, 1);
+        printf("Serving record streams on port %s\n", listen_port);
+
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            serve(&dev, pd, sock);
+            close(sock);
+        }
+    }
+
+    printf("%llu records of %u..%u bytes, %s, %u byte ring\n",
+           (unsigned long long)records, min, max,
+           rate ? "paced" : "as fast as possible", ring);
+    for (uint32_t mode = MODE_ONE; mode <= MODE_CO; mode <<= 1) {
+        static struct hist delay;
+        struct co_hello hello = { .mode = mode, .ring = ring, .records = records };
+        struct co_result res;
+        struct session s;
+
+        if (!(modes & mode))
+            continue;
+        int sock = tcp_connect(argv[optind], argv[optind + 1]);
+        xfer(sock, &hello, sizeof(hello), 1);
+        session_open(&s, &dev, pd, sock, ring, mode == MODE_CO ? threshold : 0,
+                     deadline_us * 1000);
+        hist_init(&delay);
+        s.co.delay = &delay;
+
+        double sec = run(&s, records, min, max, rate);
+        xfer(sock, &res, sizeof(res), 0);
+        char c = 'x';
+        xfer(sock, &c, 1, 1);
+
+        printf("%s", mode_name(mode));
+        if (mode == MODE_CO)
+            printf(" (%u bytes or %llu us)", threshold,
+                   (unsigned long long)deadline_us);
+        printf(":\n  %.3f s, %.3f Mrec/s, %.3f GB/s of records, %llu at the "
+               "server (%llu out of sequence)\n", sec, records / sec / 1e6,
+               res.bytes / sec / 1e9, (unsigned long long)res.records,
+               (unsigned long long)res.bad);
+        printf("  %llu writes, %.1f records per write (%llu by size, %llu by "
+               "deadline), %llu stalls on credits\n",
+               (unsigned long long)s.co.flushes,
+               (double)records / s.co.flushes,
+               (unsigned long long)s.co.size_flushes,
+               (unsigned long long)s.co.deadline_flushes,
+               (unsigned long long)s.co.credit_stalls);
+        printf("  added latency, append to doorbell: avg %.2f us\n",
+               s.co.delay_ns / 1e3 / records);
+        hist_print_us("  oldest record of each write", &delay);
+        session_close(&s);
+        close(sock);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibdev_close(&dev);
+    return 0;
+}
@@ -3,28 +3,130 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include <infiniband/verbs.h>
 
 #define BUFFER_SIZE 4096
 #define TCP_PORT    18515   /* or any fixed port you want */
 
-/* QP exchange info */
-struct qp_info {
+/*
+ * QP exchange info, sent over the TCP side channel by both peers.
+ * len is the size of the buffer behind rkey/vaddr, so the writer can
+ * check that its messages fit before it posts anything. lid and mtu
+ * are filled in by programs that discover their port (ibdev.h); 0
+ * means not known. rd_atomic is how many RDMA_READs/atomics the sender
+ * will have in flight on, or accept into, this QP; both ends use the
+ * smaller of theirs and the peer's (conn_rd_atomic()), 0 = not sent.
+ */
+struct conn_info {
     uint32_t qpn;
     uint32_t psn;
     uint32_t rkey;
+    uint32_t len;
     uint64_t vaddr;
-    union ibv_gid gid;
+    uint8_t gid[16]; // For RoCE addressing
+    uint16_t lid;    // For InfiniBand addressing
+    uint8_t mtu;     // enum ibv_mtu, the port's active MTU
+    uint8_t rd_atomic;
 };
 
+/*
+ * max_rd_atomic/max_dest_rd_atomic for a connection. A requester with
+ * more READs in flight than the responder accepts stalls or fails them,
+ * so both take the smaller value, whatever each side's -R and device.
+ */
+static inline uint8_t conn_rd_atomic(uint8_t local,
+                                     const struct conn_info *remote) {
+    return remote->rd_atomic && remote->rd_atomic < local ?
+           remote->rd_atomic : local;
+}
+
 /* Simple error handler */
 static inline void die(const char *msg) {
     fprintf(stderr, "Error: %s (%s)\n", msg, strerror(errno));
     exit(EXIT_FAILURE);
 }
 
-#endif
+// Monotonic clock in nanoseconds, used for the benchmark modes
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Side channel for the benchmarks. xfer_all() moves exactly len bytes
+ * out of (out = 1) or into buf on any blocking stream socket, TCP or
+ * Unix, riding out signals. It returns 0, or -1 with errno set, and
+ * ECONNRESET for EOF. xfer() dies instead, like the connect and listen
+ * helpers do.
+ */
+static inline int xfer_all(int sock, void *buf, size_t len, int out) {
+    char *p = (char *)buf;
+
+    while (len) {
+        ssize_t n = out ? write(sock, p, len) : read(sock, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (!n)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline void xfer(int sock, void *buf, size_t len, int out) {
+    if (xfer_all(sock, buf, len, out))
+        die(out ? "write" : "read");
+}
+
+// Connect to an address that is already resolved, e.g. once per run
+static inline int tcp_connect_addr(const struct addrinfo *res) {
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 
+    if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen))
+        die("connect");
+    return sock;
+}
+
+static inline int tcp_connect(const char *host, const char *port) {
+    struct addrinfo hints = {0}, *res;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res))
+        die("getaddrinfo");
+    int sock = tcp_connect_addr(res);
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Listen on port of every local IPv4 address
+static inline int tcp_listen(const char *port, int backlog) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    int one = 1;
+
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(strtoul(port, NULL, 0));
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0)
+        die("socket");
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, backlog))
+        die("bind/listen");
+    return lfd;
+}
+
+#endif
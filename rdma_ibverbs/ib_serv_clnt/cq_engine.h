@@ -0,0 +1,294 @@
+#ifndef CQ_ENGINE_H
+#define CQ_ENGINE_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include "common.h"
+#include "tsc.h"
+
+/*
+ * Completion engine: adaptive poll-then-sleep on a CQ
+ *
+ * The CQ is created on a completion channel. Completions are reaped in
+ * batches of up to CQE_BATCH per ibv_poll_cq(). cq_engine_wait() first
+ * busy-polls for spin_ns. If nothing arrives in that time it arms the
+ * CQ with ibv_req_notify_cq() and sleeps on the channel fd until the
+ * HCA raises a completion event:
+ *
+ *   spin_ns = CQ_SPIN_FOREVER  pure busy polling, lowest latency, one
+ *                              core per poller
+ *   spin_ns = 0                sleep as soon as the CQ is empty, no CPU
+ *                              burnt while idle, adds an interrupt and
+ *                              a wakeup to the first completion
+ *   anything in between        spin through short gaps, sleep on long
+ *                              ones
+ *
+ * The channel fd is non-blocking, so an event loop can put it in its
+ * epoll set instead: call cq_engine_arm() before sleeping and
+ * cq_engine_ack_events() when the fd turns readable. Arming has to be
+ * followed by one more poll, because a completion that arrived between
+ * the last poll and the arm does not raise an event; cq_engine_arm()
+ * does that poll and returns what it found.
+ *
+ * Every completion a poll returns gets a timestamp in ts[], on the
+ * now_ns() timeline. If the device stamps completions (a non-zero
+ * completion_timestamp_mask), the CQ is an extended one created with
+ * IBV_WC_EX_WITH_COMPLETION_TIMESTAMP and read with ibv_start_poll(),
+ * and ts[] is the time the HCA wrote the CQE: its raw clock, converted
+ * with hca_core_clock and re-anchored to tsc_ns() every CQ_SYNC_NS to
+ * follow the drift between the two oscillators. Otherwise ts[] is the
+ * tsc_ns() of the poll that found the completion, which adds the
+ * polling delay, or the sleep, to it.
+ */
+#define CQE_BATCH        32
+#define CQ_SPIN_FOREVER  UINT64_MAX
+#define CQ_ACK_BATCH     64
+#define CQ_SYNC_NS       1000000000ull
+
+struct cq_engine {
+    struct ibv_comp_channel *channel;
+    struct ibv_cq *cq;
+    struct ibv_cq_ex *cq_ex;    // NULL without hardware timestamps
+    uint64_t ts[CQE_BATCH];     // completion time of wc[i] of the last poll
+
+    // HCA clock -> ns: ns0 + (raw - raw0) * ns_per_tick
+    struct ibv_context *ctx;
+    uint64_t ts_mask;
+    uint64_t raw0, ns0;
+    double ns_per_tick;
+    uint64_t spin_ns;
+    unsigned int unacked;       // events not yet passed to ibv_ack_cq_events()
+    int armed;
+
+    uint64_t polls;
+    uint64_t completions;
+    uint64_t sleeps;
+};
+
+// Pair the HCA's current clock with tsc_ns(); 0, or -1 if unsupported
+static inline int cq_engine_sync(struct cq_engine *e) {
+    struct ibv_values_ex v = { .comp_mask = IBV_VALUES_MASK_RAW_CLOCK };
+
+    if (ibv_query_rt_values_ex(e->ctx, &v) ||
+        !(v.comp_mask & IBV_VALUES_MASK_RAW_CLOCK))
+        return -1;
+    e->ns0 = tsc_ns();
+    e->raw0 = v.raw_clock.tv_nsec;      // providers put the cycles here
+    return 0;
+}
+
+// Does the device stamp completions? Fills attr if it does.
+static inline int cq_engine_hw_ts(struct ibv_context *ctx,
+                                  struct ibv_device_attr_ex *attr) {
+    return !ibv_query_device_ex(ctx, NULL, attr) &&
+           attr->completion_timestamp_mask && attr->hca_core_clock;
+}
+
+static inline int cq_engine_create_ex(struct cq_engine *e, int cqe) {
+    struct ibv_device_attr_ex attr;
+    struct ibv_cq_init_attr_ex cq_attr = {
+        .cqe = cqe,
+        .channel = e->channel,
+        .wc_flags = IBV_WC_STANDARD_FLAGS | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP,
+    };
+
+    if (!cq_engine_hw_ts(e->ctx, &attr) || cq_engine_sync(e))
+        return -1;
+    e->cq_ex = ibv_create_cq_ex(e->ctx, &cq_attr);
+    if (!e->cq_ex)
+        return -1;
+    e->cq = ibv_cq_ex_to_cq(e->cq_ex);
+    e->ts_mask = attr.completion_timestamp_mask;
+    e->ns_per_tick = 1e6 / attr.hca_core_clock;     // the clock is in kHz
+    return 0;
+}
+
+static inline void cq_engine_create(struct cq_engine *e,
+                                    struct ibv_context *ctx, int cqe,
+                                    uint64_t spin_ns) {
+    memset(e, 0, sizeof(*e));
+    e->spin_ns = spin_ns;
+    e->ctx = ctx;
+    tsc_init();
+
+    e->channel = ibv_create_comp_channel(ctx);
+    if (!e->channel)
+        die("ibv_create_comp_channel");
+    int flags = fcntl(e->channel->fd, F_GETFL);
+    if (fcntl(e->channel->fd, F_SETFL, flags | O_NONBLOCK))
+        die("fcntl");
+
+    if (cq_engine_create_ex(e, cqe)) {
+        e->cq = ibv_create_cq(ctx, cqe, NULL, e->channel, 0);
+        if (!e->cq)
+            die("ibv_create_cq");
+    }
+}
+
+// Where ts[] comes from, for reports
+#define CQ_TS_HCA "HCA completion timestamps"
+#define CQ_TS_CPU "CPU timestamps at poll"
+
+static inline const char *cq_engine_ts_source(const struct cq_engine *e) {
+    return e->cq_ex ? CQ_TS_HCA : CQ_TS_CPU;
+}
+
+static inline void cq_engine_destroy(struct cq_engine *e) {
+    if (e->unacked)
+        ibv_ack_cq_events(e->cq, e->unacked);
+    ibv_destroy_cq(e->cq);
+    ibv_destroy_comp_channel(e->channel);
+}
+
+static inline int cq_engine_fd(const struct cq_engine *e) {
+    return e->channel->fd;
+}
+
+static inline uint64_t cq_engine_hw_ns(const struct cq_engine *e,
+                                       uint64_t raw) {
+    // Signed distance from the anchor, the CQE may predate it
+    int64_t d = (raw - e->raw0) & e->ts_mask;
+
+    if ((uint64_t)d > e->ts_mask / 2)
+        d -= (int64_t)e->ts_mask + 1;
+    return e->ns0 + (int64_t)(d * e->ns_per_tick);
+}
+
+// ibv_poll_cq() for an extended CQ: fill wc[] and the HCA timestamps
+static inline int cq_engine_poll_ex(struct cq_engine *e, struct ibv_wc *wc,
+                                    int max) {
+    struct ibv_poll_cq_attr attr = {0};
+    struct ibv_cq_ex *cq = e->cq_ex;
+    int n = 0, ret = ibv_start_poll(cq, &attr);
+
+    if (ret == ENOENT)
+        return 0;
+    if (ret)
+        return -1;
+    do {
+        struct ibv_wc *w = &wc[n];
+
+        memset(w, 0, sizeof(*w));
+        w->wr_id = cq->wr_id;
+        w->status = cq->status;
+        w->vendor_err = ibv_wc_read_vendor_err(cq);
+        w->qp_num = ibv_wc_read_qp_num(cq);
+        // For a failed WR only wr_id, status, vendor_err and qp_num are valid
+        if (w->status == IBV_WC_SUCCESS) {
+            w->opcode = ibv_wc_read_opcode(cq);
+            w->byte_len = ibv_wc_read_byte_len(cq);
+            w->wc_flags = ibv_wc_read_wc_flags(cq);
+            if (w->wc_flags & IBV_WC_WITH_IMM)
+                w->imm_data = ibv_wc_read_imm_data(cq);
+            w->src_qp = ibv_wc_read_src_qp(cq);
+            w->slid = ibv_wc_read_slid(cq);
+            w->sl = ibv_wc_read_sl(cq);
+            w->dlid_path_bits = ibv_wc_read_dlid_path_bits(cq);
+        }
+        e->ts[n] = cq_engine_hw_ns(e, ibv_wc_read_completion_ts(cq));
+        if (++n == max)
+            break;
+        ret = ibv_next_poll(cq);
+    } while (!ret);
+    ibv_end_poll(cq);
+    if (ret && ret != ENOENT)
+        return -1;
+
+    if (e->ts[n - 1] - e->ns0 > CQ_SYNC_NS)
+        cq_engine_sync(e);
+    return n;
+}
+
+// Non-blocking batched poll, returns the number of completions in wc
+static inline int cq_engine_poll(struct cq_engine *e, struct ibv_wc *wc,
+                                 int max) {
+    int n;
+
+    if (max > CQE_BATCH)
+        max = CQE_BATCH;
+    if (e->cq_ex) {
+        n = cq_engine_poll_ex(e, wc, max);
+    } else {
+        n = ibv_poll_cq(e->cq, max, wc);
+        if (n > 0) {
+            uint64_t t = tsc_ns();
+            for (int i = 0; i < n; i++)
+                e->ts[i] = t;
+        }
+    }
+    if (n < 0)
+        die("ibv_poll_cq");
+    e->polls++;
+    e->completions += n;
+    return n;
+}
+
+/*
+ * Request an event for the next completion and poll once more.
+ * Returns 0 if the caller may now sleep on the channel fd, otherwise
+ * the completions that raced with arming.
+ */
+static inline int cq_engine_arm(struct cq_engine *e, struct ibv_wc *wc,
+                                int max) {
+    if (!e->armed) {
+        if (ibv_req_notify_cq(e->cq, 0))
+            die("ibv_req_notify_cq");
+        e->armed = 1;
+    }
+    return cq_engine_poll(e, wc, max);
+}
+
+// Consume the events pending on the (readable) channel fd
+static inline void cq_engine_ack_events(struct cq_engine *e) {
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+
+    while (!ibv_get_cq_event(e->channel, &ev_cq, &ev_ctx)) {
+        e->unacked++;
+        e->armed = 0;
+    }
+    if (e->unacked >= CQ_ACK_BATCH) {
+        ibv_ack_cq_events(e->cq, e->unacked);
+        e->unacked = 0;
+    }
+}
+
+// Block until at least one completion is available, spinning first
+static inline int cq_engine_wait(struct cq_engine *e, struct ibv_wc *wc,
+                                 int max) {
+    uint64_t deadline = 0;
+
+    for (;;) {
+        int n = cq_engine_poll(e, wc, max);
+        if (n)
+            return n;
+        if (e->spin_ns == CQ_SPIN_FOREVER)
+            continue;
+        if (!deadline && e->spin_ns) {
+            deadline = now_ns() + e->spin_ns;
+            continue;
+        }
+        if (deadline && now_ns() < deadline)
+            continue;
+
+        n = cq_engine_arm(e, wc, max);
+        if (n)
+            return n;
+
+        struct pollfd pfd = { .fd = cq_engine_fd(e), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            die("poll");
+        e->sleeps++;
+        cq_engine_ack_events(e);
+        deadline = 0;
+    }
+}
+
+// Parse a -p argument: microseconds to spin, negative means forever
+static inline uint64_t cq_spin_ns(const char *arg) {
+    long us = strtol(arg, NULL, 0);
+
+    return us < 0 ? CQ_SPIN_FOREVER : (uint64_t)us * 1000;
+}
+
+#endif
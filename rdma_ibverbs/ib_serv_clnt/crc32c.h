@@ -0,0 +1,316 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <pthread.h>
+#include "common.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(__s390x__)
+#include <sys/auxv.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli) for end-to-end integrity
+ *
+ * The HCA's ICRC covers a packet on the wire, not the path from the
+ * sender's memory to the receiver's: a bad DMA, a bug that reuses a
+ * buffer too early or a write to the wrong offset all arrive with a
+ * perfect ICRC. A CRC computed by the sender over its buffer and
+ * checked by the receiver over what landed catches them.
+ *
+ * CRC32C is the one with hardware support:
+ *
+ *   x86      SSE4.2 crc32 instruction, 8 bytes per instruction
+ *   aarch64  ARMv8 CRC extension, crc32cx, likewise
+ *   s390x    no CRC instruction, but the z13 vector facility has a
+ *            carry-less multiply (VGFM) to fold 64 bytes at a time
+ *   others   slicing-by-8 tables
+ *
+ * The crc32 instruction has a latency of about three cycles but can
+ * start every cycle, so the x86 and aarch64 paths run three independent
+ * CRCs over three adjacent blocks of a buffer and join them with tables
+ * that shift a CRC over a block of zeros, instead of waiting on one
+ * chain of dependent instructions. The implementation is picked at run
+ * time by what the CPU supports.
+ *
+ * crc32c() continues a CRC: start with 0 and pass the previous result
+ * to checksum a buffer in pieces.
+ */
+#define CRC32C_POLY     0x82f63b78u     // reflected
+#define CRC32C_LONG     8192            // bytes per lane, three lanes
+#define CRC32C_SHORT    256
+#define CRC32C_TRAILER  4               // bytes a sealed buffer ends with
+
+static uint32_t crc32c_table[8][256];           // slicing-by-8
+static uint32_t crc32c_long[4][256];            // shift over CRC32C_LONG zeros
+static uint32_t crc32c_short[4][256];           // ... CRC32C_SHORT zeros
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t);
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t crc32c_load64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * a * b modulo the polynomial, bit-reflected like the CRC itself (x^0
+ * is the top bit). a must not be 0.
+ */
+static inline uint32_t crc32c_mulmod(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if (!(a & (m - 1)))
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// Tables that multiply a CRC by x^(8 * len): len zero bytes appended
+static inline void crc32c_shift_table(uint32_t t[4][256], size_t len) {
+    uint32_t k = 1u << 31, x8 = 1u << 23;      // x^0, x^8
+
+    for (; len; len >>= 1) {
+        if (len & 1)
+            k = crc32c_mulmod(x8, k);
+        x8 = crc32c_mulmod(x8, x8);
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int j = 0; j < 4; j++)
+            t[j][n] = crc32c_mulmod(k, n << (8 * j));
+}
+
+static inline uint32_t crc32c_shift(uint32_t t[4][256], uint32_t crc) {
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+           t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+// Portable slicing-by-8, byte order independent
+static inline uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    for (; len && ((uintptr_t)p & 7); len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len; len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+ * The three-lane hardware loop, for an instruction that folds 8 bytes
+ * (crc8) and one that folds 1 (crc1) into a CRC.
+ */
+#define CRC32C_HW(name, isa, crc8, crc1)                                      \
+__attribute__((target(isa)))                                                  \
+static uint32_t name(uint32_t crc, const void *buf, size_t len) {             \
+    const unsigned char *p = buf;                                             \
+    uint32_t c0 = ~crc;                                                       \
+                                                                              \
+    for (; len && ((uintptr_t)p & 7); len--)                                  \
+        c0 = crc1(c0, *p++);                                                  \
+    for (size_t blk = CRC32C_LONG; blk >= CRC32C_SHORT; blk /= 32) {          \
+        uint32_t (*t)[256] = blk == CRC32C_LONG ? crc32c_long : crc32c_short; \
+        for (; len >= 3 * blk; len -= 3 * blk, p += 2 * blk) {                \
+            const unsigned char *end = p + blk;                               \
+            uint32_t c1 = 0, c2 = 0;                                          \
+            for (; p < end; p += 8) {                                         \
+                c0 = crc8(c0, crc32c_load64(p));                              \
+                c1 = crc8(c1, crc32c_load64(p + blk));                        \
+                c2 = crc8(c2, crc32c_load64(p + 2 * blk));                    \
+            }                                                                 \
+            c0 = crc32c_shift(t, c0) ^ c1;                                    \
+            c0 = crc32c_shift(t, c0) ^ c2;                                    \
+        }                                                                     \
+    }                                                                         \
+    for (; len >= 8; len -= 8, p += 8)                                        \
+        c0 = crc8(c0, crc32c_load64(p));                                      \
+    for (; len; len--)                                                        \
+        c0 = crc1(c0, *p++);                                                  \
+    return ~c0;                                                               \
+}
+
+#if defined(__x86_64__)
+#define crc32c_x86_8(c, v)  ((uint32_t)_mm_crc32_u64((c), (v)))
+CRC32C_HW(crc32c_hw, "sse4.2", crc32c_x86_8, _mm_crc32_u8)
+#elif defined(__aarch64__)
+CRC32C_HW(crc32c_hw, "+crc", __crc32cd, __crc32cb)
+#elif defined(__s390x__)
+/*
+ * s390x folding, as in the kernel's crc32le-vx: four 128-bit
+ * accumulators take 64 bytes a round. Each is carry-less multiplied by
+ * x^(512+32) and x^(512-32) mod P (one constant per doubleword) and the
+ * next 64 bytes are XORed in, with one VECTOR GALOIS FIELD MULTIPLY SUM
+ * AND ACCUMULATE. The four are then folded into one with x^(128+-32),
+ * that one down to 64 bits, and a Barrett reduction leaves the CRC.
+ *
+ * A vector holds 16 bytes as a little-endian number, element 0 being
+ * its high doubleword, which is the bit order of the reflected CRC.
+ * Constants are bit-reflected and shifted left by one, for the same
+ * reason.
+ */
+#define CRC32C_VX_MIN   64
+
+typedef uint64_t crc32c_v2 __attribute__((vector_size(16)));
+typedef unsigned char crc32c_v16 __attribute__((vector_size(16)));
+
+static inline crc32c_v2 crc32c_vload(const unsigned char *p) {
+    return (crc32c_v2){ __builtin_bswap64(crc32c_load64(p + 8)),
+                        __builtin_bswap64(crc32c_load64(p)) };
+}
+
+// a[0] * b[0] ^ a[1] * b[1], carry-less
+__attribute__((target("arch=z13")))
+static inline crc32c_v2 crc32c_vgfm(crc32c_v2 a, crc32c_v2 b) {
+    return (crc32c_v2)__builtin_s390_vgfmg(a, b);
+}
+
+// a[0] * b[0] ^ a[1] * b[1] ^ c
+__attribute__((target("arch=z13")))
+static inline crc32c_v2 crc32c_vgfma(crc32c_v2 a, crc32c_v2 b, crc32c_v2 c) {
+    return (crc32c_v2)__builtin_s390_vgfmag(a, b, (crc32c_v16)c);
+}
+
+// The bare CRC register over len bytes, len a multiple of 16 and >= 64
+__attribute__((target("arch=z13")))
+static uint32_t crc32c_vx_fold(uint32_t crc, const unsigned char *p, size_t len) {
+    const crc32c_v2 r2r1 = { 0x09e4addf8, 0x740eef02 };
+    const crc32c_v2 r4r3 = { 0x14cd00bd6, 0xf20c0dfe };
+    const crc32c_v2 r5 = { 0, 0x0dd45aab8 };
+    const crc32c_v2 ru = { 0, 0x0dea713f1 };       // Barrett: x^64 / P
+    const crc32c_v2 poly = { 0, 0x105ec76f0 };
+    crc32c_v2 v0 = crc32c_vload(p), v1 = crc32c_vload(p + 16);
+    crc32c_v2 v2 = crc32c_vload(p + 32), v3 = crc32c_vload(p + 48);
+    crc32c_v2 t;
+
+    v0[1] ^= crc;
+    for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+        v0 = crc32c_vgfma(r2r1, v0, crc32c_vload(p));
+        v1 = crc32c_vgfma(r2r1, v1, crc32c_vload(p + 16));
+        v2 = crc32c_vgfma(r2r1, v2, crc32c_vload(p + 32));
+        v3 = crc32c_vgfma(r2r1, v3, crc32c_vload(p + 48));
+    }
+    t = crc32c_vgfma(r4r3, v0, v1);
+    t = crc32c_vgfma(r4r3, t, v2);
+    t = crc32c_vgfma(r4r3, t, v3);
+    for (; len; p += 16, len -= 16)
+        t = crc32c_vgfma(r4r3, t, crc32c_vload(p));
+
+    // 128 -> 96 bits: the high doubleword times 1, the low one times R4
+    t = crc32c_vgfm((crc32c_v2){ 1, r4r3[0] }, t);
+    // 96 -> 64 bits: the low word times R5, plus the rest a word down
+    t = crc32c_vgfma(r5, (crc32c_v2){ t[1] >> 32, (uint32_t)t[1] },
+                     (crc32c_v2){ t[0] >> 32, t[0] << 32 | t[1] >> 32 });
+    // Barrett: T1 = (t / x^32) * u, then t ^ (T1 / x^32) * P
+    crc32c_v2 b = crc32c_vgfm(ru, (crc32c_v2){ t[1] >> 32, (uint32_t)t[1] });
+    b = crc32c_vgfma(poly, (crc32c_v2){ b[1] >> 32, (uint32_t)b[1] }, t);
+    return b[1] >> 32;
+}
+
+static uint32_t crc32c_vx(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    size_t n = len & ~(size_t)15;
+
+    if (len < CRC32C_VX_MIN)
+        return crc32c_sw(crc, buf, len);
+    crc = ~crc32c_vx_fold(~crc, p, n);
+    return crc32c_sw(crc, p + n, len - n);
+}
+#endif
+
+static inline void crc32c_setup(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^
+                                 crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+    crc32c_fn = crc32c_sw;
+    crc32c_name = "slicing-by-8";
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#if defined(__x86_64__)
+    if (!__builtin_cpu_supports("sse4.2"))
+        return;
+    crc32c_name = "SSE4.2 crc32, 3 lanes";
+#else
+    if (!(getauxval(AT_HWCAP) & HWCAP_CRC32))
+        return;
+    crc32c_name = "ARMv8 crc32cx, 3 lanes";
+#endif
+    crc32c_shift_table(crc32c_long, CRC32C_LONG);
+    crc32c_shift_table(crc32c_short, CRC32C_SHORT);
+    crc32c_fn = crc32c_hw;
+#elif defined(__s390x__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_S390_VX))
+        return;
+    crc32c_name = "z13 VGFM, 4 x 128-bit folding";
+    crc32c_fn = crc32c_vx;
+#endif
+}
+
+static inline void crc32c_init(void) {
+    pthread_once(&crc32c_once, crc32c_setup);
+}
+
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc32c_init();
+    return crc32c_fn(crc, buf, len);
+}
+
+static inline const char *crc32c_impl(void) {
+    crc32c_init();
+    return crc32c_name;
+}
+
+/*
+ * A sealed buffer of len bytes carries the CRC32C of its first
+ * len - CRC32C_TRAILER bytes in its last four, little-endian whatever
+ * the host, so that s390x and x86 agree.
+ */
+static inline void crc32c_seal(void *buf, size_t len) {
+    unsigned char *t = (unsigned char *)buf + len - CRC32C_TRAILER;
+    uint32_t crc = crc32c(0, buf, len - CRC32C_TRAILER);
+
+    t[0] = crc;
+    t[1] = crc >> 8;
+    t[2] = crc >> 16;
+    t[3] = crc >> 24;
+}
+
+// 0 if the trailer matches, or -1
+static inline int crc32c_check(const void *buf, size_t len) {
+    if (len < CRC32C_TRAILER)
+        return -1;
+    const unsigned char *t = (const unsigned char *)buf + len - CRC32C_TRAILER;
+    uint32_t want = t[0] | t[1] << 8 | t[2] << 16 | (uint32_t)t[3] << 24;
+    return crc32c(0, buf, len - CRC32C_TRAILER) == want ? 0 : -1;
+}
+
+#endif
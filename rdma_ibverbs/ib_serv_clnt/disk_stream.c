@@ -0,0 +1,523 @@
+// disk_stream.c
+// Disk-to-disk streaming over RDMA for files larger than RAM: io_uring (uring.h)
+// reads O_DIRECT chunks into a ring of registered buffers while earlier chunks
+// are on the wire, and the receiver writes them out the same way. Reports GB/s
+// and how many buffers each stage of the pipeline holds on average.
+#define _GNU_SOURCE     // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "ibdev.h"
+#include "notify.h"
+#include "uring.h"
+
+#define STREAM_ALIGN  4096      // O_DIRECT alignment of offsets, lengths, buffers
+#define MAX_DEPTH     1024
+#define POLL_BATCH    32
+
+/*
+ * The pipeline
+ *
+ * Both sides own a ring of depth buffers of chunk bytes, registered once
+ * with the HCA and with io_uring. Chunk k always uses slot k % depth on
+ * both sides, so a slot only needs a state:
+ *
+ *   sender    FREE -> READ -> READY -> WIRE -> FREE
+ *             io_uring reads chunk k from the file. Once it is in, and
+ *             the chunks before it are sent, it goes out as a single
+ *             RDMA_WRITE_WITH_IMM into the receiver's slot, as soon as
+ *             the receiver has that slot free. The write's completion
+ *             frees the local slot for chunk k + depth.
+ *   receiver  EMPTY -> DISK -> EMPTY
+ *             The immediate is the chunk index and the completion's
+ *             byte_len its length. io_uring writes the chunk out; its
+ *             completion returns the slot to the sender as a credit, a
+ *             zero-length WRITE_WITH_IMM with the chunk index.
+ *
+ * Every transition is timed, which gives the average number of slots in
+ * each state. Slots pile up in front of the slowest stage: in READ when
+ * the source disk is slow, in READY waiting for credits when the
+ * receiver is, in WIRE when the network is, and in DISK on the receiver
+ * when the destination disk is.
+ */
+enum {
+    ST_FREE, ST_READ, ST_READY, ST_WIRE,        // sender
+    ST_EMPTY, ST_DISK,                          // receiver
+    NSTATES
+};
+
+static const char *state_names[NSTATES] = {
+    "idle", "reading from disk", "waiting for a credit", "on the wire",
+    "waiting for data", "writing to disk",
+};
+
+// Sent by the client first
+struct stream_hello {
+    uint64_t size;
+    uint32_t chunk;
+    uint32_t depth;
+};
+
+// The receiver's report, once the file is on its disk
+struct stream_done {
+    uint64_t ns;
+    uint64_t occ_ns;            // span of slot_ns
+    uint64_t slot_ns[NSTATES];
+};
+
+// Time-weighted count of slots per state
+struct occupancy {
+    uint32_t n[NSTATES];
+    uint64_t slot_ns[NSTATES];
+    uint64_t start, last;
+};
+
+struct stream {
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;
+    char *buf;
+    uint32_t chunk, depth;
+    struct conn_info local, remote;
+    struct uring ring;
+    uint8_t *state;             // per slot
+    struct occupancy occ;
+};
+
+static void occ_tick(struct occupancy *o) {
+    uint64_t t = now_ns();
+
+    for (int i = 0; i < NSTATES; i++)
+        o->slot_ns[i] += o->n[i] * (t - o->last);
+    o->last = t;
+}
+
+static void slot_move(struct stream *s, uint32_t slot, int to) {
+    occ_tick(&s->occ);
+    s->occ.n[s->state[slot]]--;
+    s->occ.n[to]++;
+    s->state[slot] = to;
+}
+
+static double occ_avg(const uint64_t *slot_ns, uint64_t ns, int st) {
+    return ns ? (double)slot_ns[st] / ns : 0;
+}
+
+static void occ_print(const char *side, const uint64_t *slot_ns, uint64_t ns,
+                      uint32_t depth, int first, int last) {
+    printf("  %s, average slots of %u:\n", side, depth);
+    for (int i = first; i <= last; i++) {
+        double avg = occ_avg(slot_ns, ns, i);
+        printf("    %-22s %7.2f  (%5.1f%%)\n", state_names[i], avg,
+               100 * avg / depth);
+    }
+}
+
+static char *slot_buf(const struct stream *s, uint32_t slot) {
+    return s->buf + (uint64_t)slot * s->chunk;
+}
+
+/*
+ * open() with O_DIRECT if asked for. Filesystems without it (tmpfs)
+ * fail with EINVAL; the file is then used through the page cache.
+ */
+static int open_file(const char *path, int flags, int *direct) {
+    int fd = open(path, flags | (*direct ? O_DIRECT : 0), 0644);
+
+    if (fd < 0 && *direct && errno == EINVAL) {
+        fprintf(stderr, "%s: no O_DIRECT here, using the page cache\n", path);
+        *direct = 0;
+        fd = open(path, flags, 0644);
+    }
+    if (fd < 0)
+        die(path);
+    return fd;
+}
+
+/*
+ * Buffers, QP and io_uring for one side, and connect to the peer over
+ * sock. Every slot starts in state st.
+ */
+static void stream_open(struct stream *s, const struct ibdev *dev,
+                        struct ibv_pd *pd, int sock, uint32_t chunk,
+                        uint32_t depth, int st) {
+    size_t len = (size_t)chunk * depth;
+
+    memset(s, 0, sizeof(*s));
+    s->pd = pd;
+    s->chunk = chunk;
+    s->depth = depth;
+    if (posix_memalign((void **)&s->buf, STREAM_ALIGN, len))
+        die("posix_memalign");
+    s->state = malloc(depth);
+    if (!s->state)
+        die("malloc");
+    memset(s->state, st, depth);
+    s->occ.n[st] = depth;
+    s->mr = ibv_reg_mr(pd, s->buf, len,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!s->mr)
+        die("ibv_reg_mr");
+
+    // Each side has at most depth sends and depth credits or chunks in flight
+    s->cq = ibv_create_cq(dev->ctx, 2 * depth, NULL, NULL, 0);
+    if (!s->cq)
+        die("ibv_create_cq");
+    struct ibv_qp_init_attr init = {0};
+    init.send_cq = s->cq;
+    init.recv_cq = s->cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = depth;
+    init.cap.max_recv_wr = depth;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    s->qp = ibv_create_qp(pd, &init);
+    if (!s->qp)
+        die("ibv_create_qp");
+    if (ibdev_qp_to_init(dev, s->qp, IBV_ACCESS_REMOTE_WRITE))
+        die("ibdev_qp_to_init");
+    if (notify_post_recvs(s->qp, depth))
+        die("ibv_post_recv");
+
+    s->local.qpn = s->qp->qp_num;
+    s->local.psn = rand() & 0xffffff;
+    s->local.rkey = s->mr->rkey;
+    s->local.vaddr = (uintptr_t)s->buf;
+    s->local.len = len;
+    ibdev_fill_info(dev, &s->local);
+    xfer(sock, &s->local, sizeof(s->local), 1);
+    xfer(sock, &s->remote, sizeof(s->remote), 0);
+    if (ibdev_qp_to_rts(dev, s->qp, s->local.psn, &s->remote, 1))
+        die("ibdev_qp_to_rts");
+    // Both QPs are in RTS before the first chunk is written
+    char ready = 'R';
+    xfer(sock, &ready, 1, 1);
+    xfer(sock, &ready, 1, 0);
+
+    if (uring_init(&s->ring, depth))
+        die("io_uring_setup");
+    struct iovec *iov = calloc(depth, sizeof(*iov));
+    if (!iov)
+        die("calloc");
+    for (uint32_t i = 0; i < depth; i++) {
+        iov[i].iov_base = slot_buf(s, i);
+        iov[i].iov_len = chunk;
+    }
+    if (uring_register_bufs(&s->ring, iov, depth))
+        perror("io_uring buffer registration, using unregistered buffers");
+    free(iov);
+    s->occ.start = s->occ.last = now_ns();
+}
+
+static void stream_close(struct stream *s) {
+    uring_exit(&s->ring);
+    ibv_destroy_qp(s->qp);
+    ibv_destroy_cq(s->cq);
+    ibv_dereg_mr(s->mr);
+    free(s->buf);
+    free(s->state);
+}
+
+static uint32_t chunk_len(const struct stream *s, uint64_t size, uint32_t k) {
+    uint64_t off = (uint64_t)k * s->chunk;
+
+    return size - off < s->chunk ? size - off : s->chunk;
+}
+
+/* --- receiver -------------------------------------------------------- */
+
+/*
+ * Land every chunk and write it out. With O_DIRECT the last chunk's
+ * length is rounded up to STREAM_ALIGN, and the file cut back to size
+ * at the end.
+ */
+static void receive(struct stream *s, int fd, uint64_t size, int direct) {
+    uint32_t nchunks = (size + s->chunk - 1) / s->chunk;
+    uint32_t written = 0, credits = 0;
+    struct ibv_wc wc[POLL_BATCH];
+    struct io_uring_cqe cqe;
+
+    while (written < nchunks || credits) {
+        int ne = ibv_poll_cq(s->cq, POLL_BATCH, wc);
+        if (ne < 0)
+            die("ibv_poll_cq");
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "wc.status=%d (%s)\n", wc[i].status,
+                        ibv_wc_status_str(wc[i].status));
+                exit(1);
+            }
+            if (wc[i].opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                credits--;      // a credit was delivered
+                continue;
+            }
+            uint32_t k = notify_imm(&wc[i]), slot = k % s->depth;
+            uint32_t len = wc[i].byte_len;
+            if (direct)
+                len = (len + STREAM_ALIGN - 1) & ~(STREAM_ALIGN - 1);
+            if (notify_post_recvs(s->qp, 1))
+                die("ibv_post_recv");
+            if (uring_rw(&s->ring, 1, fd, slot_buf(s, slot), len,
+                         (uint64_t)k * s->chunk, slot, k))
+                die("uring_rw");
+            slot_move(s, slot, ST_DISK);
+        }
+        if (uring_submit(&s->ring, 0) < 0)
+            die("io_uring_enter");
+
+        while (uring_peek(&s->ring, &cqe)) {
+            uint32_t k = cqe.user_data, slot = k % s->depth;
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                die("write");
+            }
+            if ((uint32_t)cqe.res < chunk_len(s, size, k)) {
+                fprintf(stderr, "Short write of chunk %u\n", k);
+                exit(1);
+            }
+            slot_move(s, slot, ST_EMPTY);
+            written++;
+            if (notify_post(s->qp, NULL, 0, 0, s->remote.vaddr, s->remote.rkey,
+                            k, 0, IBV_SEND_SIGNALED))
+                die("ibv_post_send");
+            credits++;
+        }
+    }
+    occ_tick(&s->occ);
+    if (ftruncate(fd, size) || fsync(fd))
+        die("ftruncate/fsync");
+}
+
+static void serve(const struct ibdev *dev, struct ibv_pd *pd, int sock,
+                  const char *path, int direct) {
+    struct stream_hello hello;
+    struct stream_done done = {0};
+    struct stream s;
+
+    xfer(sock, &hello, sizeof(hello), 0);
+    uint64_t start = now_ns();
+    int fd = open_file(path, O_WRONLY | O_CREAT | O_TRUNC, &direct);
+    stream_open(&s, dev, pd, sock, hello.chunk, hello.depth, ST_EMPTY);
+    printf("Receiving %llu bytes into %s: %u x %u byte buffers, %s, %s\n",
+           (unsigned long long)hello.size, path, hello.depth, hello.chunk,
+           direct ? "O_DIRECT" : "page cache",
+           s.ring.fixed ? "registered with io_uring" : "not registered with io_uring");
+
+    receive(&s, fd, hello.size, direct);
+    done.ns = now_ns() - start;
+    done.occ_ns = s.occ.last - s.occ.start;
+    memcpy(done.slot_ns, s.occ.slot_ns, sizeof(done.slot_ns));
+    printf("  %.3f s, %.3f GB/s\n", done.ns / 1e9, hello.size / (done.ns / 1e9) / 1e9);
+    occ_print("receiver", done.slot_ns, done.occ_ns, s.depth, ST_EMPTY, ST_DISK);
+    xfer(sock, &done, sizeof(done), 1);
+
+    // Keep the QP until the sender has its report
+    char c;
+    if (read(sock, &c, 1) < 0)
+        perror("read");
+    stream_close(&s);
+    close(fd);
+}
+
+/* --- sender ---------------------------------------------------------- */
+
+static void send_file(struct stream *s, int fd, uint64_t size) {
+    uint32_t nchunks = (size + s->chunk - 1) / s->chunk;
+    uint32_t next_read = 0, next_send = 0, sent = 0;
+    uint8_t *credit = malloc(s->depth);     // receiver's slot is free
+    struct ibv_wc wc[POLL_BATCH];
+    struct io_uring_cqe cqe;
+
+    if (!credit)
+        die("malloc");
+    memset(credit, 1, s->depth);
+    while (sent < nchunks) {
+        // Refill every free slot with its next chunk
+        while (next_read < nchunks && s->state[next_read % s->depth] == ST_FREE) {
+            uint32_t slot = next_read % s->depth;
+            if (uring_rw(&s->ring, 0, fd, slot_buf(s, slot), s->chunk,
+                         (uint64_t)next_read * s->chunk, slot, next_read))
+                die("uring_rw");
+            slot_move(s, slot, ST_READ);
+            next_read++;
+        }
+        if (uring_submit(&s->ring, 0) < 0)
+            die("io_uring_enter");
+
+        while (uring_peek(&s->ring, &cqe)) {
+            uint32_t k = cqe.user_data;
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                die("read");
+            }
+            if ((uint32_t)cqe.res < chunk_len(s, size, k)) {
+                fprintf(stderr, "Short read of chunk %u\n", k);
+                exit(1);
+            }
+            slot_move(s, k % s->depth, ST_READY);
+        }
+
+        // In order, each into its slot on the receiver once that is free
+        while (next_send < nchunks) {
+            uint32_t slot = next_send % s->depth;
+            if (s->state[slot] != ST_READY || !credit[slot])
+                break;
+            if (notify_post(s->qp, slot_buf(s, slot), chunk_len(s, size, next_send),
+                            s->mr->lkey, s->remote.vaddr + (uint64_t)slot * s->chunk,
+                            s->remote.rkey, next_send, slot, IBV_SEND_SIGNALED))
+                die("ibv_post_send");
+            credit[slot] = 0;
+            slot_move(s, slot, ST_WIRE);
+            next_send++;
+        }
+
+        int ne = ibv_poll_cq(s->cq, POLL_BATCH, wc);
+        if (ne < 0)
+            die("ibv_poll_cq");
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "wc.status=%d (%s)\n", wc[i].status,
+                        ibv_wc_status_str(wc[i].status));
+                exit(1);
+            }
+            if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                credit[notify_imm(&wc[i]) % s->depth] = 1;
+                if (notify_post_recvs(s->qp, 1))
+                    die("ibv_post_recv");
+            } else {
+                slot_move(s, wc[i].wr_id, ST_FREE);
+                sent++;
+            }
+        }
+    }
+    occ_tick(&s->occ);
+    free(credit);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> -o <file> [-B] [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> -f <file> [-c chunk] [-d depth] [-B]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port    serve on port, writing what arrives to -o file\n"
+            "  -f file    stream this file to the server\n"
+            "  -c chunk   bytes per read, RDMA_WRITE and write, a multiple of\n"
+            "             %d (default 4194304)\n"
+            "  -d depth   buffers in the ring on each side (default 16, at most %d)\n"
+            "  -B         go through the page cache instead of O_DIRECT\n"
+            "  -D dev     use this HCA (default: the first one)\n"
+            "  -P pnetid  use the HCA port with this PNET ID (s390)\n"
+            "  -i port    HCA port (default: the first active one)\n"
+            "  -G index   GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog, STREAM_ALIGN, MAX_DEPTH);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    const char *listen_port = NULL, *path = NULL;
+    uint32_t chunk = 4 << 20, depth = 16;
+    int direct = 1, opt;
+
+    while ((opt = getopt(argc, argv, "L:o:f:c:d:BD:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'o':
+        case 'f': path = optarg; break;
+        case 'c': chunk = strtoul(optarg, NULL, 0); break;
+        case 'd': depth = strtoul(optarg, NULL, 0); break;
+        case 'B': direct = 0; break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!path || !chunk || chunk % STREAM_ALIGN || chunk > (1u << 30) ||
+        !depth || depth > MAX_DEPTH ||
+        (listen_port ? optind != argc : argc - optind != 2))
+        usage(argv[0]);
+
+    struct ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+        die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+    struct ibv_pd *pd = ibv_alloc_pd(dev.ctx);
+    if (!pd)
+        die("ibv_alloc_pd");
+
+    if (listen_port) {
+        int lfd = tcp_listen(listen_port, 1);
+        printf("Serving streams on port %s into %s\n", listen_port, path);
+
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            serve(&dev, pd, sock, path, direct);
+            close(sock);
+        }
+    }
+
+    struct stat st;
+    int fd = open_file(path, O_RDONLY, &direct);
+    if (fstat(fd, &st))
+        die("fstat");
+    if ((uint64_t)st.st_size / chunk >= NOTIFY_VAL_MASK) {
+        fprintf(stderr, "%s has too many chunks, raise -c\n", path);
+        exit(1);
+    }
+
+    struct stream_hello hello = { .size = st.st_size, .chunk = chunk, .depth = depth };
+    struct stream_done done;
+    struct stream s;
+    int sock = tcp_connect(argv[optind], argv[optind + 1]);
+    uint64_t start = now_ns();
+    xfer(sock, &hello, sizeof(hello), 1);
+    stream_open(&s, &dev, pd, sock, chunk, depth, ST_FREE);
+    printf("Streaming %s, %llu bytes: %u x %u byte buffers, %s, %s\n", path,
+           (unsigned long long)hello.size, depth, chunk,
+           direct ? "O_DIRECT" : "page cache",
+           s.ring.fixed ? "registered with io_uring" : "not registered with io_uring");
+
+    send_file(&s, fd, hello.size);
+    xfer(sock, &done, sizeof(done), 0);
+    double sec = (now_ns() - start) / 1e9;
+    char c = 'x';
+    xfer(sock, &c, 1, 1);
+
+    printf("  %.3f s, %.3f GB/s disk to disk\n", sec, hello.size / sec / 1e9);
+    uint64_t ns = s.occ.last - s.occ.start;
+    occ_print("sender", s.occ.slot_ns, ns, depth, ST_READ, ST_WIRE);
+    occ_print("receiver", done.slot_ns, done.occ_ns, depth, ST_EMPTY, ST_DISK);
+
+    // The stage holding the most slots is the one the others wait for
+    double rd = occ_avg(s.occ.slot_ns, ns, ST_READ);
+    double wire = occ_avg(s.occ.slot_ns, ns, ST_WIRE);
+    double wr = occ_avg(done.slot_ns, done.occ_ns, ST_DISK);
+    printf("  bottleneck: %s\n", rd >= wire && rd >= wr ? "source disk" :
+           wire >= wr ? "network" : "destination disk");
+
+    stream_close(&s);
+    close(sock);
+    close(fd);
+    ibv_dealloc_pd(pd);
+    ibdev_close(&dev);
+    return 0;
+}
@@ -0,0 +1,221 @@
+#ifndef FILE_XFER_H
+#define FILE_XFER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+
+/*
+ * Zero-copy file transfer
+ *
+ * Both sides mmap the file and register the mapping itself, so the
+ * HCA reads the sender's page cache and writes into the receiver's: no
+ * read(), no write(), no bounce buffer. The receiver preallocates the
+ * destination with posix_fallocate() and maps it MAP_SHARED, so the
+ * written pages are the file's and go to disk with normal writeback.
+ *
+ * Registration, two ways:
+ *
+ *   ODP       with On-Demand Paging the whole mapping is one MR. No
+ *             page is pinned up front; the HCA faults pages in as it
+ *             touches them, like the CPU would. Registering a 100 GB
+ *             file costs as much as a 4 KB one.
+ *   chunked   otherwise the file is registered one FILE_SEG segment at
+ *             a time, while it is being transferred, and deregistered
+ *             after. ibv_reg_mr() pins the segment's pages, which reads
+ *             them in on the sender; only a few segments are pinned at
+ *             any time, whatever the file size.
+ *
+ * The receiver hands out segments with grants on the TCP side channel:
+ * segment index, address and rkey, FILE_GRANTS ahead of the sender.
+ * The sender RDMA_WRITEs a segment in FILE_WR pieces and closes it with
+ * a zero-length WRITE_WITH_IMM carrying its index (notify.h). RC keeps
+ * the order, so the segment is complete when the immediate arrives. The
+ * receiver then releases the segment and grants the next one. When
+ * every segment is in, it sends a grant with seg = FILE_DONE.
+ *
+ * For comparison, FILE_TCP mode copies the same file through the TCP
+ * socket with read() and write() on both ends.
+ */
+#define FILE_MAGIC   0x454c4946u        // "FILE"
+#define FILE_SEG     (64ull << 20)      // registration and grant unit
+#define FILE_WR      (1u << 20)         // bytes per RDMA_WRITE
+#define FILE_GRANTS  4                  // segments open ahead of the sender
+#define FILE_DONE    UINT32_MAX
+#define FILE_NAME    256
+
+enum { FILE_RDMA = 1, FILE_TCP = 2 };
+
+// Sent by the client on the TCP side channel once the QP is up
+struct file_hdr {
+    uint32_t magic;
+    uint32_t mode;              // FILE_RDMA or FILE_TCP
+    uint64_t size;
+    char name[FILE_NAME];       // stored under the server's -F directory
+};
+
+// Sent by the server: segment seg may be written at vaddr with rkey
+struct file_grant {
+    uint32_t seg;
+    uint32_t rkey;
+    uint64_t vaddr;
+};
+
+struct file_map {
+    int fd;
+    char *addr;
+    uint64_t size;
+    uint32_t nseg;
+    int access;                 // of the MRs
+    struct ibv_mr *odp_mr;      // the whole mapping, ODP only
+    struct ibv_mr **seg_mr;     // chunked: segments registered now
+    uint64_t reg_ns;            // spent in ibv_reg_mr/ibv_dereg_mr
+};
+
+/*
+ * Can the device back RC QPs with ODP MRs for caps, e.g.
+ * IBV_ODP_SUPPORT_SEND for the source of RDMA_WRITEs and
+ * IBV_ODP_SUPPORT_WRITE for their target?
+ */
+static inline int file_odp_ok(struct ibv_context *ctx, uint32_t caps) {
+    struct ibv_device_attr_ex attr;
+
+    if (ibv_query_device_ex(ctx, NULL, &attr))
+        return 0;
+    return (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+           (attr.odp_caps.per_transport_caps.rc_odp_caps & caps) == caps;
+}
+
+static inline uint64_t file_seg_len(const struct file_map *m, uint32_t i) {
+    uint64_t off = (uint64_t)i * FILE_SEG;
+
+    return m->size - off < FILE_SEG ? m->size - off : FILE_SEG;
+}
+
+static inline int file_map_init(struct file_map *m, int fd, uint64_t size,
+                                int prot) {
+    m->fd = fd;
+    m->size = size;
+    m->nseg = (size + FILE_SEG - 1) / FILE_SEG;
+    m->addr = NULL;
+    if (!size)
+        return 0;               // nothing to map
+    m->addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (m->addr == MAP_FAILED) {
+        m->addr = NULL;
+        return -1;
+    }
+    madvise(m->addr, size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+// Map path for reading. Returns 0, or -1 with errno set.
+static inline int file_map_src(struct file_map *m, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || file_map_init(m, fd, st.st_size, PROT_READ)) {
+        int err = errno;
+        close(fd);
+        m->fd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create path with size bytes allocated on disk and map it for
+ * writing. Returns 0, or -1 with errno set.
+ */
+static inline int file_map_dst(struct file_map *m, const char *path,
+                               uint64_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int err;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+    if (fd < 0)
+        return -1;
+    if (size && (err = posix_fallocate(fd, 0, size))) {
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (file_map_init(m, fd, size, PROT_READ | PROT_WRITE)) {
+        err = errno;
+        close(fd);
+        m->fd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prepare registration with access: one ODP MR over the whole mapping
+ * if odp, otherwise per segment in file_seg_get(). Returns 0, or -1
+ * with errno set.
+ */
+static inline int file_map_reg(struct file_map *m, struct ibv_pd *pd,
+                               int access, int odp) {
+    m->access = access;
+    if (!m->size)
+        return 0;
+    if (odp) {
+        uint64_t t0 = now_ns();
+        m->odp_mr = ibv_reg_mr(pd, m->addr, m->size, access | IBV_ACCESS_ON_DEMAND);
+        m->reg_ns += now_ns() - t0;
+        return m->odp_mr ? 0 : -1;
+    }
+    m->seg_mr = calloc(m->nseg, sizeof(*m->seg_mr));
+    return m->seg_mr ? 0 : -1;
+}
+
+// The MR that covers segment i, registering it if needed
+static inline struct ibv_mr *file_seg_get(struct file_map *m,
+                                          struct ibv_pd *pd, uint32_t i) {
+    if (m->odp_mr)
+        return m->odp_mr;
+    if (!m->seg_mr[i]) {
+        uint64_t t0 = now_ns();
+        m->seg_mr[i] = ibv_reg_mr(pd, m->addr + (uint64_t)i * FILE_SEG,
+                                  file_seg_len(m, i), m->access);
+        m->reg_ns += now_ns() - t0;
+    }
+    return m->seg_mr[i];
+}
+
+// Segment i is done with: unpin it (chunked only)
+static inline void file_seg_put(struct file_map *m, uint32_t i) {
+    if (m->seg_mr && m->seg_mr[i]) {
+        uint64_t t0 = now_ns();
+        ibv_dereg_mr(m->seg_mr[i]);
+        m->reg_ns += now_ns() - t0;
+        m->seg_mr[i] = NULL;
+    }
+}
+
+static inline const char *file_map_kind(const struct file_map *m) {
+    return m->odp_mr ? "ODP" : "chunked registration";
+}
+
+static inline void file_map_close(struct file_map *m) {
+    if (m->odp_mr)
+        ibv_dereg_mr(m->odp_mr);
+    for (uint32_t i = 0; m->seg_mr && i < m->nseg; i++)
+        file_seg_put(m, i);
+    free(m->seg_mr);
+    if (m->addr)
+        munmap(m->addr, m->size);
+    if (m->fd >= 0)
+        close(m->fd);
+}
+
+#endif
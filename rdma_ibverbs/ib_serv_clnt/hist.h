@@ -0,0 +1,106 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Fixed-bucket latency histogram
+ *
+ * Log-linear buckets in the style of HdrHistogram: values below
+ * HIST_SUB are counted exactly, every power-of-two range above that is
+ * split into HIST_SUB equal sub-buckets. With 16 sub-buckets the
+ * relative error of a reported percentile is below 1/16, over the whole
+ * uint64_t range, in a table of HIST_BUCKETS counters.
+ *
+ * The histogram is a plain struct that the caller places (usually on
+ * the stack or in static storage); hist_add() never allocates, so it
+ * is safe to call on the hot path.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned hist_index(uint64_t v) {
+    if (v < HIST_SUB)
+        return v;
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
+
+// Smallest value that lands in bucket idx
+static inline uint64_t hist_bucket_low(unsigned idx) {
+    if (idx < HIST_SUB)
+        return idx;
+    unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1))) << shift;
+}
+
+static inline void hist_add(struct hist *h, uint64_t v) {
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+// Add the samples of src to dst, e.g. per-thread histograms into one
+static inline void hist_merge(struct hist *dst, const struct hist *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/*
+ * Value at percentile p (0 < p <= 100). Reports the upper edge of the
+ * bucket that holds the p-th sample, clamped to the recorded max.
+ */
+static inline uint64_t hist_percentile(const struct hist *h, double p) {
+    if (!h->count)
+        return 0;
+    uint64_t target = (uint64_t)(p / 100.0 * h->count + 0.5);
+    uint64_t seen = 0;
+    if (target == 0) target = 1;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= target) {
+            if (i + 1 == HIST_BUCKETS)
+                return h->max;
+            uint64_t hi = hist_bucket_low(i + 1) - 1;
+            return hi < h->max ? hi : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Print min/p50/p99/p99.9/max of a histogram recorded in nanoseconds
+static inline void hist_print_us(const char *name, const struct hist *h) {
+    printf("%s: %llu samples, avg %.2f us\n", name,
+           (unsigned long long)h->count,
+           h->count ? h->sum / 1e3 / h->count : 0.0);
+    printf("  min %.2f  p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f (us)\n",
+           h->count ? h->min / 1e3 : 0.0,
+           hist_percentile(h, 50) / 1e3,
+           hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3,
+           h->max / 1e3);
+}
+
+#endif
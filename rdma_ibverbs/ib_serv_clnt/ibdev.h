@@ -0,0 +1,404 @@
+#ifndef IBDEV_H
+#define IBDEV_H
+
+#include <strings.h>
+#include <sys/types.h>
+#include <numa.h>
+#include "common.h"
+
+/*
+ * Device, port and path discovery
+ *
+ * Finds out at run time what the connection setup used to hard code:
+ *
+ *   - Device: by name (-D mlx5_1), by PNET ID (-P), or the first one.
+ *     A PNET ID names the physical network a port is cabled to. On
+ *     s390 the firmware stores it per port in the PCI function's
+ *     util_string, in EBCDIC, which is where SMC-R looks it up too.
+ *     Other platforms have none, so pick those devices by name.
+ *   - Port: the first ACTIVE one, unless given.
+ *   - MTU: the port's active MTU, optionally capped (-M). Each side
+ *     sends its MTU in conn_info and the QP uses the smaller one.
+ *   - GID index: on Ethernet ports (RoCE) the GID table has an entry
+ *     per IP address and RoCE version. Prefer RoCE v2 (routable UDP
+ *     encapsulation) with an IPv4-mapped address, then any RoCE v2
+ *     entry, then whatever is non-zero. InfiniBand ports use index 0
+ *     and the peer's LID.
+ *   - NUMA node: the node the HCA's PCI slot hangs off. ibdev_place()
+ *     runs the calling thread on that node's CPUs and prefers its
+ *     memory. Buffers, CQs and QP rings created afterwards, and the
+ *     threads that poll them, then stay on the HCA's side of the
+ *     socket interconnect. -N places everything on another node instead,
+ *     to measure what a remote node costs.
+ */
+#define IBDEV_NUMA_AUTO  -2     // the device's node
+#define IBDEV_NUMA_NONE  -1     // leave placement alone
+#define IBDEV_PNETID_LEN 16
+
+struct ibdev_opts {
+    const char *name;           // -D: device name, NULL = any
+    const char *pnetid;         // -P: PNET ID, NULL = any
+    int port;                   // -i: 0 = first active port
+    int gid_index;              // -G: -1 = pick one
+    int mtu;                    // -M: cap in bytes, 0 = active MTU
+    int numa_node;              // -N: IBDEV_NUMA_AUTO by default
+};
+
+struct ibdev {
+    struct ibv_context *ctx;
+    char name[IBV_SYSFS_NAME_MAX];
+    uint8_t port;
+    uint8_t link_layer;         // IBV_LINK_LAYER_*
+    uint16_t lid;
+    enum ibv_mtu mtu;           // active MTU, after the -M cap
+    int gid_index;
+    int gid_type;               // IBV_GID_TYPE_*
+    union ibv_gid gid;
+    int dev_node;               // device's NUMA node, -1 = unknown
+    int numa_node;              // where ibdev_place() put us, -1 = nowhere
+};
+
+static inline int ibdev_mtu_bytes(enum ibv_mtu mtu) {
+    return 128 << mtu;
+}
+
+// IBV_MTU_* for a size in bytes, 0 if it is not one of 256..4096
+static inline enum ibv_mtu ibdev_mtu_enum(int bytes) {
+    for (int m = IBV_MTU_256; m <= IBV_MTU_4096; m++)
+        if (ibdev_mtu_bytes((enum ibv_mtu)m) == bytes)
+            return (enum ibv_mtu)m;
+    return (enum ibv_mtu)0;
+}
+
+// Read a small sysfs file into buf; returns its length or -1
+static inline ssize_t ibdev_sysfs_read(const char *path, void *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return n;
+}
+
+static inline int ibdev_numa_node(struct ibv_device *dev) {
+    char path[IBV_SYSFS_PATH_MAX + 32], buf[16] = "";
+
+    snprintf(path, sizeof(path), "%s/device/numa_node", dev->ibdev_path);
+    if (ibdev_sysfs_read(path, buf, sizeof(buf) - 1) <= 0)
+        return -1;
+    return atoi(buf);
+}
+
+// The EBCDIC characters a PNET ID consists of, in ASCII
+static inline char ibdev_ebcdic(unsigned char c) {
+    if (c >= 0xc1 && c <= 0xc9) return 'A' + c - 0xc1;
+    if (c >= 0xd1 && c <= 0xd9) return 'J' + c - 0xd1;
+    if (c >= 0xe2 && c <= 0xe9) return 'S' + c - 0xe2;
+    if (c >= 0xf0 && c <= 0xf9) return '0' + c - 0xf0;
+    return ' ';
+}
+
+/*
+ * PNET ID of a port from the PCI function's util_string (s390 only):
+ * IBDEV_PNETID_LEN bytes per port, blank padded. Returns 0 and the
+ * NUL-terminated ID, or -1 if the device has none.
+ */
+static inline int ibdev_pnetid(struct ibv_device *dev, int port,
+                               char id[IBDEV_PNETID_LEN + 1]) {
+    unsigned char raw[4 * IBDEV_PNETID_LEN];
+    char path[IBV_SYSFS_PATH_MAX + 32];
+    ssize_t n;
+    int len = 0;
+
+    snprintf(path, sizeof(path), "%s/device/util_string", dev->ibdev_path);
+    n = ibdev_sysfs_read(path, raw, sizeof(raw));
+    if (port < 1 || n < port * IBDEV_PNETID_LEN)
+        return -1;
+    for (int i = 0; i < IBDEV_PNETID_LEN; i++) {
+        id[i] = ibdev_ebcdic(raw[(port - 1) * IBDEV_PNETID_LEN + i]);
+        if (id[i] != ' ')
+            len = i + 1;
+    }
+    id[len] = '\0';
+    return len ? 0 : -1;
+}
+
+// First ACTIVE port of ctx, or 0 if none is
+static inline int ibdev_active_port(struct ibv_context *ctx) {
+    struct ibv_device_attr dev_attr;
+    struct ibv_port_attr pattr;
+
+    if (ibv_query_device(ctx, &dev_attr))
+        return 0;
+    for (int p = 1; p <= dev_attr.phys_port_cnt; p++)
+        if (!ibv_query_port(ctx, p, &pattr) && pattr.state == IBV_PORT_ACTIVE)
+            return p;
+    return 0;
+}
+
+static inline int ibdev_gid_v4mapped(const union ibv_gid *gid) {
+    static const uint8_t prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    return !memcmp(gid->raw, prefix, sizeof(prefix));
+}
+
+/*
+ * Pick the GID index for d's port as described at the top. Returns 0,
+ * or -1 with errno set if the table has no usable entry.
+ */
+static inline int ibdev_pick_gid(struct ibdev *d, int tbl_len) {
+    int best = -1, best_rank = 0;
+
+    for (int i = 0; i < tbl_len; i++) {
+        struct ibv_gid_entry e;
+        int rank;
+
+        if (ibv_query_gid_ex(d->ctx, d->port, i, &e, 0))
+            continue;           // empty entry
+        if (!e.gid.global.subnet_prefix && !e.gid.global.interface_id)
+            continue;
+        if (e.gid_type == IBV_GID_TYPE_ROCE_V2)
+            rank = ibdev_gid_v4mapped(&e.gid) ? 3 : 2;
+        else
+            rank = 1;
+        if (rank > best_rank) {
+            best = i;
+            best_rank = rank;
+            d->gid = e.gid;
+            d->gid_type = e.gid_type;
+        }
+    }
+    if (best < 0) {
+        errno = ENODATA;
+        return -1;
+    }
+    d->gid_index = best;
+    return 0;
+}
+
+static inline int ibdev_match(struct ibv_device *dev, const struct ibdev_opts *o,
+                              struct ibv_context *ctx, int *port) {
+    char id[IBDEV_PNETID_LEN + 1];
+    struct ibv_device_attr dev_attr;
+
+    if (o->name && strcmp(ibv_get_device_name(dev), o->name))
+        return 0;
+    *port = o->port;
+    if (!o->pnetid)
+        return 1;
+    if (ibv_query_device(ctx, &dev_attr))
+        return 0;
+    for (int p = 1; p <= dev_attr.phys_port_cnt; p++) {
+        if (o->port && p != o->port)
+            continue;
+        if (!ibdev_pnetid(dev, p, id) && !strcasecmp(id, o->pnetid)) {
+            *port = p;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Open the device and port that o selects and fill in d. Returns 0, or
+ * -1 with errno set: ENODEV if nothing matches, ENETDOWN if the port is
+ * not active.
+ */
+static inline int ibdev_open(struct ibdev *d, const struct ibdev_opts *o) {
+    struct ibv_device **list = ibv_get_device_list(NULL);
+    struct ibv_port_attr pattr;
+    struct ibv_device *dev = NULL;
+    int port = 0;
+
+    memset(d, 0, sizeof(*d));
+    if (!list)
+        return -1;
+    for (int i = 0; list[i] && !d->ctx; i++) {
+        struct ibv_context *ctx = ibv_open_device(list[i]);
+        if (!ctx)
+            continue;
+        if (ibdev_match(list[i], o, ctx, &port)) {
+            d->ctx = ctx;
+            dev = list[i];
+        } else {
+            ibv_close_device(ctx);
+        }
+    }
+    if (!d->ctx) {
+        ibv_free_device_list(list);
+        errno = ENODEV;
+        return -1;
+    }
+    snprintf(d->name, sizeof(d->name), "%s", ibv_get_device_name(dev));
+    d->dev_node = ibdev_numa_node(dev);
+    d->numa_node = IBDEV_NUMA_NONE;
+    ibv_free_device_list(list);
+
+    if (!port)
+        port = ibdev_active_port(d->ctx);
+    if (!port || ibv_query_port(d->ctx, port, &pattr) ||
+        pattr.state != IBV_PORT_ACTIVE) {
+        ibv_close_device(d->ctx);
+        errno = ENETDOWN;
+        return -1;
+    }
+    d->port = port;
+    d->link_layer = pattr.link_layer;
+    d->lid = pattr.lid;
+    d->mtu = pattr.active_mtu;
+    if (o->mtu && ibdev_mtu_enum(o->mtu) < d->mtu)
+        d->mtu = ibdev_mtu_enum(o->mtu);
+
+    if (o->gid_index >= 0) {
+        d->gid_index = o->gid_index;
+        d->gid_type = IBV_GID_TYPE_IB;
+        if (ibv_query_gid(d->ctx, port, o->gid_index, &d->gid)) {
+            ibv_close_device(d->ctx);
+            return -1;
+        }
+    } else if (d->link_layer != IBV_LINK_LAYER_ETHERNET) {
+        d->gid_index = 0;
+        d->gid_type = IBV_GID_TYPE_IB;
+        ibv_query_gid(d->ctx, port, 0, &d->gid);
+    } else if (ibdev_pick_gid(d, pattr.gid_tbl_len)) {
+        ibv_close_device(d->ctx);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run the calling thread on the CPUs of NUMA node o->numa_node (the
+ * device's node for IBDEV_NUMA_AUTO) and prefer that node's memory for
+ * everything it allocates from now on. Threads it creates inherit both.
+ * Returns the node, or -1 if placement was not requested or is not
+ * possible (no NUMA, or the device does not know its node).
+ */
+static inline int ibdev_place(struct ibdev *d, const struct ibdev_opts *o) {
+    int node = o->numa_node == IBDEV_NUMA_AUTO ? d->dev_node : o->numa_node;
+
+    if (node < 0 || numa_available() < 0 || node > numa_max_node())
+        return -1;
+    if (numa_run_on_node(node))
+        return -1;
+    numa_set_preferred(node);
+    d->numa_node = node;
+    return node;
+}
+
+// Advertise the port's addressing and MTU to the peer
+static inline void ibdev_fill_info(const struct ibdev *d, struct conn_info *info) {
+    memcpy(info->gid, d->gid.raw, 16);
+    info->lid = d->lid;
+    info->mtu = d->mtu;
+}
+
+// Path MTU both ends of a connection support
+static inline enum ibv_mtu ibdev_path_mtu(const struct ibdev *d,
+                                          const struct conn_info *remote) {
+    return remote->mtu && remote->mtu < d->mtu ? (enum ibv_mtu)remote->mtu : d->mtu;
+}
+
+/*
+ * Address vector towards remote. The GRH is always present, as RoCE
+ * needs it; hop_limit 64 lets RoCE v2 packets cross IP routers.
+ */
+static inline void ibdev_fill_ah(const struct ibdev *d,
+                                 const struct conn_info *remote,
+                                 struct ibv_ah_attr *ah) {
+    memset(ah, 0, sizeof(*ah));
+    ah->is_global = 1;
+    ah->port_num = d->port;
+    ah->dlid = remote->lid;
+    memcpy(&ah->grh.dgid, remote->gid, 16);
+    ah->grh.sgid_index = d->gid_index;
+    ah->grh.hop_limit = 64;
+}
+
+/*
+ * The INIT -> RTR -> RTS sequence that rdma_client.c walks through step
+ * by step, for code that just needs a connected RC QP: on d's port and
+ * GID, at the path MTU both sides support, with the client's timeouts.
+ * rd_atomic is both the number of READs/atomics this QP may have
+ * outstanding and the number it accepts from the peer. Both return 0,
+ * or -1 with errno set.
+ */
+static inline int ibdev_qp_to_init(const struct ibdev *d, struct ibv_qp *qp,
+                                   int access) {
+    struct ibv_qp_attr attr;
+    int ret;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = d->port;
+    attr.qp_access_flags = access;
+    ret = ibv_modify_qp(qp, &attr,
+                        IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                        IBV_QP_ACCESS_FLAGS);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+static inline int ibdev_qp_to_rts(const struct ibdev *d, struct ibv_qp *qp,
+                                  uint32_t local_psn,
+                                  const struct conn_info *remote,
+                                  uint8_t rd_atomic) {
+    struct ibv_qp_attr attr;
+    int ret;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = ibdev_path_mtu(d, remote);
+    attr.dest_qp_num = remote->qpn;
+    attr.rq_psn = remote->psn;
+    attr.max_dest_rd_atomic = rd_atomic;
+    attr.min_rnr_timer = 12;
+    ibdev_fill_ah(d, remote, &attr.ah_attr);
+    ret = ibv_modify_qp(qp, &attr,
+                        IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                        IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                        IBV_QP_MIN_RNR_TIMER | IBV_QP_MAX_DEST_RD_ATOMIC);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.sq_psn = local_psn;
+    attr.max_rd_atomic = rd_atomic;
+    ret = ibv_modify_qp(qp, &attr,
+                        IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                        IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                        IBV_QP_MAX_QP_RD_ATOMIC);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void ibdev_print(const struct ibdev *d) {
+    static const char *gid_types[] = { "IB", "RoCE v1", "RoCE v2" };
+    char numa[32] = "not placed";
+
+    if (d->numa_node >= 0)
+        snprintf(numa, sizeof(numa), "node %d", d->numa_node);
+    printf("Device %s port %u (%s), GID index %d (%s), MTU %d, "
+           "device NUMA node %d, resources on %s\n",
+           d->name, d->port,
+           d->link_layer == IBV_LINK_LAYER_ETHERNET ? "Ethernet" : "InfiniBand",
+           d->gid_index, gid_types[d->gid_type < 3 ? d->gid_type : 0],
+           ibdev_mtu_bytes(d->mtu), d->dev_node, numa);
+}
+
+static inline void ibdev_close(struct ibdev *d) {
+    ibv_close_device(d->ctx);
+}
+
+#endif
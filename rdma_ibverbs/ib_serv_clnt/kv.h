@@ -0,0 +1,264 @@
+#ifndef KV_H
+#define KV_H
+
+#include <stdatomic.h>
+#include "common.h"
+
+/*
+ * Key-value store with one-sided GETs
+ *
+ * The server keeps the whole store in one region that clients may
+ * only read (IBV_ACCESS_REMOTE_READ):
+ *
+ *   +-----------+-----------------------------+----------------------+
+ *   | kv_header | buckets[nbuckets + PROBE-1] | value log (circular) |
+ *   +-----------+-----------------------------+----------------------+
+ *
+ * Buckets are one cache line each. A key lives in one of the KV_PROBE
+ * buckets from hash(key) % nbuckets on (open addressing without
+ * wraparound; the table has KV_PROBE - 1 spare buckets at the end), so
+ * a GET needs two RDMA READs and no server CPU at all:
+ *
+ *   1. the KV_PROBE buckets of the key, in one read
+ *   2. the log record the matching bucket points to
+ *
+ * PUTs are SENDs, applied by the server CPU, which is the only writer.
+ * The HCA may read a bucket or a record while the server changes it,
+ * so the client validates what it read:
+ *
+ *   - Buckets are seqlocks. The server makes version odd, updates the
+ *     bucket, stores the new even version in tail, and then in
+ *     version. A bucket is usable if version is even and equals tail.
+ *   - Records are appended to a circular log, so one may be overwritten
+ *     while a slow reader follows an old bucket to it. Each record
+ *     repeats the key and the bucket version it was written under, plus
+ *     a checksum of the value; all three must match.
+ *
+ * A GET that fails either check starts over from step 1. Neither check
+ * relies on the HCA reading a cache line atomically: a bucket torn
+ * between two updates points to a record whose version disagrees.
+ */
+#define KV_MAGIC     0x4b5631524541444bull   // "KREAD1VK"
+#define KV_KEY_LEN   32                      // NUL padded
+#define KV_PROBE     4
+#define KV_ALIGN     64
+
+enum kv_status {
+    KV_OK,
+    KV_FULL,            // all KV_PROBE buckets of the key are taken
+    KV_TOOBIG,          // value larger than the server's -s
+    KV_BADMSG,
+};
+
+struct kv_header {
+    uint64_t magic;
+    uint32_t nbuckets;          // without the KV_PROBE - 1 spares
+    uint32_t max_val;
+    uint64_t buckets_off;       // from the start of the region
+    uint64_t log_off;
+    uint64_t log_size;
+};
+
+struct kv_bucket {
+    uint64_t version;           // even: stable, odd: being updated
+    char key[KV_KEY_LEN];       // "" = free
+    uint64_t rec_off;           // record, from the start of the log
+    uint32_t val_len;
+    uint32_t pad;
+    uint64_t tail;              // equals version when stable
+} __attribute__((aligned(KV_ALIGN)));
+
+struct kv_record {
+    uint64_t version;           // bucket version it was written under
+    uint64_t csum;              // of the value
+    uint32_t val_len;
+    uint32_t pad;
+    char key[KV_KEY_LEN];
+    char val[];
+};
+
+// Two-sided PUT: a SEND to the server, answered with kv_status as the
+// immediate of a zero-length RDMA_WRITE_WITH_IMM (see notify.h)
+struct kv_put_msg {
+    char key[KV_KEY_LEN];
+    uint32_t val_len;
+    uint32_t pad;
+    char val[];
+};
+
+// FNV-1a, both for picking buckets and as the value checksum
+static inline uint64_t kv_fnv(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    while (len--)
+        h = (h ^ *p++) * 0x100000001b3ull;
+    return h;
+}
+
+static inline uint32_t kv_home(const struct kv_header *h, const char *key) {
+    return kv_fnv(key, strnlen(key, KV_KEY_LEN)) % h->nbuckets;
+}
+
+static inline size_t kv_rec_size(uint32_t val_len) {
+    return (sizeof(struct kv_record) + val_len + KV_ALIGN - 1) &
+           ~(size_t)(KV_ALIGN - 1);
+}
+
+/* --- client side: validation of what the RDMA READs returned ---------- */
+
+enum {
+    KV_MISS = -1,
+    KV_RETRY = -2,              // a bucket was being updated
+};
+
+// Client buffer for one GET: the buckets of step 1, then the record
+static inline size_t kv_slot_size(uint32_t max_val) {
+    return KV_PROBE * sizeof(struct kv_bucket) + kv_rec_size(max_val);
+}
+
+/*
+ * Look for key among the KV_PROBE buckets read in step 1. Returns its
+ * index, KV_MISS, or KV_RETRY if a bucket that might hold it was not
+ * stable.
+ */
+static inline int kv_find(const struct kv_bucket *b, const char *key) {
+    int unstable = 0;
+
+    for (int i = 0; i < KV_PROBE; i++) {
+        if (b[i].version & 1 || b[i].version != b[i].tail) {
+            unstable = 1;
+            continue;
+        }
+        if (!strncmp(b[i].key, key, KV_KEY_LEN))
+            return i;
+    }
+    return unstable ? KV_RETRY : KV_MISS;
+}
+
+// Check the record read in step 2 against the bucket that led to it
+static inline int kv_record_ok(const struct kv_record *r,
+                               const struct kv_bucket *b) {
+    return r->version == b->version && r->val_len == b->val_len &&
+           !strncmp(r->key, b->key, KV_KEY_LEN) &&
+           r->csum == kv_fnv(r->val, r->val_len);
+}
+
+/* --- server side ------------------------------------------------------ */
+
+struct kv_store {
+    char *base;
+    size_t size;
+    struct ibv_mr *mr;
+    struct kv_header *hdr;
+    struct kv_bucket *buckets;
+    char *log;
+    uint64_t log_head;          // next append offset
+
+    uint64_t puts;
+    uint64_t full;
+};
+
+/*
+ * Allocate and register the store: nbuckets buckets for values of up to
+ * max_val bytes, and a log twice the size a full table needs, so a
+ * record normally survives a while after it is replaced. Returns 0, or
+ * -1 with errno set.
+ */
+static inline int kv_store_create(struct kv_store *s, struct ibv_pd *pd,
+                                  uint32_t nbuckets, uint32_t max_val) {
+    size_t buckets_off = KV_ALIGN;
+    size_t log_off = buckets_off +
+                     (size_t)(nbuckets + KV_PROBE - 1) * sizeof(struct kv_bucket);
+    size_t log_size = 2 * (size_t)nbuckets * kv_rec_size(max_val);
+    void *mem;
+
+    memset(s, 0, sizeof(*s));
+    if (!nbuckets) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->size = log_off + log_size;
+    if (posix_memalign(&mem, 4096, s->size))
+        return -1;
+    memset(mem, 0, s->size);
+    s->mr = ibv_reg_mr(pd, mem, s->size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+    if (!s->mr) {
+        int err = errno;
+        free(mem);
+        errno = err;
+        return -1;
+    }
+
+    s->base = mem;
+    s->hdr = mem;
+    s->buckets = (struct kv_bucket *)(s->base + buckets_off);
+    s->log = s->base + log_off;
+    s->hdr->nbuckets = nbuckets;
+    s->hdr->max_val = max_val;
+    s->hdr->buckets_off = buckets_off;
+    s->hdr->log_off = log_off;
+    s->hdr->log_size = log_size;
+    s->hdr->magic = KV_MAGIC;
+    return 0;
+}
+
+static inline void kv_store_destroy(struct kv_store *s) {
+    ibv_dereg_mr(s->mr);
+    free(s->base);
+}
+
+/*
+ * Insert or replace key. The record goes into the log first, then the
+ * bucket is switched over to it under its seqlock.
+ */
+static inline enum kv_status kv_put(struct kv_store *s, const char *key,
+                                    const void *val, uint32_t len) {
+    struct kv_bucket *b = &s->buckets[kv_home(s->hdr, key)], *slot = NULL;
+
+    if (!key[0])
+        return KV_BADMSG;       // the empty key marks free buckets
+    if (len > s->hdr->max_val)
+        return KV_TOOBIG;
+    for (int i = 0; i < KV_PROBE; i++) {
+        if (!strncmp(b[i].key, key, KV_KEY_LEN)) {
+            slot = &b[i];
+            break;
+        }
+        if (!slot && !b[i].key[0])
+            slot = &b[i];
+    }
+    if (!slot) {
+        s->full++;
+        return KV_FULL;
+    }
+
+    size_t rec_size = kv_rec_size(len);
+    if (s->log_head + rec_size > s->hdr->log_size)
+        s->log_head = 0;
+    struct kv_record *r = (struct kv_record *)(s->log + s->log_head);
+    uint64_t version = slot->version + 2;
+
+    r->version = version;
+    r->csum = kv_fnv(val, len);
+    r->val_len = len;
+    strncpy(r->key, key, KV_KEY_LEN);
+    memcpy(r->val, val, len);
+
+    slot->version = version - 1;
+    atomic_thread_fence(memory_order_release);
+    strncpy(slot->key, key, KV_KEY_LEN);
+    slot->rec_off = s->log_head;
+    slot->val_len = len;
+    atomic_thread_fence(memory_order_release);
+    slot->tail = version;
+    atomic_thread_fence(memory_order_release);
+    slot->version = version;
+
+    s->log_head += rec_size;
+    s->puts++;
+    return KV_OK;
+}
+
+#endif
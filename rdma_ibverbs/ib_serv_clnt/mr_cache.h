@@ -0,0 +1,334 @@
+#ifndef MR_CACHE_H
+#define MR_CACHE_H
+
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Pin-down cache of memory registrations for user-supplied buffers
+ *
+ * Registering and deregistering an arbitrary application buffer around
+ * every transfer costs tens of microseconds. The cache keeps MRs alive
+ * after use and hands them out again when a later transfer falls inside
+ * an already registered range.
+ *
+ *  - Registrations cover whole pages. They are kept in a treap ordered
+ *    by start address, and each node also holds the largest end address
+ *    in its subtree. That lets a covering or overlapping range be found
+ *    without walking the whole tree.
+ *  - mr_cache_get() takes a reference, mr_cache_put() drops it. Entries
+ *    without references sit on an LRU list.
+ *  - Registering a new range that would take pinned memory over the
+ *    budget first deregisters unreferenced entries from the cold end of
+ *    the LRU. If the budget still cannot be met, the get fails with
+ *    ENOMEM.
+ *  - mr_cache_invalidate() must be called before a range is unmapped,
+ *    because afterwards the MR may point at pages that now back other
+ *    memory. mr_cache_hooks.c does that automatically for munmap() and
+ *    free(); without it the application has to call it.
+ *
+ * The cache is not thread safe; use one per thread or lock around it.
+ */
+struct mr_entry {
+    uintptr_t start;            // page aligned [start, end)
+    uintptr_t end;
+    struct ibv_mr *mr;
+    uint32_t refcnt;
+    int invalid;                // unmapped while referenced
+
+    struct mr_entry *left, *right;  // treap
+    uint32_t prio;
+    uintptr_t max_end;          // largest end in this subtree
+
+    struct mr_entry *lru_prev, *lru_next;
+};
+
+struct mr_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;         // deregistered to stay within budget
+    uint64_t invalidations;     // deregistered because the range went away
+    uint64_t failures;          // gets that could not be served
+};
+
+struct mr_cache {
+    struct ibv_pd *pd;
+    int access;
+    size_t budget;              // max pinned bytes, 0 = unlimited
+    size_t pinned;
+    uintptr_t page_mask;
+    uint32_t seed;
+
+    struct mr_entry *root;
+    struct mr_entry *lru_head;  // most recently used
+    struct mr_entry *lru_tail;
+    struct mr_cache_stats stats;
+};
+
+/* --- treap ----------------------------------------------------------- */
+
+static inline void mrc_update(struct mr_entry *n) {
+    n->max_end = n->end;
+    if (n->left && n->left->max_end > n->max_end)
+        n->max_end = n->left->max_end;
+    if (n->right && n->right->max_end > n->max_end)
+        n->max_end = n->right->max_end;
+}
+
+static inline struct mr_entry *mrc_insert(struct mr_entry *n,
+                                          struct mr_entry *e) {
+    if (!n)
+        return e;
+    if (e->start < n->start) {
+        n->left = mrc_insert(n->left, e);
+        if (n->left->prio > n->prio) {  // rotate right
+            struct mr_entry *l = n->left;
+            n->left = l->right;
+            l->right = n;
+            mrc_update(n);
+            n = l;
+        }
+    } else {
+        n->right = mrc_insert(n->right, e);
+        if (n->right->prio > n->prio) { // rotate left
+            struct mr_entry *r = n->right;
+            n->right = r->left;
+            r->left = n;
+            mrc_update(n);
+            n = r;
+        }
+    }
+    mrc_update(n);
+    return n;
+}
+
+static inline struct mr_entry *mrc_merge(struct mr_entry *l,
+                                         struct mr_entry *r) {
+    if (!l)
+        return r;
+    if (!r)
+        return l;
+    if (l->prio > r->prio) {
+        l->right = mrc_merge(l->right, r);
+        mrc_update(l);
+        return l;
+    }
+    r->left = mrc_merge(l, r->left);
+    mrc_update(r);
+    return r;
+}
+
+// Unlink e; entries with equal start may sit on either side
+static inline int mrc_remove(struct mr_entry **np, struct mr_entry *e) {
+    struct mr_entry *n = *np;
+    int found;
+
+    if (!n)
+        return 0;
+    if (n == e) {
+        *np = mrc_merge(n->left, n->right);
+        return 1;
+    }
+    if (e->start < n->start)
+        found = mrc_remove(&n->left, e);
+    else if (e->start > n->start)
+        found = mrc_remove(&n->right, e);
+    else
+        found = mrc_remove(&n->left, e) || mrc_remove(&n->right, e);
+    if (found)
+        mrc_update(n);
+    return found;
+}
+
+// Some entry with start <= a and end >= e
+static inline struct mr_entry *mrc_find_cover(struct mr_entry *n,
+                                              uintptr_t a, uintptr_t e) {
+    if (!n || n->max_end < e)
+        return NULL;
+    struct mr_entry *r = mrc_find_cover(n->left, a, e);
+    if (r)
+        return r;
+    if (n->start > a)
+        return NULL;
+    if (n->end >= e)
+        return n;
+    return mrc_find_cover(n->right, a, e);
+}
+
+// Some entry intersecting [a, e)
+static inline struct mr_entry *mrc_find_overlap(struct mr_entry *n,
+                                                uintptr_t a, uintptr_t e) {
+    if (!n || n->max_end <= a)
+        return NULL;
+    struct mr_entry *r = mrc_find_overlap(n->left, a, e);
+    if (r)
+        return r;
+    if (n->start >= e)
+        return NULL;
+    if (n->end > a)
+        return n;
+    return mrc_find_overlap(n->right, a, e);
+}
+
+/* --- LRU of unreferenced entries -------------------------------------- */
+
+static inline void mrc_lru_del(struct mr_cache *c, struct mr_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else c->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else c->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static inline void mrc_lru_add(struct mr_cache *c, struct mr_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head) c->lru_head->lru_prev = e;
+    else c->lru_tail = e;
+    c->lru_head = e;
+}
+
+static inline void mrc_release(struct mr_cache *c, struct mr_entry *e) {
+    ibv_dereg_mr(e->mr);
+    c->pinned -= e->end - e->start;
+    free(e);
+}
+
+/* --- API ------------------------------------------------------------- */
+
+static inline void mr_cache_init(struct mr_cache *c, struct ibv_pd *pd,
+                                 int access, size_t budget) {
+    memset(c, 0, sizeof(*c));
+    c->pd = pd;
+    c->access = access;
+    c->budget = budget;
+    c->page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    c->seed = 2463534242u;
+}
+
+/*
+ * Return a referenced entry whose MR covers [addr, addr + len), or
+ * NULL with errno set. Use e->mr->lkey / e->mr->rkey for the transfer
+ * and mr_cache_put() the entry once it has completed.
+ */
+static inline struct mr_entry *mr_cache_get(struct mr_cache *c,
+                                            const void *addr, size_t len) {
+    uintptr_t a = (uintptr_t)addr;
+    struct mr_entry *e = mrc_find_cover(c->root, a, a + len);
+
+    if (e) {
+        if (!e->refcnt++)
+            mrc_lru_del(c, e);
+        c->stats.hits++;
+        return e;
+    }
+    c->stats.misses++;
+
+    uintptr_t start = a & ~c->page_mask;
+    uintptr_t end = (a + len + c->page_mask) & ~c->page_mask;
+    while (c->budget && c->pinned + (end - start) > c->budget && c->lru_tail) {
+        struct mr_entry *victim = c->lru_tail;
+        mrc_lru_del(c, victim);
+        mrc_remove(&c->root, victim);
+        mrc_release(c, victim);
+        c->stats.evictions++;
+    }
+    if (c->budget && c->pinned + (end - start) > c->budget) {
+        c->stats.failures++;
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        c->stats.failures++;
+        return NULL;
+    }
+    e->mr = ibv_reg_mr(c->pd, (void *)start, end - start, c->access);
+    if (!e->mr) {
+        int err = errno;
+        free(e);
+        c->stats.failures++;
+        errno = err;
+        return NULL;
+    }
+    e->start = start;
+    e->end = end;
+    e->refcnt = 1;
+
+    // xorshift32 priorities keep the treap balanced in expectation
+    c->seed ^= c->seed << 13;
+    c->seed ^= c->seed >> 17;
+    c->seed ^= c->seed << 5;
+    e->prio = c->seed;
+    c->root = mrc_insert(c->root, e);
+    c->pinned += end - start;
+    return e;
+}
+
+static inline void mr_cache_put(struct mr_cache *c, struct mr_entry *e) {
+    if (--e->refcnt)
+        return;
+    if (e->invalid)
+        mrc_release(c, e);
+    else
+        mrc_lru_add(c, e);
+}
+
+/*
+ * Forget every registration that intersects [addr, addr + len).
+ * Unreferenced entries are deregistered right away, referenced ones
+ * stop matching lookups and are deregistered on their last put.
+ */
+static inline void mr_cache_invalidate(struct mr_cache *c,
+                                       const void *addr, size_t len) {
+    uintptr_t a = (uintptr_t)addr;
+    struct mr_entry *e;
+
+    while ((e = mrc_find_overlap(c->root, a, a + len))) {
+        mrc_remove(&c->root, e);
+        e->left = e->right = NULL;
+        c->stats.invalidations++;
+        if (e->refcnt) {
+            e->invalid = 1;
+        } else {
+            mrc_lru_del(c, e);
+            mrc_release(c, e);
+        }
+    }
+}
+
+// Deregister everything; entries must no longer be referenced
+static inline void mr_cache_destroy(struct mr_cache *c) {
+    while (c->root) {
+        struct mr_entry *e = c->root;
+        mrc_remove(&c->root, e);
+        mrc_release(c, e);
+    }
+    c->lru_head = c->lru_tail = NULL;
+}
+
+static inline void mr_cache_print_stats(const struct mr_cache *c) {
+    uint64_t lookups = c->stats.hits + c->stats.misses;
+
+    printf("mr_cache: %llu hits, %llu misses (%.1f%% hit rate), "
+           "%llu evictions, %llu invalidations, %llu failures, "
+           "%zu KB pinned of %zu KB budget\n",
+           (unsigned long long)c->stats.hits,
+           (unsigned long long)c->stats.misses,
+           lookups ? 100.0 * c->stats.hits / lookups : 0.0,
+           (unsigned long long)c->stats.evictions,
+           (unsigned long long)c->stats.invalidations,
+           (unsigned long long)c->stats.failures,
+           c->pinned >> 10, c->budget >> 10);
+}
+
+/*
+ * Automatic invalidation, defined in mr_cache_hooks.c: link that file
+ * in and install the cache to have munmap() and free() of mmap-backed
+ * chunks invalidate it.
+ */
+void mr_cache_hooks_install(struct mr_cache *c);
+void mr_cache_hooks_remove(struct mr_cache *c);
+
+#endif
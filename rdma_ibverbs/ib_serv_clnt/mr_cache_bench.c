@@ -0,0 +1,157 @@
+// mr_cache_bench.c
+// Registers transfers on a working set of user buffers either with
+// ibv_reg_mr()/ibv_dereg_mr() per transfer or through the pin-down MR
+// cache, and prints the cache counters used to size it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "mr_cache.h"
+
+#define ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ)
+
+struct bench {
+    struct ibv_pd *pd;
+    char **bufs;        // the application's buffers
+    size_t size;
+    uint32_t nbufs;
+    uint64_t iters;
+    uint32_t realloc_every;
+    uint32_t seed;
+};
+
+static uint32_t next_buf(struct bench *b) {
+    b->seed ^= b->seed << 13;
+    b->seed ^= b->seed >> 17;
+    b->seed ^= b->seed << 5;
+    return b->seed % b->nbufs;
+}
+
+/*
+ * Every realloc_every transfers one buffer is freed and allocated again,
+ * as an application recycling its buffers would. Buffers above glibc's
+ * mmap threshold come back from munmap()/mmap(), so this exercises the
+ * invalidation hooks.
+ */
+static void maybe_realloc(struct bench *b, uint64_t i, uint32_t idx) {
+    if (!b->realloc_every || i % b->realloc_every)
+        return;
+    free(b->bufs[idx]);
+    b->bufs[idx] = malloc(b->size);
+    if (!b->bufs[idx]) die("malloc");
+    memset(b->bufs[idx], 0, b->size);
+}
+
+static double bench_reg_per_transfer(struct bench *b) {
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < b->iters; i++) {
+        uint32_t idx = next_buf(b);
+        struct ibv_mr *mr = ibv_reg_mr(b->pd, b->bufs[idx], b->size, ACCESS);
+        if (!mr) die("ibv_reg_mr");
+        ibv_dereg_mr(mr);
+        maybe_realloc(b, i + 1, idx);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+static double bench_cache(struct bench *b, struct mr_cache *c) {
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < b->iters; i++) {
+        uint32_t idx = next_buf(b);
+        struct mr_entry *e = mr_cache_get(c, b->bufs[idx], b->size);
+        if (!e) die("mr_cache_get");
+        mr_cache_put(c, e);
+        maybe_realloc(b, i + 1, idx);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s size] [-n iters] [-w bufs] [-B budget_kb] [-r every]\n"
+            "  -s size       buffer size in bytes (default 1 MB)\n"
+            "  -n iters      transfers to register (default 100000)\n"
+            "  -w bufs       application buffers in the working set (default 64)\n"
+            "  -B budget_kb  pinned memory budget of the cache, 0 = unlimited\n"
+            "                (default 32768)\n"
+            "  -r every      free and reallocate a buffer every n transfers\n"
+            "                (default 1000, 0 = never)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct bench b = {
+        .size = 1 << 20,
+        .iters = 100000,
+        .nbufs = 64,
+        .realloc_every = 1000,
+        .seed = 2463534242u,
+    };
+    size_t budget = 32768ul << 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:w:B:r:")) != -1) {
+        switch (opt) {
+        case 's': b.size = strtoul(optarg, NULL, 0); break;
+        case 'n': b.iters = strtoull(optarg, NULL, 0); break;
+        case 'w': b.nbufs = strtoul(optarg, NULL, 0); break;
+        case 'B': budget = strtoull(optarg, NULL, 0) << 10; break;
+        case 'r': b.realloc_every = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !b.size || !b.iters || !b.nbufs)
+        usage(argv[0]);
+
+    struct ibv_device **dev_list = ibv_get_device_list(NULL);
+    if (!dev_list || !dev_list[0]) die("ibv_get_device_list");
+
+    struct ibv_context *ctx = ibv_open_device(dev_list[0]);
+    if (!ctx) die("ibv_open_device");
+
+    b.pd = ibv_alloc_pd(ctx);
+    if (!b.pd) die("ibv_alloc_pd");
+
+    struct mr_cache cache;
+    mr_cache_init(&cache, b.pd, ACCESS, budget);
+    mr_cache_hooks_install(&cache);
+
+    b.bufs = calloc(b.nbufs, sizeof(*b.bufs));
+    if (!b.bufs) die("calloc");
+    for (uint32_t i = 0; i < b.nbufs; i++) {
+        b.bufs[i] = malloc(b.size);
+        if (!b.bufs[i]) die("malloc");
+        memset(b.bufs[i], 0, b.size);
+    }
+
+    printf("%s: %zu byte buffers, working set %u (%zu KB), %llu transfers\n",
+           ibv_get_device_name(dev_list[0]), b.size, b.nbufs,
+           b.size * b.nbufs >> 10, (unsigned long long)b.iters);
+
+    double sec = bench_reg_per_transfer(&b);
+    printf("  reg/dereg per transfer: %10.0f regs/s  %8.3f us/transfer\n",
+           b.iters / sec, sec * 1e6 / b.iters);
+
+    sec = bench_cache(&b, &cache);
+    printf("  mr_cache get/put:       %10.0f regs/s  %8.3f us/transfer\n",
+           b.iters / sec, sec * 1e6 / b.iters);
+    mr_cache_print_stats(&cache);
+
+    for (uint32_t i = 0; i < b.nbufs; i++)
+        free(b.bufs[i]);
+    free(b.bufs);
+    mr_cache_hooks_remove(&cache);
+    mr_cache_destroy(&cache);
+    ibv_dealloc_pd(b.pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(dev_list);
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+// mr_cache_hooks.c
+// munmap()/free() interposers that invalidate installed MR caches before
+// memory goes back to the kernel. Link this file into the program that
+// uses mr_cache.h and call mr_cache_hooks_install().
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "mr_cache.h"
+
+#define MAX_CACHES 8
+
+/*
+ * glibc's own free() path unmaps large chunks through an internal
+ * munmap that cannot be interposed, and shrinks the heap with an
+ * internal sbrk. So:
+ *
+ *  - munmap() is wrapped directly and forwarded as a raw syscall.
+ *  - free() checks the chunk header for IS_MMAPPED (bit 1 of the size
+ *    word glibc keeps in front of every chunk) and only then
+ *    invalidates. Ordinary heap chunks stay mapped after free(), so
+ *    their registrations remain valid and keep hitting the cache.
+ *  - Heap trimming is switched off on install, so freed heap memory is
+ *    never handed back to the kernel behind the cache's back.
+ *
+ * The hooks ignore calls made while they run, because deregistering
+ * an entry frees memory itself.
+ */
+#define GLIBC_IS_MMAPPED 0x2
+
+extern void __libc_free(void *ptr);
+
+static struct mr_cache *caches[MAX_CACHES];
+static int ncaches;
+static __thread int in_hook;
+
+static void invalidate_all(const void *addr, size_t len) {
+    if (in_hook)
+        return;
+    in_hook = 1;
+    for (int i = 0; i < ncaches; i++)
+        mr_cache_invalidate(caches[i], addr, len);
+    in_hook = 0;
+}
+
+void mr_cache_hooks_install(struct mr_cache *c) {
+    if (ncaches == MAX_CACHES) {
+        fprintf(stderr, "mr_cache_hooks: too many caches\n");
+        exit(1);
+    }
+    mallopt(M_TRIM_THRESHOLD, -1);
+    caches[ncaches++] = c;
+}
+
+void mr_cache_hooks_remove(struct mr_cache *c) {
+    for (int i = 0; i < ncaches; i++) {
+        if (caches[i] == c) {
+            caches[i] = caches[--ncaches];
+            return;
+        }
+    }
+}
+
+int munmap(void *addr, size_t len) {
+    if (ncaches)
+        invalidate_all(addr, len);
+    return syscall(SYS_munmap, addr, len);
+}
+
+void free(void *ptr) {
+    if (ptr && ncaches && (((size_t *)ptr)[-1] & GLIBC_IS_MMAPPED))
+        invalidate_all(ptr, malloc_usable_size(ptr));
+    __libc_free(ptr);
+}
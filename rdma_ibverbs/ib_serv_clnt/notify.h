@@ -0,0 +1,80 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <arpa/inet.h>
+#include "common.h"
+
+/*
+ * Transfer notification with RDMA_WRITE_WITH_IMM
+ *
+ * A plain RDMA_WRITE never shows up on the target's CQ, so the target
+ * needs some other signal that the data has landed. Instead of a
+ * message on the TCP side channel, the last write of a transfer is
+ * posted as RDMA_WRITE_WITH_IMM: the data is placed exactly as before,
+ * and then the 32-bit immediate is delivered as an
+ * IBV_WC_RECV_RDMA_WITH_IMM completion that consumes one posted receive.
+ * RC places writes in order, so every earlier write of the transfer is
+ * in memory by then too. The receives carry no buffer (num_sge = 0).
+ *
+ * A zero-length WRITE_WITH_IMM is a notification without data, used
+ * after a transfer of many writes and for acknowledgements.
+ *
+ * Immediate: bit 31 (NOTIFY_ACK) asks the target to answer with a
+ * zero-length WRITE_WITH_IMM carrying the same value; the low 31 bits
+ * are the transfer length or a sequence number.
+ */
+#define NOTIFY_ACK       0x80000000u
+#define NOTIFY_VAL_MASK  0x7fffffffu
+#define NOTIFY_RECVS     8              // kept posted per QP
+#define NOTIFY_WRID      (1ull << 62)   // receive wr_id, apart from SRQ_WRID_FLAG
+
+static inline int notify_post_recvs(struct ibv_qp *qp, uint32_t n) {
+    struct ibv_recv_wr wr = { .wr_id = NOTIFY_WRID }, *bad_wr;
+
+    while (n--) {
+        int ret = ibv_post_recv(qp, &wr, &bad_wr);
+        if (ret) {
+            errno = ret;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Post len bytes at addr (lkey) to remote as RDMA_WRITE_WITH_IMM; len 0
+ * sends only the immediate. Returns 0, or -1 with errno set.
+ */
+static inline int notify_post(struct ibv_qp *qp, void *addr, uint32_t len,
+                              uint32_t lkey, uint64_t raddr, uint32_t rkey,
+                              uint32_t imm, uint64_t wr_id,
+                              unsigned int flags) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)addr,
+        .length = len,
+        .lkey = lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.sg_list = len ? &sge : NULL;
+    wr.num_sge = len ? 1 : 0;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = flags;
+    wr.imm_data = htonl(imm);
+    wr.wr.rdma.remote_addr = raddr;
+    wr.wr.rdma.rkey = rkey;
+
+    int ret = ibv_post_send(qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint32_t notify_imm(const struct ibv_wc *wc) {
+    return ntohl(wc->imm_data);
+}
+
+#endif
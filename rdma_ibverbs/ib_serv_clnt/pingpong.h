@@ -0,0 +1,133 @@
+#ifndef PINGPONG_H
+#define PINGPONG_H
+
+#include "common.h"
+
+/*
+ * RDMA_WRITE ping-pong helpers shared by the client and server latency
+ * modes.
+ *
+ * Each side registers one MR split in two halves:
+ *
+ *   [0, len)        receive area, advertised in conn_info
+ *   [len, 2 * len)  send area, source of our RDMA_WRITEs
+ *
+ * A message is size bytes written to the start of the peer's receive
+ * area. The last byte carries a per-iteration marker, and the receiver
+ * busy-polls that byte instead of waiting for a completion or a TCP
+ * message. This relies on the HCA placing the bytes of one RDMA_WRITE
+ * in increasing address order, as perftest's ib_write_lat does.
+ *
+ * Payloads up to max_inline_data are posted with IBV_SEND_INLINE, so
+ * the HCA takes them from the WQE instead of issuing a DMA read.
+ */
+#define PP_MAX_INLINE 256
+
+struct pingpong {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr;
+    volatile uint8_t *rx_last;  // last byte of the message in our receive area
+    uint8_t *tx_last;           // last byte of the message we send
+    uint32_t signal;            // signal one WR every 'signal' posts
+    uint32_t unsignaled;
+    int pending;                // signaled WR not yet reaped
+};
+
+// Marker for iteration i, never 0 so a cleared buffer never matches
+static inline uint8_t pp_marker(uint64_t i) {
+    return (uint8_t)(i % 255) + 1;
+}
+
+/*
+ * buf/len: the receive area and its length, the send area follows it
+ * inside the same MR. max_send_wr is the QP's send queue depth,
+ * max_inline the max_inline_data reported back by ibv_create_qp().
+ */
+static inline void pp_init(struct pingpong *pp, struct ibv_qp *qp,
+                           struct ibv_cq *cq, struct ibv_mr *mr,
+                           char *buf, uint32_t len, uint32_t size,
+                           const struct conn_info *remote,
+                           uint32_t max_send_wr, uint32_t max_inline) {
+    memset(pp, 0, sizeof(*pp));
+    pp->qp = qp;
+    pp->cq = cq;
+    pp->rx_last = (volatile uint8_t *)buf + size - 1;
+    pp->tx_last = (uint8_t *)buf + len + size - 1;
+    pp->signal = max_send_wr / 2 ? max_send_wr / 2 : 1;
+
+    pp->sge.addr = (uintptr_t)(buf + len);
+    pp->sge.length = size;
+    pp->sge.lkey = mr->lkey;
+
+    pp->wr.sg_list = &pp->sge;
+    pp->wr.num_sge = 1;
+    pp->wr.opcode = IBV_WR_RDMA_WRITE;
+    pp->wr.wr.rdma.remote_addr = remote->vaddr;
+    pp->wr.wr.rdma.rkey = remote->rkey;
+    if (size <= max_inline)
+        pp->wr.send_flags = IBV_SEND_INLINE;
+}
+
+/*
+ * Only every pp->signal-th write is signaled. Before posting the next
+ * signaled write the previous one must have been reaped, which frees
+ * all the send queue slots in front of it; with signal = max_send_wr / 2
+ * the queue can never overflow.
+ *
+ * pp_send_ready() tells whether the next write can go out without that
+ * reap. Callers that share pp->cq with other QPs check it and clear
+ * pp->pending from their own CQ loop; everyone else lets pp_send() reap
+ * from a private CQ, which almost always succeeds immediately.
+ */
+static inline int pp_send_ready(const struct pingpong *pp) {
+    return !pp->pending || pp->unsignaled + 1 < pp->signal;
+}
+
+static inline void pp_reap(struct pingpong *pp) {
+    while (pp->pending) {
+        struct ibv_wc wc;
+        int ne = ibv_poll_cq(pp->cq, 1, &wc);
+        if (ne < 0)
+            die("ibv_poll_cq");
+        if (ne && wc.status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "RDMA_WRITE failed: wc.status=%d (%s)\n",
+                    wc.status, ibv_wc_status_str(wc.status));
+            exit(1);
+        }
+        pp->pending -= ne;
+    }
+}
+
+// Send one message carrying marker m
+static inline void pp_send(struct pingpong *pp, uint8_t m) {
+    struct ibv_send_wr *bad_wr;
+    int flags = pp->wr.send_flags & IBV_SEND_INLINE;
+
+    if (!pp_send_ready(pp))
+        pp_reap(pp);
+    if (++pp->unsignaled == pp->signal) {
+        flags |= IBV_SEND_SIGNALED;
+        pp->unsignaled = 0;
+        pp->pending = 1;
+    }
+
+    *pp->tx_last = m;
+    pp->wr.send_flags = flags;
+    if (ibv_post_send(pp->qp, &pp->wr, &bad_wr))
+        die("ibv_post_send");
+}
+
+// Has the peer's message with marker m landed in our receive area?
+static inline int pp_arrived(const struct pingpong *pp, uint8_t m) {
+    return *pp->rx_last == m;
+}
+
+// Busy-poll our receive area until the peer's message with marker m lands
+static inline void pp_wait(struct pingpong *pp, uint8_t m) {
+    while (!pp_arrived(pp, m))
+        ;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef QP_POOL_H
+#define QP_POOL_H
+
+#include "common.h"
+#include "ibdev.h"
+
+/*
+ * Pool of warm RC QPs
+ *
+ * Setting up a connection costs ibv_create_qp() and the INIT, RTR and
+ * RTS transitions, and tearing it down an ibv_destroy_qp(). Creating
+ * and destroying are the expensive ones: the provider allocates and
+ * frees the queue memory, registers it with the HCA and maps a
+ * doorbell, each through a command to the firmware. Only RTR and RTS
+ * depend on the peer.
+ *
+ * The pool keeps QPs that are already in INIT. qp_pool_get() hands one
+ * out, so a new connection only needs RTR and RTS. qp_pool_put() takes
+ * a QP back from a closed connection and moves it to RESET and then to
+ * INIT again instead of destroying it. RESET discards the work queues
+ * without flushing them. mlx5 also drops the QP's completions from its
+ * CQs then, as on destroy, but that is up to the provider.
+ *
+ * A recycled QP keeps its QP number, and its old completions may still
+ * be queued in a CQ shared with other QPs. A new connection that gets
+ * the QP before they are polled would take them for its own, even once
+ * it is up. So drain the CQ after qp_pool_put() and before the next
+ * qp_pool_get(), dropping what names a QP with no connection. The PSNs
+ * of each connection are new, like those of a fresh QP.
+ *
+ * All QPs in a pool share one ibv_qp_init_attr and access flags. With
+ * max 0 there is no pool: get creates a QP and put destroys it, which
+ * is the baseline the pool is measured against.
+ */
+struct qp_pool {
+    struct ibv_pd *pd;
+    const struct ibdev *dev;
+    struct ibv_qp_init_attr init;       // template for every QP
+    struct ibv_qp_cap cap;              // what the device gave them
+    int access;                         // INIT qp_access_flags
+    struct ibv_qp **free;               // QPs in INIT, used as a stack
+    uint32_t nfree;
+    uint32_t max;
+
+    uint64_t created;                   // ibv_create_qp() calls
+    uint64_t reused;                    // gets served from the pool
+    uint64_t recycled;                  // puts kept in the pool
+    uint64_t destroyed;
+};
+
+// A new QP from the template, in INIT
+static inline struct ibv_qp *qp_pool_create_qp(struct qp_pool *p) {
+    struct ibv_qp_init_attr init = p->init;
+    struct ibv_qp *qp = ibv_create_qp(p->pd, &init);
+    int err;
+
+    if (!qp)
+        return NULL;
+    if (ibdev_qp_to_init(p->dev, qp, p->access)) {
+        err = errno;
+        ibv_destroy_qp(qp);
+        errno = err;
+        return NULL;
+    }
+    p->cap = init.cap;
+    p->created++;
+    return qp;
+}
+
+static inline void qp_pool_destroy_qp(struct qp_pool *p, struct ibv_qp *qp) {
+    ibv_destroy_qp(qp);
+    p->destroyed++;
+}
+
+static inline void qp_pool_destroy(struct qp_pool *p) {
+    while (p->nfree)
+        qp_pool_destroy_qp(p, p->free[--p->nfree]);
+    free(p->free);
+}
+
+/*
+ * Create the pool and fill it with max QPs up front, so that not even
+ * the first connections pay for ibv_create_qp(). Returns 0, or -1 with
+ * errno set.
+ */
+static inline int qp_pool_create(struct qp_pool *p, struct ibv_pd *pd,
+                                 const struct ibdev *dev,
+                                 const struct ibv_qp_init_attr *init,
+                                 int access, uint32_t max) {
+    int err;
+
+    memset(p, 0, sizeof(*p));
+    p->pd = pd;
+    p->dev = dev;
+    p->init = *init;
+    p->cap = init->cap;
+    p->access = access;
+    p->max = max;
+    if (max && !(p->free = calloc(max, sizeof(*p->free))))
+        return -1;
+    while (p->nfree < max) {
+        struct ibv_qp *qp = qp_pool_create_qp(p);
+        if (!qp)
+            goto err;
+        p->free[p->nfree++] = qp;
+    }
+    return 0;
+
+err:
+    err = errno;
+    qp_pool_destroy(p);
+    errno = err;
+    return -1;
+}
+
+/*
+ * A QP in INIT for a new connection, warm from the pool if there is
+ * one. Returns NULL with errno set if a new one cannot be created.
+ */
+static inline struct ibv_qp *qp_pool_get(struct qp_pool *p) {
+    if (p->nfree) {
+        p->reused++;
+        return p->free[--p->nfree];
+    }
+    return qp_pool_create_qp(p);
+}
+
+/*
+ * Take back the QP of a closed connection, in any state. It goes back
+ * to INIT for the next one, or is destroyed if the pool is full or the
+ * transitions fail.
+ */
+static inline void qp_pool_put(struct qp_pool *p, struct ibv_qp *qp) {
+    struct ibv_qp_attr attr = { .qp_state = IBV_QPS_RESET };
+
+    if (p->nfree == p->max || ibv_modify_qp(qp, &attr, IBV_QP_STATE) ||
+        ibdev_qp_to_init(p->dev, qp, p->access)) {
+        qp_pool_destroy_qp(p, qp);
+        return;
+    }
+    p->free[p->nfree++] = qp;
+    p->recycled++;
+}
+
+#endif
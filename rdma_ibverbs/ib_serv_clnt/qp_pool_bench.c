@@ -0,0 +1,349 @@
+// qp_pool_bench.c
+// Connect/disconnect cycles per second, with every QP created and destroyed
+// per connection and then with QPs recycled through a pool (qp_pool.h).
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "hist.h"
+#include "ibdev.h"
+#include "notify.h"
+#include "qp_pool.h"
+
+#define CQ_DEPTH    16
+#define BUF_SIZE    4096
+
+/*
+ * Sent by the client on every new connection. The server takes its QP
+ * from the pool or creates one as pooled says, and prints its side of
+ * the numbers after the last cycle.
+ */
+struct pool_hello {
+    uint32_t cycle;
+    uint32_t pooled;
+    uint32_t last;
+    uint32_t pad;
+};
+
+// The verbs resources a long-running process keeps across connections
+struct endpoint {
+    const struct ibdev *dev;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    struct qp_pool pools[2];    // [0]: create and destroy, [1]: recycle
+};
+
+// Per connection phase times of one run
+struct cycle_stats {
+    struct hist get;            // QP in INIT: ibv_create_qp() or the pool
+    struct hist rts;            // RTR and RTS
+    struct hist put;            // ibv_destroy_qp() or RESET and INIT
+    struct hist cycle;          // connect to close, client only
+};
+
+static void wait_wc(struct ibv_cq *cq, struct ibv_wc *wc) {
+    int ne;
+
+    while (!(ne = ibv_poll_cq(cq, 1, wc)))
+        ;
+    if (ne < 0)
+        die("ibv_poll_cq");
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "wc.status=%d (%s)\n", wc->status,
+                ibv_wc_status_str(wc->status));
+        exit(1);
+    }
+}
+
+static void endpoint_open(struct endpoint *e, const struct ibdev *dev,
+                          struct ibv_pd *pd, uint32_t pool_size) {
+    struct ibv_qp_init_attr init = {0};
+
+    e->dev = dev;
+    e->cq = ibv_create_cq(dev->ctx, CQ_DEPTH, NULL, NULL, 0);
+    if (!e->cq)
+        die("ibv_create_cq");
+    void *buf = calloc(1, BUF_SIZE);
+    if (!buf)
+        die("calloc");
+    e->mr = ibv_reg_mr(pd, buf, BUF_SIZE,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!e->mr)
+        die("ibv_reg_mr");
+
+    init.send_cq = e->cq;
+    init.recv_cq = e->cq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = 1;
+    init.cap.max_recv_wr = 1;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    if (qp_pool_create(&e->pools[0], pd, dev, &init, IBV_ACCESS_REMOTE_WRITE, 0) ||
+        qp_pool_create(&e->pools[1], pd, dev, &init, IBV_ACCESS_REMOTE_WRITE,
+                       pool_size))
+        die("qp_pool_create");
+}
+
+static void endpoint_close(struct endpoint *e) {
+    void *buf = e->mr->addr;
+
+    qp_pool_destroy(&e->pools[0]);
+    qp_pool_destroy(&e->pools[1]);
+    ibv_dereg_mr(e->mr);
+    free(buf);
+    ibv_destroy_cq(e->cq);
+}
+
+/*
+ * Both sides of a connection: a QP in INIT from pool, then swap
+ * conn_info and go to RTS. The server posts its receive for the
+ * client's notification before its QPN goes out.
+ */
+static struct ibv_qp *connect_qp(struct endpoint *e, struct qp_pool *pool,
+                                 int sock, int server, struct conn_info *remote,
+                                 struct cycle_stats *st) {
+    struct conn_info local = {0};
+    uint64_t t = now_ns();
+    struct ibv_qp *qp = qp_pool_get(pool);
+
+    if (!qp)
+        die("ibv_create_qp");
+    hist_add(&st->get, now_ns() - t);
+    if (server && notify_post_recvs(qp, 1))
+        die("ibv_post_recv");
+
+    local.qpn = qp->qp_num;
+    local.psn = (uint32_t)(rand() & 0xffffff);
+    local.rkey = e->mr->rkey;
+    local.vaddr = (uintptr_t)e->mr->addr;
+    local.len = BUF_SIZE;
+    ibdev_fill_info(e->dev, &local);
+    xfer(sock, &local, sizeof(local), 1);
+    xfer(sock, remote, sizeof(*remote), 0);
+
+    t = now_ns();
+    if (ibdev_qp_to_rts(e->dev, qp, local.psn, remote, 1))
+        die("ibdev_qp_to_rts");
+    hist_add(&st->rts, now_ns() - t);
+    return qp;
+}
+
+static void release_qp(struct qp_pool *pool, struct ibv_qp *qp,
+                       struct cycle_stats *st) {
+    uint64_t t = now_ns();
+
+    qp_pool_put(pool, qp);
+    hist_add(&st->put, now_ns() - t);
+}
+
+static void stats_init(struct cycle_stats *st) {
+    hist_init(&st->get);
+    hist_init(&st->rts);
+    hist_init(&st->put);
+    hist_init(&st->cycle);
+}
+
+static void stats_print(const struct cycle_stats *st, const struct qp_pool *p) {
+    printf("  QPs: %llu created, %llu reused, %llu recycled, %llu destroyed\n",
+           (unsigned long long)p->created, (unsigned long long)p->reused,
+           (unsigned long long)p->recycled, (unsigned long long)p->destroyed);
+    hist_print_us(p->max ? "get from the pool" : "create + INIT", &st->get);
+    hist_print_us("RTR + RTS", &st->rts);
+    hist_print_us(p->max ? "RESET + INIT into the pool" : "destroy", &st->put);
+}
+
+/* --- server ---------------------------------------------------------- */
+
+/*
+ * One connection: bring up a QP, wait for the client's zero-length
+ * WRITE_WITH_IMM to prove the path works, acknowledge it on the socket
+ * and give the QP back.
+ */
+static void serve(struct endpoint *e, int sock, struct cycle_stats st[2]) {
+    struct pool_hello hello;
+    struct conn_info remote;
+    struct ibv_wc wc;
+    char ready = 'R';
+
+    xfer(sock, &hello, sizeof(hello), 0);
+    int pooled = !!hello.pooled;
+    struct ibv_qp *qp = connect_qp(e, &e->pools[pooled], sock, 1, &remote,
+                                   &st[pooled]);
+    xfer(sock, &ready, 1, 1);
+
+    wait_wc(e->cq, &wc);
+    if (wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM ||
+        notify_imm(&wc) != (hello.cycle & NOTIFY_VAL_MASK)) {
+        fprintf(stderr, "Unexpected completion in cycle %u\n", hello.cycle);
+        exit(1);
+    }
+    xfer(sock, &ready, 1, 1);
+    release_qp(&e->pools[pooled], qp, &st[pooled]);
+
+    if (hello.last) {
+        printf("%s: %u connections\n", pooled ? "Pooled" : "Create/destroy",
+               hello.cycle + 1);
+        stats_print(&st[pooled], &e->pools[pooled]);
+        stats_init(&st[pooled]);
+    }
+}
+
+/* --- client ---------------------------------------------------------- */
+
+/*
+ * cycles connect/disconnect cycles, each a new TCP connection and a
+ * new QP on both sides, brought to RTS and used for one zero-length
+ * WRITE_WITH_IMM before everything is torn down again. Returns the
+ * elapsed time in seconds.
+ */
+static double run(struct endpoint *e, const struct addrinfo *res,
+                  uint64_t cycles, int pooled, struct cycle_stats *st) {
+    struct qp_pool *pool = &e->pools[pooled];
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < cycles; i++) {
+        struct pool_hello hello = {
+            .cycle = i,
+            .pooled = pooled,
+            .last = i + 1 == cycles,
+        };
+        struct conn_info remote;
+        struct ibv_wc wc;
+        uint64_t t0 = now_ns();
+        int one = 1;
+        char c;
+
+        int sock = tcp_connect_addr(res);
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        xfer(sock, &hello, sizeof(hello), 1);
+        struct ibv_qp *qp = connect_qp(e, pool, sock, 0, &remote, st);
+        xfer(sock, &c, 1, 0);   // the server is in RTS too
+
+        if (notify_post(qp, NULL, 0, 0, remote.vaddr, remote.rkey,
+                        i & NOTIFY_VAL_MASK, 0, IBV_SEND_SIGNALED))
+            die("ibv_post_send");
+        wait_wc(e->cq, &wc);
+        xfer(sock, &c, 1, 0);   // ... and got it
+
+        release_qp(pool, qp, st);
+        close(sock);
+        hist_add(&st->cycle, now_ns() - t0);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-Q pool] [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> [-n cycles] [-Q pool] [-c | -q]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port    serve on port\n"
+            "  -n cycles  connect/disconnect cycles per run (default 10000)\n"
+            "  -Q pool    QPs kept warm in INIT for the pooled run (default 4)\n"
+            "  -c         only create and destroy a QP per connection\n"
+            "  -q         only take QPs from the pool\n"
+            "  -D dev     use this HCA (default: the first one)\n"
+            "  -P pnetid  use the HCA port with this PNET ID (s390)\n"
+            "  -i port    HCA port (default: the first active one)\n"
+            "  -G index   GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    const char *listen_port = NULL;
+    uint64_t cycles = 10000;
+    uint32_t pool_size = 4;
+    int runs = 3, opt;          // bit 0: create/destroy, bit 1: pooled
+
+    while ((opt = getopt(argc, argv, "L:n:Q:cqD:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'n': cycles = strtoull(optarg, NULL, 0); break;
+        case 'Q': pool_size = strtoul(optarg, NULL, 0); break;
+        case 'c': runs = 1; break;
+        case 'q': runs = 2; break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (!cycles || cycles > UINT32_MAX || !pool_size ||
+        (listen_port ? optind != argc : argc - optind != 2))
+        usage(argv[0]);
+
+    struct ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+        die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+    struct ibv_pd *pd = ibv_alloc_pd(dev.ctx);
+    if (!pd)
+        die("ibv_alloc_pd");
+    struct endpoint e;
+    endpoint_open(&e, &dev, pd, pool_size);
+
+    if (listen_port) {
+        static struct cycle_stats st[2];
+        int one = 1;
+
+        int lfd = tcp_listen(listen_port, 16);
+        printf("Serving connect/disconnect cycles on port %s, %u QPs in the pool\n",
+               listen_port, pool_size);
+
+        stats_init(&st[0]);
+        stats_init(&st[1]);
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            serve(&e, sock, st);
+            close(sock);
+        }
+    }
+
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &res))
+        die("getaddrinfo");
+
+    double rate[2] = { 0, 0 };
+    for (int pooled = 0; pooled < 2; pooled++) {
+        static struct cycle_stats st;
+
+        if (!(runs & (1 << pooled)))
+            continue;
+        stats_init(&st);
+        double sec = run(&e, res, cycles, pooled, &st);
+        rate[pooled] = cycles / sec;
+        printf("%s: %llu cycles in %.3f s, %.0f connections/s\n",
+               pooled ? "Pooled" : "Create/destroy", (unsigned long long)cycles,
+               sec, rate[pooled]);
+        stats_print(&st, &e.pools[pooled]);
+        hist_print_us("connect to close", &st.cycle);
+    }
+    if (runs == 3)
+        printf("The pool makes connection cycles %.2fx as fast\n", rate[1] / rate[0]);
+
+    freeaddrinfo(res);
+    endpoint_close(&e);
+    ibv_dealloc_pd(pd);
+    ibdev_close(&dev);
+    return 0;
+}
@@ -0,0 +1,333 @@
+#ifndef RAIL_H
+#define RAIL_H
+
+#include <unistd.h>
+#include "common.h"
+#include "ibdev.h"
+#include "notify.h"
+
+/*
+ * Multi-rail striping
+ *
+ * A rail is one HCA port, found with ibdev.h. It has its own PD, CQ
+ * and QP, and the transfer buffer is registered on it. Hosts with
+ * several RoCE functions in the same PNET have one rail per function.
+ * Pick them with -P, or list them with -D.
+ *
+ * rail_write() cuts a transfer into chunks and RDMA_WRITEs them on all
+ * rails at once. Each chunk goes to the rail with the fewest bytes in
+ * flight, among those with room in their send queue. That is placement
+ * by queue depth: a rail that drains faster takes more chunks. RC only
+ * orders writes within one QP, so when all chunks are posted, every
+ * rail that carried a part sends a zero-length WRITE_WITH_IMM with its
+ * byte count (notify.h). The transfer is complete on the writer when
+ * every rail's WRs have completed. It is complete on the target when
+ * the counts it received add up to the transfer size.
+ *
+ * All WRs are signaled; chunks are large, so that costs little. wr_id
+ * is the WR's length, which is what its completion takes off queued.
+ */
+#define RAIL_MAX 16
+
+struct rail {
+    struct ibdev dev;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;          // to the peer's rail of the same index
+    struct ibv_mr *mr;          // the transfer buffer, on this device
+    struct conn_info remote;
+    uint32_t max_depth;         // chunks in flight, plus one notification
+
+    uint32_t depth;             // WRs in flight
+    uint64_t queued;            // bytes in flight, chunks go to the lowest
+    uint64_t part;              // bytes of the current transfer
+    uint64_t bytes;             // total carried, or received on the target
+    uint64_t notifies;
+};
+
+// Is name in the comma separated list?
+static inline int rail_listed(const char *list, const char *name) {
+    size_t len = strlen(name);
+
+    while (list && *list) {
+        if (!strncmp(list, name, len) && (list[len] == ',' || !list[len]))
+            return 1;
+        list = strchr(list, ',');
+        if (list)
+            list++;
+    }
+    return 0;
+}
+
+/*
+ * Open up to max rails: every active port of the devices in names
+ * (comma separated, NULL = all devices) that also matches o (-P, -i,
+ * -M). Each gets a PD and a CQ for depth chunks. Returns the number of
+ * rails, or -1 with errno set if there are none.
+ */
+static inline int rail_open_all(struct rail *rails, int max,
+                                const struct ibdev_opts *o,
+                                const char *names, uint32_t depth) {
+    struct ibv_device **list = ibv_get_device_list(NULL);
+    int n = 0;
+
+    if (!list)
+        return -1;
+    for (int i = 0; list[i] && n < max; i++) {
+        const char *name = ibv_get_device_name(list[i]);
+        struct ibv_device_attr attr;
+        struct ibv_context *ctx;
+
+        if (names && !rail_listed(names, name))
+            continue;
+        ctx = ibv_open_device(list[i]);
+        if (!ctx)
+            continue;
+        int ok = !ibv_query_device(ctx, &attr);
+        ibv_close_device(ctx);
+        if (!ok)
+            continue;
+
+        for (int p = 1; p <= attr.phys_port_cnt && n < max; p++) {
+            struct ibdev_opts ro = *o;
+            struct rail *r = &rails[n];
+
+            if (o->port && p != o->port)
+                continue;
+            ro.name = name;
+            ro.port = p;
+            memset(r, 0, sizeof(*r));
+            if (ibdev_open(&r->dev, &ro))
+                continue;       // port down or in another PNET
+            r->pd = ibv_alloc_pd(r->dev.ctx);
+            if (!r->pd)
+                goto err;
+            r->max_depth = depth + 1;
+            r->cq = ibv_create_cq(r->dev.ctx, r->max_depth + NOTIFY_RECVS,
+                                  NULL, NULL, 0);
+            if (!r->cq) {
+                ibv_dealloc_pd(r->pd);
+                goto err;
+            }
+            n++;
+        }
+    }
+    ibv_free_device_list(list);
+    if (!n) {
+        errno = ENODEV;
+        return -1;
+    }
+    return n;
+
+err:
+    ibdev_close(&rails[n].dev);
+    ibv_free_device_list(list);
+    while (n--) {
+        ibv_destroy_cq(rails[n].cq);
+        ibv_dealloc_pd(rails[n].pd);
+        ibdev_close(&rails[n].dev);
+    }
+    return -1;
+}
+
+static inline void rail_close_all(struct rail *rails, int n) {
+    for (int i = 0; i < n; i++) {
+        if (rails[i].mr)
+            ibv_dereg_mr(rails[i].mr);
+        ibv_destroy_cq(rails[i].cq);
+        ibv_dealloc_pd(rails[i].pd);
+        ibdev_close(&rails[i].dev);
+    }
+}
+
+// Register buf on every rail. Returns 0, or -1 with errno set.
+static inline int rail_reg(struct rail *rails, int n, void *buf, size_t len,
+                           int access) {
+    for (int i = 0; i < n; i++) {
+        rails[i].mr = ibv_reg_mr(rails[i].pd, buf, len, access);
+        if (!rails[i].mr)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create r's QP with receives for the peer's notifications, and connect
+ * it to the peer's rail over sock. Returns 0, or -1 with errno set.
+ */
+static inline int rail_connect(struct rail *r, int sock, int access) {
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    struct conn_info local = {0};
+
+    qp_init_attr.send_cq = r->cq;
+    qp_init_attr.recv_cq = r->cq;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr = r->max_depth;
+    qp_init_attr.cap.max_recv_wr = NOTIFY_RECVS;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    r->qp = ibv_create_qp(r->pd, &qp_init_attr);
+    if (!r->qp)
+        return -1;
+    if (ibdev_qp_to_init(&r->dev, r->qp, access) ||
+        notify_post_recvs(r->qp, NOTIFY_RECVS))
+        goto err;
+
+    local.qpn = r->qp->qp_num;
+    local.psn = (uint32_t)(rand() & 0xffffff);
+    local.rkey = r->mr->rkey;
+    local.vaddr = (uintptr_t)r->mr->addr;
+    local.len = r->mr->length;
+    ibdev_fill_info(&r->dev, &local);
+    if (xfer_all(sock, &local, sizeof(local), 1) ||
+        xfer_all(sock, &r->remote, sizeof(r->remote), 0) ||
+        ibdev_qp_to_rts(&r->dev, r->qp, local.psn, &r->remote, 1))
+        goto err;
+
+    r->depth = r->queued = r->part = r->bytes = r->notifies = 0;
+    return 0;
+
+err:
+    ibv_destroy_qp(r->qp);
+    r->qp = NULL;
+    return -1;
+}
+
+static inline void rail_disconnect(struct rail *r) {
+    ibv_destroy_qp(r->qp);
+    r->qp = NULL;
+}
+
+/*
+ * Reap the completions of all rails once. Sent WRs leave depth and
+ * queued; notifications from the peer are counted in bytes and their
+ * receives reposted. Returns the number of notifications, or -1 with
+ * errno set if a WR failed.
+ */
+static inline int rail_poll(struct rail *rails, int n) {
+    struct ibv_wc wc[16];
+    int notified = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct rail *r = &rails[i];
+        int got = ibv_poll_cq(r->cq, 16, wc);
+
+        if (got < 0) {
+            errno = EIO;
+            return -1;
+        }
+        for (int j = 0; j < got; j++) {
+            if (wc[j].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "rail %s:%u: %s\n", r->dev.name, r->dev.port,
+                        ibv_wc_status_str(wc[j].status));
+                errno = EIO;
+                return -1;
+            }
+            if (wc[j].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+                r->bytes += notify_imm(&wc[j]);
+                r->notifies++;
+                notified++;
+                if (notify_post_recvs(r->qp, 1))
+                    return -1;
+            } else {
+                r->depth--;
+                r->queued -= wc[j].wr_id;
+            }
+        }
+    }
+    return notified;
+}
+
+// Rail with the fewest bytes in flight that can take a chunk, or NULL
+static inline struct rail *rail_pick(struct rail *rails, int n) {
+    struct rail *best = NULL;
+
+    for (int i = 0; i < n; i++) {
+        struct rail *r = &rails[i];
+        if (r->depth + 1 < r->max_depth &&
+            (!best || r->queued < best->queued))
+            best = &rails[i];
+    }
+    return best;
+}
+
+static inline int rail_post(struct rail *r, size_t off, uint32_t len,
+                            enum ibv_wr_opcode opcode, uint32_t imm) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)r->mr->addr + off,
+        .length = len,
+        .lkey = r->mr->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = len;
+    wr.sg_list = len ? &sge : NULL;
+    wr.num_sge = len ? 1 : 0;
+    wr.opcode = opcode;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(imm);
+    wr.wr.rdma.remote_addr = r->remote.vaddr + off;
+    wr.wr.rdma.rkey = r->remote.rkey;
+
+    int ret = ibv_post_send(r->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    r->depth++;
+    r->queued += len;
+    return 0;
+}
+
+/*
+ * Write len bytes at off of the local buffer to the same offset of the
+ * peer's, striped over n rails in chunks of chunk bytes, then notify
+ * the peer on every rail that carried a part. Returns once all rails
+ * are done: 0, or -1 with errno set.
+ */
+static inline int rail_write(struct rail *rails, int n, size_t off, size_t len,
+                             size_t chunk) {
+    size_t pos = 0;
+    int busy;
+
+    if (len > NOTIFY_VAL_MASK) {
+        errno = EMSGSIZE;       // a rail's part must fit the immediate
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+        rails[i].part = 0;
+
+    while (pos < len) {
+        struct rail *r = rail_pick(rails, n);
+
+        if (!r) {
+            if (rail_poll(rails, n) < 0)
+                return -1;
+            continue;
+        }
+        size_t c = len - pos < chunk ? len - pos : chunk;
+        if (rail_post(r, off + pos, c, IBV_WR_RDMA_WRITE, 0))
+            return -1;
+        r->part += c;
+        r->bytes += c;
+        pos += c;
+    }
+
+    // The last WR slot of each rail was kept free for this
+    for (int i = 0; i < n; i++)
+        if (rails[i].part &&
+            rail_post(&rails[i], off, 0, IBV_WR_RDMA_WRITE_WITH_IMM,
+                      rails[i].part))
+            return -1;
+
+    do {
+        if (rail_poll(rails, n) < 0)
+            return -1;
+        busy = 0;
+        for (int i = 0; i < n; i++)
+            busy |= rails[i].depth != 0;
+    } while (busy);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,237 @@
+// rail_bench.c
+// Multi-rail RDMA_WRITE bandwidth: stripes large transfers over one QP per
+// HCA port (rail.h) and reports how the rate scales with the number of rails.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "rail.h"
+
+// Sent by the client first; the server answers with its own rail count
+struct rail_hello {
+    uint32_t rails;
+    uint32_t pad;
+    uint64_t size;              // transfer buffer on both sides
+};
+
+/*
+ * Connect the first n rails of both sides pairwise, rail i to rail i,
+ * and wait until the peer is ready to receive on all of them.
+ */
+static void connect_rails(struct rail *rails, int n, int sock, int access) {
+    char ready = 'R';
+
+    for (int i = 0; i < n; i++)
+        if (rail_connect(&rails[i], sock, access))
+            die("rail_connect");
+    xfer(sock, &ready, 1, 1);
+    xfer(sock, &ready, 1, 0);
+}
+
+static void print_rails(const struct rail *rails, int n) {
+    for (int i = 0; i < n; i++)
+        printf("  rail %d: %s port %u, MTU %d, NUMA node %d\n", i,
+               rails[i].dev.name, rails[i].dev.port,
+               ibdev_mtu_bytes(ibdev_path_mtu(&rails[i].dev, &rails[i].remote)),
+               rails[i].dev.dev_node);
+}
+
+/* --- server ---------------------------------------------------------- */
+
+static void serve(struct rail *rails, int nrails, int sock) {
+    struct rail_hello hello;
+
+    xfer(sock, &hello, sizeof(hello), 0);
+    uint32_t n = hello.rails < (uint32_t)nrails ? hello.rails : (uint32_t)nrails;
+    xfer(sock, &n, sizeof(n), 1);
+
+    void *buf;
+    if (posix_memalign(&buf, 4096, hello.size))
+        die("posix_memalign");
+    memset(buf, 0, hello.size);
+    if (rail_reg(rails, n, buf, hello.size,
+                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE))
+        die("ibv_reg_mr");
+    connect_rails(rails, n, sock, IBV_ACCESS_REMOTE_WRITE);
+    printf("Client connected on %u rails, %llu byte buffer\n", n,
+           (unsigned long long)hello.size);
+    print_rails(rails, n);
+
+    // The client closing its socket ends the session
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    for (;;) {
+        char c;
+        if (rail_poll(rails, n) < 0)
+            break;
+        ssize_t got = read(sock, &c, 1);
+        if (!got || (got < 0 && errno != EAGAIN && errno != EINTR))
+            break;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        printf("  rail %u: %llu bytes in %llu parts\n", i,
+               (unsigned long long)rails[i].bytes,
+               (unsigned long long)rails[i].notifies);
+        total += rails[i].bytes;
+        rail_disconnect(&rails[i]);
+        ibv_dereg_mr(rails[i].mr);
+        rails[i].mr = NULL;
+    }
+    printf("Client done: %llu bytes, %llu transfers of %llu bytes\n",
+           (unsigned long long)total, (unsigned long long)(total / hello.size),
+           (unsigned long long)hello.size);
+    free(buf);
+}
+
+/* --- client ---------------------------------------------------------- */
+
+/*
+ * iters transfers of size bytes over the first n rails. Returns the
+ * aggregate GB/s and prints each rail's share.
+ */
+static double run(struct rail *rails, int n, size_t size, size_t chunk,
+                  uint64_t iters) {
+    uint64_t before[RAIL_MAX];
+
+    for (int i = 0; i < n; i++)
+        before[i] = rails[i].bytes;
+
+    uint64_t start = now_ns();
+    for (uint64_t it = 0; it < iters; it++)
+        if (rail_write(rails, n, 0, size, chunk))
+            die("rail_write");
+    double sec = (now_ns() - start) / 1e9;
+    double gbps = (double)size * iters / sec / 1e9;
+
+    printf("%d rail%s: %.3f s, %.3f GB/s\n", n, n > 1 ? "s" : "", sec, gbps);
+    for (int i = 0; i < n; i++) {
+        uint64_t b = rails[i].bytes - before[i];
+        printf("  rail %d (%s): %.3f GB/s, %.1f%% of the bytes\n", i,
+               rails[i].dev.name, b / sec / 1e9, 100.0 * b / ((double)size * iters));
+    }
+    return gbps;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-D devs | -P pnetid] [-i port] [-M mtu]\n"
+            "       %s <server_ip> <port> [-D devs | -P pnetid] [-i port] [-M mtu]\n"
+            "          [-r rails] [-s size] [-c chunk] [-w depth] [-n iters] [-a]\n"
+            "  -L port    serve on port\n"
+            "  -D devs    comma separated HCAs to use as rails (default: all)\n"
+            "  -P pnetid  use the HCA ports with this PNET ID (s390)\n"
+            "  -i port    only this port of each HCA\n"
+            "  -M mtu     cap the path MTU (256 .. 4096)\n"
+            "  -r rails   use at most this many rails (default %d)\n"
+            "  -s size    bytes per transfer (default 67108864)\n"
+            "  -c chunk   bytes per RDMA_WRITE (default 1048576)\n"
+            "  -w depth   chunks in flight per rail (default 16)\n"
+            "  -n iters   transfers per run (default 100)\n"
+            "  -a         run with 1, 2, ... rails and print the scaling\n",
+            prog, prog, RAIL_MAX);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_NONE,
+    };
+    const char *listen_port = NULL, *devs = NULL;
+    uint32_t max_rails = RAIL_MAX, depth = 16;
+    uint64_t size = 64 << 20, chunk = 1 << 20, iters = 100;
+    int sweep = 0, opt;
+
+    while ((opt = getopt(argc, argv, "L:D:P:i:M:r:s:c:w:n:a")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'D': devs = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'M': dev_opts.mtu = atoi(optarg); break;
+        case 'r': max_rails = strtoul(optarg, NULL, 0); break;
+        case 's': size = strtoull(optarg, NULL, 0); break;
+        case 'c': chunk = strtoull(optarg, NULL, 0); break;
+        case 'w': depth = strtoul(optarg, NULL, 0); break;
+        case 'n': iters = strtoull(optarg, NULL, 0); break;
+        case 'a': sweep = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if ((dev_opts.mtu && !ibdev_mtu_enum(dev_opts.mtu)) || !max_rails ||
+        max_rails > RAIL_MAX || !size || size > NOTIFY_VAL_MASK || !chunk ||
+        chunk > (1u << 31) || !depth || !iters)
+        usage(argv[0]);
+
+    struct rail rails[RAIL_MAX];
+    int nrails = rail_open_all(rails, max_rails, &dev_opts, devs, depth);
+    if (nrails < 0)
+        die("rail_open_all");
+    printf("%d rail%s:", nrails, nrails > 1 ? "s" : "");
+    for (int i = 0; i < nrails; i++)
+        printf(" %s:%u", rails[i].dev.name, rails[i].dev.port);
+    printf("\n");
+
+    if (listen_port) {
+        if (optind != argc)
+            usage(argv[0]);
+        int lfd = tcp_listen(listen_port, 1);
+        printf("Serving multi-rail clients on port %s\n", listen_port);
+
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            serve(rails, nrails, sock);
+            close(sock);
+        }
+    }
+
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    int sock = tcp_connect(argv[optind], argv[optind + 1]);
+
+    struct rail_hello hello = { .rails = nrails, .size = size };
+    uint32_t n;
+    xfer(sock, &hello, sizeof(hello), 1);
+    xfer(sock, &n, sizeof(n), 0);
+
+    void *buf;
+    if (posix_memalign(&buf, 4096, size))
+        die("posix_memalign");
+    memset(buf, 'x', size);
+    if (rail_reg(rails, n, buf, size, IBV_ACCESS_LOCAL_WRITE))
+        die("ibv_reg_mr");
+    connect_rails(rails, n, sock, 0);
+    printf("Connected on %u rails: %llu byte transfers, %llu byte chunks, "
+           "%u in flight per rail\n", n, (unsigned long long)size,
+           (unsigned long long)chunk, depth);
+    print_rails(rails, n);
+
+    double base = 0;
+    for (uint32_t k = sweep ? 1 : n; k <= n; k++) {
+        double gbps = run(rails, k, size, chunk, iters);
+        if (k == 1)
+            base = gbps;
+        if (base && k > 1)
+            printf("  scaling: %.2fx of one rail (%.0f%% of linear)\n",
+                   gbps / base, 100 * gbps / base / k);
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+        rail_disconnect(&rails[i]);
+    close(sock);
+    rail_close_all(rails, nrails);
+    free(buf);
+    return 0;
+}
@@ -1,5 +1,13 @@
 // rdma_client.c
 // RoCE client: exchanges connection info with server and performs RDMA_WRITE
+// The server learns that a transfer is complete from an immediate (notify.h).
+// With -K it GETs from the server's key-value store with RDMA_READs (kv.h).
+// With -A it runs a counter or locks on the server's words with RDMA atomics.
+// -t/-m time every WR from post to completion; -S publishes the counts (wr_stats.h).
+// -f sends a file straight from its mmap'd pages into the server's (file_xfer.h).
+// -I ends each message with a CRC32C the server verifies (crc32c.h).
+// -x shm writes through shared memory to a local server instead (xport_shm.h).
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,7 +15,27 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <infiniband/verbs.h>
+#include "common.h"
+#include "hist.h"
+#include "pingpong.h"
+#include "wr_batch.h"
+#include "cq_engine.h"
+#include "notify.h"
+#include "kv.h"
+#include "ibdev.h"
+#include "atomics.h"
+#include "wr_stats.h"
+#include "file_xfer.h"
+#include "crc32c.h"
+#include "xport.h"
+#include "xport_shm.h"
 
 /*
  * QP State Machine and Node Connection Visualization
@@ -56,89 +84,317 @@
  */
 
 
-#define SIZE 4096
+#define SIZE BUFFER_SIZE
+#define MAX_RD_ATOMIC 16
 
-struct conn_info {
-    uint32_t qpn;
-    uint32_t psn;
-    uint32_t rkey;
-    uint64_t vaddr;
-    uint8_t gid[16]; // For RoCE addressing
+// -A modes
+enum { AM_NONE, AM_SEQ, AM_CAS, AM_SPIN, AM_TICKET };
+static const char *am_names[] = { "", "seq", "cas", "spin", "ticket" };
+
+/* Command line options for the benchmark modes */
+struct bench_opts {
+    int throughput;      // -t: pipelined RDMA_WRITE throughput mode
+    int latency;         // -l: RDMA_WRITE ping-pong latency mode
+    int messaging;       // -m: like -t, but with two-sided SENDs
+    int transfer;        // -e: write + notify round trip latency mode
+    int tcp_done;        // -d: notify over TCP instead of an immediate
+    uint32_t kv_keys;    // -K: key-value GET mode with this many keys
+    int atomics;         // -A: RDMA atomics mode, AM_*
+    const char *file;    // -f: send this file (server needs -F)
+    int file_tcp;        // -C: ... with read()/write() over TCP instead
+    int integrity;       // -I: end messages with a CRC32C trailer
+    int shm;             // -x shm: xport.h shared memory instead of verbs
+    uint32_t size;       // -s: message size in bytes
+    uint64_t iters;      // -n: number of RDMA_WRITEs to post
+    uint32_t window;     // -w: outstanding WRs (becomes max_send_wr)
+    uint32_t signal;     // -k: one signaled WR every k
+    uint32_t batch;      // -b: WRs per ibv_post_send (doorbell)
+    uint32_t sges;       // -g: fragments (SGEs) per message
+    uint64_t spin_ns;    // -p: busy-poll budget before sleeping on the CQ
+    uint32_t threads;    // -T: worker threads, one QP each, 0 = no workers
+    uint8_t rd_atomic;   // -R: RDMA_READs/atomics in flight per QP,
+                         // capped by the device
 };
 
-// Exit on error with perror
-static void die(const char *s) {
-    perror(s);
-    exit(1);
-}
+/*
+ * Pipelined RDMA_WRITE throughput mode
+ *
+ * Also used for SEND messaging (-m), where opcode is IBV_WR_SEND and
+ * the server takes the messages from its shared receive queue.
+ *
+ * Keeps up to o->window WRs in flight instead of waiting for each one.
+ * Only every o->signal-th WR is posted with IBV_SEND_SIGNALED; its wr_id
+ * carries the number of WRs it retires, since a signaled completion
+ * implies that all earlier unsignaled WRs on the same send queue are
+ * done too. Unsignaled WRs keep their send queue slot until such a
+ * completion is polled, so the window is refilled from retired counts.
+ *
+ * Each message is gathered from o->sges fragments of the buffer by the
+ * HCA, and the window is refilled o->batch WRs per ibv_post_send(), see
+ * wr_batch.h.
+ *
+ * With -I every message is sealed with its CRC32C (crc32c.h) just
+ * before its WR is added, as a sender with fresh data would have to.
+ * The content never changes here, so rewriting the trailer while the
+ * HCA may still be reading it for an earlier WR stores the same bytes.
+ *
+ * Every WR is stamped at its doorbell, and a signaled completion's
+ * timestamp (cq_engine.h) is the completion time of all the WRs it
+ * retires: their post-to-completion latencies go into st together with
+ * the WR counts (wr_stats.h).
+ *
+ * Returns the elapsed time in seconds. Nothing here is shared, so the
+ * -T workers each run it on their own connection and stats slot.
+ */
+static double run_throughput(struct ibv_qp *qp, struct cq_engine *cqe,
+                           struct ibv_mr *mr, const struct conn_info *remote,
+                           const struct bench_opts *o,
+                           enum ibv_wr_opcode opcode, struct wr_stats *st) {
+    const char *name = opcode == IBV_WR_SEND ? "SEND" : "RDMA_WRITE";
+    struct rdma_iov iov[WR_BATCH_MAX_SGE];
+    struct ibv_wc wc[CQE_BATCH];
+    uint64_t posted = 0, completed = 0;
+    uint32_t unsignaled = 0;
 
-// Get local GID for RoCE v2
-static void get_local_gid(struct ibv_context *ctx, int port, int index, union ibv_gid *gid) {
-    if (ibv_query_gid(ctx, port, index, gid))
-        die("ibv_query_gid");
-}
+    // Doorbell time of each WR in flight, by its window slot
+    uint64_t *post_ts = malloc(o->window * sizeof(*post_ts));
+    if (!post_ts)
+        die("malloc");
 
-// TCP connect to server
-int tcp_connect_to(const char *server_ip, const char *port) {
-    struct addrinfo hints = {0}, *res;
-    int sock = -1;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    struct wr_batch b;
+    wr_batch_init(&b, qp, o->sges);
 
-    if (getaddrinfo(server_ip, port, &hints, &res) != 0)
-	    die("getaddrinfo");
+    // Split the message into o->sges fragments, the last one takes the rest
+    uint32_t frag = o->size / o->sges;
+    for (uint32_t i = 0; i < o->sges; i++) {
+        iov[i].addr = (char *)mr->addr + i * frag;
+        iov[i].len = i + 1 < o->sges ? frag : o->size - i * frag;
+        iov[i].lkey = mr->lkey;
+    }
 
-    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sock < 0) die("socket client");
+    uint64_t start = now_ns();
+    while (completed < o->iters) {
+        /*
+         * Refill the window, but only in whole batches (or whatever is
+         * left at the end) so every doorbell carries o->batch WRs.
+         */
+        for (;;) {
+            uint64_t room = o->window - (posted - completed);
+            uint64_t left = o->iters - posted;
+            uint64_t n = left < o->batch ? left : o->batch;
 
-    if (connect(sock, res->ai_addr, res->ai_addrlen) < 0)
-	    die("connect client");
+            if (!n || room < n)
+                break;
+            uint64_t first = posted;
+            while (n--) {
+                unsigned int flags = 0;
+                uint64_t wr_id = 0;
 
-    freeaddrinfo(res);
-    return sock;
+                if (++unsignaled == o->signal || posted + 1 == o->iters) {
+                    flags = IBV_SEND_SIGNALED;
+                    wr_id = unsignaled;
+                    unsignaled = 0;
+                }
+                if (o->integrity)
+                    crc32c_seal(mr->addr, o->size);
+                if (wr_batch_add(&b, opcode, iov, o->sges, remote->vaddr,
+                                 remote->rkey, wr_id, flags) < 0)
+                    die("wr_batch_add");
+                posted++;
+            }
+            uint64_t t = tsc_ns();
+            for (uint64_t i = first; i < posted; i++)
+                post_ts[i % o->window] = t;
+            if (wr_batch_post(&b))
+                die("ibv_post_send");
+            wr_stats_inc(&st->posted, posted - first);
+        }
+
+        int ne = cq_engine_wait(cqe, wc, CQE_BATCH);
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                wr_stats_inc(&st->errors, 1);
+                fprintf(stderr, "%s failed: wc.status=%d (%s)\n", name,
+                        wc[i].status, ibv_wc_status_str(wc[i].status));
+                exit(1);
+            }
+            for (uint64_t j = completed; j < completed + wc[i].wr_id; j++) {
+                uint64_t t = post_ts[j % o->window];
+                wr_stats_lat(st, cqe->ts[i] > t ? cqe->ts[i] - t : 0);
+            }
+            completed += wc[i].wr_id;
+            wr_stats_inc(&st->completed, wc[i].wr_id);
+        }
+    }
+    free(post_ts);
+    return (now_ns() - start) / 1e9;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
-        return 1;
+/*
+ * How fast the CRC32C kernel runs on this core over messages of o->size
+ * bytes, next to the portable tables, and what share of one core the
+ * sender's CRCs take at rate bytes/s. The receiver pays the same again.
+ */
+static void print_crc32c(const struct bench_opts *o, double rate) {
+    uint32_t (*fn[2])(uint32_t, const void *, size_t) = { crc32c, crc32c_sw };
+    double gbs[2];
+    char *buf = malloc(o->size);
+    volatile uint32_t sink = 0;
+
+    if (!buf)
+        die("malloc");
+    for (uint32_t i = 0; i < o->size; i++)
+        buf[i] = i * 131;
+    crc32c_init();
+    for (int k = 0; k < 2; k++) {
+        uint64_t n = 0, start = now_ns(), t;
+        do {
+            for (int i = 0; i < 64; i++)
+                sink += fn[k](0, buf, o->size);
+            n += 64;
+            t = now_ns() - start;
+        } while (t < 100000000);
+        gbs[k] = (double)o->size * n / t;
     }
+    (void)sink;
+    free(buf);
+    printf("Integrity: CRC32C trailer, %s: %.2f GB/s per core (slicing-by-8 %.2f GB/s),\n"
+           "  %.1f%% of a core at this rate\n",
+           crc32c_impl(), gbs[0], gbs[1], rate / 1e9 / gbs[0] * 100);
+}
 
-    const char *server_ip = argv[1];
-    const char *port_str = argv[2];
+static void print_throughput(const char *name, const struct bench_opts *o,
+                             double sec, const struct cq_engine *cqe,
+                             const struct wr_stats *st) {
+    printf("%s throughput: %u bytes x %llu msgs, window %u, signal every %u, "
+           "%u WRs per doorbell, %u SGEs per WR\n",
+           name, o->size, (unsigned long long)o->iters, o->window, o->signal,
+           o->batch, o->sges);
+    printf("  %.3f s, %.3f GB/s, %.3f Mmsg/s\n", sec,
+           (double)o->size * o->iters / sec / 1e9, o->iters / sec / 1e6);
+    printf("  CQ: %llu polls, %llu completions, %llu sleeps\n",
+           (unsigned long long)cqe->polls, (unsigned long long)cqe->completions,
+           (unsigned long long)cqe->sleeps);
+    printf("  WRs: %llu posted, %llu completed, %llu failed\n",
+           (unsigned long long)st->posted, (unsigned long long)st->completed,
+           (unsigned long long)st->errors);
+    printf("Timestamps: %s\n", cq_engine_ts_source(cqe));
+    hist_print_us("post-to-completion latency", &st->lat);
+    if (o->integrity)
+        print_crc32c(o, (double)o->size * o->iters / sec);
+}
 
-    /* ---------------------------------------------------------
-     * 1. Get the list of InfiniBand devices in the system
-     *    - Use ibv_get_device_list() to enumerate available HCAs
-     *      (Host Channel Adapters)
-     *    - Typically, select the first device or based on some
-     *      criteria like device name or port count
-     * --------------------------------------------------------- */
-    struct ibv_device **dev_list = ibv_get_device_list(NULL);
-    if (!dev_list)
-	    die("ibv_get_device_list");
+/*
+ * RDMA_WRITE ping-pong latency mode
+ *
+ * The client writes a message into the server's receive area and
+ * busy-polls its own receive area until the server writes the same
+ * marker back (see pingpong.h). One round trip is recorded per
+ * iteration; the histogram is static, so nothing is allocated inside
+ * the timed loop.
+ */
+static void run_latency(struct ibv_qp *qp, struct ibv_cq *cq,
+                        struct ibv_mr *mr, char *buf, uint32_t buf_len,
+                        const struct conn_info *remote,
+                        const struct bench_opts *o,
+                        const struct ibv_qp_cap *cap) {
+    static struct hist h;
+    struct pingpong pp;
 
+    pp_init(&pp, qp, cq, mr, buf, buf_len, o->size, remote,
+            cap->max_send_wr, cap->max_inline_data);
+    hist_init(&h);
 
-    struct ibv_context *ctx = ibv_open_device(dev_list[0]);
-    if (!ctx)
-	    die("ibv_open_device");
-    /* ---------------------------------------------------------
-     * 2. Allocate a Protection Domain (PD)
-     *    - A PD is like a container that groups together
-     *      memory regions, queue pairs, and other RDMA resources.
-     * --------------------------------------------------------- */
+    for (uint64_t i = 0; i < o->iters; i++) {
+        uint8_t m = pp_marker(i);
+        uint64_t t0 = now_ns();
 
-    struct ibv_pd *pd = ibv_alloc_pd(ctx);
-    if (!pd)
-	    die("ibv_alloc_pd");
+        pp_send(&pp, m);
+        pp_wait(&pp, m);
+        hist_add(&h, now_ns() - t0);
+    }
+    // The last signaled write must not be mistaken for a later WR's
+    pp_reap(&pp);
 
-    // Allocate a buffer for sending data
-    char *buf = malloc(SIZE);
-    if (!buf)
+    printf("Latency: %u bytes x %llu round trips, %s\n", o->size,
+           (unsigned long long)o->iters,
+           pp.wr.send_flags & IBV_SEND_INLINE ? "inline" : "not inline");
+    hist_print_us("RDMA_WRITE ping-pong RTT", &h);
+}
+
+/*
+ * One RC connection to the server: the registered buffer messages are
+ * sent from, a CQ, and a QP connected to one of the server's QPs over
+ * the TCP side channel.
+ */
+struct conn {
+    char *buf;
+    size_t buf_len;             // advertised length, the MR may be twice that
+    struct ibv_mr *mr;
+    struct cq_engine cqe;
+    struct ibv_qp *qp;
+    struct ibv_qp_cap cap;      // as granted by ibv_create_qp()
+    struct conn_info local;
+    struct conn_info remote;
+    enum ibv_mtu mtu;           // path MTU, the smaller of both ports'
+    uint8_t rd_atomic;          // max_rd_atomic, the smaller of both ends'
+    int sock;
+};
+
+// Print exchanged info
+static void print_conn_info(const struct conn *c) {
+    printf("Exchanged connection info:\n");
+
+    // Local info
+    printf("Local QPN: %u\n", c->local.qpn);
+    printf("Local PSN: %u\n", c->local.psn);
+    printf("Local rkey: 0x%x\n", c->local.rkey);
+    printf("Local lkey: 0x%x\n", c->mr->lkey);
+    printf("Local vaddr: 0x%lx\n", (unsigned long)c->local.vaddr);
+    printf("Local GID: ");
+    for (int i = 0; i < 16; i++) printf("%02x", c->local.gid[i]);
+    printf("\n\n");
+
+    // Remote info
+    printf("Remote QPN: %u\n", c->remote.qpn);
+    printf("Remote PSN: %u\n", c->remote.psn);
+    printf("Remote rkey: 0x%x\n", c->remote.rkey);
+    printf("Remote vaddr: 0x%lx\n", (unsigned long)c->remote.vaddr);
+    printf("Remote len: %u\n", c->remote.len);
+    printf("Remote GID: ");
+    for (int i = 0; i < 16; i++) printf("%02x", c->remote.gid[i]);
+    printf("\n");
+    printf("Path MTU: %d\n", ibdev_mtu_bytes(c->mtu));
+}
+
+/*
+ * Steps 3 to 5: register a buffer, create the CQ and the QP, exchange
+ * connection info with the server and move the QP to RTS. The device
+ * context and PD are shared, everything else belongs to this connection.
+ */
+static void conn_open(struct conn *c, const struct ibdev *dev,
+                      struct ibv_pd *pd, const char *server_ip,
+                      const char *port, const struct bench_opts *o,
+                      int verbose) {
+    memset(c, 0, sizeof(*c));
+
+    /*
+     * Allocate a buffer for sending data. In latency mode the server
+     * writes back into it, so it gets a second half as receive area
+     * (see pingpong.h).
+     */
+    c->buf_len = o->size > SIZE ? o->size : SIZE;
+    size_t mr_len = o->latency ? 2 * c->buf_len : c->buf_len;
+    if (o->kv_keys)
+        mr_len = o->window * kv_slot_size(o->size);    // see run_kv()
+    if (o->atomics && mr_len < o->window * sizeof(uint64_t))
+        mr_len = o->window * sizeof(uint64_t);         // result slots
+    c->buf = malloc(mr_len);
+    if (!c->buf)
 	    die("malloc");
 
-    memset(buf, 0, SIZE);
-    strcpy(buf, "Sid: Client writes this via IB_WR_RDMA_WRITE");
+    memset(c->buf, 0, mr_len);
+    strcpy(c->buf, "Sid: Client writes this via IB_WR_RDMA_WRITE");
 
     /* ---------------------------------------------------------
      * 3. Register a Memory Region (MR)
@@ -147,18 +403,22 @@ int main(int argc, char **argv) {
      *    - Access flags define what remote peers are allowed to
      *      do with this memory (e.g., local write, remote read/write).
      * --------------------------------------------------------- */
-    struct ibv_mr *mr = ibv_reg_mr(pd, buf, SIZE, IBV_ACCESS_LOCAL_WRITE);
-    if (!mr)
+    int mr_access = IBV_ACCESS_LOCAL_WRITE;
+    if (o->latency || o->transfer || o->kv_keys)
+	    mr_access |= IBV_ACCESS_REMOTE_WRITE;
+    c->mr = ibv_reg_mr(pd, c->buf, mr_len, mr_access);
+    if (!c->mr)
 	    die("ibv_reg_mr");
 
     /* ---------------------------------------------------------
      * 4. Create a Completion Queue (CQ)
      *    - Used by the NIC to notify when Work Requests (WRs) finish
-     *    - Capacity here = 10 entries
+     *    - Capacity = send window, enough for every signaled WR
+     *    - Attached to a completion channel, so waiting for a
+     *      completion can sleep instead of spinning (-p)
      * --------------------------------------------------------- */
-    struct ibv_cq *cq = ibv_create_cq(ctx, 10, NULL, NULL, 0);
-    if (!cq)
-	    die("ibv_create_cq");
+    cq_engine_create(&c->cqe, dev->ctx, o->window, o->spin_ns);
+    struct ibv_cq *cq = c->cqe.cq;
 
     /* ---------------------------------------------------------
      * 5. Create a Queue Pair (QP)
@@ -177,27 +437,38 @@ int main(int argc, char **argv) {
      * qp_init_attr.qp_type   = IBV_QPT_RC
      *   - QP type: Reliable Connection (RC), similar to TCP semantics
      *
-     * qp_init_attr.cap.max_send_wr = 10
+     * qp_init_attr.cap.max_send_wr = o->window
      *   - Maximum number of outstanding send Work Requests (WRs)
+     *   - Also the number of RDMA_WRITEs kept in flight in -t mode
      *
      * qp_init_attr.cap.max_recv_wr = 10
      *   - Maximum number of outstanding receive Work Requests (WRs)
+     *   - Only -e and -K post any, for the server's acknowledgements
      *
-     * qp_init_attr.cap.max_send_sge = 1
+     * qp_init_attr.cap.max_send_sge = o->sges
      * qp_init_attr.cap.max_recv_sge = 1
      *   - Maximum scatter/gather entries per WR for send and receive
+     *   - With -g a message is gathered from several fragments, so
+     *     the send side needs one SGE per fragment
+     *
+     * qp_init_attr.cap.max_inline_data
+     *   - Largest payload that can be copied into the WQE itself
+     *     (IBV_SEND_INLINE); only requested for small latency messages
      */
     qp_init_attr.send_cq = cq;		// Associate with our CQ
     qp_init_attr.recv_cq = cq;
     qp_init_attr.qp_type = IBV_QPT_RC;	// Reliable Connection (like TCP)
-    qp_init_attr.cap.max_send_wr = 10;	// Max outstanding send WRs
+    qp_init_attr.cap.max_send_wr = o->window; // Max outstanding send WRs
     qp_init_attr.cap.max_recv_wr = 10;	// Max outstanding recv WRs
-    qp_init_attr.cap.max_send_sge = 1;	// Max scatter/gather entries per WR
+    qp_init_attr.cap.max_send_sge = o->sges; // Max scatter/gather entries per WR
     qp_init_attr.cap.max_recv_sge = 1;
+    if (o->latency && o->size <= PP_MAX_INLINE)
+        qp_init_attr.cap.max_inline_data = o->size;
 
-    struct ibv_qp *qp = ibv_create_qp(pd, &qp_init_attr);
-    if (!qp)
+    c->qp = ibv_create_qp(pd, &qp_init_attr);
+    if (!c->qp)
 	    die("ibv_create_qp");
+    c->cap = qp_init_attr.cap;
 
     // Move QP to INIT
     struct ibv_qp_attr attr = {0};
@@ -211,25 +482,34 @@ int main(int argc, char **argv) {
      *   - Index into the HCA port's PKey table
      *   - Determines the partition the QP belongs to
      *
-     * attr.port_num       = 1
-     *   - Local HCA port used for communication
+     * attr.port_num       = dev->port
+     *   - Local HCA port used for communication, the first active
+     *     one unless -i picks another (ibdev.h)
      *
      * attr.qp_access_flags = 0
      *   - Access permissions for this QP
      *   - Here, 0 means the client does not expose its
-     *     memory region for remote RDMA operations
+     *     memory region for remote RDMA operations, except in
+     *     latency mode where the server writes the reply into it,
+     *     and in -e/-K mode where it answers with WRITE_WITH_IMM
      */
     attr.qp_state = IBV_QPS_INIT;
     attr.pkey_index = 0;
-    attr.port_num = 1;
-    attr.qp_access_flags = 0; // client does not expose MR for remote ops
-    if (ibv_modify_qp(qp, &attr,
+    attr.port_num = dev->port;
+    attr.qp_access_flags = o->latency || o->transfer || o->kv_keys ?
+                           IBV_ACCESS_REMOTE_WRITE : 0;
+    if (ibv_modify_qp(c->qp, &attr,
                       IBV_QP_STATE |
                       IBV_QP_PKEY_INDEX |
                       IBV_QP_PORT |
                       IBV_QP_ACCESS_FLAGS))
 	    die("ibv_modify_qp to INIT");
 
+    // Receives for the server's acknowledgements, before it can send any
+    if (((o->transfer && !o->tcp_done) || o->kv_keys) &&
+        notify_post_recvs(c->qp, NOTIFY_RECVS))
+	    die("ibv_post_recv");
+
     /*
      * At this point:
      * - You must exchange QP information with the remote peer:
@@ -241,46 +521,36 @@ int main(int argc, char **argv) {
      */
 
     // Prepare local connection info
-    struct conn_info local = {0};
-    local.qpn = qp->qp_num;
-    local.psn = (uint32_t)(rand() & 0xffffff);
-    local.rkey = mr->rkey; // local MR rkey (for demonstration)
-    local.vaddr = (uintptr_t)buf;
+    c->local.qpn = c->qp->qp_num;
+    c->local.psn = (uint32_t)(rand() & 0xffffff);
+    c->local.rkey = c->mr->rkey; // local MR rkey (for demonstration)
+    c->local.vaddr = (uintptr_t)c->buf;
+    c->local.len = c->buf_len;
+    c->local.rd_atomic = o->rd_atomic;
 
-    // Local GID
-    union ibv_gid gid;
-    get_local_gid(ctx, 1, 0, &gid);
-    memcpy(local.gid, gid.raw, 16);
+    // Local GID, LID and MTU of the port
+    ibdev_fill_info(dev, &c->local);
 
     // TCP connect and exchange conn_info
-    int sock = tcp_connect_to(server_ip, port_str);
-    struct conn_info remote;
-    if (read(sock, &remote, sizeof(remote)) != sizeof(remote))
-	    die("read remote info");
-    if (write(sock, &local, sizeof(local)) != sizeof(local))
-	    die("write local info");
+    c->sock = tcp_connect(server_ip, port);
+    xfer(c->sock, &c->remote, sizeof(c->remote), 0);
+    xfer(c->sock, &c->local, sizeof(c->local), 1);
 
-    // Print exchanged info
-    printf("Exchanged connection info:\n");
-
-    // Local info
-    printf("Local QPN: %u\n", local.qpn);
-    printf("Local PSN: %u\n", local.psn);
-    printf("Local rkey: 0x%x\n", local.rkey);
-    printf("Local lkey: 0x%x\n", mr->lkey);
-    printf("Local vaddr: 0x%lx\n", (unsigned long)local.vaddr);
-    printf("Local GID: ");
-    for (int i = 0; i < 16; i++) printf("%02x", local.gid[i]);
-    printf("\n\n");
+    c->mtu = ibdev_path_mtu(dev, &c->remote);
+    c->rd_atomic = conn_rd_atomic(o->rd_atomic, &c->remote);
+    if (verbose)
+        print_conn_info(c);
 
-    // Remote info
-    printf("Remote QPN: %u\n", remote.qpn);
-    printf("Remote PSN: %u\n", remote.psn);
-    printf("Remote rkey: 0x%x\n", remote.rkey);
-    printf("Remote vaddr: 0x%lx\n", (unsigned long)remote.vaddr);
-    printf("Remote GID: ");
-    for (int i = 0; i < 16; i++) printf("%02x", remote.gid[i]);
-    printf("\n");
+    uint32_t msg_size = o->kv_keys || o->file ? SIZE : o->size;
+    if (o->atomics && c->remote.len != AT_SIZE) {
+        fprintf(stderr, "The server exposes no atomic words (start it with -A)\n");
+        exit(1);
+    }
+    if (!o->atomics && msg_size > c->remote.len) {
+        fprintf(stderr, "Message size %u exceeds server buffer %u (start the server with -s)\n",
+                msg_size, c->remote.len);
+        exit(1);
+    }
 
     /*
      * attr.max_dest_rd_atomic = 1;
@@ -338,33 +608,37 @@ int main(int argc, char **argv) {
      * remote’s 128-bit IPv6-like address (in RoCE this 
      * encodes IP/MAC-based identity).
      * 
-     * attr.ah_attr.grh.sgid_index = 0;
+     * attr.ah_attr.grh.sgid_index = dev->gid_index;
      *
      * Meaning: Selects which local GID (from the port’s GID table) to use as the source GID.
      * Each port may expose multiple GIDs (e.g. one per VLAN, per RoCE v1/v2, or per IP subnet).
-     * Here 0 means: use the first GID entry of that port.
+     * Index 0 is often RoCE v1 or a link-local address, so ibdev.h looks for a RoCE v2
+     * entry with an IPv4 address (-G overrides it).
      *
-     * attr.ah_attr.grh.hop_limit = 1;
+     * attr.ah_attr.grh.hop_limit = 64;
      *
      * Meaning: Sets the IPv6 hop limit in the GRH (similar to TTL in IP).
-     * 1 means the packet is only valid for direct neighbor (no routing).
-     * For multi-hop routed networks, you’d set this higher (like 64).
+     * 1 would mean the packet is only valid for direct neighbor (no routing);
+     * RoCE v2 packets may cross IP routers, so use the usual 64.
+     *
+     * attr.path_mtu = c->mtu;
+     *
+     * Meaning: Largest packet payload on the path. Both sides advertise their
+     * port's active MTU (up to 4096) in conn_info and use the smaller one;
+     * -M caps it. Every RDMA message is cut into packets of this size, so a
+     * small MTU costs headers and packet rate on large transfers.
      */
     // Move QP to RTR
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_1024;
-    attr.dest_qp_num = remote.qpn;
-    attr.rq_psn = remote.psn;
+    attr.path_mtu = c->mtu;
+    attr.dest_qp_num = c->remote.qpn;
+    attr.rq_psn = c->remote.psn;
     attr.max_dest_rd_atomic = 1;
     attr.min_rnr_timer = 12;
-    attr.ah_attr.is_global = 1;
-    attr.ah_attr.port_num = 1;
-    memcpy(&attr.ah_attr.grh.dgid, remote.gid, 16);
-    attr.ah_attr.grh.sgid_index = 0;
-    attr.ah_attr.grh.hop_limit = 1;
+    ibdev_fill_ah(dev, &c->remote, &attr.ah_attr);
 
-    if (ibv_modify_qp(qp, &attr,
+    if (ibv_modify_qp(c->qp, &attr,
                       IBV_QP_STATE |
                       IBV_QP_AV |
                       IBV_QP_PATH_MTU |
@@ -392,16 +666,20 @@ int main(int argc, char **argv) {
      * attr.sq_psn       = local.psn
      *   - Starting Packet Sequence Number for this QP's Send Queue
      *
-     * attr.max_rd_atomic = 1
+     * attr.max_rd_atomic = c->rd_atomic
      *   - Maximum number of outstanding RDMA read/atomic operations
      *     that the local QP can issue to the remote peer
+     *   - As many as the device allows (up to 16): with 1, the -K
+     *     GETs would wait for each other's READ responses
+     *   - But no more than the server's max_dest_rd_atomic, which it
+     *     sends in conn_info
      */
     attr.timeout = 14;
     attr.retry_cnt = 7;
     attr.rnr_retry = 7;
-    attr.sq_psn = local.psn;
-    attr.max_rd_atomic = 1;
-    if (ibv_modify_qp(qp, &attr,
+    attr.sq_psn = c->local.psn;
+    attr.max_rd_atomic = c->rd_atomic;
+    if (ibv_modify_qp(c->qp, &attr,
                       IBV_QP_STATE |
                       IBV_QP_TIMEOUT |
                       IBV_QP_RETRY_CNT |
@@ -409,6 +687,1177 @@ int main(int argc, char **argv) {
                       IBV_QP_SQ_PSN |
                       IBV_QP_MAX_QP_RD_ATOMIC))
 	    die("ibv_modify_qp to RTS");
+}
+
+/*
+ * Tell the server that the transfer is complete: a zero-length
+ * RDMA_WRITE_WITH_IMM carrying val (see notify.h), or "DONE" on the TCP
+ * socket with -d. Every earlier WR must have been reaped from the CQ.
+ */
+static void conn_notify(struct conn *c, const struct bench_opts *o,
+                        uint32_t val) {
+    struct ibv_wc wc;
+
+    if (o->tcp_done) {
+        const char *done = "DONE";
+        if (write(c->sock, done, strlen(done)+1) < 0)
+            die("notify server");
+        return;
+    }
+    if (notify_post(c->qp, NULL, 0, 0, c->remote.vaddr, c->remote.rkey,
+                    val & NOTIFY_VAL_MASK, 0, IBV_SEND_SIGNALED))
+        die("ibv_post_send notification");
+    cq_engine_wait(&c->cqe, &wc, 1);
+    if (wc.status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "Notification failed: wc.status=%d (%s)\n",
+                wc.status, ibv_wc_status_str(wc.status));
+        exit(1);
+    }
+}
+
+/*
+ * Transfer latency mode (-e)
+ *
+ * Each iteration is one transfer as the server experiences it: write
+ * o->size bytes, tell the server, and wait until it has acknowledged
+ * the notification. With immediates that is a single
+ * RDMA_WRITE_WITH_IMM and the server's zero-length reply. With -d it is
+ * an RDMA_WRITE, its local completion (only then is the data known to
+ * be in place), then "SYNC" and "ACK" over TCP. Running both shows what
+ * the side channel costs per transfer. With -I the CRC32C is computed
+ * inside the timed loop, and the server checks it before its answer.
+ */
+static void run_transfer(struct conn *c, const struct bench_opts *o) {
+    static struct hist h;
+    struct ibv_wc wc[CQE_BATCH];
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)c->buf,
+        .length = o->size,
+        .lkey = c->mr->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = c->remote.vaddr;
+    wr.wr.rdma.rkey = c->remote.rkey;
+    hist_init(&h);
+
+    for (uint64_t i = 0; i < o->iters; i++) {
+        uint32_t imm = NOTIFY_ACK | (i & NOTIFY_VAL_MASK);
+        int sent = 0, acked = o->tcp_done;
+        uint64_t t0 = now_ns();
+
+        if (o->integrity)
+            crc32c_seal(c->buf, o->size);
+        if (o->tcp_done ? ibv_post_send(c->qp, &wr, &bad_wr) :
+            notify_post(c->qp, c->buf, o->size, c->mr->lkey, c->remote.vaddr,
+                        c->remote.rkey, imm, 0, IBV_SEND_SIGNALED))
+            die("ibv_post_send");
+
+        while (!sent || !acked) {
+            int ne = cq_engine_wait(&c->cqe, wc, CQE_BATCH);
+            for (int j = 0; j < ne; j++) {
+                if (wc[j].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "Transfer failed: wc.status=%d (%s)\n",
+                            wc[j].status, ibv_wc_status_str(wc[j].status));
+                    exit(1);
+                }
+                if (wc[j].opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                    sent = 1;
+                    continue;
+                }
+                if (notify_imm(&wc[j]) != imm) {
+                    fprintf(stderr, "Unexpected acknowledgement 0x%x\n",
+                            notify_imm(&wc[j]));
+                    exit(1);
+                }
+                if (notify_post_recvs(c->qp, 1))
+                    die("ibv_post_recv");
+                acked = 1;
+            }
+        }
+        if (o->tcp_done) {
+            char ack[4];
+            if (write(c->sock, "SYNC", 5) != 5)
+                die("write SYNC");
+            if (read(c->sock, ack, sizeof(ack)) != sizeof(ack))
+                die("read ACK");
+        }
+        hist_add(&h, now_ns() - t0);
+    }
+
+    printf("Transfer latency: %u bytes x %llu transfers, notified %s%s\n",
+           o->size, (unsigned long long)o->iters,
+           o->tcp_done ? "over TCP" : "by immediate",
+           o->integrity ? ", CRC32C trailer" : "");
+    hist_print_us("write + notify + ack", &h);
+}
+
+/*
+ * Key-value mode (-K keys)
+ *
+ * Loads keys "key0" ... with o->size byte values through the server's
+ * two-sided PUT path, one at a time, then times o->iters GETs of random
+ * keys with o->window of them in flight. A GET is only RDMA_READs (see
+ * kv.h): the key's buckets, then its log record, starting over if
+ * either fails validation. Each GET has its own kv_slot_size() slice of
+ * the buffer, and its slot number is the READ's wr_id.
+ */
+struct kv_get {
+    uint64_t key;
+    uint64_t t0;
+    int stage;                  // 0: reading buckets, 1: reading the record
+    int bucket;
+    char *buf;
+};
+
+static void kv_key(char *key, uint64_t k) {
+    memset(key, 0, KV_KEY_LEN);
+    snprintf(key, KV_KEY_LEN, "key%llu", (unsigned long long)k);
+}
+
+// xorshift64, cheap enough to pick a key per GET
+static uint64_t kv_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+// Every value is filled with one byte derived from its key
+static char kv_fill(uint64_t k) {
+    return 'a' + k % 26;
+}
+
+static void kv_read(struct conn *c, void *laddr, uint32_t len,
+                    uint64_t offset, uint64_t wr_id) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)laddr,
+        .length = len,
+        .lkey = c->mr->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = c->remote.vaddr + offset;
+    wr.wr.rdma.rkey = c->remote.rkey;
+    if (ibv_post_send(c->qp, &wr, &bad_wr))
+        die("ibv_post_send RDMA_READ");
+}
+
+static void kv_wait_one(struct conn *c, struct ibv_wc *wc) {
+    cq_engine_wait(&c->cqe, wc, 1);
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "Key-value WR failed: wc.status=%d (%s)\n",
+                wc->status, ibv_wc_status_str(wc->status));
+        exit(1);
+    }
+}
+
+static void kv_get_start(struct conn *c, const struct kv_header *hdr,
+                         struct kv_get *g, uint64_t slot) {
+    char key[KV_KEY_LEN];
+
+    kv_key(key, g->key);
+    g->stage = 0;
+    kv_read(c, g->buf, KV_PROBE * sizeof(struct kv_bucket),
+            hdr->buckets_off + kv_home(hdr, key) * sizeof(struct kv_bucket),
+            slot);
+}
+
+static void run_kv(struct conn *c, const struct bench_opts *o) {
+    static struct hist h;
+    struct kv_header hdr;
+    struct ibv_wc wc[CQE_BATCH];
+    size_t slot_size = kv_slot_size(o->size);
+    uint64_t rejected = 0, retries = 0, misses = 0, rng = 88172645463325252ull;
+
+    // The store describes itself in its first bytes
+    kv_read(c, c->buf, sizeof(hdr), 0, 0);
+    kv_wait_one(c, wc);
+    memcpy(&hdr, c->buf, sizeof(hdr));
+    if (hdr.magic != KV_MAGIC) {
+        fprintf(stderr, "Server is not serving a key-value store (start it with -K)\n");
+        exit(1);
+    }
+    if (o->size > hdr.max_val) {
+        fprintf(stderr, "Value size %u exceeds the server's %u (start the server with -s)\n",
+                o->size, hdr.max_val);
+        exit(1);
+    }
+
+    // Load: one PUT at a time, each answered by an immediate
+    struct kv_put_msg *put = (struct kv_put_msg *)c->buf;
+    uint64_t start = now_ns();
+    for (uint64_t k = 0; k < o->kv_keys; k++) {
+        struct ibv_sge sge = {
+            .addr = (uintptr_t)put,
+            .length = sizeof(*put) + o->size,
+            .lkey = c->mr->lkey,
+        };
+        struct ibv_send_wr wr = {0}, *bad_wr;
+        int sent = 0, answered = 0;
+
+        kv_key(put->key, k);
+        put->val_len = o->size;
+        memset(put->val, kv_fill(k), o->size);
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        if (ibv_post_send(c->qp, &wr, &bad_wr))
+            die("ibv_post_send PUT");
+
+        while (!sent || !answered) {
+            kv_wait_one(c, wc);
+            if (wc->opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+                sent = 1;
+                continue;
+            }
+            if (notify_post_recvs(c->qp, 1))
+                die("ibv_post_recv");
+            answered = 1;
+            if (notify_imm(wc) == KV_FULL) {
+                rejected++;
+            } else if (notify_imm(wc) != KV_OK) {
+                fprintf(stderr, "PUT failed: status %u\n", notify_imm(wc));
+                exit(1);
+            }
+        }
+    }
+    double sec = (now_ns() - start) / 1e9;
+    printf("Loaded %u keys of %u bytes in %.3f s (%.0f PUTs/s), %llu rejected by full buckets\n",
+           o->kv_keys, o->size, sec, o->kv_keys / sec, (unsigned long long)rejected);
+
+    // GETs: o->window in flight, each a two-step state machine
+    struct kv_get *g = calloc(o->window, sizeof(*g));
+    if (!g)
+        die("calloc");
+    uint64_t started = 0, done = 0;
+    hist_init(&h);
+
+    start = now_ns();
+    for (uint32_t i = 0; i < o->window && started < o->iters; i++, started++) {
+        g[i].buf = c->buf + i * slot_size;
+        g[i].key = kv_rand(&rng) % o->kv_keys;
+        g[i].t0 = now_ns();
+        kv_get_start(c, &hdr, &g[i], i);
+    }
+
+    while (done < o->iters) {
+        int ne = cq_engine_wait(&c->cqe, wc, CQE_BATCH);
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "RDMA_READ failed: wc.status=%d (%s)\n",
+                        wc[i].status, ibv_wc_status_str(wc[i].status));
+                exit(1);
+            }
+            struct kv_get *q = &g[wc[i].wr_id];
+            struct kv_bucket *b = (struct kv_bucket *)q->buf;
+            char key[KV_KEY_LEN];
+
+            if (q->stage == 0) {
+                kv_key(key, q->key);
+                q->bucket = kv_find(b, key);
+                if (q->bucket == KV_RETRY) {
+                    retries++;
+                    kv_get_start(c, &hdr, q, wc[i].wr_id);
+                    continue;
+                }
+                if (q->bucket >= 0) {
+                    if (b[q->bucket].val_len > o->size) {
+                        fprintf(stderr, "Value of %s is larger than -s\n", key);
+                        exit(1);
+                    }
+                    q->stage = 1;
+                    kv_read(c, b + KV_PROBE,
+                            sizeof(struct kv_record) + b[q->bucket].val_len,
+                            hdr.log_off + b[q->bucket].rec_off, wc[i].wr_id);
+                    continue;
+                }
+                misses++;
+            } else {
+                struct kv_record *r = (struct kv_record *)(b + KV_PROBE);
+                if (!kv_record_ok(r, &b[q->bucket]) ||
+                    (r->val_len && r->val[0] != kv_fill(q->key))) {
+                    retries++;
+                    kv_get_start(c, &hdr, q, wc[i].wr_id);
+                    continue;
+                }
+            }
+
+            // This GET is complete; the slot starts the next one
+            hist_add(&h, now_ns() - q->t0);
+            done++;
+            if (started < o->iters) {
+                started++;
+                q->key = kv_rand(&rng) % o->kv_keys;
+                q->t0 = now_ns();
+                kv_get_start(c, &hdr, q, wc[i].wr_id);
+            }
+        }
+    }
+    sec = (now_ns() - start) / 1e9;
+
+    printf("Key-value GETs: %llu GETs of %u keys, %u in flight, max_rd_atomic %u\n",
+           (unsigned long long)o->iters, o->kv_keys, o->window, c->rd_atomic);
+    printf("  %.3f s, %.3f MGET/s, %llu retries, %llu misses\n", sec,
+           o->iters / sec / 1e6, (unsigned long long)retries,
+           (unsigned long long)misses);
+    hist_print_us("GET latency (2 RDMA_READs)", &h);
+    free(g);
+}
+
+/*
+ * RDMA atomics mode (-A, see atomics.h)
+ *
+ *   seq     FAA 1 on the counter with -w in flight: rate and latency of
+ *           the distributed sequence counter. At most max_rd_atomic
+ *           (-R) of them are outstanding on the wire, the rest wait in
+ *           the send queue
+ *   cas     increment the counter with CAS, retrying with the value a
+ *           failed CAS returned
+ *   spin    critical sections under the spin lock
+ *   ticket  critical sections under the ticket lock
+ *
+ * A critical section READs the guarded word and WRITEs it back plus
+ * one, so the server can check afterwards that no two overlapped. The
+ * latency of a seq op runs to its completion, that of a CAS increment
+ * or a critical section from the first attempt to the last WR.
+ */
+struct at_result {
+    double sec;
+    uint64_t ops;
+    uint64_t retries;           // failed CAS or lock attempts
+    uint8_t rd_atomic;          // max_rd_atomic agreed with the server
+    struct hist h;
+};
+
+static void run_atomics(struct conn *c, const struct bench_opts *o,
+                        struct at_result *r) {
+    struct at_conn a = {
+        .qp = c->qp,
+        .cqe = &c->cqe,
+        .res = (uint64_t *)c->buf,
+        .lkey = c->mr->lkey,
+        .raddr = c->remote.vaddr,
+        .rkey = c->remote.rkey,
+    };
+    uint64_t id = (uint64_t)c->local.qpn << 32 | c->local.psn;    // spin lock owner
+    uint64_t guess = 0, start;
+
+    hist_init(&r->h);
+    r->ops = 0;
+    r->rd_atomic = c->rd_atomic;
+    start = now_ns();
+
+    if (o->atomics == AM_SEQ) {
+        uint64_t *t0 = calloc(o->window, sizeof(*t0));
+        struct ibv_wc wc[CQE_BATCH];
+        uint64_t posted = 0;
+
+        if (!t0)
+            die("calloc");
+        for (; posted < o->window && posted < o->iters; posted++) {
+            t0[posted] = now_ns();
+            if (at_post(&a, IBV_WR_ATOMIC_FETCH_AND_ADD, AT_COUNTER, 1, 0, posted))
+                die("ibv_post_send");
+        }
+        while (r->ops < o->iters) {
+            int n = cq_engine_wait(&c->cqe, wc, CQE_BATCH);
+
+            for (int i = 0; i < n; i++) {
+                uint32_t slot = wc[i].wr_id;
+
+                if (wc[i].status != IBV_WC_SUCCESS) {
+                    fprintf(stderr, "FAA failed: %s\n", ibv_wc_status_str(wc[i].status));
+                    exit(1);
+                }
+                hist_add(&r->h, now_ns() - t0[slot]);
+                r->ops++;
+                if (posted < o->iters) {
+                    t0[slot] = now_ns();
+                    if (at_post(&a, IBV_WR_ATOMIC_FETCH_AND_ADD, AT_COUNTER, 1, 0, slot))
+                        die("ibv_post_send");
+                    posted++;
+                }
+            }
+        }
+        free(t0);
+    }
+
+    while (o->atomics != AM_SEQ && r->ops < o->iters) {
+        uint64_t t0 = now_ns(), old, val;
+
+        switch (o->atomics) {
+        case AM_CAS:
+            for (;;) {
+                if (at_cas(&a, AT_COUNTER, guess, guess + 1, &old))
+                    die("CAS");
+                if (old == guess)
+                    break;
+                guess = old;
+                a.spins++;
+            }
+            guess++;
+            break;
+        case AM_SPIN:
+        case AM_TICKET:
+            if (o->atomics == AM_SPIN ? at_spin_lock(&a, id) : at_ticket_lock(&a))
+                die("lock");
+            if (at_read(&a, AT_GUARDED, &val) || at_write(&a, AT_GUARDED, val + 1))
+                die("critical section");
+            if (o->atomics == AM_SPIN ? at_spin_unlock(&a, id) : at_ticket_unlock(&a))
+                die("unlock");
+            break;
+        }
+        hist_add(&r->h, now_ns() - t0);
+        r->ops++;
+    }
+
+    r->sec = (now_ns() - start) / 1e9;
+    r->retries = a.spins;
+}
+
+static void print_atomics(const struct bench_opts *o, const struct at_result *r) {
+    printf("RDMA atomics (%s): %llu ops, window %u, max_rd_atomic %u\n",
+           am_names[o->atomics], (unsigned long long)r->ops,
+           o->atomics == AM_SEQ ? o->window : 1, r->rd_atomic);
+    printf("  %.3f s, %.3f Mops/s, %llu retries\n", r->sec, r->ops / r->sec / 1e6,
+           (unsigned long long)r->retries);
+    hist_print_us(o->atomics >= AM_SPIN ? "critical section latency" :
+                  "op latency", &r->h);
+}
+
+/*
+ * File transfer mode (-f, see file_xfer.h)
+ *
+ * The file is mmap'd and registered, with ODP if the device can, and
+ * each segment the server grants is RDMA_WRITTEN from the mapping in
+ * FILE_WR pieces, at most -w in flight, then closed with its index as
+ * an immediate. That WR is signaled and tagged with the segment, so
+ * its completion is when the segment's pages can be unpinned. With -C
+ * the same file goes through the TCP socket with read() and write().
+ */
+static void file_reap(struct conn *c, struct file_map *m, uint64_t *completed) {
+    struct ibv_wc wc[CQE_BATCH];
+    int ne = cq_engine_wait(&c->cqe, wc, CQE_BATCH);
+
+    for (int i = 0; i < ne; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "file RDMA_WRITE failed: %s\n",
+                    ibv_wc_status_str(wc[i].status));
+            exit(1);
+        }
+        *completed += (uint32_t)wc[i].wr_id;
+        if (wc[i].wr_id >> 32)
+            file_seg_put(m, (wc[i].wr_id >> 32) - 1);
+    }
+}
+
+static void file_send_rdma(struct conn *c, struct file_map *m,
+                           const struct bench_opts *o) {
+    struct ibv_pd *pd = c->mr->pd;
+    uint64_t posted = 0, completed = 0;
+    uint32_t unsignaled = 0;
+
+    if (file_map_reg(m, pd, 0, file_odp_ok(pd->context, IBV_ODP_SUPPORT_SEND)))
+        die("ibv_reg_mr");
+
+    for (uint32_t seg = 0; seg < m->nseg; seg++) {
+        struct file_grant g;
+
+        // Grants come in order, FILE_GRANTS ahead
+        if (xfer_all(c->sock, &g, sizeof(g), 0))
+            die("read grant");
+        if (g.seg != seg) {
+            fprintf(stderr, "Got grant for segment %u, expected %u\n", g.seg, seg);
+            exit(1);
+        }
+        struct ibv_mr *mr = file_seg_get(m, pd, seg);
+        if (!mr)
+            die("ibv_reg_mr");
+
+        char *base = m->addr + (uint64_t)seg * FILE_SEG;
+        uint64_t len = file_seg_len(m, seg);
+        for (uint64_t pos = 0; pos < len; pos += FILE_WR) {
+            struct ibv_sge sge = {
+                .addr = (uintptr_t)(base + pos),
+                .length = len - pos < FILE_WR ? len - pos : FILE_WR,
+                .lkey = mr->lkey,
+            };
+            struct ibv_send_wr wr = {0}, *bad_wr;
+
+            while (posted - completed == o->window)
+                file_reap(c, m, &completed);
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_RDMA_WRITE;
+            if (++unsignaled == o->signal) {
+                wr.wr_id = unsignaled;
+                wr.send_flags = IBV_SEND_SIGNALED;
+                unsignaled = 0;
+            }
+            wr.wr.rdma.remote_addr = g.vaddr + pos;
+            wr.wr.rdma.rkey = g.rkey;
+            errno = ibv_post_send(c->qp, &wr, &bad_wr);
+            if (errno)
+                die("ibv_post_send");
+            posted++;
+        }
+
+        // Close the segment; its completion retires everything before it
+        while (posted - completed == o->window)
+            file_reap(c, m, &completed);
+        if (notify_post(c->qp, NULL, 0, 0, g.vaddr, g.rkey, seg,
+                        (uint64_t)(seg + 1) << 32 | (unsignaled + 1),
+                        IBV_SEND_SIGNALED))
+            die("ibv_post_send");
+        unsignaled = 0;
+        posted++;
+    }
+    while (completed < posted)
+        file_reap(c, m, &completed);
+}
+
+static void file_send_tcp(struct conn *c, struct file_map *m) {
+    size_t len = FILE_WR;
+    char *buf = malloc(len);
+
+    if (!buf)
+        die("malloc");
+    for (uint64_t left = m->size; left; ) {
+        ssize_t n = read(m->fd, buf, left < len ? left : len);
+        if (n <= 0)
+            die("read file");
+        if (xfer_all(c->sock, buf, n, 1))
+            die("write socket");
+        left -= n;
+    }
+    free(buf);
+}
+
+static void run_file(struct conn *c, const struct bench_opts *o) {
+    struct file_hdr hdr = {
+        .magic = FILE_MAGIC,
+        .mode = o->file_tcp ? FILE_TCP : FILE_RDMA,
+    };
+    const char *base = strrchr(o->file, '/');
+    struct file_grant done;
+    struct file_map m;
+
+    if (file_map_src(&m, o->file))
+        die(o->file);
+    hdr.size = m.size;
+    snprintf(hdr.name, sizeof(hdr.name), "%s", base ? base + 1 : o->file);
+
+    uint64_t start = now_ns();
+    if (xfer_all(c->sock, &hdr, sizeof(hdr), 1))
+        die("write file header");
+    if (o->file_tcp)
+        file_send_tcp(c, &m);
+    else
+        file_send_rdma(c, &m, o);
+    // The server has every byte in its page cache once it says so
+    if (xfer_all(c->sock, &done, sizeof(done), 0) || done.seg != FILE_DONE)
+        die("read completion");
+    double sec = (now_ns() - start) / 1e9;
+
+    printf("File %s: %llu bytes, %s\n", o->file, (unsigned long long)m.size,
+           o->file_tcp ? "read()/write() over TCP" : file_map_kind(&m));
+    printf("  %.3f s, %.3f GB/s", sec, m.size / sec / 1e9);
+    if (!o->file_tcp)
+        printf(", %.3f s registering, %llu MB segments, %u in flight",
+               m.reg_ns / 1e9, FILE_SEG >> 20, o->window);
+    printf("\n");
+    file_map_close(&m);
+}
+
+static void conn_close(struct conn *c) {
+    close(c->sock);
+    ibv_dereg_mr(c->mr);
+    ibv_destroy_qp(c->qp);
+    cq_engine_destroy(&c->cqe);
+    free(c->buf);
+}
+
+/*
+ * Counts the device's async events into the stats page (CQ overruns
+ * among them) while -t/-m run. It wakes up every ASYNC_POLL_MS to see
+ * whether it should stop.
+ */
+#define ASYNC_POLL_MS 200
+
+struct async_watch {
+    pthread_t tid;
+    struct ibv_context *ctx;
+    struct wr_stats_page *stats;
+    volatile int stop;
+};
+
+static void *async_main(void *arg) {
+    struct async_watch *a = arg;
+    struct pollfd pfd = { .fd = wr_stats_async_fd(a->ctx), .events = POLLIN };
+
+    if (pfd.fd < 0)
+        return NULL;
+    while (!a->stop) {
+        if (poll(&pfd, 1, ASYNC_POLL_MS) > 0)
+            wr_stats_async(a->stats, a->ctx);
+    }
+    return NULL;
+}
+
+/*
+ * Multi-QP scaling mode (-T threads)
+ *
+ * Each worker thread is created already pinned to its CPU and then
+ * opens its own connection, so its buffer is first touched on the local
+ * NUMA node and its QP, CQ and MR are never used by another thread: the
+ * data path shares no locks. Once every worker is connected they all
+ * start run_throughput(), or run_atomics() with -A, together. CPUs are
+ * taken in order from the process affinity mask, so `taskset -c`
+ * chooses the cores.
+ */
+struct worker {
+    pthread_t tid;
+    int cpu;
+    const struct ibdev *dev;
+    struct ibv_pd *pd;
+    const char *server_ip;
+    const char *port;
+    const struct bench_opts *o;
+    enum ibv_wr_opcode opcode;
+    pthread_barrier_t *start;
+    struct wr_stats *st;
+    char *ts_source;            // thread 0 reports its CQ's timestamps here
+
+    uint64_t start_ns, end_ns;
+    double sec;
+    uint64_t sleeps;
+    struct at_result at;        // -A only
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct conn c;
+
+    conn_open(&c, w->dev, w->pd, w->server_ip, w->port, w->o, 0);
+    if (w->ts_source)
+        snprintf(w->ts_source, WR_STATS_NAME, "%s", cq_engine_ts_source(&c.cqe));
+    pthread_barrier_wait(w->start);
+
+    w->start_ns = now_ns();
+    if (w->o->atomics) {
+        run_atomics(&c, w->o, &w->at);
+        w->sec = w->at.sec;
+    } else {
+        w->sec = run_throughput(c.qp, &c.cqe, c.mr, &c.remote, w->o, w->opcode,
+                                w->st);
+    }
+    w->end_ns = now_ns();
+    w->sleeps = c.cqe.sleeps;
+
+    if (!w->o->atomics)
+        conn_notify(&c, w->o, w->o->iters);
+    conn_close(&c);
+    return NULL;
+}
+
+static void run_threads(const struct ibdev *dev, struct ibv_pd *pd,
+                        const char *server_ip, const char *port,
+                        const struct bench_opts *o,
+                        enum ibv_wr_opcode opcode,
+                        struct wr_stats_page *stats) {
+    const char *name = opcode == IBV_WR_SEND ? "SEND" : "RDMA_WRITE";
+    static int cpus[CPU_SETSIZE];
+    cpu_set_t allowed;
+    int ncpus = 0, err;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+	    die("sched_getaffinity");
+    for (int i = 0; i < CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &allowed))
+            cpus[ncpus++] = i;
+    if (o->threads > (uint32_t)ncpus)
+        fprintf(stderr, "warning: %u threads on %d CPUs, some will share a core\n",
+                o->threads, ncpus);
+
+    struct worker *w = calloc(o->threads, sizeof(*w));
+    if (!w)
+	    die("calloc");
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, o->threads);
+
+    for (uint32_t i = 0; i < o->threads; i++) {
+        pthread_attr_t attr;
+        cpu_set_t set;
+
+        w[i].cpu = cpus[i % ncpus];
+        w[i].dev = dev;
+        w[i].pd = pd;
+        w[i].server_ip = server_ip;
+        w[i].port = port;
+        w[i].o = o;
+        w[i].opcode = opcode;
+        w[i].start = &start;
+        w[i].st = stats ? &stats->thread[i] : NULL;
+        w[i].ts_source = stats && !i ? stats->ts_source : NULL;
+
+        CPU_ZERO(&set);
+        CPU_SET(w[i].cpu, &set);
+        pthread_attr_init(&attr);
+        err = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        if (!err)
+            err = pthread_create(&w[i].tid, &attr, worker_main, &w[i]);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            errno = err;
+            die("pthread_create");
+        }
+    }
+
+    uint64_t first = UINT64_MAX, last = 0;
+    for (uint32_t i = 0; i < o->threads; i++) {
+        pthread_join(w[i].tid, NULL);
+        if (w[i].start_ns < first)
+            first = w[i].start_ns;
+        if (w[i].end_ns > last)
+            last = w[i].end_ns;
+    }
+    pthread_barrier_destroy(&start);
+
+    if (o->atomics) {
+        static struct hist all;         // too big for the stack
+        uint64_t ops = 0, retries = 0;
+
+        hist_init(&all);
+        printf("RDMA atomics (%s) scaling: %u threads x %llu ops, window %u, "
+               "max_rd_atomic %u\n", am_names[o->atomics], o->threads,
+               (unsigned long long)o->iters, o->atomics == AM_SEQ ? o->window : 1,
+               w[0].at.rd_atomic);
+        for (uint32_t i = 0; i < o->threads; i++) {
+            printf("  thread %u (cpu %d): %.3f s, %.3f Mops/s, %llu retries\n",
+                   i, w[i].cpu, w[i].sec, w[i].at.ops / w[i].sec / 1e6,
+                   (unsigned long long)w[i].at.retries);
+            ops += w[i].at.ops;
+            retries += w[i].at.retries;
+            hist_merge(&all, &w[i].at.h);
+        }
+        double sec = (last - first) / 1e9;
+        printf("  aggregate: %.3f s, %.3f Mops/s, %llu retries\n", sec,
+               ops / sec / 1e6, (unsigned long long)retries);
+        hist_print_us(o->atomics >= AM_SPIN ? "critical section latency" :
+                      "op latency", &all);
+        free(w);
+        return;
+    }
+
+    printf("%s scaling: %u threads x %u bytes x %llu msgs, window %u, "
+           "signal every %u, %u WRs per doorbell, %u SGEs per WR\n",
+           name, o->threads, o->size, (unsigned long long)o->iters,
+           o->window, o->signal, o->batch, o->sges);
+    static struct hist all;
+    hist_init(&all);
+    for (uint32_t i = 0; i < o->threads; i++) {
+        printf("  thread %u (cpu %d): %.3f s, %.3f GB/s, %.3f Mmsg/s, %llu sleeps, "
+               "p99 %.2f us\n", i, w[i].cpu, w[i].sec,
+               (double)o->size * o->iters / w[i].sec / 1e9,
+               o->iters / w[i].sec / 1e6, (unsigned long long)w[i].sleeps,
+               hist_percentile(&w[i].st->lat, 99) / 1e3);
+        hist_merge(&all, &w[i].st->lat);
+    }
+
+    // Aggregate over the span from the first start to the last finish
+    double sec = (last - first) / 1e9;
+    double msgs = (double)o->iters * o->threads;
+    printf("  aggregate: %.3f s, %.3f GB/s, %.3f Mmsg/s\n", sec,
+           msgs * o->size / sec / 1e9, msgs / sec / 1e6);
+    printf("Timestamps: %s\n", stats->ts_source);
+    hist_print_us("post-to-completion latency, all threads", &all);
+
+    free(w);
+}
+
+/*
+ * -x shm: the single write, or the -t stream of writes, through the
+ * transport interface (xport.h) to an rdma_server -x shm on this host,
+ * over shared memory instead of an HCA. path is the server's Unix
+ * socket. As with -d, "DONE" on the socket ends the transfer; every
+ * signaled write has completed by then, so the data is in place.
+ */
+static void run_xport(const struct bench_opts *o, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct conn_info local = {0}, remote;
+    struct xport_wc wc[CQE_BATCH];
+    struct xport_mr mr;
+    uint32_t size = o->size;
+    uint64_t iters = o->throughput ? o->iters : 1;
+    uint64_t posted = 0, completed = 0;
+    uint32_t unsignaled = 0;
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        die("connect unix socket");
+
+    size_t len = o->size > SIZE ? o->size : SIZE;
+    size_t seg = (len + XPORT_SHM_ALIGN + 4095) & ~4095ul;
+    struct xport *x = xport_shm_open(sock, o->window, seg, 0);
+    uint32_t window = o->window < x->depth ? o->window : x->depth;
+    uint32_t signal = o->signal < window ? o->signal : window;
+
+    if (xport_mr_alloc(x, len, &mr))
+        die("xport_mr_alloc");
+    strcpy(mr.addr, "Sid: Client writes this via xport_write");
+    local.rkey = mr.rkey;
+    local.vaddr = (uintptr_t)mr.addr;
+    local.len = len;
+    xfer(sock, &local, sizeof(local), 1);
+    xfer(sock, &remote, sizeof(remote), 0);
+    if (remote.len < size) {
+        fprintf(stderr, "Server buffer %u is smaller than message size %u\n",
+                remote.len, size);
+        exit(1);
+    }
+    printf("Connected over %s. Posting %s...\n", x->ops->name,
+           o->throughput ? "writes" : "one write");
+
+    uint64_t start = now_ns();
+    while (completed < iters) {
+        while (posted - completed < window && posted < iters) {
+            int signaled = 0;
+            uint64_t wr_id = 0;
+
+            if (++unsignaled == signal || posted + 1 == iters) {
+                signaled = 1;
+                wr_id = unsignaled;
+                unsignaled = 0;
+            }
+            if (xport_write(x, &mr, mr.addr, size, remote.vaddr, remote.rkey,
+                            wr_id, signaled))
+                die("xport_write");
+            posted++;
+        }
+        int ne = xport_poll(x, wc, CQE_BATCH);
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "Write failed: wc.status=%d (%s)\n",
+                        wc[i].status, ibv_wc_status_str(wc[i].status));
+                exit(1);
+            }
+            completed += wc[i].wr_id;
+        }
+    }
+    double sec = (now_ns() - start) / 1e9;
+
+    if (o->throughput) {
+        printf("WRITE throughput over %s: %u bytes x %llu msgs, window %u, "
+               "signal every %u\n", x->ops->name, size,
+               (unsigned long long)iters, window, signal);
+        printf("  %.3f s, %.3f GB/s, %.3f Mmsg/s\n", sec,
+               (double)size * iters / sec / 1e9, iters / sec / 1e6);
+    } else {
+        printf("Write completed.\n");
+    }
+    xfer(sock, "DONE", 5, 1);
+    xport_mr_free(x, &mr);
+    xport_close(x);
+    close(sock);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <server_ip> <port> [-t|-l|-m|-e|-K keys|-A mode|-f file [-C]]\n"
+            "          [-R depth] [-S name] [-s size] [-n iters] [-w window]\n"
+            "          [-k signal] [-b batch] [-g sges] [-p spin_us] [-T threads] [-d] [-I]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index] [-M mtu] [-N node]\n"
+            "       %s -x shm <socket_path> [-t] [-s size] [-n iters] [-w window] [-k signal]\n"
+            "  -x shm     write through shared memory to an rdma_server -x shm on\n"
+            "             this host, no HCA needed (default: verbs)\n"
+            "  -t         pipelined RDMA_WRITE throughput mode\n"
+            "  -l         RDMA_WRITE ping-pong latency mode (server needs -l too)\n"
+            "  -m         pipelined SEND messaging mode (server needs -m too)\n"
+            "  -e         transfer latency mode: write, notify the server and\n"
+            "             wait for its acknowledgement\n"
+            "  -d         notify the server with \"DONE\" over TCP instead of\n"
+            "             an RDMA_WRITE_WITH_IMM immediate\n"
+            "  -I         end every message (the single write, -t/-m/-e) with a\n"
+            "             CRC32C of the rest, for the server to verify (server\n"
+            "             needs -I and the same -s)\n"
+            "  -K keys    load this many keys into the server's key-value store\n"
+            "             (server needs -K), then time GETs done with RDMA_READs;\n"
+            "             -s is the value size, -w the GETs in flight\n"
+            "  -A mode    RDMA atomics on the server's words (server needs -A):\n"
+            "             seq = fetch-and-add counter, -w ops in flight;\n"
+            "             cas = compare-and-swap increments; spin, ticket =\n"
+            "             critical sections under a spin or ticket lock\n"
+            "  -f file    send this file into the server's -F directory, RDMA_WRITTEN\n"
+            "             straight from its mmap'd pages; -w WRs in flight\n"
+            "  -C         with -f: copy it with read()/write() over TCP instead\n"
+            "  -R depth   RDMA_READs/atomics in flight per QP, max_rd_atomic\n"
+            "             (default %d, capped by the device and the server's -R)\n"
+            "  -S name    publish the -t/-m WR counters and latencies in\n"
+            "             /dev/shm/name while running, see rdma_stats\n"
+            "  -s size    message size in bytes (default %d)\n"
+            "  -n iters   number of messages (default 1000000)\n"
+            "  -w window  outstanding WRs, used as max_send_wr (default 128)\n"
+            "  -k signal  post one signaled WR every k (default 16)\n"
+            "  -b batch   WRs chained per ibv_post_send, -t/-m (default 1)\n"
+            "  -g sges    gather each message from this many fragments, -t/-m\n"
+            "             (default 1, at most %d)\n"
+            "  -p spin_us busy-poll the CQ this long before sleeping on its\n"
+            "             completion channel, -1 = never sleep (default -1)\n"
+            "  -T threads run -t/-m/-A on this many pinned threads, each with its\n"
+            "             own QP, CQ and buffer (default: single-threaded)\n"
+            "  -D dev     use this HCA (default: the first one)\n"
+            "  -P pnetid  use the HCA port with this PNET ID (s390)\n"
+            "  -i port    HCA port (default: the first active one)\n"
+            "  -G index   GID index (default: a RoCE v2 IPv4 entry)\n"
+            "  -M mtu     cap the path MTU: 256, 512, 1024, 2048 or 4096\n"
+            "             (default: the ports' active MTU)\n"
+            "  -N node    put threads and memory on this NUMA node, -1 = leave\n"
+            "             them where they are (default: the HCA's node)\n",
+            prog, prog, MAX_RD_ATOMIC, SIZE, WR_BATCH_MAX_SGE);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct bench_opts opts = {
+        .size = SIZE,
+        .iters = 1000000,
+        .window = 128,
+        .signal = 16,
+        .batch = 1,
+        .sges = 1,
+        .spin_ns = CQ_SPIN_FOREVER,
+    };
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    unsigned rd_atomic = MAX_RD_ATOMIC;
+    char stats_name[WR_STATS_NAME] = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:tlmedIK:A:f:CR:S:s:n:w:k:b:g:p:T:D:P:i:G:M:N:")) != -1) {
+        switch (opt) {
+        case 't': opts.throughput = 1; break;
+        case 'l': opts.latency = 1; break;
+        case 'm': opts.messaging = 1; break;
+        case 'e': opts.transfer = 1; break;
+        case 'd': opts.tcp_done = 1; break;
+        case 'I': opts.integrity = 1; break;
+        case 'x':
+            if (!strcmp(optarg, "shm"))
+                opts.shm = 1;
+            else if (strcmp(optarg, "verbs"))
+                usage(argv[0]);
+            break;
+        case 'K': opts.kv_keys = strtoul(optarg, NULL, 0); break;
+        case 'A':
+            for (opts.atomics = AM_TICKET; opts.atomics; opts.atomics--)
+                if (!strcmp(optarg, am_names[opts.atomics]))
+                    break;
+            if (!opts.atomics)
+                usage(argv[0]);
+            break;
+        case 'f': opts.file = optarg; break;
+        case 'C': opts.file_tcp = 1; break;
+        case 'R': rd_atomic = strtoul(optarg, NULL, 0); break;
+        case 'S':
+            // shm_open() names start with a slash
+            snprintf(stats_name, sizeof(stats_name), "%s%s",
+                     optarg[0] == '/' ? "" : "/", optarg);
+            break;
+        case 's': opts.size = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.iters = strtoull(optarg, NULL, 0); break;
+        case 'w': opts.window = strtoul(optarg, NULL, 0); break;
+        case 'k': opts.signal = strtoul(optarg, NULL, 0); break;
+        case 'b': opts.batch = strtoul(optarg, NULL, 0); break;
+        case 'g': opts.sges = strtoul(optarg, NULL, 0); break;
+        case 'p': opts.spin_ns = cq_spin_ns(optarg); break;
+        case 'T': opts.threads = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        case 'M': dev_opts.mtu = atoi(optarg); break;
+        case 'N': dev_opts.numa_node = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != (opts.shm ? 1 : 2) || (opts.throughput + opts.latency + opts.messaging + opts.transfer + !!opts.kv_keys + !!opts.atomics + !!opts.file > 1) || !opts.size || !opts.iters || !opts.window || !opts.signal ||
+        !opts.batch || opts.batch > WR_BATCH_MAX ||
+        !opts.sges || opts.sges > WR_BATCH_MAX_SGE || opts.sges > opts.size ||
+        (opts.threads && !opts.throughput && !opts.messaging && !opts.atomics) ||
+        !rd_atomic || rd_atomic > 255 || (opts.file_tcp && !opts.file) ||
+        (opts.integrity && (opts.latency || opts.kv_keys || opts.atomics ||
+                            opts.file || opts.size <= CRC32C_TRAILER)) ||
+        (stats_name[0] && !opts.throughput && !opts.messaging) ||
+        (opts.shm && (opts.latency || opts.messaging || opts.transfer ||
+                      opts.kv_keys || opts.atomics || opts.file ||
+                      opts.threads || opts.tcp_done || opts.integrity ||
+                      stats_name[0])) ||
+        (dev_opts.mtu && !ibdev_mtu_enum(dev_opts.mtu)))
+        usage(argv[0]);
+
+    if (opts.shm) {
+        run_xport(&opts, argv[optind]);
+        return 0;
+    }
+
+    const char *server_ip = argv[optind];
+    const char *port_str = argv[optind + 1];
+
+    /* ---------------------------------------------------------
+     * 1. Find and open the InfiniBand device (ibdev.h)
+     *    - ibv_get_device_list() enumerates the available HCAs
+     *      (Host Channel Adapters); -D or -P select one, otherwise
+     *      the first device is used
+     *    - The port, its active MTU and the GID index to use are
+     *      queried instead of assumed
+     *    - Then this thread moves to the HCA's NUMA node, so the
+     *      buffers, CQs and QPs allocated from here on, and any
+     *      worker threads, are local to the HCA
+     * --------------------------------------------------------- */
+    struct ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+	    die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+    struct ibv_context *ctx = dev.ctx;
+    /* ---------------------------------------------------------
+     * 2. Allocate a Protection Domain (PD)
+     *    - A PD is like a container that groups together
+     *      memory regions, queue pairs, and other RDMA resources.
+     * --------------------------------------------------------- */
+
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    if (!pd)
+	    die("ibv_alloc_pd");
+
+    /*
+     * The send queue depth is the throughput window, so it cannot be
+     * larger than what the device supports per QP.
+     */
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(ctx, &dev_attr))
+	    die("ibv_query_device");
+    if (opts.window > (uint32_t)dev_attr.max_qp_wr)
+	    opts.window = dev_attr.max_qp_wr;
+    if (opts.signal > opts.window)
+	    opts.signal = opts.window;
+    /*
+     * Up to signal - 1 unsignaled WRs can sit at the end of the window
+     * with nothing behind them to retire them, so a whole batch must
+     * still fit next to those.
+     */
+    if (opts.batch > opts.window - opts.signal + 1)
+	    opts.batch = opts.window - opts.signal + 1;
+    if (opts.sges > (uint32_t)dev_attr.max_sge)
+	    opts.sges = dev_attr.max_sge;
+    opts.rd_atomic = (unsigned)dev_attr.max_qp_init_rd_atom < rd_atomic ?
+                     dev_attr.max_qp_init_rd_atom : rd_atomic;
+    if (opts.atomics && dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+        fprintf(stderr, "%s does not support RDMA atomics\n", dev.name);
+        exit(1);
+    }
+
+    /*
+     * -t/-m record every WR in a stats slot per thread, in a page that
+     * rdma_stats can read while they run if it is named with -S
+     */
+    struct wr_stats_page *stats = NULL;
+    struct async_watch watch = { .ctx = ctx };
+    if (opts.throughput || opts.messaging) {
+        stats = wr_stats_create(stats_name[0] ? stats_name : NULL,
+                                opts.threads ? opts.threads : 1);
+        if (!stats)
+            die("wr_stats_create");
+        if (stats_name[0])
+            printf("WR stats in /dev/shm%s, read them with: ./rdma_stats %s\n",
+                   stats_name, stats_name + 1);
+        watch.stats = stats;
+        errno = pthread_create(&watch.tid, NULL, async_main, &watch);
+        if (errno)
+            die("pthread_create");
+    }
+
+    if (opts.threads) {
+        run_threads(&dev, pd, server_ip, port_str, &opts,
+                    opts.messaging ? IBV_WR_SEND : IBV_WR_RDMA_WRITE, stats);
+        goto cleanup;
+    }
+
+    struct conn conn;
+    double sec;
+
+    conn_open(&conn, &dev, pd, server_ip, port_str, &opts, 1);
+    if (stats)
+        snprintf(stats->ts_source, sizeof(stats->ts_source), "%s",
+                 cq_engine_ts_source(&conn.cqe));
+
+    if (opts.throughput) {
+        printf("QP moved to RTS. Running RDMA_WRITE throughput test...\n");
+        sec = run_throughput(conn.qp, &conn.cqe, conn.mr, &conn.remote, &opts,
+                             IBV_WR_RDMA_WRITE, &stats->thread[0]);
+        print_throughput("RDMA_WRITE", &opts, sec, &conn.cqe, &stats->thread[0]);
+        conn_notify(&conn, &opts, opts.iters);
+        goto close;
+    }
+
+    if (opts.messaging) {
+        printf("QP moved to RTS. Running SEND messaging test...\n");
+        sec = run_throughput(conn.qp, &conn.cqe, conn.mr, &conn.remote, &opts,
+                             IBV_WR_SEND, &stats->thread[0]);
+        print_throughput("SEND", &opts, sec, &conn.cqe, &stats->thread[0]);
+        conn_notify(&conn, &opts, opts.iters);
+        goto close;
+    }
+
+    if (opts.latency) {
+        printf("QP moved to RTS. Running RDMA_WRITE ping-pong...\n");
+        run_latency(conn.qp, conn.cqe.cq, conn.mr, conn.buf, conn.buf_len,
+                    &conn.remote, &opts, &conn.cap);
+        conn_notify(&conn, &opts, opts.iters);
+        goto close;
+    }
+
+    if (opts.transfer) {
+        printf("QP moved to RTS. Running transfer latency test...\n");
+        run_transfer(&conn, &opts);
+        goto close;
+    }
+
+    if (opts.kv_keys) {
+        printf("QP moved to RTS. Running key-value GET test...\n");
+        run_kv(&conn, &opts);
+        goto close;
+    }
+
+    if (opts.file) {
+        printf("QP moved to RTS. Sending %s...\n", opts.file);
+        run_file(&conn, &opts);
+        goto close;
+    }
+
+    if (opts.atomics) {
+        static struct at_result at;
+
+        printf("QP moved to RTS. Running RDMA atomics test...\n");
+        run_atomics(&conn, &opts, &at);
+        print_atomics(&opts, &at);
+        goto close;
+    }
 
     printf("QP moved to RTS. Posting RDMA_WRITE...\n");
 
@@ -421,9 +1870,11 @@ int main(int argc, char **argv) {
      * --------------------------------------------------------- */
     struct ibv_sge sge;
 
-    sge.addr = (uintptr_t)buf;
-    sge.length = SIZE;
-    sge.lkey = mr->lkey;
+    sge.addr = (uintptr_t)conn.buf;
+    sge.length = opts.size;
+    sge.lkey = conn.mr->lkey;
+    if (opts.integrity)
+        crc32c_seal(conn.buf, opts.size);   // the server checks its last 4 bytes
 
     /* ---------------------------------------------------------
      * 7. Prepare a Work Request (WR) for RDMA Write
@@ -445,8 +1896,14 @@ int main(int argc, char **argv) {
      * wr.num_sge      = 1
      *   - Number of entries in the scatter-gather list (here, 1)
      *
-     * wr.opcode       = IBV_WR_RDMA_WRITE
-     *   - Operation type: here, an RDMA write to remote memory
+     * wr.opcode       = IBV_WR_RDMA_WRITE_WITH_IMM
+     *   - Operation type: here, an RDMA write to remote memory that
+     *     also delivers wr.imm_data to the server, as a completion of
+     *     one of its posted receives (see notify.h); with -d a plain
+     *     IBV_WR_RDMA_WRITE, and "DONE" follows over TCP
+     *
+     * wr.imm_data     = htonl(opts.size)
+     *   - 32-bit immediate in network byte order, here the length
      *
      * wr.send_flags   = IBV_SEND_SIGNALED
      *   - Request a completion notification when this WR is finished
@@ -462,10 +1919,11 @@ int main(int argc, char **argv) {
     wr.wr_id = 1;
     wr.sg_list = &sge;
     wr.num_sge = 1;
-    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.opcode = opts.tcp_done ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htonl(opts.size);
     wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = remote.vaddr;
-    wr.wr.rdma.rkey = remote.rkey;
+    wr.wr.rdma.remote_addr = conn.remote.vaddr;
+    wr.wr.rdma.rkey = conn.remote.rkey;
 
     /* ---------------------------------------------------------
      * 8. Post the Work Request into the Send Queue
@@ -474,22 +1932,20 @@ int main(int argc, char **argv) {
      *   - The NIC will process the WR asynchronously
      *   - Completion will be reported via the associated Completion Queue (CQ)
      * --------------------------------------------------------- */
-    if (ibv_post_send(qp, &wr, &bad_wr))
+    if (ibv_post_send(conn.qp, &wr, &bad_wr))
 	    die("ibv_post_send");
 
     /* ---------------------------------------------------------
      * 9. Poll the Completion Queue (CQ) for the result
      *
      * Block (or poll) until the NIC reports that the Work Request (WR) is complete
-     *   - Use ibv_poll_cq() to check for completions
+     *   - ibv_poll_cq() checks for completions, for up to -p us
+     *   - then the CQ is armed and we sleep on its completion channel
      *   - Completion entry contains wr_id and status
      * --------------------------------------------------------- */
     struct ibv_wc wc;
 
-    int ne;
-    do { ne = ibv_poll_cq(cq, 1, &wc); } while (ne == 0);
-    if (ne < 0)
-	    die("ibv_poll_cq");
+    cq_engine_wait(&conn.cqe, &wc, 1);
 
     if (wc.status != IBV_WC_SUCCESS) {
         fprintf(stderr, "RDMA_WRITE failed: wc.status=%d\n", wc.status);
@@ -498,21 +1954,22 @@ int main(int argc, char **argv) {
 
     printf("RDMA_WRITE completed on client side (CQ).\n");
 
-    // Notify server
-    const char *done = "DONE";
-    if (write(sock, done, strlen(done)+1) < 0)
-	    die("notify server");
+    // The immediate already told the server; with -d it is told now
+    if (opts.tcp_done)
+        conn_notify(&conn, &opts, opts.size);
 
-    // Cleanup
-    close(sock);
-    ibv_dereg_mr(mr);
-    ibv_destroy_qp(qp);
-    ibv_destroy_cq(cq);
+close:
+    // Release the QP, CQ and buffer
+    conn_close(&conn);
+
+cleanup:
+    if (stats) {
+        watch.stop = 1;
+        pthread_join(watch.tid, NULL);
+        wr_stats_destroy(stats, stats_name[0] ? stats_name : NULL);
+    }
     ibv_dealloc_pd(pd);
-    ibv_close_device(ctx);
-    ibv_free_device_list(dev_list);
-    free(buf);
+    ibdev_close(&dev);
 
     return 0;
 }
-
@@ -1,221 +1,1226 @@
 // rdma_server.c
-// RoCE server: registers a buffer, exchanges connection info with client, waits for RDMA_WRITE
+// RoCE server: registers a buffer per client, exchanges connection info with
+// each client over TCP and waits for their RDMA_WRITEs. Clients are served
+// concurrently from one epoll loop, with one QP per client on a shared CQ.
+// With -m clients SEND messages instead, received through one shared SRQ.
+// Clients signal the end of a transfer with an immediate (notify.h).
+// With -K the server holds a key-value store that clients GET with RDMA_READs.
+// With -A it exposes counter and lock words for the clients' RDMA atomics.
+// With -F it receives files straight into their mmap'd pages (file_xfer.h).
+// With -I it checks the CRC32C trailer of every message (crc32c.h).
+// With -Q closed connections leave their QP in a pool for the next (qp_pool.h).
+// With -x shm it serves local clients over shared memory instead (xport_shm.h).
+#define _GNU_SOURCE     // accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <infiniband/verbs.h>
+#include "common.h"
+#include "pingpong.h"
+#include "srq.h"
+#include "arena.h"
+#include "cq_engine.h"
+#include "notify.h"
+#include "kv.h"
+#include "ibdev.h"
+#include "atomics.h"
+#include "file_xfer.h"
+#include "crc32c.h"
+#include "qp_pool.h"
+#include "xport.h"
+#include "xport_shm.h"
 
-#define SIZE 4096
-#define BACKLOG 1
+#define SIZE BUFFER_SIZE
+#define BACKLOG 128
+#define MAX_EVENTS 64
+#define CQ_DEPTH 4096
+#define QPN_HASH 256
+#define SRQ_DEPTH 1024
+#define SRQ_BATCH 32
+#define MAX_CLIENTS 256
+#define MAX_RD_ATOMIC 16
 
-struct conn_info {
-    uint32_t qpn;
-    uint32_t psn;
-    uint32_t rkey;
-    uint64_t vaddr;
-    uint8_t gid[16];
-};
+static volatile sig_atomic_t stop;
 
-// Exit on error
-static void die(const char *s) {
-    perror(s);
-    exit(1);
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
 }
 
-// Get local GID for RoCE
-static void get_local_gid(struct ibv_context *ctx, int port, int index, union ibv_gid *gid) {
-    if (ibv_query_gid(ctx, port, index, gid))
-        die("ibv_query_gid");
-}
+/* Server wide options and the verbs resources every client shares */
+struct server {
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;      // shared by the send and recv queues of all QPs
+    struct cq_engine cqe;   // owns cq and its completion channel
+    struct arena arena;     // client buffers, registered once
+    struct ibdev dev;       // port, GID index and MTU (ibdev.h)
+    int lfd;                // listening socket
+    int epfd;
+
+    uint32_t size;          // -s: message size
+    uint32_t buf_len;       // advertised buffer, at least SIZE
+    uint64_t iters;         // -n: ping-pong round trips
+    int latency;            // -l
+    int messaging;          // -m: SEND/RECV through the SRQ
+    uint32_t kv_buckets;    // -K: key-value store, PUTs through the SRQ
+    struct srq_pool srq;
+    struct kv_store kv;
+    int atomics;            // -A: counter and lock words (atomics.h)
+    struct at_region at;
+    uint8_t rd_atomic;      // RDMA_READs/atomics a client may have outstanding
+    const char *file_dir;   // -F: receive files into this directory
+    int file_odp;           // ... registered with ODP
+    int integrity;          // -I: verify the clients' CRC32C trailers
+    struct qp_pool qps;     // every client's QP comes from here, -Q warm ones
+
+    struct client *clients;             // all connected clients
+    struct client *by_qpn[QPN_HASH];    // completion -> client lookup
+    int nclients;
+    int in_wcs;             // handle_wcs() running, its poll loop drains
+    struct ibv_wc *held;    // polled by reap_cq(), handled by drain_cq()
+    int nheld, maxheld;
+    int active;             // clients with a ping-pong in progress
+};
 
-// Listen on TCP port and accept connection
-int tcp_listen_and_accept(const char *port_str) {
-    struct addrinfo hints = {0}, *res;
-    int sock = -1, cl = -1;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+/*
+ * A file being received (-F). The header is assembled like conn_info;
+ * then the file arrives either by RDMA_WRITEs into granted segments of
+ * its mapping, or as a byte stream on the socket (FILE_TCP).
+ */
+struct file_rx {
+    struct file_hdr hdr;
+    size_t have;
+    char path[PATH_MAX];
+    struct file_map map;
+    uint32_t granted;       // segments handed out
+    uint32_t done;          // ... and written
+    uint64_t *seg_done;     // bitmap of the written ones, by segment
+    uint64_t got;           // bytes received, FILE_TCP only
+    char *buf;              // FILE_TCP only
+    uint64_t start_ns;
+};
+
+/*
+ * Per client state. The client's conn_info may arrive in pieces on the
+ * non-blocking socket, so it is assembled in 'remote' until 'have'
+ * reaches its size; only then is the QP moved to RTR/RTS.
+ */
+struct client {
+    int fd;
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;      // the arena's MR, not owned by the client
+    struct ibv_mr *rmr;     // buf_len bytes at buf, the client's rkey
+    struct arena_buf mem;
+    char *buf;
+    struct ibv_qp_cap cap;
+    struct conn_info local;
+    struct conn_info remote;
+    size_t have;
+    int ready;              // QP is in RTS
 
-    if (getaddrinfo(NULL, port_str, &hints, &res) != 0) die("getaddrinfo");
+    struct pingpong pp;
+    uint64_t iter;          // next ping-pong round trip, -l only
+    uint64_t msgs;          // messages received, -m only
+    uint64_t bytes;
+    struct file_rx *rx;     // -F, while a file is coming in
+    uint64_t crc_ok;        // -I: messages whose trailer matched
+    uint64_t crc_bad;
 
-    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sock < 0) die("socket");
+    struct client *next, *prev;
+    struct client *qpn_next;
+};
 
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+static void print_conn_info(const struct client *c) {
+    const struct conn_info *local = &c->local, *remote = &c->remote;
 
-    if (bind(sock, res->ai_addr, res->ai_addrlen) < 0) die("bind");
-    if (listen(sock, BACKLOG) < 0) die("listen");
+    printf("Client fd %d: exchanged connection info:\n", c->fd);
 
-    printf("Server listening on port %s ...\n", port_str);
-    cl = accept(sock, NULL, NULL);
-    if (cl < 0) die("accept");
-    close(sock); // close listening socket
-    freeaddrinfo(res);
-    return cl;
+    // Local info
+    printf("Local QPN: %u\n", local->qpn);
+    printf("Local PSN: %u\n", local->psn);
+    printf("Local rkey: 0x%x\n", local->rkey);
+    printf("Local lkey: 0x%x\n", c->mr->lkey);
+    printf("Local vaddr: 0x%lx\n", (unsigned long)local->vaddr);
+    printf("Local GID: ");
+    for (int i = 0; i < 16; i++) printf("%02x", local->gid[i]);
+    printf("\n\n");
+
+    // Remote info
+    printf("Remote QPN: %u\n", remote->qpn);
+    printf("Remote PSN: %u\n", remote->psn);
+    printf("Remote rkey: 0x%x\n", remote->rkey);
+    printf("Remote vaddr: 0x%lx\n", (unsigned long)remote->vaddr);
+    printf("Remote GID: ");
+    for (int i = 0; i < 16; i++) printf("%02x", remote->gid[i]);
+    printf("\n");
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        return 1;
+static struct client *client_by_qpn(struct server *srv, uint32_t qpn) {
+    struct client *c = srv->by_qpn[qpn % QPN_HASH];
+
+    while (c && c->qp->qp_num != qpn)
+        c = c->qpn_next;
+    return c;
+}
+
+/*
+ * Empty the shared CQ for client_destroy(), dropping the completions
+ * of qp_num, including any an earlier call held. The others are kept
+ * in order for drain_cq() to handle: handling them here could destroy
+ * a client the caller, or the epoll batch it runs from, still refers to.
+ */
+static void reap_cq(struct server *srv, uint32_t qp_num) {
+    struct ibv_wc wc[CQE_BATCH];
+    int n = 0, ne;
+
+    for (int i = 0; i < srv->nheld; i++) {
+        if (srv->held[i].qp_num != qp_num)
+            srv->held[n++] = srv->held[i];
+        else if (srq_is_recv(srv->held[i].wr_id))
+            srq_release(&srv->srq, srv->held[i].wr_id);
     }
-    char *port_str = argv[1];
+    srv->nheld = n;
+    do {
+        ne = cq_engine_poll(&srv->cqe, wc, CQE_BATCH);
+        for (int i = 0; i < ne; i++) {
+            if (wc[i].qp_num == qp_num) {
+                if (srq_is_recv(wc[i].wr_id))
+                    srq_release(&srv->srq, wc[i].wr_id);
+                continue;
+            }
+            if (srv->nheld == srv->maxheld) {
+                srv->maxheld = srv->maxheld ? 2 * srv->maxheld : CQE_BATCH;
+                srv->held = realloc(srv->held,
+                                    srv->maxheld * sizeof(*srv->held));
+                if (!srv->held)
+                    die("realloc");
+            }
+            srv->held[srv->nheld++] = wc[i];
+        }
+    } while (ne == CQE_BATCH);
+}
 
-    // 1) Open RDMA device
-    struct ibv_device **dev_list = ibv_get_device_list(NULL);
-    if (!dev_list) die("ibv_get_device_list");
+static void client_destroy(struct server *srv, struct client *c) {
+    uint32_t qp_num = c->qp->qp_num;
+    struct client **pp = &srv->by_qpn[qp_num % QPN_HASH];
 
-    struct ibv_context *ctx = ibv_open_device(dev_list[0]);
-    if (!ctx) die("ibv_open_device");
+    while (*pp != c)
+        pp = &(*pp)->qpn_next;
+    *pp = c->qpn_next;
 
-    struct ibv_pd *pd = ibv_alloc_pd(ctx);
-    if (!pd) die("ibv_alloc_pd");
+    if (c->prev) c->prev->next = c->next;
+    else srv->clients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    srv->nclients--;
+    if (c->ready && srv->latency && c->iter < srv->iters)
+        srv->active--;
 
-    char *buf = malloc(SIZE);
-    if (!buf) die("malloc");
-    memset(buf, 0, SIZE);
-    strcpy(buf, "INITIAL SERVER CONTENT");
+    printf("Client fd %d disconnected, %d left\n", c->fd, srv->nclients);
+    if (srv->integrity)
+        printf("Client fd %d: CRC32C %llu ok, %llu bad\n", c->fd,
+               (unsigned long long)c->crc_ok, (unsigned long long)c->crc_bad);
+    if (srv->atomics)
+        printf("Atomic words: counter %llu, spin %llu, ticket %llu, serving %llu, guarded %llu\n",
+               (unsigned long long)at_region_word(&srv->at, AT_COUNTER),
+               (unsigned long long)at_region_word(&srv->at, AT_SPIN),
+               (unsigned long long)at_region_word(&srv->at, AT_TICKET),
+               (unsigned long long)at_region_word(&srv->at, AT_SERVING),
+               (unsigned long long)at_region_word(&srv->at, AT_GUARDED));
 
-    struct ibv_mr *mr = ibv_reg_mr(pd, buf, SIZE,
-                    IBV_ACCESS_LOCAL_WRITE |
-                    IBV_ACCESS_REMOTE_WRITE |
-                    IBV_ACCESS_REMOTE_READ);
-    if (!mr) die("ibv_reg_mr");
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    qp_pool_put(&srv->qps, c->qp);
+    /*
+     * Completions of this connection may still sit in the shared CQ.
+     * Drop them before the next accept can hand the QP to a new client
+     * that would take them for its own. Inside handle_wcs() the loop
+     * that polled them keeps polling until the CQ is empty, and what it
+     * finds for this QP number no longer maps to a client.
+     */
+    if (!srv->in_wcs)
+        reap_cq(srv, qp_num);
+    if (c->rx) {
+        // A partial file stays behind, at its full size
+        fprintf(stderr, "Client fd %d: %s incomplete\n", c->fd, c->rx->path);
+        file_map_close(&c->rx->map);
+        free(c->rx->buf);
+        free(c->rx->seg_done);
+        free(c->rx);
+    }
+    if (c->rmr)
+        ibv_dereg_mr(c->rmr);
+    arena_free(&srv->arena, &c->mem);
+    free(c);
+}
 
-    struct ibv_cq *cq = ibv_create_cq(ctx, 10, NULL, NULL, 0);
-    if (!cq) die("ibv_create_cq");
+/*
+ * Set up the resources for a freshly accepted connection: a buffer from
+ * the pre-registered arena and a QP in INIT on the shared CQ, then send
+ * our conn_info. The client's reply is picked up by the epoll loop.
+ * Running out of arena space or verbs resources only costs this client
+ * its connection, not the server.
+ */
+static void client_create(struct server *srv, int fd) {
+    // In latency mode the second half is the ping-pong send area
+    size_t mr_len = srv->latency ? 2 * (size_t)srv->buf_len : srv->buf_len;
+    struct client *c = calloc(1, sizeof(*c));
+    if (!c) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
 
-    struct ibv_qp_init_attr qp_init_attr = {0};
-    qp_init_attr.send_cq = cq;
-    qp_init_attr.recv_cq = cq;
-    qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.cap.max_send_wr = 10;
-    qp_init_attr.cap.max_recv_wr = 10;
-    qp_init_attr.cap.max_send_sge = 1;
-    qp_init_attr.cap.max_recv_sge = 1;
+    c->mem = arena_alloc(&srv->arena, mr_len);
+    if (!c->mem.addr) {
+        fprintf(stderr, "Client fd %d: buffer arena exhausted\n", fd);
+        goto err_free;
+    }
+    c->mr = srv->arena.mr;
+    c->buf = c->mem.addr;
+    memset(c->buf, 0, mr_len);
+    strcpy(c->buf, "INITIAL SERVER CONTENT");
 
-    struct ibv_qp *qp = ibv_create_qp(pd, &qp_init_attr);
-    if (!qp) die("ibv_create_qp");
+    /*
+     * The arena MR is local only: its rkey would reach every client's
+     * buffer. The client writes through an MR of its own instead, over
+     * pages the arena has already pinned. Key-value and atomics clients
+     * get the store's or the words' rkey and need none.
+     */
+    if (!srv->kv_buckets && !srv->atomics) {
+        c->rmr = ibv_reg_mr(srv->pd, c->buf, srv->buf_len,
+                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        if (!c->rmr) {
+            perror("ibv_reg_mr");
+            goto err_mem;
+        }
+    }
 
-    // Move QP to INIT
-    struct ibv_qp_attr attr = {0};
-    attr.qp_state = IBV_QPS_INIT;
-    attr.pkey_index = 0;
-    attr.port_num = 1;
-    attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
-    if (ibv_modify_qp(qp, &attr,
-                      IBV_QP_STATE |
-                      IBV_QP_PKEY_INDEX |
-                      IBV_QP_PORT |
-                      IBV_QP_ACCESS_FLAGS)) die("ibv_modify_qp to INIT");
+    // A QP already in INIT, warm from the pool with -Q
+    c->qp = qp_pool_get(&srv->qps);
+    if (!c->qp) {
+        perror("ibv_create_qp");
+        goto err_mr;
+    }
+    c->cap = srv->qps.cap;
+
+    /*
+     * Receives for the clients' notification immediates. They must be
+     * posted before the client learns our QPN, or its first
+     * WRITE_WITH_IMM could find none and be RNR NAKed.
+     */
+    if (!srv->qps.init.srq && notify_post_recvs(c->qp, NOTIFY_RECVS)) {
+        perror("ibv_post_recv");
+        goto err_qp;
+    }
 
     // Prepare local connection info
-    struct conn_info local = {0};
-    local.qpn = qp->qp_num;
-    local.psn = (uint32_t)(rand() & 0xffffff);
-    local.rkey = mr->rkey;
-    local.vaddr = (uintptr_t)buf;
-
-    union ibv_gid gid;
-    get_local_gid(ctx, 1, 0, &gid);
-    memcpy(local.gid, gid.raw, 16);
-
-    // 2) TCP listen and exchange connection info
-    int cl = tcp_listen_and_accept(port_str);
-    struct conn_info remote;
-    if (write(cl, &local, sizeof(local)) != sizeof(local))
-	    die("write local conn_info");
-    if (read(cl, &remote, sizeof(remote)) != sizeof(remote))
-	    die("read remote conn_info");
+    c->local.qpn = c->qp->qp_num;
+    c->local.psn = (uint32_t)(rand() & 0xffffff);
+    c->local.rkey = c->rmr ? c->rmr->rkey : 0;
+    c->local.vaddr = (uintptr_t)c->buf;
+    c->local.len = srv->buf_len;
+    c->local.rd_atomic = srv->rd_atomic;
+    ibdev_fill_info(&srv->dev, &c->local);
 
-    printf("Exchanged connection info:\n");
+    // Key-value clients read the shared store instead of their buffer
+    if (srv->kv_buckets) {
+        c->local.rkey = srv->kv.mr->rkey;
+        c->local.vaddr = (uintptr_t)srv->kv.base;
+        c->local.len = srv->kv.size;
+    }
+    if (srv->atomics) {
+        c->local.rkey = srv->at.mr->rkey;
+        c->local.vaddr = (uintptr_t)srv->at.base;
+        c->local.len = AT_SIZE;
+    }
 
-    // Local info
-    printf("Local QPN: %u\n", local.qpn);
-    printf("Local PSN: %u\n", local.psn);
-    printf("Local rkey: 0x%x\n", local.rkey);
-    printf("Local lkey: 0x%x\n", mr->lkey);
-    printf("Local vaddr: 0x%lx\n", (unsigned long)local.vaddr);
-    printf("Local GID: ");
-    for (int i = 0; i < 16; i++) printf("%02x", local.gid[i]);
-    printf("\n\n");
+    c->next = srv->clients;
+    if (c->next) c->next->prev = c;
+    srv->clients = c;
+    c->qpn_next = srv->by_qpn[c->qp->qp_num % QPN_HASH];
+    srv->by_qpn[c->qp->qp_num % QPN_HASH] = c;
+    srv->nclients++;
 
-    // Remote info
-    printf("Remote QPN: %u\n", remote.qpn);
-    printf("Remote PSN: %u\n", remote.psn);
-    printf("Remote rkey: 0x%x\n", remote.rkey);
-    printf("Remote vaddr: 0x%lx\n", (unsigned long)remote.vaddr);
-    printf("Remote GID: ");
-    for (int i = 0; i < 16; i++) printf("%02x", remote.gid[i]);
-    printf("\n");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        perror("epoll_ctl");
+        client_destroy(srv, c);
+        return;
+    }
+
+    /*
+     * A fresh socket always has room for one conn_info, so a short
+     * write here means the client is already gone.
+     */
+    if (write(fd, &c->local, sizeof(c->local)) != sizeof(c->local)) {
+        fprintf(stderr, "Client fd %d: failed to send conn_info\n", fd);
+        client_destroy(srv, c);
+        return;
+    }
+    printf("Client fd %d connected, %d total\n", fd, srv->nclients);
+    return;
+
+err_qp:
+    qp_pool_put(&srv->qps, c->qp);
+err_mr:
+    if (c->rmr)
+        ibv_dereg_mr(c->rmr);
+err_mem:
+    arena_free(&srv->arena, &c->mem);
+err_free:
+    free(c);
+    close(fd);
+}
+
+// Move the client's QP to RTR and RTS once its conn_info is complete
+static int client_connect(struct server *srv, struct client *c) {
+    struct conn_info *remote = &c->remote;
+    struct ibv_qp_attr attr;
 
+    print_conn_info(c);
 
-    // 3) Move QP to RTR
+    // Move QP to RTR, at the smaller of both ports' MTUs
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_1024;
-    attr.dest_qp_num = remote.qpn;
-    attr.rq_psn = remote.psn;
-    attr.max_dest_rd_atomic = 1;
+    attr.path_mtu = ibdev_path_mtu(&srv->dev, remote);
+    attr.dest_qp_num = remote->qpn;
+    attr.rq_psn = remote->psn;
+    // -K GETs keep many in flight, as many as both ends allow
+    attr.max_dest_rd_atomic = conn_rd_atomic(srv->rd_atomic, remote);
     attr.min_rnr_timer = 12;
-    attr.ah_attr.is_global = 1;
-    attr.ah_attr.port_num = 1;
-    memcpy(&attr.ah_attr.grh.dgid, remote.gid, 16);
-    attr.ah_attr.grh.sgid_index = 0;
-    attr.ah_attr.grh.hop_limit = 1;
+    ibdev_fill_ah(&srv->dev, remote, &attr.ah_attr);
+    printf("Path MTU: %d\n", ibdev_mtu_bytes(attr.path_mtu));
 
-    if (ibv_modify_qp(qp, &attr,
+    if (ibv_modify_qp(c->qp, &attr,
                       IBV_QP_STATE |
                       IBV_QP_AV |
                       IBV_QP_PATH_MTU |
                       IBV_QP_DEST_QPN |
                       IBV_QP_RQ_PSN |
                       IBV_QP_MIN_RNR_TIMER |
-                      IBV_QP_MAX_DEST_RD_ATOMIC)) die("ibv_modify_qp to RTR");
+                      IBV_QP_MAX_DEST_RD_ATOMIC)) {
+        perror("ibv_modify_qp to RTR");
+        return -1;
+    }
 
-    // 4) Move QP to RTS
+    // Move QP to RTS
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTS;
     attr.timeout = 14;
     attr.retry_cnt = 7;
     attr.rnr_retry = 7;
-    attr.sq_psn = local.psn;
+    attr.sq_psn = c->local.psn;
     attr.max_rd_atomic = 1;
-    if (ibv_modify_qp(qp, &attr,
+    if (ibv_modify_qp(c->qp, &attr,
                       IBV_QP_STATE |
                       IBV_QP_TIMEOUT |
                       IBV_QP_RETRY_CNT |
                       IBV_QP_RNR_RETRY |
                       IBV_QP_SQ_PSN |
-                      IBV_QP_MAX_QP_RD_ATOMIC)) die("ibv_modify_qp to RTS");
+                      IBV_QP_MAX_QP_RD_ATOMIC)) {
+        perror("ibv_modify_qp to RTS");
+        return -1;
+    }
 
-    printf("QP moved to RTS. Waiting for client RDMA_WRITE...\n");
+    if (srv->latency) {
+        if (remote->len < srv->size) {
+            fprintf(stderr, "Client buffer %u is smaller than message size %u\n",
+                    remote->len, srv->size);
+            return -1;
+        }
+        printf("Client fd %d: QP moved to RTS. Answering %llu ping-pongs of %u bytes...\n",
+               c->fd, (unsigned long long)srv->iters, srv->size);
+        pp_init(&c->pp, c->qp, srv->cq, c->mr, c->buf, srv->buf_len,
+                srv->size, remote, c->cap.max_send_wr, c->cap.max_inline_data);
+        srv->active++;
+    } else if (srv->kv_buckets) {
+        printf("Client fd %d: QP moved to RTS. Serving PUTs, GETs are one-sided...\n",
+               c->fd);
+    } else if (srv->atomics) {
+        printf("Client fd %d: QP moved to RTS. Atomics are one-sided...\n", c->fd);
+    } else if (srv->file_dir) {
+        printf("Client fd %d: QP moved to RTS. Waiting for a file...\n", c->fd);
+    } else {
+        printf("Client fd %d: QP moved to RTS. Waiting for client RDMA_WRITE...\n",
+               c->fd);
+    }
+    c->ready = 1;
+    return 0;
+}
+
+/*
+ * -I: check the CRC32C trailer of a message that has fully landed. Only
+ * the first mismatch is reported, the rest are counted.
+ */
+static void client_verify(struct client *c, const void *msg, uint32_t len) {
+    if (!crc32c_check(msg, len)) {
+        c->crc_ok++;
+        return;
+    }
+    if (!c->crc_bad++)
+        fprintf(stderr, "Client fd %d: CRC32C mismatch in a %u byte message\n",
+                c->fd, len);
+}
+
+/*
+ * The client's transfer is complete; via says how we were told. With
+ * -I the RDMA_WRITTEN buffer is verified now: the notification is
+ * ordered after the writes, so they have all landed.
+ */
+static void client_done(struct server *srv, struct client *c, const char *via) {
+    if (srv->integrity && !srv->messaging)
+        client_verify(c, c->buf, srv->size);
+    if (srv->messaging) {
+        printf("Client fd %d signaled completion (%s): %llu messages, %llu bytes received\n",
+               c->fd, via, (unsigned long long)c->msgs, (unsigned long long)c->bytes);
+        return;
+    }
+    printf("Client fd %d signaled completion (%s).\nServer buffer content (first 256 bytes):\n",
+           c->fd, via);
+    fwrite(c->buf, 1, SIZE < 256 ? SIZE : 256, stdout);
+    printf("\n");
+}
+
+/*
+ * File receive (-F)
+ *
+ * Grants go out on the non-blocking socket. They are 16 bytes and at
+ * most FILE_GRANTS are unread by the client, so they always fit; a
+ * short write means the client is gone.
+ */
+static int file_grant(struct client *c, uint32_t seg, uint32_t rkey,
+                      uint64_t vaddr) {
+    struct file_grant g = { .seg = seg, .rkey = rkey, .vaddr = vaddr };
+
+    return write(c->fd, &g, sizeof(g)) == sizeof(g) ? 0 : -1;
+}
+
+// Hand out the next segment of the mapping, registering it if chunked
+static int file_grant_next(struct server *srv, struct client *c) {
+    struct file_rx *rx = c->rx;
+    uint32_t seg = rx->granted++;
+    struct ibv_mr *mr = file_seg_get(&rx->map, srv->pd, seg);
+
+    if (!mr) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+    return file_grant(c, seg, mr->rkey,
+                      (uintptr_t)rx->map.addr + (uint64_t)seg * FILE_SEG);
+}
+
+// Every byte is in the file's pages: report, and tell the client
+static int file_finish(struct client *c) {
+    struct file_rx *rx = c->rx;
+    double sec = (now_ns() - rx->start_ns) / 1e9;
+
+    printf("Client fd %d: received %s, %llu bytes in %.3f s, %.3f GB/s (%s",
+           c->fd, rx->path, (unsigned long long)rx->map.size, sec,
+           sec ? rx->map.size / sec / 1e9 : 0,
+           rx->hdr.mode == FILE_TCP ? "read()/write() over TCP" :
+           file_map_kind(&rx->map));
+    if (rx->hdr.mode == FILE_RDMA)
+        printf(", %.3f s registering", rx->map.reg_ns / 1e9);
+    printf(")\n");
+
+    file_map_close(&rx->map);
+    free(rx->buf);
+    free(rx->seg_done);
+    free(rx);
+    c->rx = NULL;
+    return file_grant(c, FILE_DONE, 0, 0);
+}
+
+// The header is complete: create the destination and start the transfer
+static int file_start(struct server *srv, struct client *c) {
+    struct file_rx *rx = c->rx;
+    struct file_hdr *h = &rx->hdr;
+
+    h->name[FILE_NAME - 1] = '\0';
+    if (h->magic != FILE_MAGIC || (h->mode != FILE_RDMA && h->mode != FILE_TCP) ||
+        !h->name[0] || strchr(h->name, '/') ||
+        !strcmp(h->name, ".") || !strcmp(h->name, "..")) {
+        fprintf(stderr, "Client fd %d: bad file header\n", c->fd);
+        return -1;
+    }
+    snprintf(rx->path, sizeof(rx->path), "%s/%s", srv->file_dir, h->name);
+    if (file_map_dst(&rx->map, rx->path, h->size)) {
+        perror(rx->path);
+        return -1;
+    }
+    printf("Client fd %d: receiving %s, %llu bytes\n", c->fd, rx->path,
+           (unsigned long long)h->size);
+    rx->start_ns = now_ns();
+
+    if (h->mode == FILE_TCP) {
+        rx->buf = malloc(FILE_WR);
+        if (!rx->buf) {
+            perror("malloc");
+            return -1;
+        }
+        return h->size ? 0 : file_finish(c);
+    }
+
+    if (file_map_reg(&rx->map, srv->pd,
+                     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE,
+                     srv->file_odp)) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+    if (!rx->map.nseg)
+        return file_finish(c);
+    rx->seg_done = calloc((rx->map.nseg + 63) / 64, sizeof(*rx->seg_done));
+    if (!rx->seg_done) {
+        perror("calloc");
+        return -1;
+    }
+    while (rx->granted < rx->map.nseg && rx->granted < FILE_GRANTS)
+        if (file_grant_next(srv, c))
+            return -1;
+    return 0;
+}
+
+/*
+ * Socket readable in -F mode: more of a file header, file data with
+ * FILE_TCP, or EOF. Returns -1 if the client is to be dropped.
+ */
+static int file_readable(struct server *srv, struct client *c) {
+    struct file_rx *rx = c->rx;
+    ssize_t r;
+
+    if (!rx) {
+        rx = c->rx = calloc(1, sizeof(*rx));
+        if (!rx) {
+            perror("calloc");
+            return -1;
+        }
+        rx->map.fd = -1;
+    }
+    if (rx->have < sizeof(rx->hdr)) {
+        r = read(c->fd, (char *)&rx->hdr + rx->have, sizeof(rx->hdr) - rx->have);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (r <= 0)
+            return -1;
+        rx->have += r;
+        return rx->have == sizeof(rx->hdr) ? file_start(srv, c) : 0;
+    }
+    if (rx->hdr.mode != FILE_TCP) {
+        // Nothing more is sent during an RDMA transfer, so this is EOF
+        char b;
+        r = read(c->fd, &b, 1);
+        return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    uint64_t left = rx->map.size - rx->got;
+    r = read(c->fd, rx->buf, left < FILE_WR ? left : FILE_WR);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0 || pwrite(rx->map.fd, rx->buf, r, rx->got) != r)
+        return -1;
+    rx->got += r;
+    return rx->got == rx->map.size ? file_finish(c) : 0;
+}
+
+/*
+ * A segment's closing immediate arrived: RC has placed all of its
+ * writes, so unpin it and grant the next one. A segment that is
+ * already done is ignored, so a repeated immediate cannot finish the
+ * file before every segment has been written.
+ */
+static int file_segment_done(struct server *srv, struct client *c, uint32_t seg) {
+    struct file_rx *rx = c->rx;
+
+    if (!rx || rx->hdr.mode != FILE_RDMA || seg >= rx->granted) {
+        fprintf(stderr, "Client fd %d: unexpected segment %u\n", c->fd, seg);
+        return -1;
+    }
+    uint64_t bit = 1ull << (seg % 64);
+    if (rx->seg_done[seg / 64] & bit) {
+        fprintf(stderr, "Client fd %d: segment %u is done already\n", c->fd, seg);
+        return 0;
+    }
+    rx->seg_done[seg / 64] |= bit;
+    file_seg_put(&rx->map, seg);
+    if (++rx->done == rx->map.nseg)
+        return file_finish(c);
+    if (rx->granted < rx->map.nseg)
+        return file_grant_next(srv, c);
+    return 0;
+}
+
+/*
+ * A notification immediate arrived (see notify.h). Answer it right away
+ * if the client asked for that, with a zero-length WRITE_WITH_IMM that
+ * echoes the value; the client is timing the round trip (-e).
+ */
+static void client_notified(struct server *srv, struct client *c,
+                            uint32_t imm, int own_recv) {
+    char via[32];
+
+    if (own_recv && notify_post_recvs(c->qp, 1)) {
+        perror("ibv_post_recv");
+        client_destroy(srv, c);
+        return;
+    }
+    if (imm & NOTIFY_ACK) {
+        if (srv->integrity)
+            client_verify(c, c->buf, srv->size);
+        if (notify_post(c->qp, NULL, 0, 0, c->remote.vaddr, c->remote.rkey,
+                        imm, 0, IBV_SEND_SIGNALED)) {
+            perror("ibv_post_send ack");
+            client_destroy(srv, c);
+        }
+        return;
+    }
+    if (srv->file_dir) {
+        if (file_segment_done(srv, c, imm & NOTIFY_VAL_MASK))
+            client_destroy(srv, c);
+        return;
+    }
+    snprintf(via, sizeof(via), "immediate %u", imm & NOTIFY_VAL_MASK);
+    client_done(srv, c, via);
+}
+
+/*
+ * Socket readable: either more of the client's conn_info, or EOF when
+ * it leaves. Clients started with -d still announce the end of their
+ * transfer with "DONE" here, or ask for an "ACK" with "SYNC".
+ */
+static void client_readable(struct server *srv, struct client *c) {
+    if (!c->ready) {
+        ssize_t r = read(c->fd, (char *)&c->remote + c->have,
+                         sizeof(c->remote) - c->have);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r <= 0) {
+            client_destroy(srv, c);
+            return;
+        }
+        c->have += r;
+        if (c->have == sizeof(c->remote) && client_connect(srv, c))
+            client_destroy(srv, c);
+        return;
+    }
+    if (srv->file_dir) {
+        if (file_readable(srv, c))
+            client_destroy(srv, c);
+        return;
+    }
 
-    // 5) Wait for client completion notification
     char donebuf[16];
-    ssize_t r = read(cl, donebuf, sizeof(donebuf));
-    if (r <= 0) fprintf(stderr, "Failed to read client done (r=%zd)\n", r);
-    else {
-        printf("Client signaled completion.\nServer buffer content (first 256 bytes):\n");
-        fwrite(buf, 1, SIZE < 256 ? SIZE : 256, stdout);
-        printf("\n");
+    ssize_t r = read(c->fd, donebuf, sizeof(donebuf));
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (r <= 0) {
+        client_destroy(srv, c);
+        return;
+    }
+    if (!strncmp(donebuf, "SYNC", r)) {
+        if (srv->integrity)
+            client_verify(c, c->buf, srv->size);
+        // A fresh reply always fits into the socket buffer
+        if (write(c->fd, "ACK", 4) != 4)
+            client_destroy(srv, c);
+        return;
     }
+    client_done(srv, c, "TCP");
+}
 
-    // Cleanup
-    close(cl);
-    ibv_dereg_mr(mr);
-    ibv_destroy_qp(qp);
-    ibv_destroy_cq(cq);
-    ibv_dealloc_pd(pd);
-    ibv_close_device(ctx);
-    ibv_free_device_list(dev_list);
-    free(buf);
+/*
+ * A PUT arrived through the SRQ: apply it to the store and answer with
+ * its status as an immediate. The store is only ever written here, by
+ * the event loop thread. Returns -1 if the client had to be dropped.
+ */
+static int client_put(struct server *srv, struct client *c,
+                       const char *msg, uint32_t len) {
+    const struct kv_put_msg *put = (const struct kv_put_msg *)msg;
+    enum kv_status st = KV_BADMSG;
 
+    if (len >= sizeof(*put) && put->val_len <= len - sizeof(*put))
+        st = kv_put(&srv->kv, put->key, put->val, put->val_len);
+    if (notify_post(c->qp, NULL, 0, 0, c->remote.vaddr, c->remote.rkey,
+                    st, 0, IBV_SEND_SIGNALED)) {
+        perror("ibv_post_send PUT reply");
+        client_destroy(srv, c);
+        return -1;
+    }
     return 0;
 }
 
+static void accept_clients(struct server *srv) {
+    for (;;) {
+        int fd = accept4(srv->lfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        client_create(srv, fd);
+    }
+}
+
+/*
+ * Completions are mapped back to their client through the QP number; a
+ * failed WR means the connection is broken and the client is dropped.
+ * Receive buffers go back to the SRQ pool whatever their status, even
+ * if their client is already gone. Notification immediates arrive on
+ * the SRQ with -m, otherwise on receives posted to the client's QP.
+ * A client whose QP is not in RTS yet cannot have completions of its
+ * own; client_destroy() already reaps those of a QP's last connection
+ * before -Q hands the QP out again, so this is only a safety net.
+ */
+static void handle_wcs(struct server *srv, struct ibv_wc *wc, int ne) {
+    srv->in_wcs++;
+    for (int i = 0; i < ne; i++) {
+        struct client *c = client_by_qpn(srv, wc[i].qp_num);
+        if (c && !c->ready)
+            c = NULL;   // left over from a recycled QP's last connection
+        if (srq_is_recv(wc[i].wr_id)) {
+            if (c && wc[i].status == IBV_WC_SUCCESS &&
+                wc[i].opcode == IBV_WC_RECV) {
+                c->msgs++;
+                c->bytes += wc[i].byte_len;
+                if (srv->integrity)
+                    client_verify(c, srq_buf(&srv->srq, wc[i].wr_id),
+                                  wc[i].byte_len);
+                if (srv->kv_buckets &&
+                    client_put(srv, c, srq_buf(&srv->srq, wc[i].wr_id),
+                               wc[i].byte_len))
+                    c = NULL;   // dropped, its buffer still goes back
+            }
+            srq_release(&srv->srq, wc[i].wr_id);
+        }
+        if (!c)
+            continue;   // client already destroyed
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "Client fd %d: wc.status=%d (%s)\n", c->fd,
+                    wc[i].status, ibv_wc_status_str(wc[i].status));
+            client_destroy(srv, c);
+            continue;
+        }
+        if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+            client_notified(srv, c, notify_imm(&wc[i]),
+                            wc[i].wr_id == NOTIFY_WRID);
+        else if (wc[i].opcode == IBV_WC_RDMA_WRITE)
+            c->pp.pending = 0;
+    }
+    srv->in_wcs--;
+}
+
+// Drain the shared CQ in batches of CQE_BATCH, after what reap_cq() held
+static int drain_cq(struct server *srv) {
+    struct ibv_wc wc[CQE_BATCH];
+    int total = srv->nheld, ne;
+
+    srv->nheld = 0;
+    handle_wcs(srv, srv->held, total);
+    do {
+        ne = cq_engine_poll(&srv->cqe, wc, CQE_BATCH);
+        handle_wcs(srv, wc, ne);
+        total += ne;
+    } while (ne == CQE_BATCH);
+
+    return total;
+}
+
+/*
+ * Arm the CQ before the loop goes to sleep. Returns non-zero if
+ * completions slipped in meanwhile, in which case it must not sleep.
+ * A full batch is followed by a drain, so the CQ is always left empty.
+ */
+static int arm_cq(struct server *srv) {
+    struct ibv_wc wc[CQE_BATCH];
+    int ne = cq_engine_arm(&srv->cqe, wc, CQE_BATCH);
+
+    handle_wcs(srv, wc, ne);
+    if (ne == CQE_BATCH)
+        ne += drain_cq(srv);
+    return ne;
+}
+
+/*
+ * Answer every ping that has landed. A client whose next write would
+ * have to wait for its signaled completion is skipped until drain_cq()
+ * has reaped it.
+ */
+static void serve_pingpongs(struct server *srv) {
+    for (struct client *c = srv->clients; c; c = c->next) {
+        if (!c->ready || c->iter == srv->iters)
+            continue;
+
+        uint8_t m = pp_marker(c->iter);
+        if (!pp_arrived(&c->pp, m) || !pp_send_ready(&c->pp))
+            continue;
+        pp_send(&c->pp, m);
+        if (++c->iter == srv->iters)
+            srv->active--;
+    }
+}
+
+/*
+ * -x shm: the default mode through the transport interface (xport.h),
+ * for rdma_client -x shm on this host. No HCA is opened; each client
+ * swaps shared-memory segments with us over the Unix socket at path,
+ * WRITEs into its buffer, and says "DONE" on the socket when the last
+ * write has completed. Clients are served one after the other.
+ */
+static void serve_xport(const struct server *srv, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t seg = (srv->buf_len + XPORT_SHM_ALIGN + 4095) & ~4095ul;
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(lfd, BACKLOG))
+        die("bind unix socket");
+    printf("shm transport, waiting on %s\n", path);
+
+    // No SA_RESTART, so a signal gets the loop out of accept()
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop) {
+        struct conn_info local = {0}, remote;
+        struct xport_mr mr;
+        char done[5];
+
+        int sock = accept(lfd, NULL, NULL);
+        if (sock < 0)
+            continue;
+        struct xport *x = xport_shm_open(sock, NOTIFY_RECVS, seg, 0);
+        if (xport_mr_alloc(x, srv->buf_len, &mr))
+            die("xport_mr_alloc");
+        strcpy(mr.addr, "INITIAL SERVER CONTENT");
+        local.rkey = mr.rkey;
+        local.vaddr = (uintptr_t)mr.addr;
+        local.len = srv->buf_len;
+        xfer(sock, &local, sizeof(local), 1);
+        xfer(sock, &remote, sizeof(remote), 0);
+        printf("Client fd %d connected over %s. Waiting for client writes...\n",
+               sock, x->ops->name);
+
+        if (recv(sock, done, sizeof(done), MSG_WAITALL) == sizeof(done)) {
+            printf("Client fd %d signaled completion (DONE).\nServer buffer content (first 256 bytes):\n",
+                   sock);
+            fwrite(mr.addr, 1, SIZE < 256 ? SIZE : 256, stdout);
+            printf("\n");
+        } else {
+            printf("Client fd %d disconnected without DONE\n", sock);
+        }
+
+        xport_mr_free(x, &mr);
+        xport_close(x);
+        close(sock);
+    }
+    close(lfd);
+    unlink(path);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <port> [-l|-m|-K buckets|-A|-F dir] [-s size] [-n iters] [-c count] [-p spin_us]\n"
+            "          [-R rd_atomic] [-Q pool] [-I]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index] [-M mtu] [-N node]\n"
+            "       %s -x shm <socket_path> [-s size]\n"
+            "  -x shm     serve rdma_client -x shm on this host over shared\n"
+            "             memory, no HCA needed (default: verbs)\n"
+            "  -l         answer the clients' RDMA_WRITE ping-pong\n"
+            "  -m         receive SEND messages through a shared receive queue\n"
+            "  -K buckets serve a key-value store with this many hash buckets:\n"
+            "             GETs are the clients' RDMA_READs, PUTs come as SENDs\n"
+            "  -A         expose counter and lock words to the clients' RDMA\n"
+            "             atomics (atomics.h)\n"
+            "  -F dir     receive the clients' -f files into this directory,\n"
+            "             written straight into their mmap'd pages\n"
+            "  -I         verify the CRC32C trailer of every message from -I\n"
+            "             clients: each SEND with -m, else the -s bytes of the\n"
+            "             buffer when a transfer is notified\n"
+            "  -s size    message size, the RDMA_WRITE target buffer and the\n"
+            "             SRQ buffers are at least this large; with -K the\n"
+            "             largest value (default %d)\n"
+            "  -n iters   ping-pong round trips, must match the client\n"
+            "  -c count   client buffers to pre-register (default %d)\n"
+            "  -p spin_us keep polling the CQ this long after the last\n"
+            "             completion before sleeping, -1 = never sleep (default 0)\n"
+            "  -Q pool    keep this many QPs in INIT for new clients, and reset\n"
+            "             a leaving client's QP into the pool instead of\n"
+            "             destroying it (default 0: create and destroy each)\n"
+            "  -R n       RDMA_READs/atomics a client may have outstanding\n"
+            "             (max_dest_rd_atomic, default: device limit up to %d;\n"
+            "             a client with a smaller -R gets that)\n"
+            "  -D dev     use this HCA (default: the first one)\n"
+            "  -P pnetid  use the HCA port with this PNET ID (s390)\n"
+            "  -i port    HCA port (default: the first active one)\n"
+            "  -G index   GID index (default: a RoCE v2 IPv4 entry)\n"
+            "  -M mtu     cap the path MTU: 256, 512, 1024, 2048 or 4096\n"
+            "             (default: the ports' active MTU)\n"
+            "  -N node    put the event loop and memory on this NUMA node,\n"
+            "             -1 = leave them where they are (default: the HCA's node)\n",
+            prog, prog, SIZE, MAX_CLIENTS, MAX_RD_ATOMIC);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct server srv = {
+        .size = SIZE,
+        .iters = 1000000,
+    };
+    uint32_t max_clients = MAX_CLIENTS;
+    uint64_t spin_ns = 0;
+    uint32_t rd_atomic = MAX_RD_ATOMIC;
+    uint32_t pool_size = 0;
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    int shm = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:lmIK:AF:s:n:c:p:Q:R:D:P:i:G:M:N:")) != -1) {
+        switch (opt) {
+        case 'l': srv.latency = 1; break;
+        case 'm': srv.messaging = 1; break;
+        case 'I': srv.integrity = 1; break;
+        case 'x':
+            if (!strcmp(optarg, "shm"))
+                shm = 1;
+            else if (strcmp(optarg, "verbs"))
+                usage(argv[0]);
+            break;
+        case 'K': srv.kv_buckets = strtoul(optarg, NULL, 0); break;
+        case 'A': srv.atomics = 1; break;
+        case 'F': srv.file_dir = optarg; break;
+        case 's': srv.size = strtoul(optarg, NULL, 0); break;
+        case 'n': srv.iters = strtoull(optarg, NULL, 0); break;
+        case 'c': max_clients = strtoul(optarg, NULL, 0); break;
+        case 'p': spin_ns = cq_spin_ns(optarg); break;
+        case 'Q': pool_size = strtoul(optarg, NULL, 0); break;
+        case 'R': rd_atomic = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        case 'M': dev_opts.mtu = atoi(optarg); break;
+        case 'N': dev_opts.numa_node = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || (srv.latency + srv.messaging + !!srv.kv_buckets + srv.atomics + !!srv.file_dir > 1) ||
+        !srv.size || !srv.iters || !max_clients || !rd_atomic ||
+        (srv.integrity && (srv.latency || srv.kv_buckets || srv.atomics ||
+                           srv.file_dir || srv.size <= CRC32C_TRAILER)) ||
+        (shm && (srv.latency || srv.messaging || srv.kv_buckets ||
+                 srv.atomics || srv.file_dir || srv.integrity)) ||
+        (dev_opts.mtu && !ibdev_mtu_enum(dev_opts.mtu)))
+        usage(argv[0]);
+
+    srv.buf_len = srv.size > SIZE ? srv.size : SIZE;
+    if (srv.kv_buckets && srv.buf_len < sizeof(struct kv_put_msg) + srv.size)
+        srv.buf_len = sizeof(struct kv_put_msg) + srv.size;    // SRQ buffers
+    char *port_str = argv[optind];
+
+    if (shm) {
+        serve_xport(&srv, argv[optind]);
+        return 0;
+    }
+
+    /*
+     * 1) Open the RDMA device and port that -D/-P/-i select, and move to
+     *    the HCA's NUMA node before anything is allocated: the arena,
+     *    the SRQ, the CQ and the event loop polling it all end up there.
+     */
+    if (ibdev_open(&srv.dev, &dev_opts)) die("ibdev_open");
+    ibdev_place(&srv.dev, &dev_opts);
+    ibdev_print(&srv.dev);
+    srv.ctx = srv.dev.ctx;
+
+    srv.pd = ibv_alloc_pd(srv.ctx);
+    if (!srv.pd) die("ibv_alloc_pd");
+
+    /*
+     * One CQ for every client QP, so completions are reaped with a
+     * single batched poll no matter how many clients are connected.
+     * Its completion channel sits in the epoll set next to the sockets.
+     */
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(srv.ctx, &dev_attr)) die("ibv_query_device");
+    int cq_depth = dev_attr.max_cqe < CQ_DEPTH ? dev_attr.max_cqe : CQ_DEPTH;
+    cq_engine_create(&srv.cqe, srv.ctx, cq_depth, spin_ns);
+    srv.cq = srv.cqe.cq;
+
+    /*
+     * Responder resources for incoming RDMA_READs and atomics: with only
+     * one, every client's READs would be served one at a time however
+     * many it posts. -R sets it, up to what the device allows.
+     */
+    srv.rd_atomic = (uint32_t)dev_attr.max_qp_rd_atom < rd_atomic ?
+                    dev_attr.max_qp_rd_atom : rd_atomic;
+
+    if (srv.atomics) {
+        if (dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+            fprintf(stderr, "%s does not support RDMA atomics\n", srv.dev.name);
+            exit(1);
+        }
+        if (at_region_create(&srv.at, srv.pd))
+            die("at_region_create");
+        printf("Registered atomic words (%s atomicity), max_dest_rd_atomic %u\n",
+               dev_attr.atomic_cap == IBV_ATOMIC_GLOB ? "global" : "HCA",
+               srv.rd_atomic);
+    }
+
+    if (srv.file_dir) {
+        srv.file_odp = file_odp_ok(srv.ctx, IBV_ODP_SUPPORT_WRITE);
+        printf("Receiving files into %s, %s\n", srv.file_dir, srv.file_odp ?
+               "ODP registered" : "registered in chunks (no ODP)");
+    }
+    if (srv.integrity)
+        printf("Verifying CRC32C trailers, %s\n", crc32c_impl());
+
+    /*
+     * Every client buffer comes from one arena that is allocated, pinned
+     * and registered here, once, instead of per connection. Its MR has
+     * no remote access; see client_create().
+     */
+    size_t client_len = srv.latency ? 2 * (size_t)srv.buf_len : srv.buf_len;
+    if (arena_create(&srv.arena, srv.pd,
+                     max_clients * (ARENA_MIN_SIZE << arena_class(client_len)),
+                     IBV_ACCESS_LOCAL_WRITE))
+        die("arena_create");
+    printf("Registered %zu MB buffer arena (%s pages) for %u clients\n",
+           srv.arena.size >> 20, srv.arena.huge ? "huge" : "normal", max_clients);
+
+    if (srv.messaging || srv.kv_buckets)
+        srq_create(&srv.srq, srv.pd, SRQ_DEPTH, srv.buf_len, SRQ_BATCH);
+    if (srv.kv_buckets) {
+        if (kv_store_create(&srv.kv, srv.pd, srv.kv_buckets, srv.size))
+            die("kv_store_create");
+        printf("Registered %zu MB key-value store: %u buckets, values up to %u bytes\n",
+               srv.kv.size >> 20, srv.kv_buckets, srv.size);
+    }
+
+    /*
+     * Every client QP is alike, so they all come from one pool: with -Q
+     * that many wait in INIT, and a client that leaves returns its QP
+     * there instead of destroying it (qp_pool.h).
+     */
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    qp_init_attr.send_cq = srv.cq;
+    qp_init_attr.recv_cq = srv.cq;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr = 10;
+    qp_init_attr.cap.max_recv_wr = 10;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    if (srv.messaging || srv.kv_buckets)
+        qp_init_attr.srq = srv.srq.srq;     // receives come from the SRQ
+    else
+        qp_init_attr.cap.max_recv_wr = NOTIFY_RECVS;
+    if (srv.latency && srv.size <= PP_MAX_INLINE)
+        qp_init_attr.cap.max_inline_data = srv.size;
+    int access = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    if (srv.atomics)
+        access |= IBV_ACCESS_REMOTE_ATOMIC;
+    if (qp_pool_create(&srv.qps, srv.pd, &srv.dev, &qp_init_attr, access,
+                       pool_size))
+        die("qp_pool_create");
+    if (pool_size)
+        printf("QP pool: %u QPs waiting in INIT\n", pool_size);
+
+    // 2) TCP listen; connections are accepted from the epoll loop
+    srv.lfd = tcp_listen(port_str, BACKLOG);
+    if (fcntl(srv.lfd, F_SETFL, fcntl(srv.lfd, F_GETFL) | O_NONBLOCK))
+        die("fcntl");
+    printf("Server listening on port %s ...\n", port_str);
+    srv.epfd = epoll_create1(0);
+    if (srv.epfd < 0) die("epoll_create1");
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.lfd, &ev)) die("epoll_ctl");
+    ev.data.ptr = &srv.cqe;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, cq_engine_fd(&srv.cqe), &ev))
+        die("epoll_ctl");
+
+    /*
+     * 3) Event loop
+     *
+     * While ping-pongs are in progress, and for -p us after the last
+     * completion, the loop spins (timeout 0) to keep latency low.
+     * Otherwise it arms the CQ and sleeps in epoll_wait() until a socket
+     * or the completion channel wakes it up. SIGINT/SIGTERM end the
+     * loop and tear down whatever clients are still connected.
+     */
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    uint64_t last_wc = 0;
+    int timeout = -1;
+    while (!stop) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(srv.epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!events[i].data.ptr)
+                accept_clients(&srv);
+            else if (events[i].data.ptr == &srv.cqe)
+                cq_engine_ack_events(&srv.cqe);
+            else
+                client_readable(&srv, events[i].data.ptr);
+        }
+
+        if (drain_cq(&srv))
+            last_wc = now_ns();
+        if (srv.active)
+            serve_pingpongs(&srv);
+
+        if (srv.active || now_ns() - last_wc < srv.cqe.spin_ns || arm_cq(&srv))
+            timeout = 0;
+        else
+            timeout = -1;
+    }
+
+    // Cleanup
+    while (srv.clients)
+        client_destroy(&srv, srv.clients);
+    if (pool_size)
+        printf("QP pool: %llu created, %llu reused, %llu recycled, %llu destroyed\n",
+               (unsigned long long)srv.qps.created, (unsigned long long)srv.qps.reused,
+               (unsigned long long)srv.qps.recycled, (unsigned long long)srv.qps.destroyed);
+    qp_pool_destroy(&srv.qps);
+    free(srv.held);
+    if (srv.messaging || srv.kv_buckets)
+        srq_destroy(&srv.srq);
+    if (srv.kv_buckets) {
+        printf("Key-value store: %llu PUTs, %llu rejected for full buckets\n",
+               (unsigned long long)srv.kv.puts, (unsigned long long)srv.kv.full);
+        kv_store_destroy(&srv.kv);
+    }
+    if (srv.atomics)
+        at_region_destroy(&srv.at);
+    arena_destroy(&srv.arena);
+    close(srv.lfd);
+    close(srv.epfd);
+    cq_engine_destroy(&srv.cqe);
+    ibv_dealloc_pd(srv.pd);
+    ibdev_close(&srv.dev);
+
+    return 0;
+}
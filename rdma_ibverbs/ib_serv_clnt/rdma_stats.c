@@ -0,0 +1,102 @@
+// rdma_stats.c
+// Reads the WR stats page of a running rdma_client -S (wr_stats.h) without
+// stopping it: per-thread WR counts, rates and post-to-completion latency.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "common.h"
+#include "hist.h"
+#include "wr_stats.h"
+
+struct sample {
+    uint64_t posted, completed;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <name> [-i interval_ms] [-c count]\n"
+            "  name         the page given to rdma_client -S\n"
+            "  -i interval  print every interval ms, with the rates in\n"
+            "               between (default: print once)\n"
+            "  -c count     stop after count prints (default: until the\n"
+            "               page goes away or on Ctrl-C)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static struct hist h;
+    unsigned interval = 0;
+    long count = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:c:")) != -1) {
+        switch (opt) {
+        case 'i': interval = strtoul(optarg, NULL, 0); break;
+        case 'c': count = strtol(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+
+    char name[WR_STATS_NAME];
+    snprintf(name, sizeof(name), "%s%s", argv[optind][0] == '/' ? "" : "/",
+             argv[optind]);
+    const struct wr_stats_page *p = wr_stats_attach(name);
+    if (!p)
+        die(name);
+
+    struct sample *last = calloc(p->nthreads, sizeof(*last));
+    if (!last)
+        die("calloc");
+    printf("pid %d, %u threads, %s\n", p->pid, p->nthreads, p->ts_source);
+
+    uint64_t prev_ns = 0;
+    for (long n = 0; count < 0 || n < count; n++) {
+        uint64_t t = now_ns();
+        double dt = prev_ns ? (t - prev_ns) / 1e9 : 0;
+
+        printf("%8.3f s: cq_overruns %llu, async events %llu\n",
+               (t - p->start_ns) / 1e9,
+               (unsigned long long)wr_stats_get(&p->cq_overruns),
+               (unsigned long long)wr_stats_get(&p->async_events));
+        for (uint32_t i = 0; i < p->nthreads; i++) {
+            const struct wr_stats *s = &p->thread[i];
+            struct sample now = {
+                .posted = wr_stats_get(&s->posted),
+                .completed = wr_stats_get(&s->completed),
+            };
+
+            wr_stats_read_lat(s, &h);
+            printf("  thread %u: %llu posted, %llu completed, %llu failed",
+                   i, (unsigned long long)now.posted,
+                   (unsigned long long)now.completed,
+                   (unsigned long long)wr_stats_get(&s->errors));
+            if (dt)
+                printf(", %.3f Mwr/s", (now.completed - last[i].completed) / dt / 1e6);
+            printf("\n    latency (us): p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+                   hist_percentile(&h, 50) / 1e3, hist_percentile(&h, 99) / 1e3,
+                   hist_percentile(&h, 99.9) / 1e3, h.max / 1e3);
+            last[i] = now;
+        }
+        fflush(stdout);
+        prev_ns = t;
+
+        if (!interval)
+            break;
+        usleep(interval * 1000);
+        // The mapping outlives the page's name, so ask about the writer
+        if (kill(p->pid, 0) && errno == ESRCH) {
+            printf("pid %d has exited\n", p->pid);
+            break;
+        }
+    }
+
+    free(last);
+    return 0;
+}
@@ -0,0 +1,592 @@
+#ifndef RPC_HPP
+#define RPC_HPP
+
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include "common.h"
+#include "ibdev.h"
+#include "verbs.hpp"
+
+/*
+ * Coroutine RPC over verbs SEND/RECV
+ *
+ * Each thread runs one Scheduler. It owns a CQ shared by that thread's
+ * Connections. run() polls the CQ and, for each completion, resumes
+ * the coroutine that waits for it. A call reads like blocking code:
+ *
+ *     rpc::Reply r = co_await conn.call(method, request);
+ *
+ * The call copies the request into a registered send buffer, posts a
+ * SEND whose wr_id is that buffer's slot, and suspends. The slot
+ * number travels in the message header as the tag. The response
+ * carries the same tag back into one of the connection's posted
+ * receive buffers, and that tag names the call to resume. The Reply is
+ * read in place, and destroying it reposts the buffer.
+ *
+ * A Connection has depth send and depth receive buffers, so at most
+ * depth calls are in flight on it. Further calls queue in FIFO order
+ * for a free slot, linked through their awaiters. Buffers, slots and
+ * waiter links live in the pools and in coroutine frames that exist
+ * before the steady state, so a call allocates nothing.
+ *
+ * A server registers one plain function per Connection with serve().
+ * run() calls it for each request, with the response buffer to fill.
+ *
+ * Nothing here is thread safe. A failed completion or a malformed
+ * message throws out of Scheduler::run(). Connections must be
+ * destroyed before their Scheduler, and Replies before their
+ * Connection.
+ */
+namespace rpc {
+
+struct Header {
+    uint32_t tag;               // caller's send slot, echoed in the response
+    uint16_t method;
+    uint16_t status;
+    uint32_t len;               // payload bytes after the header
+    uint32_t pad;
+};
+
+class Scheduler;
+class Connection;
+
+/* --- Task ----------------------------------------------------------- */
+
+template <typename T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    Scheduler *root = nullptr;  // set for tasks started by spawn()
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object() noexcept;
+    template <typename U> void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+    T result() {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+    void result() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+/*
+ * A lazily started coroutine. co_await on a Task runs it and resumes
+ * the awaiting coroutine once it finishes, with its result or
+ * exception; top-level tasks are handed to Scheduler::spawn().
+ */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+    using promise_type = detail::Promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    explicit Task(handle_type h) noexcept : h_(h) {}
+    Task(Task &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+    Task &operator=(Task &&o) noexcept {
+        if (this != &o) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(o.h_, {});
+        }
+        return *this;
+    }
+    ~Task() {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        h_.promise().continuation = caller;
+        return h_;
+    }
+    T await_resume() { return h_.promise().result(); }
+
+    handle_type release() noexcept { return std::exchange(h_, {}); }
+
+private:
+    handle_type h_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/* --- Scheduler ------------------------------------------------------ */
+
+class Scheduler {
+public:
+    explicit Scheduler(ibv_context *ctx, int cq_depth = 4096)
+        : cq_(verbs::create_cq(ctx, cq_depth)) {}
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+    ~Scheduler() {
+        for (auto h : roots_)
+            h.destroy();
+    }
+
+    ibv_cq *cq() const noexcept { return cq_.get(); }
+
+    // Start t now; it runs up to its first co_await and run() does the rest
+    void spawn(Task<void> t) {
+        auto h = t.release();
+        h.promise().root = this;
+        roots_.push_back(h);
+        live_++;
+        h.resume();
+    }
+
+    /*
+     * Drive completions until every spawned task has finished, then
+     * rethrow the first exception one of them ended with.
+     */
+    void run() {
+        while (live_)
+            poll();
+
+        std::exception_ptr error;
+        for (auto h : roots_) {
+            if (!error)
+                error = h.promise().error;
+            h.destroy();
+        }
+        roots_.clear();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Reap one batch of completions; returns how many there were
+    int poll();
+
+private:
+    friend class Connection;
+    friend struct detail::PromiseBase;
+
+    void attach(Connection *c, int cqes) {
+        if (cqes_ + cqes > cq_->cqe)
+            throw std::length_error("rpc: scheduler CQ too small for another connection");
+        cqes_ += cqes;
+        conns_.push_back(c);
+    }
+
+    void detach(Connection *c, int cqes) noexcept {
+        for (size_t i = 0; i < conns_.size(); i++) {
+            if (conns_[i] == c) {
+                conns_[i] = conns_.back();
+                conns_.pop_back();
+                break;
+            }
+        }
+        cqes_ -= cqes;
+    }
+
+    Connection *lookup(uint32_t qpn) const noexcept;
+
+    verbs::Cq cq_;
+    std::vector<Connection *> conns_;
+    std::vector<std::coroutine_handle<detail::Promise<void>>> roots_;
+    size_t live_ = 0;
+    int cqes_ = 0;              // CQ entries the connections may need at once
+};
+
+template <typename P>
+std::coroutine_handle<> detail::PromiseBase::FinalAwaiter::await_suspend(
+    std::coroutine_handle<P> h) noexcept {
+    PromiseBase &p = h.promise();
+
+    if (p.continuation)
+        return p.continuation;
+    if (p.root)
+        p.root->live_--;        // the frame is destroyed by run()
+    return std::noop_coroutine();
+}
+
+/* --- Connection ----------------------------------------------------- */
+
+/*
+ * Server side request handler: fill resp with the response payload and
+ * return its length.
+ */
+using Handler = uint32_t (*)(void *ctx, uint16_t method,
+                             std::span<const std::byte> req,
+                             std::span<std::byte> resp);
+
+// A response, read in place from its receive buffer
+class Reply {
+public:
+    Reply() noexcept = default;
+    Reply(Connection *c, uint32_t slot, uint32_t buf, const Header *h) noexcept
+        : c_(c), slot_(slot), buf_(buf), hdr_(h) {}
+    Reply(Reply &&o) noexcept
+        : c_(std::exchange(o.c_, nullptr)), slot_(o.slot_), buf_(o.buf_), hdr_(o.hdr_) {}
+    Reply &operator=(Reply &&o) noexcept {
+        if (this != &o) {
+            reset();
+            c_ = std::exchange(o.c_, nullptr);
+            slot_ = o.slot_;
+            buf_ = o.buf_;
+            hdr_ = o.hdr_;
+        }
+        return *this;
+    }
+    Reply(const Reply &) = delete;
+    Reply &operator=(const Reply &) = delete;
+    ~Reply() { reset(); }
+
+    std::span<const std::byte> data() const noexcept {
+        return { reinterpret_cast<const std::byte *>(hdr_ + 1), hdr_->len };
+    }
+    uint16_t status() const noexcept { return hdr_->status; }
+
+    void reset();               // give the buffer back early
+
+private:
+    Connection *c_ = nullptr;
+    uint32_t slot_ = 0;
+    uint32_t buf_ = 0;
+    const Header *hdr_ = nullptr;
+};
+
+class Connection {
+public:
+    /*
+     * Create an RC QP on sched's CQ with depth send and receive buffers
+     * of max_payload bytes each (plus the header), and connect it to the
+     * peer on the other end of sock, which does the same. dev is the
+     * port and GID to connect through; pd must belong to dev.ctx.
+     */
+    Connection(Scheduler &sched, const ibdev &dev, ibv_pd *pd, int sock,
+               uint32_t depth, uint32_t max_payload)
+        : sched_(sched),
+          send_(pd, depth, max_payload + sizeof(Header), IBV_ACCESS_LOCAL_WRITE),
+          recv_(pd, depth, max_payload + sizeof(Header), IBV_ACCESS_LOCAL_WRITE),
+          qp_(verbs::create_rc_qp(pd, sched.cq(), depth, depth)),
+          pending_(depth, nullptr), state_(depth, 0), backlog_(depth) {
+        if (ibdev_qp_to_init(&dev, qp_.get(), 0))
+            verbs::fail("ibv_modify_qp to INIT");
+        for (uint32_t i = 0; i < depth; i++)
+            post_recv(i);
+
+        conn_info local = {}, remote;
+        local.qpn = qp_->qp_num;
+        local.psn = (uint32_t)(rand() & 0xffffff);
+        ibdev_fill_info(&dev, &local);
+        send_all(sock, &local, sizeof(local));
+        recv_all(sock, &remote, sizeof(remote));
+        if (ibdev_qp_to_rts(&dev, qp_.get(), local.psn, &remote, 1))
+            verbs::fail("ibv_modify_qp to RTR/RTS");
+
+        // Neither side sends before the other one can receive
+        char ready = 'R';
+        send_all(sock, &ready, 1);
+        recv_all(sock, &ready, 1);
+
+        sched_.attach(this, 2 * depth);
+    }
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+    ~Connection() { sched_.detach(this, 2 * send_.count()); }
+
+    class CallAwaiter {
+    public:
+        CallAwaiter(Connection *c, uint16_t method,
+                    std::span<const std::byte> req) noexcept
+            : c_(c), method_(method), req_(req) {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            if (req_.size() > c_->max_payload())
+                return false;   // await_resume() reports it
+            h_ = h;
+            c_->submit(this);
+            return true;
+        }
+        Reply await_resume() {
+            if (req_.size() > c_->max_payload())
+                throw std::length_error("rpc: request larger than the connection's buffers");
+            return std::move(reply_);
+        }
+
+    private:
+        friend class Connection;
+
+        Connection *c_;
+        uint16_t method_;
+        std::span<const std::byte> req_;
+        std::coroutine_handle<> h_;
+        CallAwaiter *next_ = nullptr;   // waiting for a send slot
+        Reply reply_;
+    };
+
+    CallAwaiter call(uint16_t method, std::span<const std::byte> req) noexcept {
+        return { this, method, req };
+    }
+
+    void serve(Handler h, void *ctx) noexcept {
+        handler_ = h;
+        handler_ctx_ = ctx;
+    }
+
+    uint32_t max_payload() const noexcept { return send_.size() - sizeof(Header); }
+    uint32_t qpn() const noexcept { return qp_->qp_num; }
+
+    // No request or response of ours is still being sent
+    bool idle() const noexcept { return send_.available() == send_.count(); }
+
+    uint64_t calls() const noexcept { return calls_; }
+    uint64_t served() const noexcept { return served_; }
+
+private:
+    friend class Scheduler;
+    friend class Reply;
+
+    // Client side: a slot is free again once both of these happened
+    enum : uint8_t { SENT = 1, REPLIED = 2 };
+    static constexpr uint64_t RECV_WRID = 1ull << 32;
+
+    static void send_all(int sock, const void *buf, size_t len) {
+        const char *p = static_cast<const char *>(buf);
+        while (len) {
+            ssize_t n = write(sock, p, len);
+            if (n <= 0)
+                verbs::fail("rpc: side channel write");
+            p += n;
+            len -= n;
+        }
+    }
+
+    static void recv_all(int sock, void *buf, size_t len) {
+        char *p = static_cast<char *>(buf);
+        while (len) {
+            ssize_t n = read(sock, p, len);
+            if (n <= 0)
+                verbs::fail("rpc: side channel read", n ? errno : ECONNRESET);
+            p += n;
+            len -= n;
+        }
+    }
+
+    void post_recv(uint32_t i) {
+        ibv_sge sge = { (uintptr_t)recv_.data(i), recv_.size(), recv_.lkey() };
+        ibv_recv_wr wr = {}, *bad_wr;
+        wr.wr_id = RECV_WRID | i;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        if (int err = ibv_post_recv(qp_.get(), &wr, &bad_wr))
+            verbs::fail("ibv_post_recv", err);
+    }
+
+    void post_send(uint32_t slot, const Header &hdr) {
+        memcpy(send_.data(slot), &hdr, sizeof(hdr));
+        ibv_sge sge = {
+            (uintptr_t)send_.data(slot), (uint32_t)(sizeof(hdr) + hdr.len), send_.lkey()
+        };
+        ibv_send_wr wr = {}, *bad_wr;
+        wr.wr_id = slot;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        if (int err = ibv_post_send(qp_.get(), &wr, &bad_wr))
+            verbs::fail("ibv_post_send", err);
+    }
+
+    std::byte *payload(uint32_t slot) noexcept { return send_.data(slot) + sizeof(Header); }
+
+    void submit(CallAwaiter *aw) {
+        int64_t slot = send_.acquire();
+        if (slot >= 0) {
+            start(aw, slot);
+            return;
+        }
+        aw->next_ = nullptr;
+        if (wait_tail_)
+            wait_tail_->next_ = aw;
+        else
+            wait_head_ = aw;
+        wait_tail_ = aw;
+    }
+
+    void start(CallAwaiter *aw, uint32_t slot) {
+        Header hdr = { slot, aw->method_, 0, (uint32_t)aw->req_.size(), 0 };
+        if (!aw->req_.empty())
+            memcpy(payload(slot), aw->req_.data(), aw->req_.size());
+        pending_[slot] = aw;
+        state_[slot] = 0;
+        post_send(slot, hdr);
+        calls_++;
+    }
+
+    // Client slot done: hand it to the next waiting call, if any
+    void free_slot(uint32_t slot) {
+        CallAwaiter *aw = wait_head_;
+        if (!aw) {
+            send_.release(slot);
+            return;
+        }
+        wait_head_ = aw->next_;
+        if (!wait_head_)
+            wait_tail_ = nullptr;
+        start(aw, slot);
+    }
+
+    void reply_done(uint32_t slot, uint32_t buf) {
+        post_recv(buf);
+        if ((state_[slot] |= REPLIED) & SENT)
+            free_slot(slot);
+    }
+
+    // Server: answer the request in receive buffer buf from send slot
+    void respond(uint32_t buf, uint32_t slot) {
+        const Header *req = reinterpret_cast<const Header *>(recv_.data(buf));
+        Header hdr = { req->tag, req->method, 0, 0, 0 };
+
+        hdr.len = handler_(handler_ctx_, req->method,
+                           { reinterpret_cast<const std::byte *>(req + 1), req->len },
+                           { payload(slot), max_payload() });
+        post_recv(buf);
+        post_send(slot, hdr);
+        served_++;
+    }
+
+    void on_completion(const ibv_wc &wc) {
+        if (wc.status != IBV_WC_SUCCESS)
+            throw std::runtime_error(std::string("rpc: completion failed: ") +
+                                     ibv_wc_status_str(wc.status));
+
+        if (!(wc.wr_id & RECV_WRID)) {
+            uint32_t slot = (uint32_t)wc.wr_id;
+            if (handler_) {
+                // Server: the response is out, its slot takes the next request
+                if (backlog_n_) {
+                    uint32_t buf = backlog_[backlog_head_];
+                    backlog_head_ = (backlog_head_ + 1) % backlog_.size();
+                    backlog_n_--;
+                    respond(buf, slot);
+                } else {
+                    send_.release(slot);
+                }
+            } else if ((state_[slot] |= SENT) & REPLIED) {
+                free_slot(slot);
+            }
+            return;
+        }
+
+        uint32_t buf = (uint32_t)wc.wr_id;
+        const Header *hdr = reinterpret_cast<const Header *>(recv_.data(buf));
+        if (wc.byte_len < sizeof(Header) || hdr->len > wc.byte_len - sizeof(Header))
+            throw std::runtime_error("rpc: malformed message");
+
+        if (handler_) {
+            int64_t slot = send_.acquire();
+            if (slot >= 0) {
+                respond(buf, slot);
+            } else {
+                // All responses in flight; the receive buffer holds the request
+                backlog_[(backlog_head_ + backlog_n_) % backlog_.size()] = buf;
+                backlog_n_++;
+            }
+            return;
+        }
+
+        if (hdr->tag >= pending_.size() || !pending_[hdr->tag])
+            throw std::runtime_error("rpc: response for no pending call");
+        CallAwaiter *aw = pending_[hdr->tag];
+        pending_[hdr->tag] = nullptr;
+        aw->reply_ = Reply(this, hdr->tag, buf, hdr);
+        aw->h_.resume();
+    }
+
+    Scheduler &sched_;
+    verbs::BufferPool send_;
+    verbs::BufferPool recv_;
+    verbs::Qp qp_;              // destroyed before the pools are deregistered
+
+    std::vector<CallAwaiter *> pending_;    // client: call per send slot
+    std::vector<uint8_t> state_;            // client: SENT | REPLIED per slot
+    CallAwaiter *wait_head_ = nullptr;
+    CallAwaiter *wait_tail_ = nullptr;
+
+    Handler handler_ = nullptr;
+    void *handler_ctx_ = nullptr;
+    std::vector<uint32_t> backlog_;         // server: requests waiting for a slot
+    size_t backlog_head_ = 0;
+    size_t backlog_n_ = 0;
+
+    uint64_t calls_ = 0;
+    uint64_t served_ = 0;
+};
+
+inline void Reply::reset() {
+    if (c_)
+        std::exchange(c_, nullptr)->reply_done(slot_, buf_);
+}
+
+inline Connection *Scheduler::lookup(uint32_t qpn) const noexcept {
+    for (Connection *c : conns_)
+        if (c->qpn() == qpn)
+            return c;
+    return nullptr;
+}
+
+inline int Scheduler::poll() {
+    ibv_wc wc[32];
+    int n = ibv_poll_cq(cq_.get(), 32, wc);
+
+    if (n < 0)
+        verbs::fail("ibv_poll_cq", EIO);
+    for (int i = 0; i < n; i++)
+        if (Connection *c = lookup(wc[i].qp_num))
+            c->on_completion(wc[i]);
+    return n;
+}
+
+} // namespace rpc
+
+#endif
@@ -0,0 +1,184 @@
+// rpc_bench.cpp
+// Echo RPC rate and latency over rpc.hpp: the client runs many
+// coroutines that each issue calls back to back on one connection.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <vector>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "hist.h"
+#include "ibdev.h"
+#include "rpc.hpp"
+
+enum : uint16_t { ECHO = 1, STOP = 2 };
+
+// Sent by the client before the connection is set up
+struct bench_req {
+    uint32_t depth;
+    uint32_t size;
+};
+
+struct server_state {
+    bool stop;
+};
+
+static uint32_t handle(void *ctx, uint16_t method,
+                       std::span<const std::byte> req,
+                       std::span<std::byte> resp) {
+    auto *st = static_cast<server_state *>(ctx);
+
+    switch (method) {
+    case ECHO:
+        memcpy(resp.data(), req.data(), req.size());
+        return req.size();
+    case STOP:
+        st->stop = true;
+        return 0;
+    }
+    return 0;
+}
+
+static void serve_client(const ibdev &dev, ibv_pd *pd, int sock) {
+    bench_req req;
+    server_state st = { false };
+
+    xfer(sock, &req, sizeof(req), 0);
+    rpc::Scheduler sched(dev.ctx, 2 * req.depth);
+    rpc::Connection conn(sched, dev, pd, sock, req.depth, req.size);
+
+    conn.serve(handle, &st);
+    while (!st.stop || !conn.idle())
+        sched.poll();
+    printf("Client done: %llu calls served, depth %u, %u bytes\n",
+           (unsigned long long)conn.served(), req.depth, req.size);
+}
+
+static rpc::Task<> caller(rpc::Connection &conn, uint64_t calls,
+                          std::span<const std::byte> msg, hist *h) {
+    for (uint64_t i = 0; i < calls; i++) {
+        uint64_t t0 = now_ns();
+        rpc::Reply r = co_await conn.call(ECHO, msg);
+        if (r.data().size() != msg.size())
+            throw std::runtime_error("short echo");
+        hist_add(h, now_ns() - t0);
+    }
+}
+
+static rpc::Task<> stop_server(rpc::Connection &conn) {
+    co_await conn.call(STOP, {});
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> [-c coroutines] [-n calls] [-s size] [-d depth]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port        serve on port\n"
+            "  -c coroutines  concurrent callers (default 64)\n"
+            "  -n calls       calls in total (default 1000000)\n"
+            "  -s size        request and response payload (default 64)\n"
+            "  -d depth       calls in flight on the QP (default 32)\n"
+            "  -D dev         use this HCA (default: the first one)\n"
+            "  -P pnetid      use the HCA port with this PNET ID (s390)\n"
+            "  -i port        HCA port (default: the first active one)\n"
+            "  -G index       GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    const char *listen_port = NULL;
+    uint32_t coroutines = 64, depth = 32, size = 64;
+    uint64_t calls = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "L:c:n:s:d:D:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'c': coroutines = strtoul(optarg, NULL, 0); break;
+        case 'n': calls = strtoull(optarg, NULL, 0); break;
+        case 's': size = strtoul(optarg, NULL, 0); break;
+        case 'd': depth = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (listen_port ? optind != argc :
+        argc - optind != 2 || !coroutines || !calls || !depth)
+        usage(argv[0]);
+
+    ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+        die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+
+    int ret = 0;
+    try {
+        verbs::Pd pd = verbs::alloc_pd(dev.ctx);
+
+        if (listen_port) {
+            int lfd = tcp_listen(listen_port, 1);
+            printf("Serving RPC clients on port %s\n", listen_port);
+
+            for (;;) {
+                int sock = accept(lfd, NULL, NULL);
+                if (sock < 0)
+                    die("accept");
+                try {
+                    serve_client(dev, pd.get(), sock);
+                } catch (const std::exception &e) {
+                    fprintf(stderr, "Client dropped: %s\n", e.what());
+                }
+                close(sock);
+            }
+        }
+
+        int sock = tcp_connect(argv[optind], argv[optind + 1]);
+
+        bench_req req = { depth, size };
+        xfer(sock, &req, sizeof(req), 1);
+
+        rpc::Scheduler sched(dev.ctx, 2 * depth);
+        rpc::Connection conn(sched, dev, pd.get(), sock, depth, size);
+        std::vector<std::byte> msg(size, std::byte{0x5a});
+        static hist h;
+
+        // Split calls evenly, the first ones take the remainder
+        hist_init(&h);
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < coroutines; i++)
+            sched.spawn(caller(conn, calls / coroutines + (i < calls % coroutines),
+                               msg, &h));
+        sched.run();
+        double secs = (now_ns() - start) / 1e9;
+
+        printf("%llu calls in %.3f s: %.3f Mcalls/s (%u coroutines, depth %u, %u bytes)\n",
+               (unsigned long long)conn.calls(), secs, conn.calls() / secs / 1e6,
+               coroutines, depth, size);
+        hist_print_us("call latency", &h);
+
+        sched.spawn(stop_server(conn));
+        sched.run();
+        close(sock);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        ret = 1;
+    }
+    ibdev_close(&dev);
+    return ret;
+}
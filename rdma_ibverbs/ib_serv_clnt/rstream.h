@@ -0,0 +1,353 @@
+#ifndef RSTREAM_H
+#define RSTREAM_H
+
+#include "common.h"
+
+/*
+ * Byte stream over one-sided RDMA writes (SMC-R style)
+ *
+ * Each side registers a circular receive buffer (RMB) of size bytes,
+ * plus a send buffer of the same size, and advertises the RMB to the
+ * peer. Both sides keep two free-running 32-bit cursors: bytes
+ * produced into the peer's RMB and bytes consumed from their own.
+ *
+ *  - rstream_send() copies application data into the send buffer and
+ *    RDMA_WRITEs it to the same offset in the peer's RMB. The last WR
+ *    of every chunk is RDMA_WRITE_WITH_IMM with the new producer cursor
+ *    as immediate data. Since RC writes are placed in order, the
+ *    receive completion tells the peer that every byte up to the cursor
+ *    is in place.
+ *  - rstream_recv() copies bytes out of the RMB and advances the
+ *    consumer cursor. Once a quarter of the buffer has been consumed
+ *    it goes back to the sender in a zero-length WRITE_WITH_IMM
+ *    (RSTREAM_CREDIT set in the immediate). The sender never has more
+ *    than size bytes unconsumed at the peer, so it never overwrites
+ *    unread data.
+ *
+ * Immediates carry the low 31 bits of a cursor; the top bit tells
+ * credits from data. Receives for the immediates take no buffer, so
+ * nothing is posted per message: RSTREAM_RECV_DEPTH empty receive WRs
+ * are kept posted and reposted RSTREAM_RECV_BATCH at a time.
+ *
+ * The QP must be an RC QP in INIT or later, with at least
+ * RSTREAM_RECV_DEPTH receive WRs and RSTREAM_SQ_MIN send WRs, and the
+ * peer must use the same buffer size. The calls never block; the
+ * _all() variants spin on the CQ until they are done. Not thread safe.
+ */
+#define RSTREAM_CREDIT       0x80000000u
+#define RSTREAM_CURSOR_MASK  0x7fffffffu
+#define RSTREAM_RECV_DEPTH   256
+#define RSTREAM_RECV_BATCH   32
+#define RSTREAM_SQ_MIN       4
+#define RSTREAM_MAX_SIZE     (1u << 30)
+
+// wr_id of a send: WRs it retires, and for data the cursor it completes
+#define RS_WRID(nwr, cursor, data) \
+    ((uint64_t)(cursor) << 32 | (uint64_t)(data) << 8 | (nwr))
+
+struct rstream {
+    struct ibv_qp *qp;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *rmb;                  // peer writes here
+    char *sndbuf;               // staged data we write to the peer
+    uint32_t size;              // power of two
+    uint32_t sq_free;           // send WRs we may still post
+
+    uint64_t peer_rmb;
+    uint32_t peer_rkey;
+
+    // send side
+    uint32_t produced;          // bytes posted to the peer's RMB
+    uint32_t completed;         // bytes whose write completed locally
+    uint32_t peer_consumed;     // from the peer's last credit update
+
+    // receive side
+    uint32_t peer_produced;     // from the peer's last data immediate
+    uint32_t consumed;          // bytes handed to the application
+    uint32_t credited;          // consumed as last reported to the peer
+    uint32_t recv_used;         // receive WRs consumed, not yet reposted
+    struct ibv_recv_wr rwr[RSTREAM_RECV_BATCH];
+
+    uint64_t data_writes;
+    uint64_t credit_updates;
+    uint64_t credit_stalls;     // sends that found no room at the peer
+};
+
+// Extend a 31-bit cursor from an immediate to the full 32-bit counter
+static inline uint32_t rs_cursor(uint32_t old, uint32_t imm) {
+    return old + ((imm - old) & RSTREAM_CURSOR_MASK);
+}
+
+static inline int rs_post_recvs(struct rstream *s, uint32_t n) {
+    struct ibv_recv_wr *bad_wr;
+
+    for (uint32_t i = 0; i < n; i++)
+        s->rwr[i].next = i + 1 < n ? &s->rwr[i + 1] : NULL;
+    return ibv_post_recv(s->qp, s->rwr, &bad_wr);
+}
+
+/*
+ * Register the buffers and post the immediate receives. sq_depth is the
+ * QP's max_send_wr. Returns 0, or -1 with errno set.
+ */
+static inline int rstream_create(struct rstream *s, struct ibv_pd *pd,
+                                 struct ibv_qp *qp, struct ibv_cq *cq,
+                                 uint32_t size, uint32_t sq_depth) {
+    void *mem;
+
+    memset(s, 0, sizeof(*s));
+    if (!size || (size & (size - 1)) || size > RSTREAM_MAX_SIZE ||
+        sq_depth < RSTREAM_SQ_MIN) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (posix_memalign(&mem, 4096, 2 * (size_t)size))
+        return -1;
+    memset(mem, 0, 2 * (size_t)size);
+    s->mr = ibv_reg_mr(pd, mem, 2 * (size_t)size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!s->mr) {
+        int err = errno;
+        free(mem);
+        errno = err;
+        return -1;
+    }
+    s->qp = qp;
+    s->cq = cq;
+    s->rmb = mem;
+    s->sndbuf = s->rmb + size;
+    s->size = size;
+    s->sq_free = sq_depth;
+
+    for (uint32_t i = 0; i < RSTREAM_RECV_DEPTH; i += RSTREAM_RECV_BATCH) {
+        int ret = rs_post_recvs(s, RSTREAM_RECV_BATCH);
+        if (ret) {
+            ibv_dereg_mr(s->mr);
+            free(mem);
+            errno = ret;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void rstream_destroy(struct rstream *s) {
+    ibv_dereg_mr(s->mr);
+    free(s->rmb);
+}
+
+// What the peer needs to write into our RMB; merge into its conn_info
+static inline void rstream_local(const struct rstream *s,
+                                 struct conn_info *info) {
+    info->rkey = s->mr->rkey;
+    info->vaddr = (uintptr_t)s->rmb;
+    info->len = s->size;
+}
+
+static inline int rstream_set_peer(struct rstream *s,
+                                   const struct conn_info *remote) {
+    if (remote->len != s->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->peer_rmb = remote->vaddr;
+    s->peer_rkey = remote->rkey;
+    return 0;
+}
+
+static inline int rs_post_credit(struct rstream *s) {
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = RS_WRID(1, 0, 0);
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.imm_data = htonl(RSTREAM_CREDIT | (s->consumed & RSTREAM_CURSOR_MASK));
+    wr.wr.rdma.remote_addr = s->peer_rmb;
+    wr.wr.rdma.rkey = s->peer_rkey;
+    int ret = ibv_post_send(s->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    s->sq_free--;
+    s->credited = s->consumed;
+    s->credit_updates++;
+    return 0;
+}
+
+// Return credits once a quarter of the RMB has been consumed
+static inline int rs_maybe_credit(struct rstream *s) {
+    if (s->consumed - s->credited < s->size / 4 || !s->sq_free)
+        return 0;
+    return rs_post_credit(s);
+}
+
+/*
+ * Reap completions: cursors from the peer's immediates and send slots
+ * from our own signaled writes. Returns the number of completions, or
+ * -1 if one failed.
+ */
+static inline int rstream_progress(struct rstream *s) {
+    struct ibv_wc wc[32];
+    int n = ibv_poll_cq(s->cq, 32, wc);
+
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "rstream: completion failed: %s\n",
+                    ibv_wc_status_str(wc[i].status));
+            errno = EIO;
+            return -1;
+        }
+        if (wc[i].opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            uint32_t imm = ntohl(wc[i].imm_data);
+
+            if (imm & RSTREAM_CREDIT)
+                s->peer_consumed = rs_cursor(s->peer_consumed, imm);
+            else
+                s->peer_produced = rs_cursor(s->peer_produced, imm);
+            if (++s->recv_used == RSTREAM_RECV_BATCH) {
+                int ret = rs_post_recvs(s, RSTREAM_RECV_BATCH);
+                if (ret) {
+                    errno = ret;
+                    return -1;
+                }
+                s->recv_used = 0;
+            }
+        } else {
+            s->sq_free += wc[i].wr_id & 0xff;
+            if (wc[i].wr_id & 0x100)
+                s->completed = wc[i].wr_id >> 32;
+        }
+    }
+    if (rs_maybe_credit(s))
+        return -1;
+    return n;
+}
+
+/*
+ * Queue up to len bytes. Returns the number of bytes taken, 0 if
+ * there is no room at the peer or in the send queue yet, -1 on error.
+ */
+static inline ssize_t rstream_send(struct rstream *s, const void *buf,
+                                   size_t len) {
+    if (rstream_progress(s) < 0)
+        return -1;
+
+    uint32_t room = s->size - (s->produced - s->peer_consumed);
+    uint32_t staged = s->size - (s->produced - s->completed);
+    if (staged < room)
+        room = staged;
+    if (len > room)
+        len = room;
+    // Two WRs for a chunk that wraps, and one slot kept for credits
+    if (!len || s->sq_free < 3) {
+        if (!room)
+            s->credit_stalls++;
+        return 0;
+    }
+
+    uint32_t mask = s->size - 1;
+    uint32_t pos = s->produced & mask;
+    uint32_t first = s->size - pos < len ? s->size - pos : len;
+    memcpy(s->sndbuf + pos, buf, first);
+    memcpy(s->sndbuf, (const char *)buf + first, len - first);
+
+    // The send buffer and the peer's RMB wrap at the same offsets
+    struct ibv_sge sge[2] = {
+        { (uintptr_t)s->sndbuf + pos, first, s->mr->lkey },
+        { (uintptr_t)s->sndbuf, len - first, s->mr->lkey },
+    };
+    struct ibv_send_wr wr[2], *bad_wr;
+    uint32_t nwr = first < len ? 2 : 1;
+    uint32_t cursor = s->produced + len;
+
+    memset(wr, 0, sizeof(wr));
+    for (uint32_t i = 0; i < nwr; i++) {
+        wr[i].sg_list = &sge[i];
+        wr[i].num_sge = 1;
+        wr[i].opcode = IBV_WR_RDMA_WRITE;
+        wr[i].wr.rdma.remote_addr = s->peer_rmb + (i ? 0 : pos);
+        wr[i].wr.rdma.rkey = s->peer_rkey;
+    }
+    if (nwr == 2)
+        wr[0].next = &wr[1];
+    wr[nwr - 1].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr[nwr - 1].imm_data = htonl(cursor & RSTREAM_CURSOR_MASK);
+    wr[nwr - 1].send_flags = IBV_SEND_SIGNALED;
+    wr[nwr - 1].wr_id = RS_WRID(nwr, cursor, 1);
+    int ret = ibv_post_send(s->qp, wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+
+    s->sq_free -= nwr;
+    s->produced = cursor;
+    s->data_writes++;
+    return len;
+}
+
+/*
+ * Copy up to len received bytes out. Returns the number copied, 0 if
+ * nothing has arrived yet, -1 on error.
+ */
+static inline ssize_t rstream_recv(struct rstream *s, void *buf, size_t len) {
+    if (rstream_progress(s) < 0)
+        return -1;
+
+    uint32_t avail = s->peer_produced - s->consumed;
+    if (len > avail)
+        len = avail;
+    if (!len)
+        return 0;
+
+    uint32_t pos = s->consumed & (s->size - 1);
+    uint32_t first = s->size - pos < len ? s->size - pos : len;
+    memcpy(buf, s->rmb + pos, first);
+    memcpy((char *)buf + first, s->rmb, len - first);
+    s->consumed += len;
+
+    if (rs_maybe_credit(s))
+        return -1;
+    return len;
+}
+
+static inline int rstream_send_all(struct rstream *s, const void *buf,
+                                   size_t len) {
+    const char *p = buf;
+
+    while (len) {
+        ssize_t n = rstream_send(s, p, len);
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static inline int rstream_recv_all(struct rstream *s, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = rstream_recv(s, p, len);
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Wait until every byte sent so far has been placed at the peer
+static inline int rstream_flush(struct rstream *s) {
+    while (s->completed != s->produced)
+        if (rstream_progress(s) < 0)
+            return -1;
+    return 0;
+}
+
+#endif
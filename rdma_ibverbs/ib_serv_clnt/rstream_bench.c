@@ -0,0 +1,300 @@
+// rstream_bench.c
+// Stream throughput and ping-pong latency over the RDMA byte stream in
+// rstream.h, or over plain TCP (-T) between the same two hosts.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "hist.h"
+#include "ibdev.h"
+#include "rstream.h"
+
+#define SQ_DEPTH 64
+
+struct bench_req {
+    uint32_t latency;
+    uint32_t size;              // bytes per send / per round trip
+    uint64_t iters;
+    uint32_t bufsize;           // RMB size, rdma only
+    uint32_t tcp;
+};
+
+// Data path: either the TCP socket itself or an rstream
+struct chan {
+    int fd;
+    struct rstream *rs;
+};
+
+static void chan_send(struct chan *ch, const void *buf, size_t len) {
+    if (!ch->rs)
+        xfer(ch->fd, (void *)buf, len, 1);
+    else if (rstream_send_all(ch->rs, buf, len))
+        die("rstream_send");
+}
+
+static void chan_recv(struct chan *ch, void *buf, size_t len) {
+    if (!ch->rs)
+        xfer(ch->fd, buf, len, 0);
+    else if (rstream_recv_all(ch->rs, buf, len))
+        die("rstream_recv");
+}
+
+/* --- RDMA setup ------------------------------------------------------ */
+
+struct rdma_res {
+    struct ibdev dev;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct rstream rs;
+};
+
+/*
+ * Open the HCA port that dev_opts selects (ibdev.h), create an RC QP
+ * with room for the stream's immediate receives, and swap QP and RMB
+ * details over the TCP socket.
+ */
+static void rdma_setup(struct rdma_res *r, const struct ibdev_opts *dev_opts,
+                       int sock, uint32_t bufsize) {
+    if (ibdev_open(&r->dev, dev_opts))
+        die("ibdev_open");
+    ibdev_place(&r->dev, dev_opts);
+
+    r->pd = ibv_alloc_pd(r->dev.ctx);
+    if (!r->pd)
+        die("ibv_alloc_pd");
+    r->cq = ibv_create_cq(r->dev.ctx, SQ_DEPTH + RSTREAM_RECV_DEPTH, NULL, NULL, 0);
+    if (!r->cq)
+        die("ibv_create_cq");
+
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    qp_init_attr.send_cq = r->cq;
+    qp_init_attr.recv_cq = r->cq;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr = SQ_DEPTH;
+    qp_init_attr.cap.max_recv_wr = RSTREAM_RECV_DEPTH;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    r->qp = ibv_create_qp(r->pd, &qp_init_attr);
+    if (!r->qp)
+        die("ibv_create_qp");
+    if (ibdev_qp_to_init(&r->dev, r->qp, IBV_ACCESS_REMOTE_WRITE))
+        die("ibv_modify_qp to INIT");
+    if (rstream_create(&r->rs, r->pd, r->qp, r->cq, bufsize, SQ_DEPTH))
+        die("rstream_create");
+
+    struct conn_info local = {0}, remote;
+    local.qpn = r->qp->qp_num;
+    local.psn = (uint32_t)(rand() & 0xffffff);
+    ibdev_fill_info(&r->dev, &local);
+    rstream_local(&r->rs, &local);
+
+    struct chan tcp = { .fd = sock };
+    chan_send(&tcp, &local, sizeof(local));
+    chan_recv(&tcp, &remote, sizeof(remote));
+    if (ibdev_qp_to_rts(&r->dev, r->qp, local.psn, &remote, 1))
+        die("ibv_modify_qp to RTR/RTS");
+    if (rstream_set_peer(&r->rs, &remote))
+        die("rstream_set_peer (buffer sizes differ)");
+
+    // Neither side writes before the other one is ready to receive
+    char ready = 'R';
+    chan_send(&tcp, &ready, 1);
+    chan_recv(&tcp, &ready, 1);
+}
+
+static void rdma_teardown(struct rdma_res *r) {
+    rstream_destroy(&r->rs);
+    ibv_destroy_qp(r->qp);
+    ibv_destroy_cq(r->cq);
+    ibv_dealloc_pd(r->pd);
+    ibdev_close(&r->dev);
+}
+
+/* --- benchmark ------------------------------------------------------- */
+
+/*
+ * Throughput: the client streams iters sends of size bytes, the server
+ * reads them in the same chunks and answers with one byte once it has
+ * everything, which stops the clock. Latency: size bytes there and
+ * back, iters times.
+ */
+static void run(struct chan *ch, const struct bench_req *req, int server) {
+    static struct hist h;
+    char *buf = malloc(req->size);
+    if (!buf)
+        die("malloc");
+    memset(buf, 'x', req->size);
+
+    if (req->latency) {
+        hist_init(&h);
+        for (uint64_t i = 0; i < req->iters; i++) {
+            uint64_t t0 = now_ns();
+
+            if (server) {
+                chan_recv(ch, buf, req->size);
+                chan_send(ch, buf, req->size);
+            } else {
+                chan_send(ch, buf, req->size);
+                chan_recv(ch, buf, req->size);
+                hist_add(&h, now_ns() - t0);
+            }
+        }
+        if (!server) {
+            printf("Latency over %s: %u bytes x %llu round trips\n",
+                   req->tcp ? "TCP" : "rstream", req->size,
+                   (unsigned long long)req->iters);
+            hist_print_us("stream ping-pong RTT", &h);
+        }
+    } else {
+        char ack = 'A';
+        uint64_t start = now_ns();
+
+        for (uint64_t i = 0; i < req->iters; i++) {
+            if (server)
+                chan_recv(ch, buf, req->size);
+            else
+                chan_send(ch, buf, req->size);
+        }
+        if (server) {
+            chan_send(ch, &ack, 1);
+        } else {
+            chan_recv(ch, &ack, 1);
+            double sec = (now_ns() - start) / 1e9;
+            printf("Throughput over %s: %u bytes x %llu\n",
+                   req->tcp ? "TCP" : "rstream", req->size,
+                   (unsigned long long)req->iters);
+            printf("  %.3f s, %.3f GB/s, %.3f Mmsg/s\n", sec,
+                   (double)req->size * req->iters / sec / 1e9,
+                   req->iters / sec / 1e6);
+        }
+    }
+
+    if (ch->rs && !server)
+        printf("  rstream: %llu data writes, %llu credit updates, "
+               "%llu credit stalls\n",
+               (unsigned long long)ch->rs->data_writes,
+               (unsigned long long)ch->rs->credit_updates,
+               (unsigned long long)ch->rs->credit_stalls);
+    free(buf);
+}
+
+static void session(int sock, struct bench_req *req,
+                    const struct ibdev_opts *dev_opts, int server) {
+    struct chan ch = { .fd = sock };
+    struct rdma_res r;
+    int one = 1;
+
+    if (server)
+        chan_recv(&ch, req, sizeof(*req));
+    else
+        chan_send(&ch, req, sizeof(*req));
+
+    if (req->tcp) {
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        run(&ch, req, server);
+        return;
+    }
+    rdma_setup(&r, dev_opts, sock, req->bufsize);
+    ch.rs = &r.rs;
+    run(&ch, req, server);
+    if (rstream_flush(&r.rs))
+        die("rstream_flush");
+
+    // Drain outstanding credit updates before the QP goes away
+    char bye = 'B';
+    ch.rs = NULL;
+    chan_send(&ch, &bye, 1);
+    chan_recv(&ch, &bye, 1);
+    rdma_teardown(&r);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> [-T] [-l] [-s size] [-n iters] [-B bufsize]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port     serve on port\n"
+            "  -T          plain TCP instead of the RDMA stream\n"
+            "  -l          ping-pong latency instead of throughput\n"
+            "  -s size     bytes per send (default 65536, latency: 64)\n"
+            "  -n iters    sends or round trips (default 100000)\n"
+            "  -B bufsize  receive buffer per side, power of two\n"
+            "              (default 1048576)\n"
+            "  -D dev      use this HCA (default: the first one)\n"
+            "  -P pnetid   use the HCA port with this PNET ID (s390)\n"
+            "  -i port     HCA port (default: the first active one)\n"
+            "  -G index    GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    struct bench_req req = {
+        .iters = 100000,
+        .bufsize = 1 << 20,
+    };
+    const char *listen_port = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "L:Tls:n:B:D:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'T': req.tcp = 1; break;
+        case 'l': req.latency = 1; break;
+        case 's': req.size = strtoul(optarg, NULL, 0); break;
+        case 'n': req.iters = strtoull(optarg, NULL, 0); break;
+        case 'B': req.bufsize = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (listen_port) {
+        if (optind != argc)
+            usage(argv[0]);
+        int lfd = tcp_listen(listen_port, 1);
+        printf("Serving rstream and TCP clients on port %s\n", listen_port);
+
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            session(sock, &req, &dev_opts, 1);
+            printf("Client done: %s %s, %u bytes x %llu\n",
+                   req.tcp ? "TCP" : "rstream",
+                   req.latency ? "latency" : "throughput", req.size,
+                   (unsigned long long)req.iters);
+            close(sock);
+        }
+    }
+
+    if (!req.size)
+        req.size = req.latency ? 64 : 65536;
+    if (argc - optind != 2 || !req.iters ||
+        !req.bufsize || (req.bufsize & (req.bufsize - 1)) ||
+        req.bufsize > RSTREAM_MAX_SIZE)
+        usage(argv[0]);
+
+    int sock = tcp_connect(argv[optind], argv[optind + 1]);
+
+    session(sock, &req, &dev_opts, 0);
+    close(sock);
+
+    return 0;
+}
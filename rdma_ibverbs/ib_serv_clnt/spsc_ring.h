@@ -0,0 +1,80 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include "common.h"
+
+/*
+ * Lock-free single-producer/single-consumer ring of fixed-size entries
+ *
+ * head is written only by the consumer and tail only by the producer.
+ * Each publishes its index with a release store and reads the other
+ * one with an acquire load, so an entry is completely written before
+ * the consumer can see it and completely read before the producer can
+ * reuse its slot. No locks and no read-modify-write atomics are needed.
+ * The two indices sit on separate cache lines so the sides do not
+ * bounce one line between them on every operation.
+ *
+ * The indices run freely and are masked on access, so the ring size
+ * must be a power of two.
+ */
+#define SPSC_CACHE_LINE 64
+
+struct spsc_ring {
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t head;   // next to pop
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t tail;   // next to push
+    _Alignas(SPSC_CACHE_LINE) uint32_t mask;
+    uint32_t esize;
+    char *slots;
+};
+
+static inline int spsc_ring_init(struct spsc_ring *r, uint32_t entries,
+                                 uint32_t esize) {
+    if (!entries || (entries & (entries - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    r->slots = calloc(entries, esize);
+    if (!r->slots)
+        return -1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->mask = entries - 1;
+    r->esize = esize;
+    return 0;
+}
+
+static inline void spsc_ring_free(struct spsc_ring *r) {
+    free(r->slots);
+}
+
+// Producer side. Returns -1 if the ring is full.
+static inline int spsc_ring_push(struct spsc_ring *r, const void *e) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (tail - head > r->mask)
+        return -1;
+    memcpy(r->slots + (size_t)(tail & r->mask) * r->esize, e, r->esize);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// Consumer side. Returns -1 if the ring is empty.
+static inline int spsc_ring_pop(struct spsc_ring *r, void *e) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head == tail)
+        return -1;
+    memcpy(e, r->slots + (size_t)(head & r->mask) * r->esize, r->esize);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+static inline uint32_t spsc_ring_count(struct spsc_ring *r) {
+    return atomic_load_explicit(&r->tail, memory_order_acquire) -
+           atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef SRQ_H
+#define SRQ_H
+
+#include "common.h"
+
+/*
+ * Shared Receive Queue backed by a pre-posted buffer pool
+ *
+ * All client QPs take their receives from one ibv_srq, so receive
+ * buffer memory is depth * buf_size no matter how many clients are
+ * connected, instead of clients * max_recv_wr * buf_size.
+ *
+ * The buffers are carved out of one slab that is registered once.
+ * Buffer i is described by a recv WR and SGE that are built up front;
+ * its wr_id is i tagged with SRQ_WRID_FLAG, so completions can be told
+ * apart from send completions on the same CQ. Consumed buffers are
+ * chained back together and reposted with a single
+ * ibv_post_srq_recv() once 'batch' of them have collected, so the
+ * receive path never allocates and rings the doorbell once per batch.
+ */
+#define SRQ_WRID_FLAG (1ull << 63)
+
+struct srq_pool {
+    struct ibv_srq *srq;
+    struct ibv_mr *mr;
+    char *slab;
+    uint32_t buf_size;
+    uint32_t depth;
+    uint32_t batch;
+
+    struct ibv_recv_wr *wrs;    // one prebuilt WR per buffer
+    struct ibv_sge *sges;
+    struct ibv_recv_wr *head;   // consumed buffers waiting for repost
+    struct ibv_recv_wr *tail;
+    uint32_t pending;
+};
+
+static inline int srq_is_recv(uint64_t wr_id) {
+    return !!(wr_id & SRQ_WRID_FLAG);
+}
+
+static inline uint32_t srq_index(uint64_t wr_id) {
+    return (uint32_t)(wr_id & ~SRQ_WRID_FLAG);
+}
+
+static inline char *srq_buf(struct srq_pool *p, uint64_t wr_id) {
+    return p->slab + (size_t)srq_index(wr_id) * p->buf_size;
+}
+
+// Post everything collected so far
+static inline void srq_flush(struct srq_pool *p) {
+    struct ibv_recv_wr *bad_wr;
+
+    if (!p->head)
+        return;
+    if (ibv_post_srq_recv(p->srq, p->head, &bad_wr))
+        die("ibv_post_srq_recv");
+    p->head = p->tail = NULL;
+    p->pending = 0;
+}
+
+// Hand a consumed buffer back; it is reposted with the next full batch
+static inline void srq_release(struct srq_pool *p, uint64_t wr_id) {
+    struct ibv_recv_wr *wr = &p->wrs[srq_index(wr_id)];
+
+    wr->next = NULL;
+    if (p->tail)
+        p->tail->next = wr;
+    else
+        p->head = wr;
+    p->tail = wr;
+    if (++p->pending >= p->batch)
+        srq_flush(p);
+}
+
+/*
+ * Create the SRQ, register the slab and post all depth buffers.
+ * depth is clamped to what the device allows per SRQ.
+ */
+static inline void srq_create(struct srq_pool *p, struct ibv_pd *pd,
+                              uint32_t depth, uint32_t buf_size,
+                              uint32_t batch) {
+    struct ibv_device_attr dev_attr;
+
+    memset(p, 0, sizeof(*p));
+    if (ibv_query_device(pd->context, &dev_attr))
+        die("ibv_query_device");
+    if (depth > (uint32_t)dev_attr.max_srq_wr)
+        depth = dev_attr.max_srq_wr;
+    p->depth = depth;
+    p->buf_size = buf_size;
+    p->batch = batch < depth ? batch : depth;
+
+    struct ibv_srq_init_attr srq_attr = {0};
+    srq_attr.attr.max_wr = depth;
+    srq_attr.attr.max_sge = 1;
+    p->srq = ibv_create_srq(pd, &srq_attr);
+    if (!p->srq)
+        die("ibv_create_srq");
+
+    p->slab = malloc((size_t)depth * buf_size);
+    p->wrs = calloc(depth, sizeof(*p->wrs));
+    p->sges = calloc(depth, sizeof(*p->sges));
+    if (!p->slab || !p->wrs || !p->sges)
+        die("malloc");
+
+    p->mr = ibv_reg_mr(pd, p->slab, (size_t)depth * buf_size,
+                       IBV_ACCESS_LOCAL_WRITE);
+    if (!p->mr)
+        die("ibv_reg_mr");
+
+    for (uint32_t i = 0; i < depth; i++) {
+        p->sges[i].addr = (uintptr_t)(p->slab + (size_t)i * buf_size);
+        p->sges[i].length = buf_size;
+        p->sges[i].lkey = p->mr->lkey;
+        p->wrs[i].wr_id = i | SRQ_WRID_FLAG;
+        p->wrs[i].sg_list = &p->sges[i];
+        p->wrs[i].num_sge = 1;
+        p->wrs[i].next = i + 1 < depth ? &p->wrs[i + 1] : NULL;
+    }
+    p->head = &p->wrs[0];
+    p->tail = &p->wrs[depth - 1];
+    srq_flush(p);
+}
+
+static inline void srq_destroy(struct srq_pool *p) {
+    ibv_destroy_srq(p->srq);
+    ibv_dereg_mr(p->mr);
+    free(p->sges);
+    free(p->wrs);
+    free(p->slab);
+}
+
+#endif
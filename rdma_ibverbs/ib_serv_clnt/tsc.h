@@ -0,0 +1,72 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <pthread.h>
+#include "common.h"
+
+/*
+ * Cheap timestamps on the now_ns() timeline
+ *
+ * clock_gettime() costs tens of nanoseconds even through the vDSO,
+ * which is too much to stamp every doorbell and every completion. The
+ * CPU's free-running counter is read in a few cycles instead:
+ *
+ *   x86      rdtsc, constant and invariant on anything recent
+ *   aarch64  the generic timer, cntvct_el0
+ *   s390x    the TOD clock, stckf
+ *
+ * tsc_init() measures the counter against CLOCK_MONOTONIC once per
+ * process, after which tsc_ns() converts readings to nanoseconds on the
+ * same timeline as now_ns(), so both can be mixed. Elsewhere tsc_ns()
+ * is just now_ns().
+ */
+static inline uint64_t tsc_read(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#elif defined(__s390x__)
+    uint64_t v;
+    __asm__ __volatile__("stckf %0" : "=Q"(v) : : "cc");
+    return v;
+#else
+    return now_ns();
+#endif
+}
+
+struct tsc_clock {
+    uint64_t tsc0;
+    uint64_t ns0;
+    double ns_per_tick;
+};
+
+static struct tsc_clock tsc_clk = { .ns_per_tick = 1.0 };
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+
+static inline void tsc_calibrate(void) {
+    uint64_t t0 = tsc_read(), n0 = now_ns(), t1, n1;
+
+    // 10 ms is enough for a rate good to a few ppm
+    do {
+        t1 = tsc_read();
+        n1 = now_ns();
+    } while (n1 - n0 < 10000000);
+
+    tsc_clk.ns_per_tick = (double)(n1 - n0) / (t1 - t0);
+    tsc_clk.tsc0 = t1;
+    tsc_clk.ns0 = n1;
+}
+
+// Calibrate once per process; cheap after the first call
+static inline void tsc_init(void) {
+    pthread_once(&tsc_once, tsc_calibrate);
+}
+
+static inline uint64_t tsc_ns(void) {
+    return tsc_clk.ns0 +
+           (int64_t)((int64_t)(tsc_read() - tsc_clk.tsc0) * tsc_clk.ns_per_tick);
+}
+
+#endif
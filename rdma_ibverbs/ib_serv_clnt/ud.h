@@ -0,0 +1,367 @@
+#ifndef UD_H
+#define UD_H
+
+#include "common.h"
+#include "ibdev.h"
+
+/*
+ * Unreliable Datagram endpoints
+ *
+ * An RC QP talks to exactly one remote QP, so reaching N peers takes N
+ * QPs on every node, each with its own send queue, state and HCA
+ * context. A UD QP is not connected: every send WR names its
+ * destination with an address handle (AH), the remote QPN and a Q_Key.
+ * One UD QP reaches every peer, and N peers cost N AHs, a few bytes of
+ * path information each.
+ *
+ * The price is what RC does for free:
+ *
+ *   - a message must fit in one packet, the path MTU
+ *   - no acknowledgements, no retransmission: a message that finds no
+ *     receive posted at the target, or hits congestion, is dropped
+ *     without notice to either side
+ *   - no RDMA_WRITE/READ or atomics, SEND only
+ *   - every receive buffer starts with UD_GRH bytes for the Global
+ *     Routing Header, whether the packet had one or not
+ *
+ * which suits small, loss-tolerant traffic: heartbeats, gossip,
+ * metadata fan-out.
+ *
+ * Creating an AH is a system call on many providers. The cache below
+ * creates one per destination GID, the first time the GID is sent to,
+ * and keeps it until the cache is destroyed. Peers behind the same
+ * port (several endpoints in one process, say) share their AH and
+ * differ only in QPN.
+ *
+ * Receives come from a ring of depth fixed-size slots, all posted up
+ * front. Consumed slots are chained and reposted with one
+ * ibv_post_recv() per batch, as srq.h does for the SRQ.
+ */
+#define UD_GRH      40
+#define UD_QKEY     0x11111111          // same on every endpoint
+
+/* --- address handle cache -------------------------------------------- */
+
+struct ud_ah_slot {
+    uint8_t gid[16];
+    struct ibv_ah *ah;          // NULL = free
+};
+
+struct ud_ah_cache {
+    struct ibv_pd *pd;
+    const struct ibdev *dev;
+    struct ud_ah_slot *slot;    // open addressing, linear probing
+    uint32_t mask;
+    uint32_t used;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Room for at least max GIDs. Returns 0, or -1 with errno set.
+static inline int ud_ah_cache_init(struct ud_ah_cache *c, struct ibv_pd *pd,
+                                   const struct ibdev *dev, uint32_t max) {
+    uint32_t n = 16;
+
+    // Keep the table at most half full, so probes stay short
+    while (n < 2 * max)
+        n <<= 1;
+    memset(c, 0, sizeof(*c));
+    c->slot = calloc(n, sizeof(*c->slot));
+    if (!c->slot)
+        return -1;
+    c->pd = pd;
+    c->dev = dev;
+    c->mask = n - 1;
+    return 0;
+}
+
+static inline uint32_t ud_gid_hash(const uint8_t *gid) {
+    uint32_t h = 2166136261u;           // FNV-1a
+
+    for (int i = 0; i < 16; i++)
+        h = (h ^ gid[i]) * 16777619u;
+    return h;
+}
+
+/*
+ * The AH for remote's GID, created on the first call for that GID.
+ * Returns NULL with errno set if it cannot be created, or ENOSPC when
+ * the cache is full.
+ */
+static inline struct ibv_ah *ud_ah_get(struct ud_ah_cache *c,
+                                       const struct conn_info *remote) {
+    uint32_t i = ud_gid_hash(remote->gid) & c->mask;
+
+    for (;; i = (i + 1) & c->mask) {
+        struct ud_ah_slot *s = &c->slot[i];
+
+        if (!s->ah)
+            break;
+        if (!memcmp(s->gid, remote->gid, 16)) {
+            c->hits++;
+            return s->ah;
+        }
+    }
+    if (c->used * 2 >= c->mask + 1) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    struct ibv_ah_attr attr;
+    ibdev_fill_ah(c->dev, remote, &attr);
+    struct ibv_ah *ah = ibv_create_ah(c->pd, &attr);
+    if (!ah)
+        return NULL;
+    memcpy(c->slot[i].gid, remote->gid, 16);
+    c->slot[i].ah = ah;
+    c->used++;
+    c->misses++;
+    return ah;
+}
+
+static inline void ud_ah_cache_destroy(struct ud_ah_cache *c) {
+    for (uint32_t i = 0; i <= c->mask; i++)
+        if (c->slot[i].ah)
+            ibv_destroy_ah(c->slot[i].ah);
+    free(c->slot);
+}
+
+/* --- receive ring ---------------------------------------------------- */
+
+struct ud_ring {
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;
+    char *slab;
+    uint32_t slot_size;         // UD_GRH + the largest message
+    uint32_t depth;
+    uint32_t batch;
+
+    struct ibv_recv_wr *wrs;    // one prebuilt WR per slot
+    struct ibv_sge *sges;
+    struct ibv_recv_wr *head;   // consumed slots waiting for repost
+    struct ibv_recv_wr *tail;
+    uint32_t pending;
+};
+
+// wr_id of slot i: the ring's tag in the upper half, i in the lower
+static inline uint32_t ud_slot(uint64_t wr_id) {
+    return (uint32_t)wr_id;
+}
+
+static inline uint32_t ud_tag(uint64_t wr_id) {
+    return (uint32_t)(wr_id >> 32);
+}
+
+// Payload of a received slot, past the GRH
+static inline char *ud_ring_msg(struct ud_ring *r, uint64_t wr_id) {
+    return r->slab + (size_t)ud_slot(wr_id) * r->slot_size + UD_GRH;
+}
+
+static inline int ud_ring_flush(struct ud_ring *r) {
+    struct ibv_recv_wr *bad_wr;
+    int ret;
+
+    if (!r->head)
+        return 0;
+    ret = ibv_post_recv(r->qp, r->head, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    r->head = r->tail = NULL;
+    r->pending = 0;
+    return 0;
+}
+
+// Hand a consumed slot back; it is reposted with the next full batch
+static inline int ud_ring_release(struct ud_ring *r, uint64_t wr_id) {
+    struct ibv_recv_wr *wr = &r->wrs[ud_slot(wr_id)];
+
+    wr->next = NULL;
+    if (r->tail)
+        r->tail->next = wr;
+    else
+        r->head = wr;
+    r->tail = wr;
+    return ++r->pending >= r->batch ? ud_ring_flush(r) : 0;
+}
+
+/*
+ * depth slots for messages of up to msg_size bytes, all posted on qp.
+ * Returns 0, or -1 with errno set.
+ */
+static inline int ud_ring_create(struct ud_ring *r, struct ibv_pd *pd,
+                                 struct ibv_qp *qp, uint32_t depth,
+                                 uint32_t msg_size, uint32_t tag) {
+    int ret;
+
+    memset(r, 0, sizeof(*r));
+    r->qp = qp;
+    r->depth = depth;
+    r->slot_size = UD_GRH + msg_size;
+    r->batch = depth / 4 ? depth / 4 : 1;
+    r->slab = malloc((size_t)depth * r->slot_size);
+    r->wrs = calloc(depth, sizeof(*r->wrs));
+    r->sges = calloc(depth, sizeof(*r->sges));
+    if (!r->slab || !r->wrs || !r->sges)
+        goto err;
+    r->mr = ibv_reg_mr(pd, r->slab, (size_t)depth * r->slot_size,
+                       IBV_ACCESS_LOCAL_WRITE);
+    if (!r->mr)
+        goto err;
+
+    for (uint32_t i = 0; i < depth; i++) {
+        r->sges[i].addr = (uintptr_t)(r->slab + (size_t)i * r->slot_size);
+        r->sges[i].length = r->slot_size;
+        r->sges[i].lkey = r->mr->lkey;
+        r->wrs[i].wr_id = (uint64_t)tag << 32 | i;
+        r->wrs[i].sg_list = &r->sges[i];
+        r->wrs[i].num_sge = 1;
+        r->wrs[i].next = i + 1 < depth ? &r->wrs[i + 1] : NULL;
+    }
+    r->head = &r->wrs[0];
+    r->tail = &r->wrs[depth - 1];
+    if (ud_ring_flush(r))
+        goto err;
+    return 0;
+
+err:
+    ret = errno;
+    if (r->mr)
+        ibv_dereg_mr(r->mr);
+    free(r->sges);
+    free(r->wrs);
+    free(r->slab);
+    errno = ret;
+    return -1;
+}
+
+static inline void ud_ring_destroy(struct ud_ring *r) {
+    ibv_dereg_mr(r->mr);
+    free(r->sges);
+    free(r->wrs);
+    free(r->slab);
+}
+
+/* --- endpoint -------------------------------------------------------- */
+
+struct ud_ep {
+    struct ibv_qp *qp;
+    struct ud_ring ring;
+    struct conn_info local;     // what peers need: QPN, GID, LID
+    uint32_t max_inline;
+};
+
+/*
+ * A UD QP on d's port with send_depth send WRs on cq, and a ring of
+ * recv_depth receives for messages of up to msg_size bytes (completing
+ * on cq too, with tag in their wr_id). Returns 0, or -1 with errno set.
+ */
+static inline int ud_ep_create(struct ud_ep *ep, const struct ibdev *d,
+                               struct ibv_pd *pd, struct ibv_cq *cq,
+                               uint32_t send_depth, uint32_t recv_depth,
+                               uint32_t msg_size, uint32_t tag) {
+    struct ibv_qp_init_attr init = {0};
+    struct ibv_qp_attr attr;
+    int ret;
+
+    if (msg_size > (uint32_t)ibdev_mtu_bytes(d->mtu)) {
+        errno = EMSGSIZE;       // a datagram is one packet
+        return -1;
+    }
+    memset(ep, 0, sizeof(*ep));
+    init.send_cq = cq;
+    init.recv_cq = cq;
+    init.qp_type = IBV_QPT_UD;
+    init.cap.max_send_wr = send_depth;
+    init.cap.max_recv_wr = recv_depth;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.cap.max_inline_data = msg_size;
+    ep->qp = ibv_create_qp(pd, &init);
+    if (!ep->qp) {
+        // Not every device inlines that much; ask for none
+        init.cap.max_inline_data = 0;
+        ep->qp = ibv_create_qp(pd, &init);
+        if (!ep->qp)
+            return -1;
+    }
+    ep->max_inline = init.cap.max_inline_data;
+
+    /*
+     * UD has no remote side to agree with: INIT takes the Q_Key that
+     * incoming datagrams must carry, RTR nothing, RTS the send PSN.
+     */
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.port_num = d->port;
+    attr.qkey = UD_QKEY;
+    ret = ibv_modify_qp(ep->qp, &attr,
+                        IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                        IBV_QP_QKEY);
+    if (ret)
+        goto err;
+    if (ud_ring_create(&ep->ring, pd, ep->qp, recv_depth, msg_size, tag)) {
+        ret = errno;
+        goto err;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    ret = ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE);
+    if (!ret) {
+        attr.qp_state = IBV_QPS_RTS;
+        attr.sq_psn = (uint32_t)(rand() & 0xffffff);
+        ret = ibv_modify_qp(ep->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+    }
+    if (ret) {
+        ibv_destroy_qp(ep->qp);
+        ud_ring_destroy(&ep->ring);
+        errno = ret;
+        return -1;
+    }
+
+    ep->local.qpn = ep->qp->qp_num;
+    ibdev_fill_info(d, &ep->local);
+    return 0;
+
+err:
+    ibv_destroy_qp(ep->qp);
+    errno = ret;
+    return -1;
+}
+
+static inline void ud_ep_destroy(struct ud_ep *ep) {
+    ibv_destroy_qp(ep->qp);
+    ud_ring_destroy(&ep->ring);
+}
+
+/*
+ * Send len bytes of sge to the QP qpn behind ah. Inlined when it fits,
+ * so the buffer can be reused at once. Returns 0, or -1 with errno set.
+ */
+static inline int ud_send(struct ud_ep *ep, struct ibv_ah *ah, uint32_t qpn,
+                          struct ibv_sge *sge, uint64_t wr_id, int signaled) {
+    struct ibv_send_wr wr = {0}, *bad_wr;
+    int ret;
+
+    wr.wr_id = wr_id;
+    wr.sg_list = sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    if (sge->length <= ep->max_inline)
+        wr.send_flags |= IBV_SEND_INLINE;
+    wr.wr.ud.ah = ah;
+    wr.wr.ud.remote_qpn = qpn;
+    wr.wr.ud.remote_qkey = UD_QKEY;
+    ret = ibv_post_send(ep->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
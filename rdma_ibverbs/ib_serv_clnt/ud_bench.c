@@ -0,0 +1,532 @@
+// ud_bench.c
+// Small-message fan-out to many peers: one UD QP with cached address handles
+// (ud.h) against one RC QP per peer. Reports messages per second and loss.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "ibdev.h"
+#include "srq.h"
+#include "ud.h"
+
+#define MODE_RC       1
+#define MODE_UD       2
+#define MAX_PEERS     4096      // per server
+#define MAX_SERVERS   64
+#define POLL_BATCH    32
+#define DRAIN_NS      100000000ull    // quiet time that ends a UD run
+
+// Sent by the client first; the server answers with its endpoint count
+struct ud_hello {
+    uint32_t mode;
+    uint32_t peers;             // endpoints the server should emulate
+    uint32_t size;              // message size
+    uint32_t ring;              // receives per endpoint
+};
+
+static const char *mode_name(uint32_t mode) {
+    return mode == MODE_UD ? "UD" : "RC";
+}
+
+static struct ibv_qp *rc_qp_create(struct ibv_pd *pd, struct ibv_cq *cq,
+                                   struct ibv_srq *srq, uint32_t depth,
+                                   uint32_t inline_size) {
+    struct ibv_qp_init_attr init = {0};
+    struct ibv_qp *qp;
+
+    init.send_cq = cq;
+    init.recv_cq = cq;
+    init.srq = srq;
+    init.qp_type = IBV_QPT_RC;
+    init.cap.max_send_wr = depth;
+    init.cap.max_recv_wr = srq ? 0 : 1;
+    init.cap.max_send_sge = 1;
+    init.cap.max_recv_sge = 1;
+    init.cap.max_inline_data = inline_size;
+    qp = ibv_create_qp(pd, &init);
+    if (!qp && inline_size) {
+        init.cap.max_inline_data = 0;
+        qp = ibv_create_qp(pd, &init);
+    }
+    if (!qp)
+        die("ibv_create_qp");
+    return qp;
+}
+
+/* --- server ---------------------------------------------------------- */
+
+/*
+ * Emulate hello.peers peers: UD endpoints with their own receive ring,
+ * or RC QPs on one SRQ, all completing on one CQ. Count what arrives
+ * until the client reports how much it sent and the CQ has been quiet
+ * for DRAIN_NS, then send back the count.
+ */
+static void serve(const struct ibdev *dev, struct ibv_pd *pd, int sock) {
+    struct ud_hello hello;
+    struct ibv_device_attr attr;
+
+    xfer(sock, &hello, sizeof(hello), 0);
+    uint32_t n = hello.peers < MAX_PEERS ? hello.peers : MAX_PEERS;
+    if (ibv_query_device(dev->ctx, &attr))
+        die("ibv_query_device");
+
+    // Every posted receive must have room in the CQ
+    if ((uint64_t)n * hello.ring > (uint64_t)attr.max_cqe)
+        hello.ring = attr.max_cqe / n;
+    uint32_t cqe = n * hello.ring;
+    struct ibv_cq *cq = ibv_create_cq(dev->ctx, cqe, NULL, NULL, 0);
+    if (!cq)
+        die("ibv_create_cq");
+
+    struct conn_info *local = calloc(n, sizeof(*local));
+    struct conn_info *remote = calloc(n, sizeof(*remote));
+    struct ud_ep *eps = NULL;
+    struct ibv_qp **qps = NULL;
+    struct srq_pool srq;
+    if (!local || !remote)
+        die("calloc");
+
+    if (hello.mode == MODE_UD) {
+        eps = calloc(n, sizeof(*eps));
+        if (!eps)
+            die("calloc");
+        for (uint32_t i = 0; i < n; i++) {
+            if (ud_ep_create(&eps[i], dev, pd, cq, 1, hello.ring, hello.size, i))
+                die("ud_ep_create");
+            local[i] = eps[i].local;
+        }
+    } else {
+        qps = calloc(n, sizeof(*qps));
+        if (!qps)
+            die("calloc");
+        srq_create(&srq, pd, cqe, hello.size, 64);
+        for (uint32_t i = 0; i < n; i++) {
+            qps[i] = rc_qp_create(pd, cq, srq.srq, 1, 0);
+            if (ibdev_qp_to_init(dev, qps[i], 0))
+                die("ibdev_qp_to_init");
+            local[i].qpn = qps[i]->qp_num;
+            local[i].psn = (uint32_t)(rand() & 0xffffff);
+            ibdev_fill_info(dev, &local[i]);
+        }
+    }
+
+    xfer(sock, &n, sizeof(n), 1);
+    xfer(sock, local, n * sizeof(*local), 1);
+    xfer(sock, remote, n * sizeof(*remote), 0);
+    for (uint32_t i = 0; qps && i < n; i++)
+        if (ibdev_qp_to_rts(dev, qps[i], local[i].psn, &remote[i], 1))
+            die("ibdev_qp_to_rts");
+    char ready = 'R';
+    xfer(sock, &ready, 1, 1);
+    printf("Client connected: %s, %u peers, %u byte messages, %u receives each\n",
+           mode_name(hello.mode), n, hello.size, hello.ring);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    uint64_t received = 0, sent = UINT64_MAX, last_rx = 0;
+    int have = 0;
+    for (;;) {
+        struct ibv_wc wc[POLL_BATCH];
+        int got = ibv_poll_cq(cq, POLL_BATCH, wc);
+
+        if (got < 0)
+            die("ibv_poll_cq");
+        for (int i = 0; i < got; i++) {
+            if (wc[i].status != IBV_WC_SUCCESS) {
+                fprintf(stderr, "receive failed: %s\n",
+                        ibv_wc_status_str(wc[i].status));
+                goto out;
+            }
+            received++;
+            if (eps) {
+                if (ud_ring_release(&eps[ud_tag(wc[i].wr_id)].ring, wc[i].wr_id))
+                    die("ibv_post_recv");
+            } else {
+                srq_release(&srq, wc[i].wr_id);
+            }
+        }
+        if (got)
+            last_rx = now_ns();
+
+        if (have < (int)sizeof(sent)) {
+            ssize_t r = read(sock, (char *)&sent + have, sizeof(sent) - have);
+            if (!r || (r < 0 && errno != EAGAIN && errno != EINTR))
+                goto out;       // the client went away
+            if (r > 0 && (have += r) == sizeof(sent))
+                last_rx = now_ns();
+        } else if (received >= sent || now_ns() - last_rx > DRAIN_NS) {
+            break;
+        }
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    xfer(sock, &received, sizeof(received), 1);
+    printf("  received %llu of %llu messages\n", (unsigned long long)received,
+           (unsigned long long)sent);
+
+out:
+    for (uint32_t i = 0; i < n; i++) {
+        if (eps)
+            ud_ep_destroy(&eps[i]);
+        else
+            ibv_destroy_qp(qps[i]);
+    }
+    if (qps)
+        srq_destroy(&srq);
+    ibv_destroy_cq(cq);
+    free(eps);
+    free(qps);
+    free(remote);
+    free(local);
+}
+
+/* --- client ---------------------------------------------------------- */
+
+// A send queue the client posts on: the one UD QP, or one RC QP per peer
+struct sendq {
+    struct ibv_qp *qp;
+    uint32_t depth;             // send WRs it may have in flight
+    uint32_t signal;            // one signaled WR every signal
+    uint32_t inflight;
+    uint32_t unsignaled;
+    uint32_t max_inline;
+};
+
+struct peer {
+    struct conn_info info;
+    struct ibv_ah *ah;          // UD only, from the cache
+    struct sendq *q;
+    uint32_t server;
+};
+
+struct session {
+    uint32_t mode;
+    int socks[MAX_SERVERS];
+    uint32_t nservers;
+    struct peer *peers;
+    uint32_t npeers;
+    struct sendq *qs;
+    uint32_t nqs;
+    struct ibv_cq *cq;
+    struct ud_ep ep;            // UD
+    struct ud_ah_cache ahs;     // UD
+};
+
+// Retire what the CQ reports; wr_id is (send queue << 32 | WRs retired)
+static void reap(struct session *s) {
+    struct ibv_wc wc[POLL_BATCH];
+    int got = ibv_poll_cq(s->cq, POLL_BATCH, wc);
+
+    if (got < 0)
+        die("ibv_poll_cq");
+    for (int i = 0; i < got; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "%s send failed: %s\n", mode_name(s->mode),
+                    ibv_wc_status_str(wc[i].status));
+            exit(1);
+        }
+        s->qs[wc[i].wr_id >> 32].inflight -= (uint32_t)wc[i].wr_id;
+    }
+}
+
+/*
+ * iters messages round-robin over all peers. A send queue signals
+ * every q->signal WRs, and each peer's last message is signaled, so
+ * every queue drains at the end. Returns the elapsed seconds and counts
+ * the messages per server in sent.
+ */
+static double run(struct session *s, struct ibv_mr *mr, uint32_t size,
+                  uint64_t iters, uint64_t *sent) {
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)mr->addr,
+        .length = size,
+        .lkey = mr->lkey,
+    };
+
+    memset(sent, 0, s->nservers * sizeof(*sent));
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iters; i++) {
+        struct peer *p = &s->peers[i % s->npeers];
+        struct sendq *q = p->q;
+
+        while (q->inflight == q->depth)
+            reap(s);
+
+        int signaled = ++q->unsignaled == q->signal || i + s->npeers >= iters;
+        uint64_t wr_id = (uint64_t)(q - s->qs) << 32 | q->unsignaled;
+
+        if (s->mode == MODE_UD) {
+            if (ud_send(&s->ep, p->ah, p->info.qpn, &sge, wr_id, signaled))
+                die("ibv_post_send");
+        } else {
+            struct ibv_send_wr wr = {0}, *bad_wr;
+            wr.wr_id = wr_id;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+            if (size <= q->max_inline)
+                wr.send_flags |= IBV_SEND_INLINE;
+            errno = ibv_post_send(q->qp, &wr, &bad_wr);
+            if (errno)
+                die("ibv_post_send");
+        }
+        q->inflight++;
+        if (signaled)
+            q->unsignaled = 0;
+        sent[p->server]++;
+    }
+
+    for (uint32_t i = 0; i < s->nqs; i++)
+        while (s->qs[i].inflight)
+            reap(s);
+    return (now_ns() - start) / 1e9;
+}
+
+/*
+ * Set up a session with every server: the UD endpoint and one AH per
+ * server port, or one RC QP per peer, and exchange endpoints.
+ */
+static void session_open(struct session *s, uint32_t mode,
+                         const struct ibdev *dev, struct ibv_pd *pd,
+                         char **servers, uint32_t nservers,
+                         const struct ud_hello *want, uint32_t window,
+                         uint32_t signal) {
+    memset(s, 0, sizeof(*s));
+    s->mode = mode;
+    s->nservers = nservers;
+    s->peers = calloc((size_t)nservers * MAX_PEERS, sizeof(*s->peers));
+    if (!s->peers)
+        die("calloc");
+
+    struct ud_hello hello = *want;
+    hello.mode = mode;
+    for (uint32_t i = 0; i < nservers; i++) {
+        uint32_t n;
+
+        s->socks[i] = tcp_connect(servers[2 * i], servers[2 * i + 1]);
+        xfer(s->socks[i], &hello, sizeof(hello), 1);
+        xfer(s->socks[i], &n, sizeof(n), 0);
+        for (uint32_t j = 0; j < n; j++) {
+            struct peer *p = &s->peers[s->npeers++];
+            xfer(s->socks[i], &p->info, sizeof(p->info), 0);
+            p->server = i;
+        }
+    }
+
+    // Per RC QP, the window is shared out over the peers
+    uint32_t depth = mode == MODE_UD ? window : (window + s->npeers - 1) / s->npeers;
+    if (depth < 2)
+        depth = 2;
+    s->nqs = mode == MODE_UD ? 1 : s->npeers;
+    s->qs = calloc(s->nqs, sizeof(*s->qs));
+    if (!s->qs)
+        die("calloc");
+    s->cq = ibv_create_cq(dev->ctx, s->nqs * depth + 16, NULL, NULL, 0);
+    if (!s->cq)
+        die("ibv_create_cq");
+
+    if (mode == MODE_UD) {
+        if (ud_ep_create(&s->ep, dev, pd, s->cq, depth, 16, hello.size, 0))
+            die("ud_ep_create");
+        s->qs[0].qp = s->ep.qp;
+        s->qs[0].max_inline = s->ep.max_inline;
+        if (ud_ah_cache_init(&s->ahs, pd, dev, s->npeers))
+            die("ud_ah_cache_init");
+    }
+    for (uint32_t i = 0; i < s->nqs; i++) {
+        struct sendq *q = &s->qs[i];
+        q->depth = depth;
+        q->signal = signal < depth ? signal : depth;
+        if (mode == MODE_RC) {
+            struct ibv_qp_init_attr init;
+            struct ibv_qp_attr attr;
+
+            q->qp = rc_qp_create(pd, s->cq, NULL, depth, hello.size);
+            if (ibv_query_qp(q->qp, &attr, IBV_QP_CAP, &init))
+                die("ibv_query_qp");
+            q->max_inline = init.cap.max_inline_data;
+            if (ibdev_qp_to_init(dev, q->qp, 0))
+                die("ibdev_qp_to_init");
+        }
+    }
+
+    // Tell each server who sends to its endpoints, in the same order
+    for (uint32_t j = 0; j < s->npeers; j++) {
+        struct peer *p = &s->peers[j];
+        struct conn_info local = {0};
+
+        if (mode == MODE_UD) {
+            p->q = &s->qs[0];
+            p->ah = ud_ah_get(&s->ahs, &p->info);
+            if (!p->ah)
+                die("ud_ah_get");
+            local = s->ep.local;
+        } else {
+            p->q = &s->qs[j];
+            local.qpn = p->q->qp->qp_num;
+            local.psn = (uint32_t)(rand() & 0xffffff);
+            ibdev_fill_info(dev, &local);
+            if (ibdev_qp_to_rts(dev, p->q->qp, local.psn, &p->info, 1))
+                die("ibdev_qp_to_rts");
+        }
+        xfer(s->socks[p->server], &local, sizeof(local), 1);
+    }
+    for (uint32_t i = 0; i < nservers; i++) {
+        char ready;
+        xfer(s->socks[i], &ready, 1, 0);
+    }
+}
+
+static void session_close(struct session *s) {
+    if (s->mode == MODE_UD) {
+        ud_ep_destroy(&s->ep);
+        ud_ah_cache_destroy(&s->ahs);
+    } else {
+        for (uint32_t i = 0; i < s->nqs; i++)
+            ibv_destroy_qp(s->qs[i].qp);
+    }
+    ibv_destroy_cq(s->cq);
+    for (uint32_t i = 0; i < s->nservers; i++)
+        close(s->socks[i]);
+    free(s->qs);
+    free(s->peers);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s -L <port> [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s <server_ip> <port> [<server_ip> <port> ...] [-u | -c]\n"
+            "          [-p peers] [-s size] [-n msgs] [-w window] [-k signal]\n"
+            "          [-r ring] [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  -L port    serve on port\n"
+            "  -u         UD only (default: RC, then UD)\n"
+            "  -c         RC only\n"
+            "  -p peers   endpoints each server emulates (default 16, at most %d)\n"
+            "  -s size    bytes per message, at most the path MTU (default 64)\n"
+            "  -n msgs    messages, round-robin over all peers (default 1000000)\n"
+            "  -w window  sends in flight in total (default 256)\n"
+            "  -k signal  one signaled send every k per QP (default 16)\n"
+            "  -r ring    receives posted per server endpoint (default 256)\n"
+            "  -D dev     use this HCA (default: the first one)\n"
+            "  -P pnetid  use the HCA port with this PNET ID (s390)\n"
+            "  -i port    HCA port (default: the first active one)\n"
+            "  -G index   GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog, MAX_PEERS);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct ibdev_opts dev_opts = {
+        .gid_index = -1,
+        .numa_node = IBDEV_NUMA_AUTO,
+    };
+    struct ud_hello hello = { .peers = 16, .size = 64, .ring = 256 };
+    const char *listen_port = NULL;
+    uint64_t iters = 1000000;
+    uint32_t window = 256, signal = 16;
+    int modes = MODE_RC | MODE_UD, opt;
+
+    while ((opt = getopt(argc, argv, "L:ucp:s:n:w:k:r:D:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'L': listen_port = optarg; break;
+        case 'u': modes = MODE_UD; break;
+        case 'c': modes = MODE_RC; break;
+        case 'p': hello.peers = strtoul(optarg, NULL, 0); break;
+        case 's': hello.size = strtoul(optarg, NULL, 0); break;
+        case 'n': iters = strtoull(optarg, NULL, 0); break;
+        case 'w': window = strtoul(optarg, NULL, 0); break;
+        case 'k': signal = strtoul(optarg, NULL, 0); break;
+        case 'r': hello.ring = strtoul(optarg, NULL, 0); break;
+        case 'D': dev_opts.name = optarg; break;
+        case 'P': dev_opts.pnetid = optarg; break;
+        case 'i': dev_opts.port = atoi(optarg); break;
+        case 'G': dev_opts.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    uint32_t nservers = (argc - optind) / 2;
+    if (!hello.peers || hello.peers > MAX_PEERS ||
+        !hello.size || !iters || !window || !signal ||
+        !hello.ring || (listen_port ? optind != argc :
+                        !nservers || nservers > MAX_SERVERS || (argc - optind) % 2))
+        usage(argv[0]);
+
+    struct ibdev dev;
+    if (ibdev_open(&dev, &dev_opts))
+        die("ibdev_open");
+    ibdev_place(&dev, &dev_opts);
+    ibdev_print(&dev);
+    struct ibv_pd *pd = ibv_alloc_pd(dev.ctx);
+    if (!pd)
+        die("ibv_alloc_pd");
+
+    if (listen_port) {
+        int lfd = tcp_listen(listen_port, 1);
+        printf("Serving fan-out clients on port %s\n", listen_port);
+
+        for (;;) {
+            int sock = accept(lfd, NULL, NULL);
+            if (sock < 0)
+                die("accept");
+            serve(&dev, pd, sock);
+            close(sock);
+        }
+    }
+
+    if (hello.size > (uint32_t)ibdev_mtu_bytes(dev.mtu)) {
+        fprintf(stderr, "-s %u is larger than the %d byte MTU\n", hello.size,
+                ibdev_mtu_bytes(dev.mtu));
+        exit(1);
+    }
+    void *buf;
+    if (posix_memalign(&buf, 4096, hello.size))
+        die("posix_memalign");
+    memset(buf, 'x', hello.size);
+    struct ibv_mr *mr = ibv_reg_mr(pd, buf, hello.size, IBV_ACCESS_LOCAL_WRITE);
+    if (!mr)
+        die("ibv_reg_mr");
+
+    printf("Fan-out: %llu x %u byte messages to %u server%s x %u peers, "
+           "%u in flight, signal every %u\n", (unsigned long long)iters,
+           hello.size, nservers, nservers > 1 ? "s" : "", hello.peers, window,
+           signal);
+    for (uint32_t mode = MODE_RC; mode <= MODE_UD; mode <<= 1) {
+        struct session s;
+        uint64_t sent[MAX_SERVERS], received = 0;
+
+        if (!(modes & mode))
+            continue;
+        session_open(&s, mode, &dev, pd, argv + optind, nservers, &hello,
+                     window, signal);
+        double sec = run(&s, mr, hello.size, iters, sent);
+        for (uint32_t i = 0; i < nservers; i++) {
+            uint64_t got;
+            xfer(s.socks[i], &sent[i], sizeof(sent[i]), 1);
+            xfer(s.socks[i], &got, sizeof(got), 0);
+            received += got;
+        }
+
+        printf("%s: %u QP%s for %u peers", mode_name(mode), s.nqs,
+               s.nqs > 1 ? "s" : "", s.npeers);
+        if (mode == MODE_UD)
+            printf(", %u AH%s", s.ahs.used, s.ahs.used > 1 ? "s" : "");
+        printf("\n  %.3f s, %.3f Mmsg/s, %.3f GB/s, %llu received (%.3f%% lost)\n",
+               sec, iters / sec / 1e6, (double)iters * hello.size / sec / 1e9,
+               (unsigned long long)received, 100.0 * (iters - received) / iters);
+        session_close(&s);
+    }
+
+    ibv_dereg_mr(mr);
+    free(buf);
+    ibv_dealloc_pd(pd);
+    ibdev_close(&dev);
+    return 0;
+}
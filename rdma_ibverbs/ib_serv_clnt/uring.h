@@ -0,0 +1,176 @@
+#ifndef URING_H
+#define URING_H
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "common.h"
+
+/*
+ * Minimal io_uring, on the raw system calls
+ *
+ * io_uring is a pair of rings shared with the kernel: the program
+ * fills submission queue entries (SQEs) and moves the SQ tail, one
+ * io_uring_enter() hands over all of them at once, and completions
+ * (CQEs) show up in the completion ring without any system call.
+ * That is the same shape as a verbs QP and CQ, so disk I/O can be
+ * driven from the same busy-polling loop as the HCA: post, then poll
+ * both completion queues.
+ *
+ * Buffers registered with uring_register_bufs() are pinned once and
+ * used with READ_FIXED/WRITE_FIXED, which skips mapping the user pages
+ * on every request, the io_uring counterpart of an MR.
+ *
+ * This covers just what a read/write pipeline needs; liburing is the
+ * full version. Only one thread may use a ring.
+ */
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len;
+    unsigned tail;              // SQEs filled in, published on submit
+    int fixed;                  // buffers registered
+};
+
+static inline void uring_exit(struct uring *u) {
+    if (u->sqes)
+        munmap(u->sqes, u->entries * sizeof(*u->sqes));
+    if (u->cq_ring)
+        munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+}
+
+// Returns 0, or -1 with errno set (ENOSYS: no io_uring in this kernel)
+static inline int uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+    int err;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    u->entries = p.sq_entries;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto err;
+    }
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+        u->cq_ring = NULL;
+        goto err;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto err;
+    }
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+    return 0;
+
+err:
+    err = errno;
+    uring_exit(u);
+    errno = err;
+    return -1;
+}
+
+/*
+ * Pin n buffers for READ_FIXED/WRITE_FIXED; buffer i is then given by
+ * its index. Counts against RLIMIT_MEMLOCK like ibv_reg_mr() does.
+ */
+static inline int uring_register_bufs(struct uring *u, const struct iovec *iov,
+                                      unsigned n) {
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, n))
+        return -1;
+    u->fixed = 1;
+    return 0;
+}
+
+/*
+ * Queue a read or write of len bytes at buf, from or to offset off of
+ * fd. buf must lie in registered buffer buf_index if there are any.
+ * Returns 0, or -1 with errno EBUSY if the SQ is full.
+ */
+static inline int uring_rw(struct uring *u, int write, int fd, void *buf,
+                           uint32_t len, uint64_t off, uint16_t buf_index,
+                           uint64_t user_data) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (u->tail - head == u->entries) {
+        errno = EBUSY;
+        return -1;
+    }
+    unsigned idx = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (u->fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buf_index;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    u->sq_array[idx] = idx;
+    u->tail++;
+    return 0;
+}
+
+/*
+ * Hand every queued SQE to the kernel, and wait for at least wait_nr
+ * completions. Returns the number submitted, or -1 with errno set.
+ */
+static inline int uring_submit(struct uring *u, unsigned wait_nr) {
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    unsigned n = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (!n && !wait_nr)
+        return 0;
+    return syscall(__NR_io_uring_enter, u->fd, n, wait_nr,
+                   wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// Take one completion if there is one, without a system call
+static inline int uring_peek(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#endif
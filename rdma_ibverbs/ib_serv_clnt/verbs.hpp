@@ -0,0 +1,142 @@
+#ifndef VERBS_HPP
+#define VERBS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <system_error>
+#include <vector>
+#include <infiniband/verbs.h>
+
+/*
+ * Move-only RAII handles for the verbs objects used in this directory
+ *
+ * Each handle is a std::unique_ptr with a deleter that calls the
+ * matching ibv_destroy/dealloc/close function, so resources are
+ * released in reverse order of declaration and cannot be copied or
+ * double-freed. The factories throw std::system_error with the errno
+ * that verbs reported, where the C programs call die().
+ */
+namespace verbs {
+
+template <typename T, int (*Release)(T *)>
+struct Deleter {
+    void operator()(T *p) const noexcept { Release(p); }
+};
+
+using Context = std::unique_ptr<ibv_context, Deleter<ibv_context, ibv_close_device>>;
+using Pd = std::unique_ptr<ibv_pd, Deleter<ibv_pd, ibv_dealloc_pd>>;
+using Cq = std::unique_ptr<ibv_cq, Deleter<ibv_cq, ibv_destroy_cq>>;
+using Qp = std::unique_ptr<ibv_qp, Deleter<ibv_qp, ibv_destroy_qp>>;
+using Mr = std::unique_ptr<ibv_mr, Deleter<ibv_mr, ibv_dereg_mr>>;
+
+[[noreturn]] inline void fail(const char *what, int err = errno) {
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+// First device in ibv_get_device_list(), as the C programs use
+inline Context open_device() {
+    int num;
+    ibv_device **list = ibv_get_device_list(&num);
+    if (!list || !num) {
+        if (list)
+            ibv_free_device_list(list);
+        fail("ibv_get_device_list", list ? ENODEV : errno);
+    }
+    Context ctx(ibv_open_device(list[0]));
+    int err = errno;
+    ibv_free_device_list(list);
+    if (!ctx)
+        fail("ibv_open_device", err);
+    return ctx;
+}
+
+inline Pd alloc_pd(ibv_context *ctx) {
+    Pd pd(ibv_alloc_pd(ctx));
+    if (!pd)
+        fail("ibv_alloc_pd");
+    return pd;
+}
+
+inline Cq create_cq(ibv_context *ctx, int depth) {
+    Cq cq(ibv_create_cq(ctx, depth, nullptr, nullptr, 0));
+    if (!cq)
+        fail("ibv_create_cq");
+    return cq;
+}
+
+inline Qp create_rc_qp(ibv_pd *pd, ibv_cq *cq, uint32_t send_wr,
+                       uint32_t recv_wr) {
+    ibv_qp_init_attr attr = {};
+    attr.send_cq = cq;
+    attr.recv_cq = cq;
+    attr.qp_type = IBV_QPT_RC;
+    attr.cap.max_send_wr = send_wr;
+    attr.cap.max_recv_wr = recv_wr;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+    Qp qp(ibv_create_qp(pd, &attr));
+    if (!qp)
+        fail("ibv_create_qp");
+    return qp;
+}
+
+inline Mr reg_mr(ibv_pd *pd, void *addr, size_t len, int access) {
+    Mr mr(ibv_reg_mr(pd, addr, len, access));
+    if (!mr)
+        fail("ibv_reg_mr");
+    return mr;
+}
+
+/*
+ * count fixed-size buffers in one registered slab, with a free list of
+ * indices that is allocated up front: acquire() and release() never
+ * allocate.
+ */
+class BufferPool {
+public:
+    BufferPool(ibv_pd *pd, uint32_t count, uint32_t size, int access)
+        : size_(size), count_(count) {
+        void *mem;
+        if (posix_memalign(&mem, 4096, (size_t)count * size))
+            fail("posix_memalign", ENOMEM);
+        mem_.reset(static_cast<std::byte *>(mem));
+        mr_ = reg_mr(pd, mem, (size_t)count * size, access);
+        free_.reserve(count);
+        for (uint32_t i = count; i--; )
+            free_.push_back(i);
+    }
+
+    // A free buffer's index, or -1 if all are in use
+    int64_t acquire() noexcept {
+        if (free_.empty())
+            return -1;
+        uint32_t i = free_.back();
+        free_.pop_back();
+        return i;
+    }
+
+    void release(uint32_t i) noexcept { free_.push_back(i); }
+
+    std::byte *data(uint32_t i) const noexcept { return mem_.get() + (size_t)i * size_; }
+    uint32_t lkey() const noexcept { return mr_->lkey; }
+    uint32_t size() const noexcept { return size_; }
+    uint32_t count() const noexcept { return count_; }
+    uint32_t available() const noexcept { return free_.size(); }
+
+private:
+    struct Free {
+        void operator()(std::byte *p) const noexcept { std::free(p); }
+    };
+
+    std::unique_ptr<std::byte[], Free> mem_;
+    Mr mr_;                     // declared after mem_, so deregistered first
+    std::vector<uint32_t> free_;
+    uint32_t size_;
+    uint32_t count_;
+};
+
+} // namespace verbs
+
+#endif
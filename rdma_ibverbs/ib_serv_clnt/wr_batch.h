@@ -0,0 +1,123 @@
+#ifndef WR_BATCH_H
+#define WR_BATCH_H
+
+#include "common.h"
+
+/*
+ * Batched, zero-copy send work requests
+ *
+ * A message made of several application fragments is described by a
+ * list of rdma_iov entries (an iovec that also carries each fragment's
+ * lkey). The fragments go into the SGEs of one WR, so the HCA gathers
+ * them itself and nothing is copied into a bounce buffer. For
+ * RDMA_WRITE and RDMA_READ, lists longer than the QP's max_send_sge are
+ * split over several WRs that cover consecutive remote ranges. A SEND
+ * cannot be split like that, the receiver would get several messages,
+ * so it must fit into one WR.
+ *
+ * WRs are chained through wr.next as they are added, and
+ * wr_batch_post() hands the whole chain to one ibv_post_send(). The
+ * provider then writes all WQEs and rings the doorbell once per batch
+ * instead of once per message, which is what limits small-message
+ * rates.
+ */
+#define WR_BATCH_MAX     64
+#define WR_BATCH_MAX_SGE 16
+
+struct rdma_iov {
+    void *addr;
+    uint32_t len;
+    uint32_t lkey;
+};
+
+struct wr_batch {
+    struct ibv_qp *qp;
+    uint32_t max_sge;           // per WR, min(QP cap, WR_BATCH_MAX_SGE)
+    uint32_t nwr;
+    uint32_t nsge;
+    struct ibv_send_wr wr[WR_BATCH_MAX];
+    struct ibv_sge sge[WR_BATCH_MAX * WR_BATCH_MAX_SGE];
+};
+
+static inline void wr_batch_init(struct wr_batch *b, struct ibv_qp *qp,
+                                 uint32_t max_send_sge) {
+    b->qp = qp;
+    b->max_sge = max_send_sge < WR_BATCH_MAX_SGE ? max_send_sge : WR_BATCH_MAX_SGE;
+    if (!b->max_sge)
+        b->max_sge = 1;
+    b->nwr = 0;
+    b->nsge = 0;
+}
+
+// WRs that a message of iovcnt fragments takes
+static inline uint32_t wr_batch_wrs(const struct wr_batch *b, int iovcnt) {
+    return iovcnt ? (iovcnt + b->max_sge - 1) / b->max_sge : 1;
+}
+
+/*
+ * Append one message. For RDMA opcodes, remote_addr/rkey describe the
+ * target of the first fragment, later fragments follow it back to back.
+ * wr_id and send_flags go on the last WR of the message, the ones
+ * before it are posted unsignaled. Returns the number of WRs added, or
+ * -1 with errno ENOSPC if the batch has no room for them (post it and
+ * try again), or EINVAL if a message other than an RDMA_WRITE or
+ * RDMA_READ has more than max_sge fragments.
+ */
+static inline int wr_batch_add(struct wr_batch *b, enum ibv_wr_opcode opcode,
+                               const struct rdma_iov *iov, int iovcnt,
+                               uint64_t remote_addr, uint32_t rkey,
+                               uint64_t wr_id, unsigned int send_flags) {
+    uint32_t need = wr_batch_wrs(b, iovcnt);
+    int i = 0;
+
+    if (need > 1 && opcode != IBV_WR_RDMA_WRITE && opcode != IBV_WR_RDMA_READ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (b->nwr + need > WR_BATCH_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    for (uint32_t n = 0; n < need; n++) {
+        struct ibv_send_wr *wr = &b->wr[b->nwr];
+        int last = n + 1 == need;
+
+        memset(wr, 0, sizeof(*wr));
+        wr->sg_list = &b->sge[b->nsge];
+        wr->opcode = opcode;
+        wr->wr.rdma.remote_addr = remote_addr;
+        wr->wr.rdma.rkey = rkey;
+        for (; i < iovcnt && wr->num_sge < (int)b->max_sge; i++) {
+            struct ibv_sge *sge = &b->sge[b->nsge++];
+
+            sge->addr = (uintptr_t)iov[i].addr;
+            sge->length = iov[i].len;
+            sge->lkey = iov[i].lkey;
+            wr->num_sge++;
+            remote_addr += iov[i].len;
+        }
+        if (last) {
+            wr->wr_id = wr_id;
+            wr->send_flags = send_flags;
+        }
+        if (b->nwr)
+            b->wr[b->nwr - 1].next = wr;
+        b->nwr++;
+    }
+    return need;
+}
+
+// Post the chain with a single ibv_post_send(), i.e. one doorbell
+static inline int wr_batch_post(struct wr_batch *b) {
+    struct ibv_send_wr *bad_wr;
+    int ret = 0;
+
+    if (b->nwr)
+        ret = ibv_post_send(b->qp, b->wr, &bad_wr);
+    b->nwr = 0;
+    b->nsge = 0;
+    return ret;
+}
+
+#endif
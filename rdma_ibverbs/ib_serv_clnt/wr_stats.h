@@ -0,0 +1,197 @@
+#ifndef WR_STATS_H
+#define WR_STATS_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "hist.h"
+
+/*
+ * Per-WR counters and latency, published in shared memory
+ *
+ * Each data path thread owns one struct wr_stats: WRs posted, completed
+ * and failed, and a histogram of the time from the doorbell to the
+ * WR's completion (cq_engine.h timestamps). Only the owner writes it,
+ * so there are no locks and no atomic read-modify-writes: every field
+ * is stored whole with a relaxed atomic store, and a reader never sees
+ * a torn value. A reader does not see a consistent snapshot across
+ * fields either, which is fine for counters.
+ *
+ * The slots sit in one page, created with shm_open() when the program
+ * is given a name (-S), so that rdma_stats can map it read-only and
+ * watch a running benchmark. Without a name the page is anonymous
+ * memory and only the program itself reads it. The page is unlinked
+ * on a clean exit; one left behind by a crash still holds the last
+ * counts.
+ *
+ * cq_overruns counts IBV_EVENT_CQ_ERR, the async event a device raises
+ * when a CQ overflows. Async events belong to the device, not to a
+ * thread, so wr_stats_async() counts them page-wide.
+ */
+#define WR_STATS_MAGIC   0x3153544154535257ull     // "WRSTATS1"
+#define WR_STATS_NAME    64
+
+struct wr_stats {
+    uint64_t posted;
+    uint64_t completed;
+    uint64_t errors;
+    struct hist lat;            // post-to-completion, ns
+} __attribute__((aligned(64)));
+
+struct wr_stats_page {
+    uint64_t magic;             // written last, once the page is ready
+    uint32_t nthreads;
+    int32_t pid;
+    uint64_t start_ns;          // now_ns() at creation
+    uint64_t cq_overruns;
+    uint64_t async_events;
+    char ts_source[WR_STATS_NAME];
+    struct wr_stats thread[];
+};
+
+static inline size_t wr_stats_size(uint32_t nthreads) {
+    return sizeof(struct wr_stats_page) + nthreads * sizeof(struct wr_stats);
+}
+
+/*
+ * Create the page for nthreads slots, as /dev/shm/<name> if name is
+ * not NULL. Returns NULL with errno set on failure.
+ */
+static inline struct wr_stats_page *wr_stats_create(const char *name,
+                                                    uint32_t nthreads) {
+    size_t size = wr_stats_size(nthreads);
+    struct wr_stats_page *p;
+    int fd = -1;
+
+    if (name) {
+        fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd < 0)
+            return NULL;
+        if (ftruncate(fd, size)) {
+            int err = errno;
+            close(fd);
+            shm_unlink(name);
+            errno = err;
+            return NULL;
+        }
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             name ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (p == MAP_FAILED) {
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    memset(p, 0, size);
+    p->nthreads = nthreads;
+    p->pid = getpid();
+    p->start_ns = now_ns();
+    for (uint32_t i = 0; i < nthreads; i++)
+        hist_init(&p->thread[i].lat);
+    __atomic_store_n(&p->magic, WR_STATS_MAGIC, __ATOMIC_RELEASE);
+    return p;
+}
+
+static inline void wr_stats_destroy(struct wr_stats_page *p, const char *name) {
+    munmap(p, wr_stats_size(p->nthreads));
+    if (name)
+        shm_unlink(name);
+}
+
+// Map another process's page read-only. Returns NULL with errno set.
+static inline const struct wr_stats_page *wr_stats_attach(const char *name) {
+    const struct wr_stats_page *p;
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*p)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != WR_STATS_MAGIC ||
+        wr_stats_size(p->nthreads) > (size_t)st.st_size) {
+        munmap((void *)p, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return p;
+}
+
+/* --- writer side, owner thread only ---------------------------------- */
+
+static inline void wr_stats_set(uint64_t *field, uint64_t v) {
+    __atomic_store_n(field, v, __ATOMIC_RELAXED);
+}
+
+static inline void wr_stats_inc(uint64_t *field, uint64_t n) {
+    wr_stats_set(field, *field + n);
+}
+
+// hist_add() with whole-word stores, for the page's histograms
+static inline void wr_stats_lat(struct wr_stats *s, uint64_t ns) {
+    struct hist *h = &s->lat;
+
+    wr_stats_inc(&h->bucket[hist_index(ns)], 1);
+    wr_stats_inc(&h->count, 1);
+    wr_stats_inc(&h->sum, ns);
+    if (ns < h->min)
+        wr_stats_set(&h->min, ns);
+    if (ns > h->max)
+        wr_stats_set(&h->max, ns);
+}
+
+/*
+ * Drain the device's async events without blocking and count them.
+ * The async fd must have been made non-blocking (wr_stats_async_fd()).
+ */
+static inline void wr_stats_async(struct wr_stats_page *p,
+                                  struct ibv_context *ctx) {
+    struct ibv_async_event ev;
+
+    while (!ibv_get_async_event(ctx, &ev)) {
+        if (ev.event_type == IBV_EVENT_CQ_ERR)
+            wr_stats_inc(&p->cq_overruns, 1);
+        fprintf(stderr, "Async event: %s\n", ibv_event_type_str(ev.event_type));
+        wr_stats_inc(&p->async_events, 1);
+        ibv_ack_async_event(&ev);
+    }
+}
+
+static inline int wr_stats_async_fd(struct ibv_context *ctx) {
+    int flags = fcntl(ctx->async_fd, F_GETFL);
+
+    if (fcntl(ctx->async_fd, F_SETFL, flags | O_NONBLOCK))
+        return -1;
+    return ctx->async_fd;
+}
+
+/* --- reader side ----------------------------------------------------- */
+
+static inline uint64_t wr_stats_get(const uint64_t *field) {
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+// Copy a slot's histogram field by field, for hist_percentile()
+static inline void wr_stats_read_lat(const struct wr_stats *s, struct hist *h) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        h->bucket[i] = wr_stats_get(&s->lat.bucket[i]);
+    h->count = wr_stats_get(&s->lat.count);
+    h->sum = wr_stats_get(&s->lat.sum);
+    h->min = wr_stats_get(&s->lat.min);
+    h->max = wr_stats_get(&s->lat.max);
+}
+
+#endif
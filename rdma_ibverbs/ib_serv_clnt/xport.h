@@ -0,0 +1,263 @@
+#ifndef XPORT_H
+#define XPORT_H
+
+#include <unistd.h>
+#include "common.h"
+#include "ibdev.h"
+
+/*
+ * Transport interface: one-sided WRITE/READ between two peers
+ *
+ * A small subset of verbs behind a table of function pointers, so the
+ * same benchmark or application code runs over an RC QP (this file) or
+ * over shared memory between processes on one host (xport_shm.h):
+ *
+ *   xport_mr_alloc()   registered buffer; lkey/rkey as in ibv_mr
+ *   xport_write()      RDMA_WRITE from a local buffer to (raddr, rkey)
+ *   xport_read()       RDMA_READ from (raddr, rkey) to a local buffer
+ *   xport_poll()       completions of signaled requests, in order
+ *
+ * Both backends follow verbs semantics: posts are asynchronous, only
+ * signaled requests complete, a completion retires every earlier
+ * request, and wc.status uses enum ibv_wc_status.
+ *
+ * Each backend is opened on a connected stream socket that it uses
+ * for its own handshake; the caller keeps using the socket afterwards
+ * to exchange buffer addresses (struct conn_info) and to say goodbye.
+ */
+enum xport_op {
+    XPORT_WRITE,
+    XPORT_READ,
+};
+
+struct xport_mr {
+    void *addr;
+    size_t len;
+    uint32_t lkey;
+    uint32_t rkey;
+    void *handle;               // backend's own registration
+};
+
+struct xport_wc {
+    uint64_t wr_id;
+    int status;                 // enum ibv_wc_status
+};
+
+struct xport;
+
+struct xport_ops {
+    const char *name;
+    int (*mr_alloc)(struct xport *x, size_t len, struct xport_mr *mr);
+    void (*mr_free)(struct xport *x, struct xport_mr *mr);
+    int (*post)(struct xport *x, enum xport_op op, const struct xport_mr *mr,
+                void *laddr, uint32_t len, uint64_t raddr, uint32_t rkey,
+                uint64_t wr_id, int signaled);
+    int (*poll)(struct xport *x, struct xport_wc *wc, int max);
+    void (*close)(struct xport *x);
+};
+
+struct xport {
+    const struct xport_ops *ops;
+    uint32_t depth;             // requests that may be outstanding
+};
+
+static inline int xport_mr_alloc(struct xport *x, size_t len,
+                                 struct xport_mr *mr) {
+    return x->ops->mr_alloc(x, len, mr);
+}
+
+static inline void xport_mr_free(struct xport *x, struct xport_mr *mr) {
+    x->ops->mr_free(x, mr);
+}
+
+static inline int xport_write(struct xport *x, const struct xport_mr *mr,
+                              void *laddr, uint32_t len, uint64_t raddr,
+                              uint32_t rkey, uint64_t wr_id, int signaled) {
+    return x->ops->post(x, XPORT_WRITE, mr, laddr, len, raddr, rkey,
+                        wr_id, signaled);
+}
+
+static inline int xport_read(struct xport *x, const struct xport_mr *mr,
+                             void *laddr, uint32_t len, uint64_t raddr,
+                             uint32_t rkey, uint64_t wr_id, int signaled) {
+    return x->ops->post(x, XPORT_READ, mr, laddr, len, raddr, rkey,
+                        wr_id, signaled);
+}
+
+static inline int xport_poll(struct xport *x, struct xport_wc *wc, int max) {
+    return x->ops->poll(x, wc, max);
+}
+
+static inline void xport_close(struct xport *x) {
+    x->ops->close(x);
+}
+
+/* --- verbs backend --------------------------------------------------- */
+
+#define XPORT_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | \
+                      IBV_ACCESS_REMOTE_READ)
+
+struct xport_verbs {
+    struct xport x;
+    struct ibdev dev;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+};
+
+static inline int xport_verbs_mr_alloc(struct xport *x, size_t len,
+                                       struct xport_mr *mr) {
+    struct xport_verbs *v = (struct xport_verbs *)x;
+    void *buf;
+
+    if (posix_memalign(&buf, 4096, len))
+        return -1;
+    memset(buf, 0, len);
+    struct ibv_mr *m = ibv_reg_mr(v->pd, buf, len, XPORT_ACCESS);
+    if (!m) {
+        int err = errno;
+        free(buf);
+        errno = err;
+        return -1;
+    }
+    mr->addr = buf;
+    mr->len = len;
+    mr->lkey = m->lkey;
+    mr->rkey = m->rkey;
+    mr->handle = m;
+    return 0;
+}
+
+static inline void xport_verbs_mr_free(struct xport *x, struct xport_mr *mr) {
+    (void)x;
+    ibv_dereg_mr(mr->handle);
+    free(mr->addr);
+}
+
+static inline int xport_verbs_post(struct xport *x, enum xport_op op,
+                                   const struct xport_mr *mr, void *laddr,
+                                   uint32_t len, uint64_t raddr,
+                                   uint32_t rkey, uint64_t wr_id,
+                                   int signaled) {
+    struct xport_verbs *v = (struct xport_verbs *)x;
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)laddr,
+        .length = len,
+        .lkey = mr->lkey,
+    };
+    struct ibv_send_wr wr = {0}, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = op == XPORT_READ ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+    wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+    wr.wr.rdma.remote_addr = raddr;
+    wr.wr.rdma.rkey = rkey;
+
+    int ret = ibv_post_send(v->qp, &wr, &bad_wr);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+static inline int xport_verbs_poll(struct xport *x, struct xport_wc *wc,
+                                   int max) {
+    struct xport_verbs *v = (struct xport_verbs *)x;
+    struct ibv_wc iwc[32];
+    int n = ibv_poll_cq(v->cq, max < 32 ? max : 32, iwc);
+
+    if (n < 0)
+        die("ibv_poll_cq");
+    for (int i = 0; i < n; i++) {
+        wc[i].wr_id = iwc[i].wr_id;
+        wc[i].status = iwc[i].status;
+    }
+    return n;
+}
+
+static inline void xport_verbs_close(struct xport *x) {
+    struct xport_verbs *v = (struct xport_verbs *)x;
+
+    ibv_destroy_qp(v->qp);
+    ibv_destroy_cq(v->cq);
+    ibv_dealloc_pd(v->pd);
+    ibdev_close(&v->dev);
+    free(v);
+}
+
+static const struct xport_ops xport_verbs_ops = {
+    .name = "verbs",
+    .mr_alloc = xport_verbs_mr_alloc,
+    .mr_free = xport_verbs_mr_free,
+    .post = xport_verbs_post,
+    .poll = xport_verbs_poll,
+    .close = xport_verbs_close,
+};
+
+/*
+ * Open the HCA port that dev_opts selects (ibdev.h) and connect an RC
+ * QP to the peer on the other end of sock (see ibdev_qp_to_rts()).
+ * Both peers call this; each writes its conn_info before reading the
+ * other one.
+ */
+static inline struct xport *xport_verbs_open(int sock, uint32_t depth,
+                                             const struct ibdev_opts *dev_opts) {
+    struct xport_verbs *v = calloc(1, sizeof(*v));
+    if (!v)
+        die("calloc");
+
+    if (ibdev_open(&v->dev, dev_opts))
+        die("ibdev_open");
+    ibdev_place(&v->dev, dev_opts);
+
+    struct ibv_device_attr dev_attr;
+    if (ibv_query_device(v->dev.ctx, &dev_attr))
+        die("ibv_query_device");
+    if (depth > (uint32_t)dev_attr.max_qp_wr)
+        depth = dev_attr.max_qp_wr;
+    v->x.ops = &xport_verbs_ops;
+    v->x.depth = depth;
+
+    v->pd = ibv_alloc_pd(v->dev.ctx);
+    if (!v->pd)
+        die("ibv_alloc_pd");
+    v->cq = ibv_create_cq(v->dev.ctx, depth, NULL, NULL, 0);
+    if (!v->cq)
+        die("ibv_create_cq");
+
+    struct ibv_qp_init_attr qp_init_attr = {0};
+    qp_init_attr.send_cq = v->cq;
+    qp_init_attr.recv_cq = v->cq;
+    qp_init_attr.qp_type = IBV_QPT_RC;
+    qp_init_attr.cap.max_send_wr = depth;
+    qp_init_attr.cap.max_recv_wr = 1;
+    qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_recv_sge = 1;
+    v->qp = ibv_create_qp(v->pd, &qp_init_attr);
+    if (!v->qp)
+        die("ibv_create_qp");
+
+    if (ibdev_qp_to_init(&v->dev, v->qp,
+                         IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ))
+        die("ibv_modify_qp to INIT");
+
+    // Reads are pipelined too, so allow as many as both devices can track
+    struct conn_info local = {0}, remote;
+    local.qpn = v->qp->qp_num;
+    local.psn = (uint32_t)(rand() & 0xffffff);
+    local.rd_atomic = dev_attr.max_qp_rd_atom < 16 ? dev_attr.max_qp_rd_atom : 16;
+    ibdev_fill_info(&v->dev, &local);
+    xfer(sock, &local, sizeof(local), 1);
+    xfer(sock, &remote, sizeof(remote), 0);
+
+    if (ibdev_qp_to_rts(&v->dev, v->qp, local.psn, &remote,
+                        conn_rd_atomic(local.rd_atomic, &remote)))
+        die("ibv_modify_qp to RTR/RTS");
+
+    return &v->x;
+}
+
+#endif
@@ -0,0 +1,383 @@
+// xport_bench.c
+// One-sided WRITE/READ throughput and WRITE ping-pong latency over the
+// transport interface in xport.h, on an RC QP (-x verbs) or on shared
+// memory between two local processes (-x shm).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <infiniband/verbs.h>
+#include "common.h"
+#include "hist.h"
+#include "ibdev.h"
+#include "xport.h"
+#include "xport_shm.h"
+
+#define SHM_SEGMENT (64ul << 20)
+
+enum bench_mode {
+    MODE_WRITE,                 // -t
+    MODE_READ,                  // -r
+    MODE_LATENCY,               // -l
+};
+
+// Sent by the client after the transport is up, so the server can follow
+struct bench_req {
+    uint32_t mode;
+    uint32_t size;
+    uint64_t iters;
+};
+
+struct bench_opts {
+    int shm;                    // -x shm
+    int threaded;               // -E: shm engine on its own thread
+    enum bench_mode mode;
+    uint32_t size;
+    uint64_t iters;
+    uint32_t window;
+    uint32_t signal;
+    struct ibdev_opts dev;      // -D/-P/-i/-G, verbs only
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static uint8_t marker(uint64_t i) {
+    return (uint8_t)(i % 255) + 1;
+}
+
+/*
+ * Side channel. For verbs the endpoint is host:port (a port alone when
+ * listening), for shm it is the path of a Unix socket.
+ */
+static int side_listen(const struct bench_opts *o, const char *endpoint) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (!o->shm)
+        return tcp_listen(endpoint, 1);
+    strncpy(addr.sun_path, endpoint, sizeof(addr.sun_path) - 1);
+    unlink(endpoint);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, 1))
+        die("bind unix socket");
+    return fd;
+}
+
+static int side_connect(const struct bench_opts *o, const char *endpoint) {
+    int fd;
+
+    if (o->shm) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, endpoint, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            die("connect unix socket");
+        return fd;
+    }
+
+    char host[256];
+    const char *colon = strrchr(endpoint, ':');
+    if (!colon || colon - endpoint >= (long)sizeof(host)) {
+        fprintf(stderr, "verbs endpoint must be host:port\n");
+        exit(1);
+    }
+    memcpy(host, endpoint, colon - endpoint);
+    host[colon - endpoint] = '\0';
+    return tcp_connect(host, colon + 1);
+}
+
+static struct xport *open_xport(const struct bench_opts *o, int sock) {
+    if (o->shm)
+        return xport_shm_open(sock, o->window, SHM_SEGMENT, o->threaded);
+    return xport_verbs_open(sock, o->window, &o->dev);
+}
+
+/*
+ * The buffer has a receive area [0, size) that the peer writes into or
+ * reads from, and a send area [size, 2 * size) that outgoing messages
+ * are built in. Both peers advertise it with a struct conn_info.
+ */
+static void exchange_buffers(int sock, const struct xport_mr *mr,
+                             uint32_t size, struct conn_info *remote) {
+    struct conn_info local = {0};
+
+    local.rkey = mr->rkey;
+    local.vaddr = (uintptr_t)mr->addr;
+    local.len = size;
+    xfer(sock, &local, sizeof(local), 1);
+    xfer(sock, remote, sizeof(*remote), 0);
+}
+
+static void check_wc(const struct xport_wc *wc) {
+    if (wc->status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "request failed: wc.status=%d (%s)\n", wc->status,
+                ibv_wc_status_str(wc->status));
+        exit(1);
+    }
+}
+
+/*
+ * Windowed WRITEs or READs with selective signaling, as in rdma_client
+ * -t: every o->signal-th request is signaled and its wr_id carries the
+ * number of requests it retires.
+ */
+static double run_stream(struct xport *x, const struct xport_mr *mr,
+                         const struct conn_info *remote,
+                         const struct bench_opts *o) {
+    struct xport_wc wc[32];
+    uint64_t posted = 0, completed = 0;
+    uint32_t unsignaled = 0;
+    char *recv = mr->addr, *send = recv + o->size;
+
+    uint64_t start = now_ns();
+    while (completed < o->iters) {
+        while (posted - completed < o->window && posted < o->iters) {
+            int signaled = 0;
+            uint64_t wr_id = 0;
+            int ret;
+
+            if (++unsignaled == o->signal || posted + 1 == o->iters) {
+                signaled = 1;
+                wr_id = unsignaled;
+                unsignaled = 0;
+            }
+            if (o->mode == MODE_READ)
+                ret = xport_read(x, mr, recv, o->size, remote->vaddr,
+                                 remote->rkey, wr_id, signaled);
+            else
+                ret = xport_write(x, mr, send, o->size, remote->vaddr,
+                                  remote->rkey, wr_id, signaled);
+            if (ret)
+                die("post");
+            posted++;
+        }
+
+        int ne = xport_poll(x, wc, 32);
+        for (int i = 0; i < ne; i++) {
+            check_wc(&wc[i]);
+            completed += wc[i].wr_id;
+        }
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+// Post one signaled WRITE and wait until it has completed
+static void write_sync(struct xport *x, const struct xport_mr *mr,
+                       char *buf, uint32_t len,
+                       const struct conn_info *remote) {
+    struct xport_wc wc;
+
+    if (xport_write(x, mr, buf, len, remote->vaddr, remote->rkey, 0, 1))
+        die("post");
+    while (!xport_poll(x, &wc, 1))
+        ;
+    check_wc(&wc);
+}
+
+/*
+ * WRITE ping-pong. The last byte of every message is a marker that the
+ * receiver busy-polls on, see pingpong.h; the sender fills it in last,
+ * so the rest of the message is there once it shows up. The client
+ * starts every round trip, the server answers (pong).
+ */
+static void pingpong(struct xport *x, const struct xport_mr *mr,
+                     const struct conn_info *remote, uint32_t size,
+                     uint64_t iters, int pong, struct hist *h) {
+    volatile uint8_t *arrived = (uint8_t *)mr->addr + size - 1;
+    char *send = (char *)mr->addr + size;
+
+    for (uint64_t i = 0; i < iters; i++) {
+        uint8_t m = marker(i);
+        uint64_t t0 = now_ns();
+
+        if (pong)
+            while (*arrived != m)
+                if (stop)
+                    return;
+        send[size - 1] = m;
+        write_sync(x, mr, send, size, remote);
+        if (!pong) {
+            while (*arrived != m)
+                if (stop)
+                    return;
+            hist_add(h, now_ns() - t0);
+        }
+    }
+}
+
+static void serve(const struct bench_opts *o, const char *endpoint) {
+    int lfd = side_listen(o, endpoint);
+
+    printf("%s transport, waiting on %s\n", o->shm ? "shm" : "verbs",
+           endpoint);
+    // No SA_RESTART, so a signal gets the loop out of accept()
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop) {
+        int sock = accept(lfd, NULL, NULL);
+        if (sock < 0)
+            continue;
+
+        struct xport *x = open_xport(o, sock);
+        struct bench_req req;
+        struct xport_mr mr;
+        struct conn_info remote;
+
+        xfer(sock, &req, sizeof(req), 0);
+        if (xport_mr_alloc(x, 2 * (size_t)req.size, &mr))
+            die("xport_mr_alloc");
+        exchange_buffers(sock, &mr, req.size, &remote);
+        if (req.mode == MODE_LATENCY)
+            pingpong(x, &mr, &remote, req.size, req.iters, 1, NULL);
+
+        char done;
+        xfer(sock, &done, 1, 0);
+        printf("Client done: %u bytes x %llu over %s\n", req.size,
+               (unsigned long long)req.iters, x->ops->name);
+
+        xport_mr_free(x, &mr);
+        xport_close(x);
+        close(sock);
+    }
+    close(lfd);
+    if (o->shm)
+        unlink(endpoint);
+}
+
+static void run_client(struct bench_opts *o, const char *endpoint) {
+    static struct hist h;
+    int sock = side_connect(o, endpoint);
+    struct xport *x = open_xport(o, sock);
+    struct bench_req req = { o->mode, o->size, o->iters };
+    struct xport_mr mr;
+    struct conn_info remote;
+
+    if (o->window > x->depth)
+        o->window = x->depth;
+    if (o->signal > o->window)
+        o->signal = o->window;
+
+    xfer(sock, &req, sizeof(req), 1);
+    if (xport_mr_alloc(x, 2 * (size_t)o->size, &mr))
+        die("xport_mr_alloc");
+    exchange_buffers(sock, &mr, o->size, &remote);
+
+    if (o->mode == MODE_LATENCY) {
+        hist_init(&h);
+        pingpong(x, &mr, &remote, o->size, o->iters, 0, &h);
+        printf("Latency over %s%s: %u bytes x %llu round trips\n",
+               x->ops->name, o->threaded ? " (engine thread)" : "",
+               o->size, (unsigned long long)o->iters);
+        hist_print_us("WRITE ping-pong RTT", &h);
+    } else {
+        double sec = run_stream(x, &mr, &remote, o);
+        printf("%s throughput over %s%s: %u bytes x %llu, window %u, "
+               "signal every %u\n",
+               o->mode == MODE_READ ? "READ" : "WRITE", x->ops->name,
+               o->threaded ? " (engine thread)" : "", o->size,
+               (unsigned long long)o->iters, o->window, o->signal);
+        printf("  %.3f s, %.3f GB/s, %.3f Mmsg/s\n", sec,
+               (double)o->size * o->iters / sec / 1e9, o->iters / sec / 1e6);
+    }
+
+    xfer(sock, "D", 1, 1);
+    xport_mr_free(x, &mr);
+    xport_close(x);
+    close(sock);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-x verbs|shm] [-E] -L <endpoint>\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "       %s [-x verbs|shm] [-E] <endpoint> [-t|-r|-l] [-s size]\n"
+            "          [-n iters] [-w window] [-k signal]\n"
+            "          [-D dev | -P pnetid] [-i port] [-G gid_index]\n"
+            "  endpoint   verbs: host:port (port when listening),\n"
+            "             shm: path of a Unix socket\n"
+            "  -x         transport (default verbs)\n"
+            "  -E         shm: run the copy engine on its own thread\n"
+            "  -L         serve on endpoint\n"
+            "  -t         WRITE throughput (default)\n"
+            "  -r         READ throughput\n"
+            "  -l         WRITE ping-pong latency\n"
+            "  -s size    message size in bytes (default %d)\n"
+            "  -n iters   number of messages (default 1000000)\n"
+            "  -w window  outstanding requests (default 128)\n"
+            "  -k signal  signal one request every k (default 16)\n"
+            "  -D dev     verbs: use this HCA (default: the first one)\n"
+            "  -P pnetid  verbs: use the HCA port with this PNET ID (s390)\n"
+            "  -i port    verbs: HCA port (default: the first active one)\n"
+            "  -G index   verbs: GID index (default: a RoCE v2 IPv4 entry)\n",
+            prog, prog, BUFFER_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct bench_opts opts = {
+        .mode = MODE_WRITE,
+        .size = BUFFER_SIZE,
+        .iters = 1000000,
+        .window = 128,
+        .signal = 16,
+        .dev = { .gid_index = -1, .numa_node = IBDEV_NUMA_AUTO },
+    };
+    const char *listen_on = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:EL:trls:n:w:k:D:P:i:G:")) != -1) {
+        switch (opt) {
+        case 'x':
+            if (!strcmp(optarg, "shm"))
+                opts.shm = 1;
+            else if (strcmp(optarg, "verbs"))
+                usage(argv[0]);
+            break;
+        case 'E': opts.threaded = 1; break;
+        case 'L': listen_on = optarg; break;
+        case 't': opts.mode = MODE_WRITE; break;
+        case 'r': opts.mode = MODE_READ; break;
+        case 'l': opts.mode = MODE_LATENCY; break;
+        case 's': opts.size = strtoul(optarg, NULL, 0); break;
+        case 'n': opts.iters = strtoull(optarg, NULL, 0); break;
+        case 'w': opts.window = strtoul(optarg, NULL, 0); break;
+        case 'k': opts.signal = strtoul(optarg, NULL, 0); break;
+        case 'D': opts.dev.name = optarg; break;
+        case 'P': opts.dev.pnetid = optarg; break;
+        case 'i': opts.dev.port = atoi(optarg); break;
+        case 'G': opts.dev.gid_index = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (opts.threaded && !opts.shm)
+        usage(argv[0]);
+
+    if (listen_on) {
+        if (optind != argc)
+            usage(argv[0]);
+        serve(&opts, listen_on);
+        return 0;
+    }
+
+    if (argc - optind != 1 || !opts.size || !opts.iters || !opts.window ||
+        !opts.signal)
+        usage(argv[0]);
+    run_client(&opts, argv[optind]);
+
+    return 0;
+}
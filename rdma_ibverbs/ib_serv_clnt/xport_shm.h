@@ -0,0 +1,305 @@
+#ifndef XPORT_SHM_H
+#define XPORT_SHM_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "xport.h"
+#include "spsc_ring.h"
+
+/*
+ * Shared-memory loopback backend for xport.h (SMC-D/ISM style)
+ *
+ * For two processes on the same host the NIC is only in the way. Each
+ * peer puts all of its registered memory into one memfd segment and
+ * passes the fd to the other side over the Unix socket (SCM_RIGHTS).
+ * Both map both segments, so a WRITE is a memcpy() into the peer's
+ * mapping and a READ a memcpy() out of it.
+ *
+ * The verbs queueing model is kept: posting pushes a work request onto
+ * a lock-free send ring, an engine executes the copies and pushes a
+ * completion for every signaled request onto a completion ring, and
+ * xport_poll() pops those. The engine either runs inside xport_poll()
+ * or, with threaded set, on its own thread, which then acts as the
+ * "NIC": posts and polls never copy, and both rings are genuinely used
+ * by two threads.
+ *
+ * rkey/lkey name the segment; an address outside it completes with
+ * IBV_WC_REM_ACCESS_ERR or IBV_WC_LOC_PROT_ERR like verbs would.
+ * mr_alloc() carves buffers from the segment with a bump pointer;
+ * freeing only returns space when it frees the most recent buffer.
+ */
+#define XPORT_SHM_KEY     0x53484d31u   // "SHM1"
+#define XPORT_SHM_ALIGN   64
+
+struct shm_wr {
+    uint64_t wr_id;
+    uint64_t raddr;
+    char *laddr;
+    uint32_t len;
+    uint32_t rkey;
+    uint8_t op;
+    uint8_t signaled;
+};
+
+// What each peer tells the other about its segment, next to the fd
+struct shm_hello {
+    uint64_t base;              // segment address in the sender
+    uint64_t size;
+};
+
+struct xport_shm {
+    struct xport x;
+    int memfd;
+    char *seg;
+    size_t seg_size;
+    size_t used;
+
+    char *peer;                 // peer's segment, mapped here
+    uint64_t peer_base;         // the same segment, in the peer
+    size_t peer_size;
+
+    struct spsc_ring sq;        // struct shm_wr
+    struct spsc_ring cq;        // struct xport_wc
+    int threaded;
+    pthread_t engine;
+    _Atomic int stop;
+};
+
+static inline int xport_shm_mr_alloc(struct xport *x, size_t len,
+                                     struct xport_mr *mr) {
+    struct xport_shm *s = (struct xport_shm *)x;
+    size_t off = (s->used + XPORT_SHM_ALIGN - 1) & ~(size_t)(XPORT_SHM_ALIGN - 1);
+
+    if (off + len > s->seg_size) {
+        errno = ENOMEM;
+        return -1;
+    }
+    s->used = off + len;
+    mr->addr = s->seg + off;
+    mr->len = len;
+    mr->lkey = XPORT_SHM_KEY;
+    mr->rkey = XPORT_SHM_KEY;
+    mr->handle = NULL;
+    return 0;
+}
+
+static inline void xport_shm_mr_free(struct xport *x, struct xport_mr *mr) {
+    struct xport_shm *s = (struct xport_shm *)x;
+
+    if ((char *)mr->addr + mr->len == s->seg + s->used)
+        s->used = (char *)mr->addr - s->seg;
+}
+
+static inline int xport_shm_post(struct xport *x, enum xport_op op,
+                                 const struct xport_mr *mr, void *laddr,
+                                 uint32_t len, uint64_t raddr, uint32_t rkey,
+                                 uint64_t wr_id, int signaled) {
+    struct xport_shm *s = (struct xport_shm *)x;
+    (void)mr;                   // the segment check covers the lkey
+    struct shm_wr wr = {
+        .wr_id = wr_id,
+        .raddr = raddr,
+        .laddr = laddr,
+        .len = len,
+        .rkey = rkey,
+        .op = op,
+        .signaled = signaled,
+    };
+
+    if (spsc_ring_push(&s->sq, &wr)) {
+        errno = ENOMEM;         // send queue full, as ibv_post_send()
+        return -1;
+    }
+    return 0;
+}
+
+static inline int shm_execute(struct xport_shm *s, const struct shm_wr *wr) {
+    if (wr->laddr < s->seg || wr->len > s->seg_size ||
+        wr->laddr - s->seg > (ptrdiff_t)(s->seg_size - wr->len))
+        return IBV_WC_LOC_PROT_ERR;
+    if (wr->rkey != XPORT_SHM_KEY || wr->raddr < s->peer_base ||
+        wr->len > s->peer_size ||
+        wr->raddr - s->peer_base > s->peer_size - wr->len)
+        return IBV_WC_REM_ACCESS_ERR;
+
+    char *remote = s->peer + (wr->raddr - s->peer_base);
+    if (wr->op == XPORT_WRITE && wr->len) {
+        /*
+         * The last byte goes last, after a release fence: a peer that
+         * polls on it (see pingpong.h) then finds the rest in place,
+         * as it does with an HCA writing in address order.
+         */
+        memcpy(remote, wr->laddr, wr->len - 1);
+        atomic_thread_fence(memory_order_release);
+        remote[wr->len - 1] = wr->laddr[wr->len - 1];
+    } else if (wr->op == XPORT_READ) {
+        atomic_thread_fence(memory_order_acquire);
+        memcpy(wr->laddr, remote, wr->len);
+    }
+    return IBV_WC_SUCCESS;
+}
+
+/*
+ * Execute up to budget queued requests. Stops early when the
+ * completion ring is full, so completions are never dropped; the send
+ * ring then fills up and posting fails until the application polls.
+ */
+static inline int shm_progress(struct xport_shm *s, int budget) {
+    struct shm_wr wr;
+    int done = 0;
+
+    while (done < budget && spsc_ring_count(&s->cq) <= s->cq.mask &&
+           !spsc_ring_pop(&s->sq, &wr)) {
+        struct xport_wc wc = {
+            .wr_id = wr.wr_id,
+            .status = shm_execute(s, &wr),
+        };
+        if (wr.signaled || wc.status != IBV_WC_SUCCESS)
+            spsc_ring_push(&s->cq, &wc);
+        done++;
+    }
+    return done;
+}
+
+static inline void *shm_engine(void *arg) {
+    struct xport_shm *s = arg;
+
+    while (!atomic_load_explicit(&s->stop, memory_order_relaxed))
+        if (!shm_progress(s, 64))
+            sched_yield();
+    return NULL;
+}
+
+static inline int xport_shm_poll(struct xport *x, struct xport_wc *wc,
+                                 int max) {
+    struct xport_shm *s = (struct xport_shm *)x;
+    int n = 0;
+
+    if (!s->threaded)
+        shm_progress(s, s->x.depth);
+    while (n < max && !spsc_ring_pop(&s->cq, &wc[n]))
+        n++;
+    return n;
+}
+
+static inline void xport_shm_close(struct xport *x) {
+    struct xport_shm *s = (struct xport_shm *)x;
+
+    if (s->threaded) {
+        atomic_store(&s->stop, 1);
+        pthread_join(s->engine, NULL);
+    }
+    munmap(s->peer, s->peer_size);
+    munmap(s->seg, s->seg_size);
+    close(s->memfd);
+    spsc_ring_free(&s->sq);
+    spsc_ring_free(&s->cq);
+    free(s);
+}
+
+static const struct xport_ops xport_shm_ops = {
+    .name = "shm",
+    .mr_alloc = xport_shm_mr_alloc,
+    .mr_free = xport_shm_mr_free,
+    .post = xport_shm_post,
+    .poll = xport_shm_poll,
+    .close = xport_shm_close,
+};
+
+static inline void shm_send_fd(int sock, int fd, const struct shm_hello *h) {
+    char ctrl[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = { .iov_base = (void *)h, .iov_len = sizeof(*h) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl,
+        .msg_controllen = sizeof(ctrl),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    if (sendmsg(sock, &msg, 0) != sizeof(*h))
+        die("sendmsg segment fd");
+}
+
+static inline int shm_recv_fd(int sock, struct shm_hello *h) {
+    char ctrl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = h, .iov_len = sizeof(*h) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl,
+        .msg_controllen = sizeof(ctrl),
+    };
+    int fd;
+
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(*h))
+        die("recvmsg segment fd");
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        die("recvmsg segment fd");
+    }
+    memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    return fd;
+}
+
+/*
+ * Create a seg_size segment and swap segments with the peer on the
+ * other end of sock, which must be an AF_UNIX stream socket. depth
+ * sizes both rings and is rounded up to a power of two.
+ */
+static inline struct xport *xport_shm_open(int sock, uint32_t depth,
+                                           size_t seg_size, int threaded) {
+    struct xport_shm *s = calloc(1, sizeof(*s));
+    if (!s)
+        die("calloc");
+
+    uint32_t entries = 1;
+    while (entries < depth)
+        entries <<= 1;
+    s->x.ops = &xport_shm_ops;
+    s->x.depth = entries;
+    if (spsc_ring_init(&s->sq, entries, sizeof(struct shm_wr)) ||
+        spsc_ring_init(&s->cq, entries, sizeof(struct xport_wc)))
+        die("spsc_ring_init");
+
+    s->memfd = memfd_create("xport_shm", MFD_CLOEXEC);
+    if (s->memfd < 0)
+        die("memfd_create");
+    if (ftruncate(s->memfd, seg_size))
+        die("ftruncate");
+    s->seg = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->memfd, 0);
+    if (s->seg == MAP_FAILED)
+        die("mmap segment");
+    s->seg_size = seg_size;
+
+    struct shm_hello local = { (uintptr_t)s->seg, seg_size }, remote;
+    shm_send_fd(sock, s->memfd, &local);
+    int fd = shm_recv_fd(sock, &remote);
+    s->peer = mmap(NULL, remote.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    if (s->peer == MAP_FAILED)
+        die("mmap peer segment");
+    close(fd);
+    s->peer_base = remote.base;
+    s->peer_size = remote.size;
+
+    s->threaded = threaded;
+    if (threaded) {
+        int err = pthread_create(&s->engine, NULL, shm_engine, s);
+        if (err) {
+            errno = err;
+            die("pthread_create");
+        }
+    }
+    return &s->x;
+}
+
+#endif